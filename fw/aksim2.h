@@ -126,6 +126,7 @@ class Aksim2 {
         (buffer_[5] << 0);
 
     status->nonce++;
+    status->sample_us = last_query_start_us_;
     status->active = true;
   }
 
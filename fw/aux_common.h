@@ -110,6 +110,8 @@ struct Spi {
     bool active = false;
     uint32_t value = 0;
     uint8_t nonce = 0;
+    // The microsecond timer when this value was sampled.
+    uint32_t sample_us = 0;
 
     uint8_t ic_pz_bits = 0;
 
@@ -119,6 +121,7 @@ struct Spi {
       a->Visit(MJ_NVP(value));
       a->Visit(MJ_NVP(nonce));
       a->Visit(MJ_NVP(ic_pz_bits));
+      a->Visit(MJ_NVP(sample_us));
     }
   };
 };
@@ -157,6 +160,8 @@ struct UartEncoder {
     bool active = false;
     uint32_t value = 0;
     uint8_t nonce = 0;
+    // The microsecond timer when the query for this value was sent.
+    uint32_t sample_us = 0;
 
     bool aksim2_err = false;
     bool aksim2_warn = false;
@@ -173,6 +178,7 @@ struct UartEncoder {
       a->Visit(MJ_NVP(aksim2_warn));
       a->Visit(MJ_NVP(aksim2_status));
       a->Visit(MJ_NVP(checksum_errors));
+      a->Visit(MJ_NVP(sample_us));
     }
   };
 };
@@ -195,12 +201,20 @@ struct Quadrature {
     uint32_t value = 0;
     uint16_t error = 0;
 
+    // The time of the most recent edge, in microseconds.
+    uint32_t edge_us = 0;
+    // The number of edges since the previous control cycle.  This
+    // can be more than the change in value if the direction changed.
+    uint8_t edge_count = 0;
+
     template <typename Archive>
     void Serialize(Archive* a) {
       a->Visit(MJ_NVP(active));
       a->Visit(MJ_NVP(pins));
       a->Visit(MJ_NVP(value));
       a->Visit(MJ_NVP(error));
+      a->Visit(MJ_NVP(edge_us));
+      a->Visit(MJ_NVP(edge_count));
     }
   };
 };
@@ -328,6 +342,8 @@ struct I2C {
     uint16_t value = 0;
     uint8_t nonce = 0;
     uint32_t error_count = 0;
+    // The microsecond timer when the read for this value was started.
+    uint32_t sample_us = 0;
 
     uint8_t ams_agc = 0;
     uint8_t ams_diag = 0;
@@ -343,6 +359,7 @@ struct I2C {
       a->Visit(MJ_NVP(ams_agc));
       a->Visit(MJ_NVP(ams_diag));
       a->Visit(MJ_NVP(ams_mag));
+      a->Visit(MJ_NVP(sample_us));
     }
   };
 
@@ -456,6 +473,10 @@ struct AuxStatus {
   uint8_t analog_bit_active = 0;
   std::array<float, 5> analog_inputs = { {} };
 
+  // The microsecond timer at the most recent current sample instant.
+  // Source ages are measured relative to this.
+  uint32_t sample_us = 0;
+
   template <typename Archive>
   void Serialize(Archive* a) {
     a->Visit(MJ_NVP(i2c));
@@ -470,6 +491,7 @@ struct AuxStatus {
     a->Visit(MJ_NVP(pins));
     a->Visit(MJ_NVP(analog_bit_active));
     a->Visit(MJ_NVP(analog_inputs));
+    a->Visit(MJ_NVP(sample_us));
   }
 };
 
@@ -55,12 +55,15 @@ In summary, this code provides a foundational framework for managing auxiliary I
 
 #pragma once
 
+#include <algorithm>
 #include <atomic>
+#include <cstdlib>
 
 #include "mbed.h"
 
 #include "fw/aux_common.h"
 #include "fw/ccm.h"
+#include "fw/millisecond_timer.h"
 #include "fw/stm32_gpio_interrupt_in.h"
 
 namespace moteus {
@@ -118,9 +121,11 @@ class Stm32Quadrature {
   Stm32Quadrature(const Quadrature::Config& config,
                   aux::Quadrature::Status* status,
                   const PinArray& array,
-                  const AuxHardwareConfig& hw_config)
+                  const AuxHardwareConfig& hw_config,
+                  MillisecondTimer* timer)
       : config_(config),
-        status_(status) {
+        status_(status),
+        timer_(timer) {
     aux::AuxPinConfig pina = {};
     aux::Pin::Mode pina_mode = {};
     aux::AuxPinConfig pinb = {};
@@ -237,7 +242,21 @@ class Stm32Quadrature {
   aux::AuxError error() { return error_; }
 
   void ISR_Update(aux::Quadrature::Status* status) MOTEUS_CCM_ATTRIBUTE {
-    if (!hwtimer_) { return; }
+    if (!hwtimer_) {
+      // The edges themselves were counted and timed in ISR_Callback.
+      // It may run at any point, so everything it updates is taken
+      // together, otherwise an edge could be seen in the value one
+      // cycle and in the edge count the next.
+      __disable_irq();
+      status->pins = pins_;
+      status->value = value_;
+      status->error = quad_errors_;
+      status->edge_us = edge_us_;
+      status->edge_count = edges_;
+      edges_ = 0;
+      __enable_irq();
+      return;
+    }
 
     status_->pins =
         (a_in_->read() ? 1 : 0) |
@@ -250,6 +269,13 @@ class Stm32Quadrature {
 
     old_timer_cnt_ = new_cnt;
 
+    // The counter does not record when it changed, so the best we
+    // can do is the time we noticed.
+    if (delta != 0) {
+      status->edge_us = timer_->read_us();
+    }
+    status->edge_count = std::min(255, std::abs(delta));
+
     const uint32_t new_value =
         static_cast<uint32_t>(status_->value) + delta + config_.cpr;
     status->value = new_value % config_.cpr;
@@ -298,23 +324,35 @@ class Stm32Quadrature {
       0, // 11 10 => 1
       0, // 11 11 => 0
     };
-    const auto old_pins = status_->pins;
-    status_->pins = (
+    const auto old_pins = pins_;
+    pins_ = (
         (a_->read() ? 1 : 0) |
         (b_->read() ? 2 : 0));
-    const uint8_t update = (old_pins << 2) | status_->pins;
+    const uint8_t update = (old_pins << 2) | pins_;
     const uint32_t new_value =
-        static_cast<uint32_t>(status_->value) +
+        static_cast<uint32_t>(value_) +
         kQuadUpdate[update] +
         config_.cpr;
-    status_->value = new_value % config_.cpr;
-    status_->error += kQuadError[update];
+    value_ = new_value % config_.cpr;
+    quad_errors_ += kQuadError[update];
+    edge_us_ = timer_->read_us();
+    if (edges_ != 255) { edges_++; }
   }
 
  private:
   const Quadrature::Config config_;
   Quadrature::Status* const status_;
+  MillisecondTimer* const timer_;
   aux::AuxError error_ = aux::AuxError::kNone;
+
+  // These are only used in software mode, where they are updated
+  // from ISR_Callback.
+  uint8_t pins_ = 0;
+  uint32_t value_ = 0;
+  uint16_t quad_errors_ = 0;
+  uint32_t edge_us_ = 0;
+  uint8_t edges_ = 0;
+
   std::optional<Stm32GpioInterruptIn> a_;
   std::optional<Stm32GpioInterruptIn> b_;
 
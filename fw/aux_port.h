@@ -144,6 +144,8 @@ class AuxPort {
   }
 
   void ISR_MaybeStartSample() MOTEUS_CCM_ATTRIBUTE {
+    status_.sample_us = timer_->read_us();
+
     // For now, we will just always sample.
     if (as5047_) {
       as5047_->StartSample();
@@ -163,12 +165,14 @@ class AuxPort {
       status_.spi.active = true;
       status_.spi.value = as5047_->FinishSample();
       status_.spi.nonce += 1;
+      status_.spi.sample_us = status_.sample_us;
     }
 
     if (ma732_) {
       status_.spi.active = true;
       status_.spi.value = ma732_->FinishSample();
       status_.spi.nonce += 1;
+      status_.spi.sample_us = status_.sample_us;
     }
 
     if (ic_pz_) {
@@ -177,6 +181,11 @@ class AuxPort {
       if (status.active) {
         status_.spi.active = true;
         status_.spi.value = status.value;
+        if (status_.spi.nonce != status.nonce) {
+          // The transfer is nearly always complete in the same cycle
+          // it was started.
+          status_.spi.sample_us = status_.sample_us;
+        }
         status_.spi.nonce = status.nonce;
         status_.spi.ic_pz_bits =
             (status.warn ? 1 : 0) |
@@ -272,6 +281,7 @@ class AuxPort {
           break;
         }
 
+        status.sample_us = static_cast<uint32_t>(state.last_poll_us);
         ISR_ParseI2c(i);
         break;
       }
@@ -972,7 +982,7 @@ class AuxPort {
 
     if (config_.quadrature.enabled) {
       quad_.emplace(config_.quadrature, &status_.quadrature,
-                    config_.pins, hw_config_);
+                    config_.pins, hw_config_, timer_);
       if (quad_->error() != aux::AuxError::kNone) {
         status_.error = quad_->error();
         quad_.reset();
@@ -0,0 +1,1119 @@
+// Copyright 2023 mjbots Robotic Systems, LLC.  info@mjbots.com
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+/// Time the math kernels used in the control ISR on the host, and
+/// measure their worst case error against double precision
+/// references.
+///
+///  bench [key=value ...]
+///
+/// Recognized keys:
+///  filter   - only run kernels whose name contains this string
+///  baseline - compare against this baseline file
+///             (default fw/bench_baseline.txt)
+///  write    - write the results as a new baseline to this file
+///  count    - number of randomized inputs per kernel
+///  repeat   - the best of this many passes is reported
+///
+/// The baseline file has one kernel per line, "name ns_per_call
+/// max_error", with '#' starting a comment.  Because the inputs are
+/// generated from a fixed seed, the error column is reproducible and
+/// any increase is reported as a failure.  Timings are only reported,
+/// as they depend upon the host.
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <limits>
+#include <map>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <fmt/format.h>
+
+#include "mjlib/micro/test/persistent_config_fixture.h"
+
+#include "fw/bldc_servo_position.h"
+#include "fw/bldc_servo_sim.h"
+#include "fw/fixed_point.h"
+#include "fw/foc.h"
+#include "fw/math.h"
+#include "fw/svpwm.h"
+#include "fw/torque_model.h"
+
+namespace moteus {
+volatile uint8_t g_measured_hw_family = 0;
+volatile uint8_t g_measured_hw_rev = 7;
+}
+
+using namespace moteus;
+
+namespace {
+constexpr double kNaN = std::numeric_limits<double>::quiet_NaN();
+
+// Results are written here so that the compiler cannot discard the
+// calls being timed.
+volatile float g_float_sink;
+volatile int32_t g_int_sink;
+
+void Consume(float value) { g_float_sink = value; }
+void Consume(int32_t value) { g_int_sink = value; }
+
+struct Args {
+  std::string filter;
+  std::string baseline = "fw/bench_baseline.txt";
+  std::string write;
+  int count = 4096;
+  int repeat = 50;
+};
+
+Args ParseArgs(int argc, char** argv) {
+  Args result;
+  for (int i = 1; i < argc; i++) {
+    const char* eq = std::strchr(argv[i], '=');
+    if (!eq) {
+      fmt::print(stderr, "malformed argument: {}\n", argv[i]);
+      std::exit(1);
+    }
+    const std::string key(argv[i], eq - argv[i]);
+    const char* value = eq + 1;
+    if (key == "filter") { result.filter = value; }
+    else if (key == "baseline") { result.baseline = value; }
+    else if (key == "write") { result.write = value; }
+    else if (key == "count") { result.count = std::atoi(value); }
+    else if (key == "repeat") { result.repeat = std::atoi(value); }
+    else {
+      fmt::print(stderr, "unknown key: {}\n", key);
+      std::exit(1);
+    }
+  }
+  return result;
+}
+
+/// When run from "bazel run", relative output paths should be
+/// relative to the workspace, not the runfiles tree.
+std::string WorkspacePath(const std::string& path) {
+  const char* workspace = std::getenv("BUILD_WORKSPACE_DIRECTORY");
+  if (!workspace || path.empty() || path[0] == '/') { return path; }
+  return std::string(workspace) + "/" + path;
+}
+
+struct Result {
+  std::string name;
+  std::string error_units;
+  double ns_per_call = 0.0;
+  double max_error = kNaN;
+};
+
+struct BaselineEntry {
+  double ns_per_call = kNaN;
+  double max_error = kNaN;
+};
+
+std::map<std::string, BaselineEntry> ReadBaseline(const std::string& path) {
+  std::map<std::string, BaselineEntry> result;
+  std::ifstream inf(path);
+  std::string line;
+  while (std::getline(inf, line)) {
+    const auto hash = line.find('#');
+    if (hash != std::string::npos) { line = line.substr(0, hash); }
+    std::istringstream istr(line);
+    std::string name, ns, error;
+    if (!(istr >> name >> ns >> error)) { continue; }
+    BaselineEntry entry;
+    entry.ns_per_call = std::strtod(ns.c_str(), nullptr);
+    entry.max_error = std::strtod(error.c_str(), nullptr);
+    result[name] = entry;
+  }
+  return result;
+}
+
+/// Return the smallest absolute difference between two angles.
+double AngleError(double a, double b) {
+  const double diff = std::remainder(a - b, 2.0 * M_PI);
+  return std::abs(diff);
+}
+
+class Runner {
+ public:
+  Runner(const Args& args) : args_(args) {}
+
+  /// Time @p kernel over every element of @p inputs, then evaluate
+  /// @p error on each to find the worst case.  @p error may be
+  /// nullptr when no reference exists.
+  template <typename Input, typename Kernel>
+  void Run(const std::string& name,
+           const std::string& error_units,
+           const std::vector<Input>& inputs,
+           Kernel kernel,
+           std::function<double (const Input&)> error) {
+    if (!args_.filter.empty() &&
+        name.find(args_.filter) == std::string::npos) {
+      return;
+    }
+
+    // The first pass warms the caches and is not counted.
+    double best_ns = std::numeric_limits<double>::infinity();
+    for (int pass = 0; pass <= args_.repeat; pass++) {
+      const auto start = std::chrono::steady_clock::now();
+      for (const auto& input : inputs) {
+        Consume(kernel(input));
+      }
+      const auto end = std::chrono::steady_clock::now();
+      const double ns =
+          std::chrono::duration<double, std::nano>(end - start).count();
+      if (pass == 0) { continue; }
+      best_ns = std::min(best_ns, ns / inputs.size());
+    }
+
+    Result result;
+    result.name = name;
+    result.error_units = error_units;
+    result.ns_per_call = best_ns;
+    if (error) {
+      result.max_error = 0.0;
+      for (const auto& input : inputs) {
+        result.max_error = std::max(result.max_error, error(input));
+      }
+    }
+    results_.push_back(result);
+  }
+
+  const std::vector<Result>& results() const { return results_; }
+
+ private:
+  const Args args_;
+  std::vector<Result> results_;
+};
+
+struct DqInput {
+  SinCos sc;
+  double theta;
+  float a;
+  float b;
+  float c;
+};
+
+struct TorqueInput {
+  float value;
+};
+
+// The same parameters as the TorqueModel unit test, which are
+// representative of an mj5208.
+constexpr double kTorqueConstant = 0.41;
+constexpr double kCurrentCutoff = 17.0;
+constexpr double kCurrentScale = 0.002;
+constexpr double kTorqueScale = 97.0;
+
+double ReferenceCurrentToTorque(double current) {
+  const double abs_current = std::abs(current);
+  if (abs_current < kCurrentCutoff) { return current * kTorqueConstant; }
+  return std::copysign(
+      kCurrentCutoff * kTorqueConstant +
+      kTorqueScale * std::log2(
+          1.0 + (abs_current - kCurrentCutoff) * kCurrentScale),
+      current);
+}
+
+double ReferenceTorqueToCurrent(double torque) {
+  const double abs_torque = std::abs(torque);
+  const double cutoff_torque = kCurrentCutoff * kTorqueConstant;
+  if (abs_torque < cutoff_torque) { return torque / kTorqueConstant; }
+  return std::copysign(
+      kCurrentCutoff +
+      (std::exp2((abs_torque - cutoff_torque) / kTorqueScale) - 1.0) /
+      kCurrentScale,
+      torque);
+}
+
+struct PositionInput {
+  int64_t target_raw;
+  int64_t measured_raw;
+  float velocity;
+};
+
+class PositionContext {
+ public:
+  PositionContext(bool planned = false) : planned_(planned) {
+    position_config_.position_min = std::numeric_limits<float>::quiet_NaN();
+    position_config_.position_max = std::numeric_limits<float>::quiet_NaN();
+
+    // Limits are set so that the trajectory generator runs on every
+    // cycle, as that is the most expensive path.
+    data_.mode = kPosition;
+    data_.velocity_limit = 2.0f;
+    data_.accel_limit = 5.0f;
+  }
+
+  float operator()(const PositionInput& input) {
+    data_.position_relative_raw = input.target_raw;
+    position_.position_relative_raw = input.measured_raw;
+    return BldcServoPosition::UpdateCommand(
+        &status_, &config_, &position_config_, &position_,
+        0, 20000.0f, &data_, input.velocity,
+        planned_ ? &plan_ : nullptr);
+  }
+
+ private:
+  const bool planned_;
+  TrajectoryPlan plan_;
+  BldcServoStatus status_;
+  BldcServoConfig config_;
+  BldcServoPositionConfig position_config_;
+  MotorPosition::Status position_;
+  BldcServoCommandData data_;
+};
+
+/// A 7th harmonic encoder error, as from a magnetic ring, as a
+/// fraction of a revolution.
+constexpr double kCompensationOrder = 7.0;
+constexpr double kCompensationAmplitude = 0.002;
+constexpr uint32_t kCompensationCpr = 16384;
+
+double ReferenceCompensation(uint32_t raw) {
+  return kCompensationAmplitude *
+      std::cos(2.0 * M_PI * kCompensationOrder * raw / kCompensationCpr);
+}
+
+/// Updates a single compensated SPI source, described either with
+/// the 32 bin table or a harmonic.
+class CompensationContext {
+ public:
+  CompensationContext(bool harmonic) {
+    auto& source = position_.config()->sources[0];
+    if (harmonic) {
+      source.compensation_bits = 10;
+      source.compensation_harmonics[0].order = kCompensationOrder;
+      source.compensation_harmonics[0].cos_term = kCompensationAmplitude;
+    } else {
+      const int bins = MotorPosition::kCompensationSize;
+      for (int i = 0; i < bins; i++) {
+        source.compensation_table[i] = static_cast<float>(
+            ReferenceCompensation(
+                (2 * i + 1) * kCompensationCpr / (2 * bins)));
+      }
+    }
+    source.pll_filter_hz = 0.0f;
+    position_.motor()->poles = 14;
+    pcf_.persistent_config.Load();
+
+    aux1_status_.spi.active = true;
+  }
+
+  float operator()(uint32_t raw) {
+    aux1_status_.spi.value = raw;
+    aux1_status_.spi.nonce++;
+    position_.ISR_Update(1.0f / 30000.0f);
+    return position_.status().sources[0].compensated_value;
+  }
+
+ private:
+  mjlib::micro::test::PersistentConfigFixture pcf_;
+  mjlib::micro::TelemetryManager telemetry_manager_{
+    &pcf_.pool, &pcf_.command_manager, &pcf_.write_stream,
+    pcf_.output_buffer};
+  aux::AuxStatus aux1_status_;
+  aux::AuxStatus aux2_status_;
+  aux::AuxConfig aux1_config_;
+  aux::AuxConfig aux2_config_;
+  MotorPosition position_{&pcf_.persistent_config, &telemetry_manager_,
+                          &aux1_status_, &aux2_status_,
+                          &aux1_config_, &aux2_config_};
+};
+
+/// Updates a typical set of position sources: either a single rotor
+/// encoder, or one with a non power of two output encoder and an
+/// incremental encoder.
+class SourcesContext {
+ public:
+  SourcesContext(bool multiple) {
+    using Source = MotorPosition::SourceConfig;
+    auto& config = *position_.config();
+    config.sources[0].pll_filter_hz = 400.0f;
+    if (multiple) {
+      config.sources[1].aux_number = 2;
+      config.sources[1].type = Source::kUart;
+      config.sources[1].reference = Source::kOutput;
+      config.sources[1].cpr = 10000;
+      config.sources[1].pll_filter_hz = 50.0f;
+      config.sources[2].aux_number = 2;
+      config.sources[2].type = Source::kQuadrature;
+      config.sources[2].reference = Source::kOutput;
+      config.sources[2].cpr = 4000;
+      config.sources[2].pll_filter_hz = 100.0f;
+      config.rotor_to_output_ratio = 0.25f;
+    }
+    position_.motor()->poles = 14;
+    pcf_.persistent_config.Load();
+
+    aux1_status_.spi.active = true;
+    aux2_status_.uart.active = true;
+    aux2_status_.quadrature.active = true;
+  }
+
+  float operator()(uint32_t raw) {
+    aux1_status_.spi.value = raw;
+    aux1_status_.spi.nonce++;
+    aux2_status_.uart.value = raw % 10000;
+    aux2_status_.uart.nonce++;
+    aux2_status_.quadrature.value = raw % 4000;
+    position_.ISR_Update(1.0f / 30000.0f);
+    return position_.status().sources[0].filtered_value;
+  }
+
+ private:
+  mjlib::micro::test::PersistentConfigFixture pcf_;
+  mjlib::micro::TelemetryManager telemetry_manager_{
+    &pcf_.pool, &pcf_.command_manager, &pcf_.write_stream,
+    pcf_.output_buffer};
+  aux::AuxStatus aux1_status_;
+  aux::AuxStatus aux2_status_;
+  aux::AuxConfig aux1_config_;
+  aux::AuxConfig aux2_config_;
+  MotorPosition position_{&pcf_.persistent_config, &telemetry_manager_,
+                          &aux1_status_, &aux2_status_,
+                          &aux1_config_, &aux2_config_};
+};
+
+/// Runs the complete control cycle of a simulated servo which has
+/// settled in the given mode.
+class ServoContext {
+ public:
+  /// When @p generic is true, optional features are enabled in a way
+  /// that leaves the output unchanged, so that the control handlers
+  /// which check every feature are used.
+  ServoContext(BldcServoMode mode, bool generic, int position_divisor = 1) {
+    auto& config = *sim_.core()->mutable_config();
+    config.pid_position.kp = 1.0f;
+    config.pid_position.kd = 0.02f;
+    config.position_rate_divisor = position_divisor;
+    if (generic) {
+      config.motor_fault_temperature = 1000.0f;
+      sim_.motor_position()->motor()->cogging_dq_scale = 1e-6f;
+    }
+    pcf_.persistent_config.Load();
+
+    BldcServoCommandData command;
+    command.mode = mode;
+    command.timeout_s = std::numeric_limits<float>::quiet_NaN();
+    command.i_q_A = 1.0f;
+    command.position = 0.1f;
+    command.velocity = 0.0f;
+    command.max_torque_Nm = 0.5f;
+    sim_.Command(command);
+    sim_.Run(0.05);
+  }
+
+  float operator()(int) {
+    sim_.core()->ISR_DoControlCycle();
+    return sim_.core()->control().q_V;
+  }
+
+ private:
+  mjlib::micro::test::PersistentConfigFixture pcf_;
+  mjlib::micro::TelemetryManager telemetry_manager_{
+    &pcf_.pool, &pcf_.command_manager, &pcf_.write_stream,
+    pcf_.output_buffer};
+  BldcServoSim sim_{&pcf_.persistent_config, &telemetry_manager_};
+};
+
+/// Each group of kernels draws its inputs from a generator seeded by
+/// name, so that adding kernels does not change the inputs, and
+/// thus the error, of any other.
+uint32_t Seed(const char* name) {
+  // FNV-1a
+  uint32_t result = 2166136261u;
+  for (; *name; name++) {
+    result = (result ^ static_cast<uint8_t>(*name)) * 16777619u;
+  }
+  return result;
+}
+
+void RunAll(Runner* runner, int count) {
+  std::mt19937 rng;
+  auto uniform = [&](double lo, double hi) {
+    return std::uniform_real_distribution<double>(lo, hi)(rng);
+  };
+
+  auto floats = [&](double lo, double hi) {
+    std::vector<float> result;
+    for (int i = 0; i < count; i++) {
+      result.push_back(static_cast<float>(uniform(lo, hi)));
+    }
+    return result;
+  };
+
+  {
+    rng.seed(Seed("RadiansToQ31"));
+    const auto inputs = floats(-100.0, 100.0);
+    runner->Run(
+        "RadiansToQ31", "rad", inputs,
+        [](float x) { return RadiansToQ31(x); },
+        std::function<double (const float&)>([](const float& x) {
+          const double actual =
+              RadiansToQ31(x) * (M_PI / 2147483648.0);
+          return AngleError(actual, x);
+        }));
+  }
+
+  {
+    rng.seed(Seed("WrapZeroToTwoPi"));
+    const auto inputs = floats(-100.0, 100.0);
+    runner->Run(
+        "WrapZeroToTwoPi", "rad", inputs,
+        [](float x) { return WrapZeroToTwoPi(x); },
+        std::function<double (const float&)>([](const float& x) {
+          return AngleError(WrapZeroToTwoPi(x), x);
+        }));
+  }
+
+  {
+    rng.seed(Seed("ElectricalAngle"));
+    // A 14 bit encoder on a 7 pole pair motor, with a full table of
+    // commutation offsets.
+    constexpr float kCpr = 16384.0f;
+    constexpr float kPolePairs = 7.0f;
+    constexpr int kOffsets = 64;
+    const auto inputs = floats(0.0, static_cast<double>(kCpr));
+    std::array<float, kOffsets> offset = {};
+    std::array<uint32_t, kOffsets> offset_phase = {};
+    for (int i = 0; i < kOffsets; i++) {
+      offset[i] = static_cast<float>(uniform(-0.1, 0.1));
+      offset_phase[i] = static_cast<uint32_t>(RadiansToQ31(offset[i]));
+    }
+
+    auto reference = [&](float value) {
+      const double ratio =
+          static_cast<double>(value) / static_cast<double>(kCpr);
+      const int index = static_cast<int>(ratio * kOffsets);
+      return ratio * static_cast<double>(kPolePairs) * 2.0 * M_PI +
+          static_cast<double>(offset[index]);
+    };
+    auto phase_error = [&](int32_t phase, float value) {
+      return AngleError(phase * (M_PI / 2147483648.0), reference(value));
+    };
+
+    // This is how MotorPosition used to produce the angle handed to
+    // the CORDIC.
+    auto float_path = [&](float value) {
+      const float ratio = value / kCpr;
+      const int offset_index =
+          std::min<int>(kOffsets - 1, static_cast<int>(ratio * kOffsets));
+      const float theta = WrapZeroToTwoPi(
+          ratio * kPolePairs * k2Pi + offset[offset_index]);
+      return RadiansToQ31(theta);
+    };
+
+    const float cpr_scale = 4294967296.0f / kCpr;
+    const auto multiplier = PhaseMultiplier::FromFloat(kPolePairs);
+    auto phase_path = [&](float value) {
+      const uint32_t ratio = static_cast<uint32_t>(
+          std::min(value * cpr_scale, 4294967040.0f));
+      const uint32_t offset_index = static_cast<uint32_t>(
+          (static_cast<uint64_t>(ratio) * kOffsets) >> 32);
+      return static_cast<int32_t>(multiplier(ratio) + offset_phase[offset_index]);
+    };
+
+    runner->Run(
+        "ElectricalTheta/float", "rad", inputs, float_path,
+        std::function<double (const float&)>([&](const float& x) {
+          return phase_error(float_path(x), x);
+        }));
+    runner->Run(
+        "ElectricalPhase/uint32", "rad", inputs, phase_path,
+        std::function<double (const float&)>([&](const float& x) {
+          return phase_error(phase_path(x), x);
+        }));
+  }
+
+  {
+    rng.seed(Seed("log2f_approx"));
+    // The torque model uses this for values of 1 and greater.
+    const auto inputs = floats(1.0, 1000.0);
+    runner->Run(
+        "log2f_approx", "abs", inputs,
+        [](float x) { return log2f_approx(x); },
+        std::function<double (const float&)>([](const float& x) {
+          return std::abs(static_cast<double>(log2f_approx(x)) -
+                          std::log2(static_cast<double>(x)));
+        }));
+  }
+
+  {
+    rng.seed(Seed("pow2f_approx"));
+    // The torque model uses this for values of 0 and greater.
+    const auto inputs = floats(0.0, 16.0);
+    runner->Run(
+        "pow2f_approx", "rel", inputs,
+        [](float x) { return pow2f_approx(x); },
+        std::function<double (const float&)>([](const float& x) {
+          const double expected = std::exp2(static_cast<double>(x));
+          return std::abs(static_cast<double>(pow2f_approx(x)) - expected) /
+              expected;
+        }));
+  }
+
+  {
+    rng.seed(Seed("FastAtan2"));
+    std::vector<std::pair<float, float>> inputs;
+    for (int i = 0; i < count; i++) {
+      inputs.push_back({static_cast<float>(uniform(-10.0, 10.0)),
+                        static_cast<float>(uniform(-10.0, 10.0))});
+    }
+    using Input = std::pair<float, float>;
+    runner->Run(
+        "FastAtan2", "rad", inputs,
+        [](const Input& in) { return FastAtan2(in.first, in.second); },
+        std::function<double (const Input&)>([](const Input& in) {
+          return AngleError(FastAtan2(in.first, in.second),
+                            std::atan2(static_cast<double>(in.first),
+                                       static_cast<double>(in.second)));
+        }));
+  }
+
+  {
+    rng.seed(Seed("Cordic"));
+    std::vector<int32_t> inputs;
+    for (int i = 0; i < count; i++) {
+      inputs.push_back(static_cast<int32_t>(
+          std::uniform_int_distribution<int64_t>(kQ31Min, kQ31Max)(rng)));
+    }
+    auto error = [](int32_t theta_q31, const SinCos& sc) {
+      const double theta = theta_q31 * (M_PI / 2147483648.0);
+      return std::max(
+          std::abs(static_cast<double>(sc.s) - std::sin(theta)),
+          std::abs(static_cast<double>(sc.c) - std::cos(theta)));
+    };
+
+    // This is what the host Cordic used to do.
+    auto libm = [](int32_t theta_q31) {
+      const float theta =
+          static_cast<float>(theta_q31) * kPi * (1.0f / 2147483648.0f);
+      return SinCos{std::sin(theta), std::cos(theta)};
+    };
+
+    const Cordic cordic;
+    runner->Run(
+        "std::sin+std::cos", "abs", inputs,
+        [&](int32_t theta) {
+          const SinCos sc = libm(theta);
+          return sc.s + sc.c;
+        },
+        std::function<double (const int32_t&)>([&](const int32_t& theta) {
+          return error(theta, libm(theta));
+        }));
+    runner->Run(
+        "Cordic", "abs", inputs,
+        [&](int32_t theta) {
+          const SinCos sc = cordic(theta);
+          return sc.s + sc.c;
+        },
+        std::function<double (const int32_t&)>([&](const int32_t& theta) {
+          return error(theta, cordic(theta));
+        }));
+
+    // Time the batch version by evaluating blocks of 64.
+    constexpr int kBlock = 64;
+    std::vector<int> blocks;
+    for (int i = 0; i + kBlock <= count; i += kBlock) { blocks.push_back(i); }
+    SinCos batch[kBlock] = {};
+    runner->Run(
+        "Cordic/batch64", "abs", blocks,
+        [&](int start) {
+          cordic(&inputs[start], batch, kBlock);
+          return batch[kBlock - 1].s;
+        },
+        std::function<double (const int&)>([&](const int& start) {
+          cordic(&inputs[start], batch, kBlock);
+          double result = 0.0;
+          for (int i = 0; i < kBlock; i++) {
+            result = std::max(result, error(inputs[start + i], batch[i]));
+          }
+          return result;
+        }));
+  }
+
+  rng.seed(Seed("DqTransform"));
+  std::vector<DqInput> dq_inputs;
+  for (int i = 0; i < count; i++) {
+    DqInput input;
+    input.theta = uniform(0.0, 2.0 * M_PI);
+    input.sc.s = static_cast<float>(std::sin(input.theta));
+    input.sc.c = static_cast<float>(std::cos(input.theta));
+    input.a = static_cast<float>(uniform(-50.0, 50.0));
+    input.b = static_cast<float>(uniform(-50.0, 50.0));
+    input.c = static_cast<float>(uniform(-50.0, 50.0));
+    dq_inputs.push_back(input);
+  }
+
+  runner->Run(
+      "DqTransform", "abs", dq_inputs,
+      [](const DqInput& in) {
+        DqTransform dq(in.sc, in.a, in.b, in.c);
+        return dq.d + dq.q;
+      },
+      std::function<double (const DqInput&)>([](const DqInput& in) {
+        const DqTransform dq(in.sc, in.a, in.b, in.c);
+        const double abc[3] = {
+          static_cast<double>(in.a),
+          static_cast<double>(in.b),
+          static_cast<double>(in.c),
+        };
+        double d = 0.0;
+        double q = 0.0;
+        for (int k = 0; k < 3; k++) {
+          const double th = in.theta - k * 2.0 * M_PI / 3.0;
+          d += (2.0 / 3.0) * abc[k] * std::cos(th);
+          q += -(2.0 / 3.0) * abc[k] * std::sin(th);
+        }
+        return std::max(std::abs(static_cast<double>(dq.d) - d),
+                        std::abs(static_cast<double>(dq.q) - q));
+      }));
+
+  runner->Run(
+      "InverseDqTransform", "abs", dq_inputs,
+      [](const DqInput& in) {
+        InverseDqTransform abc(in.sc, in.a, in.b);
+        return abc.a + abc.b + abc.c;
+      },
+      std::function<double (const DqInput&)>([](const DqInput& in) {
+        const InverseDqTransform abc(in.sc, in.a, in.b);
+        const float actual[3] = {abc.a, abc.b, abc.c};
+        double result = 0.0;
+        for (int k = 0; k < 3; k++) {
+          const double th = in.theta - k * 2.0 * M_PI / 3.0;
+          const double expected =
+              std::cos(th) * static_cast<double>(in.a) -
+              std::sin(th) * static_cast<double>(in.b);
+          result = std::max(result, std::abs(static_cast<double>(actual[k]) - expected));
+        }
+        return result;
+      }));
+
+  {
+    rng.seed(Seed("DqTransform/adc"));
+    // The fixed point transforms start from raw ADC counts, so the
+    // float version is timed the same way for comparison.  Errors are
+    // in fractions of full scale.
+    struct AdcInput {
+      double theta;
+      SinCos sc;
+      SinCosQ31 sc31;
+      SinCosQ15 sc15;
+      uint16_t raw[3];
+    };
+    constexpr uint16_t kOffset = 2048;
+
+    std::vector<AdcInput> inputs;
+    Cordic cordic;
+    for (int i = 0; i < count; i++) {
+      AdcInput input;
+      const int32_t theta_q31 =
+          static_cast<int32_t>(std::uniform_int_distribution<int64_t>(
+              kQ31Min, kQ31Max)(rng));
+      input.theta = theta_q31 * (M_PI / 2147483648.0);
+      input.sc = cordic(theta_q31);
+      input.sc31 = cordic.q31(theta_q31);
+      input.sc15 = cordic.q15(theta_q31);
+      for (auto& raw : input.raw) {
+        raw = static_cast<uint16_t>(
+            std::uniform_int_distribution<int>(1024, 3072)(rng));
+      }
+      inputs.push_back(input);
+    }
+
+    auto reference_error = [&](const AdcInput& in, float d, float q) {
+      double expected_d = 0.0;
+      double expected_q = 0.0;
+      for (int k = 0; k < 3; k++) {
+        const double th = in.theta - k * 2.0 * M_PI / 3.0;
+        const double x =
+            (static_cast<double>(in.raw[k]) - kOffset) / kAdcFullScaleCounts;
+        expected_d += (2.0 / 3.0) * x * std::cos(th);
+        expected_q += -(2.0 / 3.0) * x * std::sin(th);
+      }
+      return std::max(std::abs(static_cast<double>(d) - expected_d),
+                      std::abs(static_cast<double>(q) - expected_q));
+    };
+
+    auto transform = [](auto policy, const auto& sc, const AdcInput& in) {
+      using P = decltype(policy);
+      return DqTransformT<P>(
+          sc,
+          P::FromAdc(in.raw[0], kOffset),
+          P::FromAdc(in.raw[1], kOffset),
+          P::FromAdc(in.raw[2], kOffset));
+    };
+
+    runner->Run(
+        "DqTransform<float>/adc", "fs", inputs,
+        [&](const AdcInput& in) {
+          const auto dq = transform(FloatPolicy(), in.sc, in);
+          return dq.d + dq.q;
+        },
+        std::function<double (const AdcInput&)>([&](const AdcInput& in) {
+          const auto dq = transform(FloatPolicy(), in.sc, in);
+          return reference_error(in, dq.d, dq.q);
+        }));
+    runner->Run(
+        "DqTransform<Q31>/adc", "fs", inputs,
+        [&](const AdcInput& in) {
+          const auto dq = transform(Q31Policy(), in.sc31, in);
+          return static_cast<int32_t>(dq.d ^ dq.q);
+        },
+        std::function<double (const AdcInput&)>([&](const AdcInput& in) {
+          const auto dq = transform(Q31Policy(), in.sc31, in);
+          return reference_error(in, Q31ToFloat(dq.d), Q31ToFloat(dq.q));
+        }));
+    runner->Run(
+        "DqTransform<Q15>/adc", "fs", inputs,
+        [&](const AdcInput& in) {
+          const auto dq = transform(Q15Policy(), in.sc15, in);
+          return static_cast<int32_t>(dq.d ^ dq.q);
+        },
+        std::function<double (const AdcInput&)>([&](const AdcInput& in) {
+          const auto dq = transform(Q15Policy(), in.sc15, in);
+          return reference_error(in, Q15ToFloat(dq.d), Q15ToFloat(dq.q));
+        }));
+
+    // Feed the forward transform back through the inverse, which
+    // should reproduce the zero sequence free portion of the input.
+    auto inverse_error = [&](const AdcInput& in, float a, float b, float c) {
+      const double x[3] = {
+        (static_cast<double>(in.raw[0]) - kOffset) / kAdcFullScaleCounts,
+        (static_cast<double>(in.raw[1]) - kOffset) / kAdcFullScaleCounts,
+        (static_cast<double>(in.raw[2]) - kOffset) / kAdcFullScaleCounts,
+      };
+      const double common = (x[0] + x[1] + x[2]) / 3.0;
+      return std::max({
+          std::abs(static_cast<double>(a) - (x[0] - common)),
+          std::abs(static_cast<double>(b) - (x[1] - common)),
+          std::abs(static_cast<double>(c) - (x[2] - common))});
+    };
+
+    std::vector<std::pair<AdcInput, DqTransformT<Q31Policy>>> inverse_inputs;
+    for (const auto& in : inputs) {
+      inverse_inputs.push_back({in, transform(Q31Policy(), in.sc31, in)});
+    }
+    using InverseInput = std::pair<AdcInput, DqTransformT<Q31Policy>>;
+    runner->Run(
+        "InverseDqTransform<Q31>", "fs", inverse_inputs,
+        [&](const InverseInput& in) {
+          const InverseDqTransformT<Q31Policy> abc(
+              in.first.sc31, in.second.d, in.second.q);
+          return static_cast<int32_t>(abc.a ^ abc.b ^ abc.c);
+        },
+        std::function<double (const InverseInput&)>(
+            [&](const InverseInput& in) {
+              const InverseDqTransformT<Q31Policy> abc(
+                  in.first.sc31, in.second.d, in.second.q);
+              return inverse_error(in.first,
+                                   Q31ToFloat(abc.a),
+                                   Q31ToFloat(abc.b),
+                                   Q31ToFloat(abc.c));
+            }));
+  }
+
+  {
+    // With no compensation, the duty cycles are just the phase
+    // voltages centered about 50%.
+    const PwmCompensation comp;
+    constexpr float kBusV = 24.0f;
+
+    auto reference_error = [](const DqInput& in, float a, float b, float c) {
+      const double actual[3] = {
+        static_cast<double>(a),
+        static_cast<double>(b),
+        static_cast<double>(c),
+      };
+      double result = 0.0;
+      for (int k = 0; k < 3; k++) {
+        const double th = in.theta - k * 2.0 * M_PI / 3.0;
+        const double v =
+            std::cos(th) * static_cast<double>(in.a * 0.2f) -
+            std::sin(th) * static_cast<double>(in.b * 0.2f);
+        const double expected = 0.5 + v / static_cast<double>(kBusV);
+        result = std::max(result, std::abs(actual[k] - expected));
+      }
+      return result;
+    };
+
+    // The inputs are scaled so that the voltage stays within the
+    // bus.
+    runner->Run(
+        "InverseDqTransform+BalancedPwm", "duty", dq_inputs,
+        [&](const DqInput& in) {
+          const InverseDqTransform idt(in.sc, in.a * 0.2f, in.b * 0.2f);
+          const BalancedPwm pwm(idt.a, idt.b, idt.c, kBusV, comp);
+          return pwm.a + pwm.b + pwm.c;
+        },
+        std::function<double (const DqInput&)>([&](const DqInput& in) {
+          const InverseDqTransform idt(in.sc, in.a * 0.2f, in.b * 0.2f);
+          const BalancedPwm pwm(idt.a, idt.b, idt.c, kBusV, comp);
+          return reference_error(in, pwm.a, pwm.b, pwm.c);
+        }));
+    runner->Run(
+        "SpaceVectorPwm", "duty", dq_inputs,
+        [&](const DqInput& in) {
+          const SpaceVectorPwm pwm(in.sc, in.a * 0.2f, in.b * 0.2f,
+                                   1.0f / kBusV, comp);
+          return pwm.a + pwm.b + pwm.c;
+        },
+        std::function<double (const DqInput&)>([&](const DqInput& in) {
+          const SpaceVectorPwm pwm(in.sc, in.a * 0.2f, in.b * 0.2f,
+                                   1.0f / kBusV, comp);
+          return reference_error(in, pwm.a, pwm.b, pwm.c);
+        }));
+  }
+
+  {
+    rng.seed(Seed("TorqueModel"));
+    const TorqueModel model(kTorqueConstant, kCurrentCutoff,
+                            kCurrentScale, kTorqueScale);
+    std::vector<TorqueInput> currents;
+    std::vector<TorqueInput> torques;
+    for (int i = 0; i < count; i++) {
+      // Cover both sides of the cutoff.
+      currents.push_back({static_cast<float>(uniform(-60.0, 60.0))});
+      torques.push_back({static_cast<float>(uniform(-20.0, 20.0))});
+    }
+
+    runner->Run(
+        "TorqueModel::current_to_torque", "Nm", currents,
+        [&](const TorqueInput& in) { return model.current_to_torque(in.value); },
+        std::function<double (const TorqueInput&)>(
+            [&](const TorqueInput& in) {
+              return std::abs(
+                  static_cast<double>(model.current_to_torque(in.value)) -
+                  ReferenceCurrentToTorque(static_cast<double>(in.value)));
+            }));
+    runner->Run(
+        "TorqueModel::torque_to_current", "A", torques,
+        [&](const TorqueInput& in) { return model.torque_to_current(in.value); },
+        std::function<double (const TorqueInput&)>(
+            [&](const TorqueInput& in) {
+              return std::abs(
+                  static_cast<double>(model.torque_to_current(in.value)) -
+                  ReferenceTorqueToCurrent(static_cast<double>(in.value)));
+            }));
+
+    // The same curve, sampled into a table covering the range of
+    // torques above, with the cutoff current on a table entry.
+    constexpr double kTableMaxCurrent = 68.0;
+    TorqueTable::Table torque_table;
+    for (int i = 0; i < TorqueTable::kSize; i++) {
+      torque_table[i] = static_cast<float>(ReferenceCurrentToTorque(
+          i * kTableMaxCurrent / (TorqueTable::kSize - 1)));
+    }
+    TorqueTable table;
+    table.Configure(torque_table, static_cast<float>(kTableMaxCurrent));
+
+    runner->Run(
+        "TorqueTable::current_to_torque", "Nm", currents,
+        [&](const TorqueInput& in) { return table.current_to_torque(in.value); },
+        std::function<double (const TorqueInput&)>(
+            [&](const TorqueInput& in) {
+              return std::abs(
+                  static_cast<double>(table.current_to_torque(in.value)) -
+                  ReferenceCurrentToTorque(static_cast<double>(in.value)));
+            }));
+    runner->Run(
+        "TorqueTable::torque_to_current", "A", torques,
+        [&](const TorqueInput& in) { return table.torque_to_current(in.value); },
+        std::function<double (const TorqueInput&)>(
+            [&](const TorqueInput& in) {
+              return std::abs(
+                  static_cast<double>(table.torque_to_current(in.value)) -
+                  ReferenceTorqueToCurrent(static_cast<double>(in.value)));
+            }));
+  }
+
+  {
+    rng.seed(Seed("BldcServoPosition"));
+    std::vector<PositionInput> inputs;
+    for (int i = 0; i < count; i++) {
+      PositionInput input;
+      input.target_raw = MotorPosition::FloatToInt(
+          static_cast<float>(uniform(-5.0, 5.0)));
+      input.measured_raw = MotorPosition::FloatToInt(
+          static_cast<float>(uniform(-5.0, 5.0)));
+      input.velocity = static_cast<float>(uniform(-1.0, 1.0));
+      inputs.push_back(input);
+    }
+
+    PositionContext context;
+    runner->Run(
+        "BldcServoPosition::UpdateCommand", "", inputs,
+        std::ref(context),
+        std::function<double (const PositionInput&)>());
+
+    // A single long move, which is where planning once pays off.
+    for (auto& input : inputs) {
+      input.target_raw = MotorPosition::FloatToInt(1000.0f);
+      input.velocity = 0.0f;
+    }
+    for (const bool planned : { false, true }) {
+      PositionContext long_context(planned);
+      runner->Run(
+          planned ? "BldcServoPosition::UpdateCommand/long_planned" :
+          "BldcServoPosition::UpdateCommand/long",
+          "", inputs, std::ref(long_context),
+          std::function<double (const PositionInput&)>());
+    }
+  }
+
+  {
+    rng.seed(Seed("MotorPosition"));
+    std::vector<uint32_t> inputs;
+    for (int i = 0; i < count; i++) {
+      inputs.push_back(static_cast<uint32_t>(rng() % kCompensationCpr));
+    }
+
+    for (const bool harmonic : { false, true }) {
+      CompensationContext context(harmonic);
+      runner->Run(
+          harmonic ? "MotorPosition::ISR_Update/harmonic" :
+          "MotorPosition::ISR_Update/table32",
+          "counts", inputs, std::ref(context),
+          std::function<double (const uint32_t&)>(
+              [&](const uint32_t& raw) {
+                const double expected =
+                    raw + ReferenceCompensation(raw) * kCompensationCpr;
+                double error = std::abs(
+                    static_cast<double>(context(raw)) - expected);
+                return std::min(error, kCompensationCpr - error);
+              }));
+    }
+  }
+
+  {
+    // A slowly moving encoder, so that the filters are tracking.
+    std::vector<uint32_t> inputs;
+    for (int i = 0; i < count; i++) {
+      inputs.push_back(static_cast<uint32_t>(i * 3) % kCompensationCpr);
+    }
+
+    for (const bool multiple : { false, true }) {
+      SourcesContext context(multiple);
+      runner->Run(
+          multiple ? "MotorPosition::ISR_Update/three_sources" :
+          "MotorPosition::ISR_Update/spi",
+          "", inputs, std::ref(context),
+          std::function<double (const uint32_t&)>());
+    }
+  }
+
+  {
+    // The common configurations, with the optional control features
+    // disabled, compared to the handlers that check for them.
+    const std::vector<int> inputs(count);
+    const std::pair<const char*, BldcServoMode> modes[] = {
+      { "current", kCurrent },
+      { "position", kPosition },
+    };
+    for (const auto& mode : modes) {
+      for (const bool generic : { false, true }) {
+        ServoContext context(mode.second, generic);
+        runner->Run(
+            fmt::format("ISR_DoControlCycle/{}{}",
+                        mode.first, generic ? "/generic" : ""),
+            "", inputs, std::ref(context),
+            std::function<double (const int&)>());
+      }
+    }
+
+    // The average over every cycle, when the position loop runs at a
+    // quarter of the control rate.
+    ServoContext context(kPosition, false, 4);
+    runner->Run(
+        "ISR_DoControlCycle/position/divisor4", "", inputs, std::ref(context),
+        std::function<double (const int&)>());
+  }
+}
+
+std::string FormatError(double value) {
+  return std::isnan(value) ? "-" : fmt::format("{:.3g}", value);
+}
+}
+
+extern "C" {
+int main(int argc, char** argv) {
+  const auto args = ParseArgs(argc, argv);
+
+  Runner runner(args);
+  RunAll(&runner, args.count);
+
+  const auto baseline = ReadBaseline(args.baseline);
+
+  fmt::print("{:<36} {:>9} {:>9} {:>7}  {:>10} {:>10}\n",
+             "kernel", "ns/call", "base", "delta", "max_error", "base");
+
+  bool error_regression = false;
+  for (const auto& result : runner.results()) {
+    const auto it = baseline.find(result.name);
+    const BaselineEntry base =
+        (it == baseline.end()) ? BaselineEntry() : it->second;
+
+    const double delta =
+        100.0 * (result.ns_per_call - base.ns_per_call) / base.ns_per_call;
+
+    // A small tolerance allows for compilers which contract or
+    // reorder floating point operations differently.
+    const bool error_worse =
+        !std::isnan(result.max_error) &&
+        !std::isnan(base.max_error) &&
+        result.max_error > base.max_error * 1.01 + 1e-12;
+    if (error_worse) { error_regression = true; }
+
+    fmt::print("{:<36} {:>9.2f} {:>9} {:>7}  {:>10} {:>10} {}{}\n",
+               result.name,
+               result.ns_per_call,
+               std::isnan(base.ns_per_call) ?
+               "-" : fmt::format("{:.2f}", base.ns_per_call),
+               std::isnan(delta) ? "-" : fmt::format("{:+.0f}%", delta),
+               FormatError(result.max_error),
+               FormatError(base.max_error),
+               result.error_units,
+               error_worse ? "  ERROR REGRESSION" : "");
+  }
+
+  if (!args.write.empty()) {
+    const auto path = WorkspacePath(args.write);
+    std::ofstream outf(path);
+    if (!outf) {
+      fmt::print(stderr, "could not open {}\n", path);
+      return 1;
+    }
+    outf << "# Generated by: bazel run -c opt //fw:bench -- write=" <<
+        args.write << "\n";
+    outf << "# name ns_per_call max_error\n";
+    for (const auto& result : runner.results()) {
+      outf << fmt::format("{} {:.2f} {}\n",
+                          result.name, result.ns_per_call,
+                          std::isnan(result.max_error) ?
+                          "nan" : fmt::format("{:.6g}", result.max_error));
+    }
+    fmt::print("wrote {}\n", path);
+  }
+
+  return error_regression ? 1 : 0;
+}
+}
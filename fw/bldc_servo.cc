@@ -41,6 +41,7 @@ In summary, the provided code is a sophisticated and well-structured part of a B
 #include "mjlib/base/assert.h"
 #include "mjlib/base/windowed_average.h"
 
+#include "fw/bldc_servo_core.h"
 #include "fw/bldc_servo_position.h"
 #include "fw/foc.h"
 #include "fw/math.h"
@@ -70,68 +71,6 @@ using HardwareUart = Stm32G4AsyncUart;
 #endif
 
 
-float Limit(float, float, float) MOTEUS_CCM_ATTRIBUTE;
-
-float Limit(float a, float min, float max) {
-  if (a < min) { return min; }
-  if (a > max) { return max; }
-  return a;
-}
-
-float Threshold(float, float, float) MOTEUS_CCM_ATTRIBUTE;
-
-float Threshold(float value, float lower, float upper) {
-  if (value > lower && value < upper) { return 0.0f; }
-  return value;
-}
-
-float BilinearRate(float offset, float mag, float val) MOTEUS_CCM_ATTRIBUTE;
-
-float BilinearRate(float offset, float mag, float val) {
-  const float sign = val < 0.0f ? -1.0f : 1.0f;
-  if (std::abs(val) < mag) {
-    return val / mag * offset;
-  } else {
-    return sign * ((0.5f - offset) * (std::abs(val) - mag) / (0.5f - mag) + offset);
-  }
-}
-
-// From make_thermistor_table.py
-constexpr float g_thermistor_lookup[] = {
-  -74.17f, // 0
-  -11.36f, // 128
-  1.53f, // 256
-  9.97f, // 384
-  16.51f, // 512
-  21.98f, // 640
-  26.79f, // 768
-  31.15f, // 896
-  35.19f, // 1024
-  39.00f, // 1152
-  42.65f, // 1280
-  46.18f, // 1408
-  49.64f, // 1536
-  53.05f, // 1664
-  56.45f, // 1792
-  59.87f, // 1920
-  63.33f, // 2048
-  66.87f, // 2176
-  70.51f, // 2304
-  74.29f, // 2432
-  78.25f, // 2560
-  82.44f, // 2688
-  86.92f, // 2816
-  91.78f, // 2944
-  97.13f, // 3072
-  103.13f, // 3200
-  110.01f, // 3328
-  118.16f, // 3456
-  128.23f, // 3584
-  141.49f, // 3712
-  161.02f, // 3840
-  197.66f, // 3968
-};
-
 template <typename Array>
 int MapConfig(const Array& array, int value) {
   static_assert(sizeof(array) > 0);
@@ -144,77 +83,6 @@ int MapConfig(const Array& array, int value) {
   return result - 1;
 }
 
-// This is used to determine the maximum allowable PWM value so that
-// the current sampling is guaranteed to occur while the FETs are
-// still low.  It was calibrated using the scope and trial and error.
-//
-// The primary test is a high torque pulse with absolute position
-// limits in place of +-1.0.  Something like "d pos nan 0 1 p0 d0 f1".
-// This all but ensures the current controller will saturate.
-//
-// As of 2020-09-13, 0.98 was the highest value that failed.
-constexpr float kCurrentSampleTime = 1.03e-6f;
-
-
-// All of these constants depend upon the pwm rate.
-struct RateConfig {
-  int int_rate_hz;
-  int interrupt_divisor;
-  uint32_t interrupt_mask;
-  int pwm_rate_hz;
-  float min_pwm;
-  float max_pwm;
-  float max_voltage_ratio;
-  float rate_hz;
-  float period_s;
-  int16_t max_position_delta;
-
-  RateConfig(int pwm_rate_hz_in = 30000) {
-    const int board_min_pwm_rate_hz =
-        (g_measured_hw_family == 0 &&
-         g_measured_hw_rev == 2) ? 60000 :
-        15000;
-
-    // Limit our PWM rate to even frequencies between 15kHz and 60kHz.
-    pwm_rate_hz =
-        ((std::max(board_min_pwm_rate_hz,
-                   std::min(60000, pwm_rate_hz_in))) / 2) * 2;
-
-    interrupt_divisor = (pwm_rate_hz > 30000) ? 2 : 1;
-    interrupt_mask = [&]() {
-                       switch (interrupt_divisor) {
-                         case 1: return 0;
-                         case 2: return 1;
-                         default: mbed_die();
-                       }
-                     }();
-
-    // The maximum interrupt rate is 30kHz, so if our PWM rate is
-    // higher than that, then set up the interrupt at half rate.
-    int_rate_hz = pwm_rate_hz / interrupt_divisor;
-
-    min_pwm = kCurrentSampleTime / (0.5f / static_cast<float>(pwm_rate_hz));
-    max_pwm = 1.0f - min_pwm;
-    max_voltage_ratio = (max_pwm - 0.5f) * 2.0f;
-
-    rate_hz = int_rate_hz;
-    period_s = 1.0f / rate_hz;
-
-    // The maximum amount the absolute encoder can change in one cycle
-    // without triggering a fault.  Measured as a fraction of a uint16_t
-    // and corresponds to roughly 28krpm, which is the limit of the AS5047
-    // encoder.
-    //  28000 / 60 = 467 Hz
-    //  467 Hz * 65536 / kIntRate ~= 763
-    max_position_delta = 28000 / 60 * 65536 / int_rate_hz;
-  }
-};
-
-constexpr int kCalibrateCount = 256;
-
-constexpr float kDefaultTorqueConstant = 0.1f;
-constexpr float kMaxUnconfiguredCurrent = 5.0f;
-
 constexpr int kMaxVelocityFilter = 256;
 
 IRQn_Type FindUpdateIrq(TIM_TypeDef* timer) {
@@ -311,11 +179,11 @@ class BldcServo::Impl {
        const Options& options)
       : options_(options),
         ms_timer_(millisecond_timer),
-        motor_driver_(motor_driver),
         aux_adc_(aux_adc),
         aux1_port_(aux1_port),
         aux2_port_(aux2_port),
         motor_position_(motor_position),
+        core_(motor_driver, motor_position, g_hw_pins.vsense_adc_scale),
         pwm1_(options.pwm1),
         pwm2_(options.pwm2),
         pwm3_(options.pwm3),
@@ -329,19 +197,19 @@ class BldcServo::Impl {
         tsense_sqr_(FindSqr(options.tsense)),
         msense_(options.msense),
         msense_sqr_(FindSqr(options.msense)),
-        debug_dac_(options.debug_dac),
+        debug_dac_(options.debug_dac)
 #ifdef MOTEUS_DEBUG_OUT
-        debug_out_(options.debug_out),
+        , debug_out_(options.debug_out)
 #endif
-        vsense_adc_scale_(g_hw_pins.vsense_adc_scale) {
-
-    persistent_config->Register("servo", &config_,
+  {
+    persistent_config->Register("servo", core_.mutable_config(),
                                 std::bind(&Impl::UpdateConfig, this));
-    persistent_config->Register("servopos", &position_config_,
+    persistent_config->Register("servopos", core_.mutable_position_config(),
                                 std::bind(&Impl::UpdateConfig, this));
     telemetry_manager->Register("servo_stats", &status_);
-    telemetry_manager->Register("servo_cmd", &telemetry_data_);
-    telemetry_manager->Register("servo_control", &control_);
+    telemetry_manager->Register("servo_cmd", core_.telemetry_data());
+    telemetry_manager->Register("servo_control", core_.mutable_control());
+    telemetry_manager->Register("servo_profile", core_.mutable_profile());
 
     UpdateConfig();
 
@@ -366,99 +234,24 @@ class BldcServo::Impl {
   }
 
   void Command(const CommandData& data) {
-    if (data.mode == kFault ||
-        data.mode == kEnabling ||
-        data.mode == kCalibrating ||
-        data.mode == kCalibrationComplete) {
-      // These are not valid states to command.  Ignore the command
-      // entirely.
-      return;
-    }
-
-    // Actually setting values will happen in the interrupt routine,
-    // so we need to update this atomically.
-    CommandData* next = next_data_;
-    *next = data;
-
-    if (next->timeout_s == 0.0f) {
-      next->timeout_s = config_.default_timeout_s;
-    }
-    if (std::isnan(next->velocity_limit)) {
-      next->velocity_limit = config_.default_velocity_limit;
-    }
-    if (std::isnan(next->accel_limit)) {
-      next->accel_limit = config_.default_accel_limit;
-    }
-    // If we are going to limit at all, ensure that we have a velocity
-    // limit, and that is is no more than the configured maximum
-    // velocity.
-    if (!std::isnan(next->velocity_limit) || !std::isnan(next->accel_limit)) {
-      if (std::isnan(next->velocity_limit)) {
-        next->velocity_limit = config_.max_velocity;
-      } else {
-        next->velocity_limit =
-            std::min(next->velocity_limit, config_.max_velocity);
-      }
-    }
-
-    // If we have a velocity command and velocity_limit, ensure that
-    // the command does not violate the limit.
-    if (!std::isnan(next->velocity_limit) &&
-        !std::isnan(next->velocity)) {
-      next->velocity = Limit(next->velocity,
-                             -next->velocity_limit,
-                             next->velocity_limit);
-    }
-
-    // Transform any position and stop_position command into the
-    // relative raw space.
-    const auto delta = static_cast<int64_t>(
-        motor_position_->absolute_relative_delta.load()) << 32ll;
-    if (!std::isnan(next->position)) {
-      next->position_relative_raw =
-          MotorPosition::FloatToInt(next->position) - delta;
-    } else {
-      next->position_relative_raw.reset();
-    }
-
-    if (!std::isnan(next->stop_position)) {
-      next->stop_position_relative_raw =
-          MotorPosition::FloatToInt(next->stop_position) - delta;
-    }
-
-    // If we have a case where the position is left unspecified, but
-    // we have a velocity and stop condition, then we pick the sign of
-    // the velocity so that we actually move.
-    if (!next->position_relative_raw &&
-        !!next->stop_position_relative_raw &&
-        !std::isnan(next->velocity) &&
-        next->velocity != 0.0f) {
-
-      next->velocity = std::abs(next->velocity) *
-          (((*next->stop_position_relative_raw -
-             position_.position_relative_raw) > 0) ?
-           1.0f : -1.0f);
-    }
+    core_.Command(data);
+  }
 
-    telemetry_data_ = *next;
-
-    if (!!next->stop_position_relative_raw &&
-        (std::isfinite(next->accel_limit) ||
-         std::isfinite(next->velocity_limit))) {
-      // There is no valid use case for using a stop position along
-      // with an acceleration or velocity limit.
-      volatile auto* mode_volatile = &status_.mode;
-      volatile auto* fault_volatile = &status_.fault;
-      *fault_volatile = errc::kStopPositionDeprecated;
-      *mode_volatile = kFault;
-    }
+  bool PushWaypoint(float position, float velocity,
+                    float feedforward_Nm, float duration_s) {
+    return core_.PushWaypoint(position, velocity, feedforward_Nm, duration_s);
+  }
 
-    std::swap(current_data_, next_data_);
+  void ClearWaypoints() {
+    core_.ClearWaypoints();
   }
 
-  const Status& status() const { return status_; }
-  const Config& config() const { return config_; }
-  const Control& control() const { return control_; }
+  int waypoint_count() const { return core_.waypoint_count(); }
+
+  const Status& status() const { return core_.status(); }
+  const Config& config() const { return core_.config(); }
+  const Control& control() const { return core_.control(); }
+  const IsrProfile& profile() const { return core_.profile(); }
   const AuxPort::Status& aux1() const { return *aux1_port_->status(); }
   const AuxPort::Status& aux2() const { return *aux2_port_->status(); }
   const MotorPosition::Status& motor_position() const {
@@ -472,77 +265,14 @@ class BldcServo::Impl {
     return motor_position_->config();
   }
 
-  bool is_torque_constant_configured() const {
-    return motor_.v_per_hz != 0.0f;
-  }
-
-  float current_to_torque(float current) const MOTEUS_CCM_ATTRIBUTE {
-    TorqueModel model(torque_constant_,
-                      motor_.rotation_current_cutoff_A,
-                      motor_.rotation_current_scale,
-                      motor_.rotation_torque_scale);
-    return model.current_to_torque(current);
-  }
-
-  float torque_to_current(float torque) const MOTEUS_CCM_ATTRIBUTE {
-    TorqueModel model(torque_constant_,
-                      motor_.rotation_current_cutoff_A,
-                      motor_.rotation_current_scale,
-                      motor_.rotation_torque_scale);
-    return model.torque_to_current(torque);
-  }
-
   void UpdateConfig() {
-    rate_config_ = RateConfig(config_.pwm_rate_hz);
-    // Update the saved config to match our limits.
-    config_.pwm_rate_hz = rate_config_.pwm_rate_hz;
+    core_.UpdateConfig();
 
     ConfigurePwmTimer();
-
-    const float kv = 0.5f * 60.0f / motor_.v_per_hz;
-
-    // I have no idea why this fudge is necessary, but it seems to be
-    // consistent across every motor I have tried.
-    constexpr float kFudge = 0.78;
-
-    torque_constant_ =
-        is_torque_constant_configured() ?
-        kFudge * 60.0f / (2.0f * kPi * kv) :
-        kDefaultTorqueConstant;
-
-    adc_scale_ = 3.3f / (4096.0f * config_.current_sense_ohm * config_.i_gain);
-
-    const float pwm_derate =
-        (static_cast<float>(config_.pwm_rate_hz) / 40000.0f);
-    adjusted_pwm_comp_off_ = config_.pwm_comp_off * pwm_derate;
-    adjusted_max_power_W_ = config_.max_power_W * pwm_derate;
   }
 
   void PollMillisecond() {
-    volatile auto* mode_volatile = &status_.mode;
-    volatile auto* fault_volatile = &status_.fault;
-    Mode mode = *mode_volatile;
-    if (mode == kEnabling) {
-      const auto enable_result = motor_driver_->StartEnable(true);
-      switch (enable_result) {
-        case MotorDriver::kEnabled: {
-          *mode_volatile = kCalibrating;
-          break;
-        }
-        case MotorDriver::kCalibrateFailed: {
-          *fault_volatile = errc::kDriverEnableFault;
-          *mode_volatile = kFault;
-          break;
-        }
-        case MotorDriver::kDisabled:
-        case MotorDriver::kEnabling1:
-        case MotorDriver::kEnabling2:
-        case MotorDriver::kEnabling3: {
-          // Not done yet.
-          break;
-        }
-      }
-    }
+    core_.PollMillisecond();
 
     // Because the aux ports can be configured after us, we just poll
     // periodically to see if we need to point our debug uart
@@ -583,6 +313,10 @@ class BldcServo::Impl {
     __enable_irq();
   }
 
+  void ResetProfile() {
+    core_.profiler()->Reset();
+  }
+
   void Fault(moteus::errc fault_code) {
     __disable_irq();
 
@@ -637,6 +371,13 @@ class BldcServo::Impl {
     pwm2_ccr_ = FindCcr(timer_, options_.pwm2);
     pwm3_ccr_ = FindCcr(timer_, options_.pwm3);
 
+    BldcServoCore::Registers registers;
+    registers.pwm1_ccr = pwm1_ccr_;
+    registers.pwm2_ccr = pwm2_ccr_;
+    registers.pwm3_ccr = pwm3_ccr_;
+    registers.cycle_count = &DWT->CYCCNT;
+    core_.SetRegisters(registers);
+
 
     // Enable the update interrupt.
     timer_->DIER = TIM_DIER_UIE;
@@ -658,8 +399,9 @@ class BldcServo::Impl {
     // Set up PWM.
 
     timer_->PSC = 0; // No prescaler.
-    pwm_counts_ = HAL_RCC_GetPCLK1Freq() * 2 / (2 * rate_config_.pwm_rate_hz);
+    pwm_counts_ = HAL_RCC_GetPCLK1Freq() * 2 / (2 * rate_config().pwm_rate_hz);
     timer_->ARR = pwm_counts_;
+    core_.SetPwmCounts(pwm_counts_);
 
     // Reinitialize the counter and update all registers.
     timer_->EGR |= TIM_EGR_UG;
@@ -673,8 +415,8 @@ class BldcServo::Impl {
       2, 6, 12, 24, 47, 92, 247, 640,
     };
 
-    const uint32_t cur_cycles = MapConfig(kCycleMap, config_.adc_cur_cycles);
-    const uint32_t aux_cycles = MapConfig(kCycleMap, config_.adc_aux_cycles);
+    const uint32_t cur_cycles = MapConfig(kCycleMap, config().adc_cur_cycles);
+    const uint32_t aux_cycles = MapConfig(kCycleMap, config().adc_aux_cycles);
     auto make_cycles = [](auto v) {
       return
         (v << 0) |
@@ -857,12 +599,13 @@ class BldcServo::Impl {
       );
     }
 
-    phase_ = (phase_ + 1) & rate_config_.interrupt_mask;
+    phase_ = (phase_ + 1) & rate_config().interrupt_mask;
     if (phase_) { return; }
 
 #ifdef MOTEUS_PERFORMANCE_MEASURE
     DWT->CYCCNT = 0;
 #endif
+    core_.profiler()->ISR_Start();
 
     // No matter what mode we are in, always sample our ADC and
     // position sensors.
@@ -882,32 +625,18 @@ class BldcServo::Impl {
 #ifdef MOTEUS_PERFORMANCE_MEASURE
     status_.dwt.sense = DWT->CYCCNT;
 #endif
+    auto* const profiler = core_.profiler();
+    profiler->ISR_Mark(&profiler->mutable_profile()->sense);
 
-    SinCos sin_cos = cordic_(RadiansToQ31(position_.electrical_theta));
-    status_.sin = sin_cos.s;
-    status_.cos = sin_cos.c;
-
-    ISR_CalculateCurrentState(sin_cos);
-
-    if (config_.fixed_voltage_mode) {
-      // Don't pretend we know where we are.
-      status_.position = 0.0f;
-      status_.velocity = 0.0f;
-      status_.torque_Nm = 0.0f;
-      status_.torque_error_Nm = 0.0f;
-    }
-
-#ifdef MOTEUS_PERFORMANCE_MEASURE
-    status_.dwt.curstate = DWT->CYCCNT;
-#endif
-
-    ISR_DoControl(sin_cos);
+    core_.ISR_DoControlCycle();
 
-#ifdef MOTEUS_PERFORMANCE_MEASURE
-    status_.dwt.control = DWT->CYCCNT;
+#ifdef MOTEUS_EMIT_CURRENT_TO_DAC
+    DAC1->DHR12R1 = static_cast<uint32_t>(status_.d_A * 400.0f + 2048.0f);
 #endif
 
     ISR_MaybeEmitDebug();
+    profiler->ISR_Mark(&profiler->mutable_profile()->emit);
+    profiler->ISR_Finish();
 
 #ifdef MOTEUS_PERFORMANCE_MEASURE
     status_.dwt.done = DWT->CYCCNT;
@@ -918,7 +647,7 @@ class BldcServo::Impl {
         ((*timer_cr1_) & TIM_CR1_DIR) ?
         (pwm_counts_ - cnt) :
         (pwm_counts_ + cnt);
-    status_.total_timer = 2 * pwm_counts_ * rate_config_.interrupt_divisor;
+    status_.total_timer = 2 * pwm_counts_ * rate_config().interrupt_divisor;
 
 #ifdef MOTEUS_DEBUG_OUT
     debug_out_ = 0;
@@ -958,11 +687,7 @@ class BldcServo::Impl {
     aux1_port_->ISR_MaybeStartSample();
     aux2_port_->ISR_MaybeStartSample();
 
-    if (std::isnan(current_data_->timeout_s) ||
-        current_data_->timeout_s != 0.0f) {
-      status_.timeout_s = current_data_->timeout_s;
-      current_data_->timeout_s = 0.0;
-    }
+    core_.ISR_BeginSense();
 
     // And now, wait for the entire conversion to complete.  We
     // started ADC3 last, so we just wait for it.
@@ -1025,14 +750,7 @@ class BldcServo::Impl {
 #ifdef MOTEUS_PERFORMANCE_MEASURE
     status_.dwt.done_pos_sample = DWT->CYCCNT;
 #endif
-    motor_position_->ISR_Update(rate_config_.period_s);
-
-    if (!std::isnan(status_.position_to_set)) {
-      motor_position_->ISR_SetOutputPositionNearest(status_.position_to_set);
-      status_.position_to_set = std::numeric_limits<float>::quiet_NaN();
-    }
-
-    ISR_UpdateFilteredValue(position_.velocity, &status_.velocity_filt, 0.01f);
+    core_.ISR_UpdatePosition();
 
     // The temperature sensing should be done by now, but just double
     // check.
@@ -1062,1124 +780,15 @@ class BldcServo::Impl {
 #ifdef MOTEUS_PERFORMANCE_MEASURE
     status_.dwt.done_temp_sample = DWT->CYCCNT;
 #endif
-
-    {
-      constexpr int adc_max = 4096;
-      constexpr size_t size_thermistor_table =
-          sizeof(g_thermistor_lookup) / sizeof(*g_thermistor_lookup);
-
-      const auto calculate_temp =
-          [&](uint16_t adc_raw) {
-            const size_t offset = std::max<size_t>(
-                1, std::min<size_t>(
-                    size_thermistor_table - 2,
-                    adc_raw * size_thermistor_table / adc_max));
-            const int16_t this_value = offset * adc_max / size_thermistor_table;
-            const int16_t next_value = (offset + 1) * adc_max / size_thermistor_table;
-            const float temp1 = g_thermistor_lookup[offset];
-            const float temp2 = g_thermistor_lookup[offset + 1];
-            return temp1 +
-                (temp2 - temp1) *
-                static_cast<float>(adc_raw - this_value) /
-                static_cast<float>(next_value - this_value);
-          };
-
-      status_.fet_temp_C = calculate_temp(status_.adc_fet_temp_raw);
-      ISR_UpdateFilteredValue(status_.fet_temp_C, &status_.filt_fet_temp_C, 0.01f);
-
-      if (config_.enable_motor_temperature) {
-        status_.motor_temp_C = calculate_temp(status_.adc_motor_temp_raw);
-        ISR_UpdateFilteredValue(status_.motor_temp_C, &status_.filt_motor_temp_C, 0.01f);
-      } else {
-        status_.motor_temp_C = status_.filt_motor_temp_C = 0.0f;
-      }
-    }
-
-    status_.position = position_.position;
-    status_.velocity = position_.velocity;
+    core_.ISR_FinishSense();
 
     aux_adc_->ISR_EndSample();
     aux1_port_->ISR_EndAnalogSample();
     aux2_port_->ISR_EndAnalogSample();
   }
 
-  void ISR_UpdateFilteredValue(float input, float* filtered, float period_s) const MOTEUS_CCM_ATTRIBUTE {
-    if (std::isnan(*filtered)) {
-      *filtered = input;
-    } else {
-      const float alpha = 1.0f / (rate_config_.rate_hz * period_s);
-      *filtered = alpha * input + (1.0f - alpha) * *filtered;
-    }
-  }
-
-  void ISR_UpdateFilteredBusV(float* filtered, float period_s) const MOTEUS_CCM_ATTRIBUTE {
-    ISR_UpdateFilteredValue(status_.bus_V, filtered, period_s);
-  }
-
-  // This is called from the ISR.
-  void ISR_CalculateCurrentState(const SinCos& sin_cos) MOTEUS_CCM_ATTRIBUTE {
-    status_.cur1_A = (status_.adc_cur1_raw - status_.adc_cur1_offset) * adc_scale_;
-    status_.cur2_A = (status_.adc_cur2_raw - status_.adc_cur2_offset) * adc_scale_;
-    status_.cur3_A = (status_.adc_cur3_raw - status_.adc_cur3_offset) * adc_scale_;
-    if (motor_.phase_invert) {
-      std::swap(status_.cur2_A, status_.cur3_A);
-    }
-    status_.bus_V = status_.adc_voltage_sense_raw * vsense_adc_scale_;
-
-    ISR_UpdateFilteredBusV(&status_.filt_bus_V, 0.5f);
-    ISR_UpdateFilteredBusV(&status_.filt_1ms_bus_V, 0.001f);
-
-    DqTransform dq{sin_cos,
-          status_.cur1_A,
-          status_.cur3_A,
-          status_.cur2_A
-          };
-    status_.d_A = dq.d;
-    status_.q_A = dq.q;
-    status_.torque_Nm = torque_on() ? (
-        current_to_torque(status_.q_A) /
-        motor_position_->config()->rotor_to_output_ratio) : 0.0f;
-    if (!torque_on()) {
-      status_.torque_error_Nm = 0.0f;
-    }
-#ifdef MOTEUS_EMIT_CURRENT_TO_DAC
-    DAC1->DHR12R1 = static_cast<uint32_t>(dq.d * 400.0f + 2048.0f);
-#endif
-  }
-
-  bool current_control() const {
-    switch (status_.mode) {
-      case kNumModes: {
-        MJ_ASSERT(false);
-        return false;
-      }
-      case kFault:
-      case kCalibrating:
-      case kCalibrationComplete:
-      case kEnabling:
-      case kStopped:
-      case kPwm:
-      case kVoltage:
-      case kVoltageFoc:
-      case kVoltageDq:
-      case kMeasureInductance:
-      case kBrake: {
-        return false;
-      }
-      case kCurrent:
-      case kPosition:
-      case kZeroVelocity:
-      case kStayWithinBounds: {
-        return true;
-      }
-      case kPositionTimeout: {
-        return (config_.timeout_mode == BldcServoMode::kZeroVelocity ||
-                config_.timeout_mode == BldcServoMode::kPosition);
-      }
-    }
-    return false;
-  }
-
-  bool torque_on() const {
-    switch (status_.mode) {
-      case kNumModes: {
-        MJ_ASSERT(false);
-        return false;
-      }
-      case kFault:
-      case kCalibrating:
-      case kCalibrationComplete:
-      case kEnabling:
-      case kStopped: {
-        return false;
-      }
-      case kPwm:
-      case kVoltage:
-      case kVoltageFoc:
-      case kVoltageDq:
-      case kCurrent:
-      case kPosition:
-      case kZeroVelocity:
-      case kStayWithinBounds:
-      case kMeasureInductance:
-      case kBrake: {
-        return true;
-      }
-      case kPositionTimeout: {
-        return config_.timeout_mode != 0;
-      }
-    }
-    return false;
-  }
-
-  void ISR_MaybeChangeMode(CommandData* data) MOTEUS_CCM_ATTRIBUTE {
-    // We are requesting a different mode than we are in now.  Do our
-    // best to advance if possible.
-    switch (data->mode) {
-      case kNumModes:
-      case kFault:
-      case kCalibrating:
-      case kCalibrationComplete: {
-        // These should not be possible.
-        MJ_ASSERT(false);
-        return;
-      }
-      case kStopped: {
-        // It is always valid to enter stopped mode.
-        status_.mode = kStopped;
-        return;
-      }
-      case kEnabling: {
-        // We can never change out from enabling in ISR context.
-        return;
-      }
-      case kPwm:
-      case kVoltage:
-      case kVoltageFoc:
-      case kVoltageDq:
-      case kCurrent:
-      case kPosition:
-      case kPositionTimeout:
-      case kZeroVelocity:
-      case kStayWithinBounds:
-      case kMeasureInductance:
-      case kBrake: {
-        switch (status_.mode) {
-          case kNumModes: {
-            MJ_ASSERT(false);
-            return;
-          }
-          case kFault: {
-            // We cannot leave a fault state directly into an active state.
-            return;
-          }
-          case kStopped: {
-            // From a stopped state, we first have to enter the
-            // calibrating state.
-            ISR_StartCalibrating();
-            return;
-          }
-          case kEnabling:
-          case kCalibrating: {
-            // We can only leave this state when calibration is
-            // complete.
-            return;
-          }
-          case kCalibrationComplete:
-          case kPwm:
-          case kVoltage:
-          case kVoltageFoc:
-          case kVoltageDq:
-          case kCurrent:
-          case kPosition:
-          case kZeroVelocity:
-          case kStayWithinBounds:
-          case kMeasureInductance:
-          case kBrake: {
-            if ((data->mode == kPosition || data->mode == kStayWithinBounds) &&
-                ISR_IsOutsideLimits()) {
-              status_.mode = kFault;
-              status_.fault = errc::kStartOutsideLimit;
-            } else {
-              // Yep, we can do this.
-              status_.mode = data->mode;
-
-              // We are entering a new active control mode.  Require
-              // our PID loops to start from scratch.
-              ISR_ClearPid(kAlwaysClear);
-            }
-
-            if (data->mode == kMeasureInductance) {
-              status_.meas_ind_phase = 0;
-              status_.meas_ind_integrator = 0.0f;
-              status_.meas_ind_old_d_A = status_.d_A;
-            }
-
-            return;
-          }
-          case kPositionTimeout: {
-            // We cannot leave this mode except through a stop.
-            return;
-          }
-        }
-      }
-    }
-  }
-
-  bool ISR_IsOutsideLimits() {
-    return ((!std::isnan(position_config_.position_min) &&
-             position_.position < position_config_.position_min) ||
-            (!std::isnan(position_config_.position_max) &&
-             position_.position > position_config_.position_max));
-  }
-
-  void ISR_StartCalibrating() {
-    // Capture the current motor position epoch.
-    motor_position_epoch_ = position_.epoch;
-
-    status_.mode = kEnabling;
-
-    // The main context will set our state to kCalibrating when the
-    // motor driver is fully enabled.
-
-    (*pwm1_ccr_) = 0;
-    (*pwm2_ccr_) = 0;
-    (*pwm3_ccr_) = 0;
-
-    // Power should already be false for any state we could possibly
-    // be in, but lets just be certain.
-    motor_driver_->Power(false);
-
-    calibrate_adc1_ = 0;
-    calibrate_adc2_ = 0;
-    calibrate_adc3_ = 0;
-    calibrate_count_ = 0;
-  }
-
-  enum ClearMode {
-    kClearIfMode,
-    kAlwaysClear,
-  };
-
-  void ISR_ClearPid(ClearMode force_clear) MOTEUS_CCM_ATTRIBUTE {
-    const bool current_pid_active = [&]() MOTEUS_CCM_ATTRIBUTE {
-      switch (status_.mode) {
-        case kNumModes:
-        case kFault:
-        case kEnabling:
-        case kCalibrating:
-        case kCalibrationComplete:
-        case kPwm:
-        case kVoltage:
-        case kVoltageFoc:
-        case kVoltageDq:
-        case kMeasureInductance:
-        case kBrake:
-          return false;
-        case kCurrent:
-        case kPosition:
-        case kPositionTimeout:
-        case kZeroVelocity:
-        case kStayWithinBounds:
-          return true;
-        case kStopped: {
-          return status_.cooldown_count != 0;
-        }
-      }
-      return false;
-    }();
-
-    if (!current_pid_active || force_clear == kAlwaysClear) {
-      status_.pid_d.Clear();
-      status_.pid_q.Clear();
-
-      // We always want to start from 0 current when initiating
-      // current control of some form.
-      status_.pid_d.desired = 0.0f;
-      status_.pid_q.desired = 0.0f;
-    }
-
-    const bool position_pid_active = [&]() MOTEUS_CCM_ATTRIBUTE {
-      switch (status_.mode) {
-        case kNumModes:
-        case kStopped:
-        case kFault:
-        case kEnabling:
-        case kCalibrating:
-        case kCalibrationComplete:
-        case kPwm:
-        case kVoltage:
-        case kVoltageFoc:
-        case kVoltageDq:
-        case kCurrent:
-        case kMeasureInductance:
-        case kBrake:
-          return false;
-        case kPosition:
-        case kPositionTimeout:
-        case kZeroVelocity:
-        case kStayWithinBounds:
-          return true;
-      }
-      return false;
-    }();
-
-    if (!position_pid_active || force_clear == kAlwaysClear) {
-      status_.pid_position.Clear();
-      status_.control_position_raw = {};
-      status_.control_position = std::numeric_limits<float>::quiet_NaN();
-      status_.control_velocity = {};
-    }
-  }
-
-  void ISR_DoControl(const SinCos& sin_cos) MOTEUS_CCM_ATTRIBUTE {
-    // current_data_ is volatile, so read it out now, and operate on
-    // the pointer for the rest of the routine.
-    CommandData* data = current_data_;
-
-    control_.Clear();
-
-    if (!std::isnan(status_.timeout_s) && status_.timeout_s > 0.0f) {
-      status_.timeout_s =
-          std::max(0.0f, status_.timeout_s - rate_config_.period_s);
-    }
-
-    // See if we need to update our current mode.
-    if (data->mode != status_.mode) {
-      ISR_MaybeChangeMode(data);
-    }
-
-    // Handle our persistent fault conditions.
-    if (status_.mode != kStopped && status_.mode != kFault) {
-      if (motor_driver_->fault()) {
-        status_.mode = kFault;
-        status_.fault = errc::kMotorDriverFault;
-      }
-      if (status_.bus_V > config_.max_voltage) {
-        status_.mode = kFault;
-        status_.fault = errc::kOverVoltage;
-      }
-      // NOTE: This is mostly to identify faulty voltage sense
-      // components.  Actual undervolts are more likely to trigger the
-      // drv8323 first.  If we erroneously use a very low voltage
-      // here, we can command a very large current due to the voltage
-      // compensation.
-      if (status_.bus_V < 4.0f) {
-        status_.mode = kFault;
-        status_.fault = errc::kUnderVoltage;
-      }
-      if (status_.filt_fet_temp_C > config_.fault_temperature) {
-        status_.mode = kFault;
-        status_.fault = errc::kOverTemperature;
-      }
-      if (std::isfinite(config_.motor_fault_temperature) &&
-          status_.filt_motor_temp_C > config_.motor_fault_temperature) {
-        status_.mode = kFault;
-        status_.fault = errc::kOverTemperature;
-      }
-    }
-
-    if ((status_.mode == kPosition || status_.mode == kStayWithinBounds) &&
-        !std::isnan(status_.timeout_s) &&
-        status_.timeout_s <= 0.0f) {
-      status_.mode = kPositionTimeout;
-    }
-
-    // Ensure unused PID controllers have zerod state.
-    ISR_ClearPid(kClearIfMode);
-
-    if (status_.mode != kFault) {
-      status_.fault = errc::kSuccess;
-    }
-
-#ifdef MOTEUS_PERFORMANCE_MEASURE
-    status_.dwt.control_sel_mode = DWT->CYCCNT;
-#endif
-
-    if (current_control()) {
-      status_.cooldown_count = config_.cooldown_cycles;
-    }
-
-    switch (status_.mode) {
-      case kNumModes:
-      case kStopped: {
-        ISR_DoStopped(sin_cos);
-        break;
-      }
-      case kFault: {
-        ISR_DoFault();
-        break;
-      }
-      case kEnabling: {
-        break;
-      }
-      case kCalibrating: {
-        ISR_DoCalibrating();
-        break;
-      }
-      case kCalibrationComplete: {
-        break;
-      }
-      case kPwm: {
-        ISR_DoPwmControl(data->pwm);
-        break;
-      }
-      case kVoltage: {
-        ISR_DoBalancedVoltageControl(data->phase_v);
-        break;
-      }
-      case kVoltageFoc: {
-        ISR_DoVoltageFOC(data);
-        break;
-      }
-      case kVoltageDq: {
-        ISR_DoVoltageDQCommand(sin_cos, data->d_V, data->q_V);
-        break;
-      }
-      case kCurrent: {
-        ISR_DoCurrent(sin_cos, data->i_d_A, data->i_q_A, 0.0f);
-        break;
-      }
-      case kPosition: {
-        ISR_DoPosition(sin_cos, data);
-        break;
-      }
-      case kPositionTimeout: {
-        ISR_DoPositionTimeout(sin_cos, data);
-        break;
-      }
-      case kZeroVelocity: {
-        ISR_DoZeroVelocity(sin_cos, data);
-        break;
-      }
-      case kStayWithinBounds: {
-        ISR_DoStayWithinBounds(sin_cos, data);
-        break;
-      }
-      case kMeasureInductance: {
-        ISR_DoMeasureInductance(sin_cos, data);
-        break;
-      }
-      case kBrake: {
-        ISR_DoBrake();
-        break;
-      }
-    }
-  }
-
-  void ISR_DoStopped(const SinCos& sin_cos) MOTEUS_CCM_ATTRIBUTE {
-    if (status_.cooldown_count) {
-      status_.cooldown_count--;
-      ISR_DoCurrent(sin_cos, 0.0f, 0.0f, 0.0f);
-      return;
-    }
-
-    const auto result = motor_driver_->StartEnable(false);
-    // We should always be able to disable immediately.
-    MJ_ASSERT(result == MotorDriver::kDisabled);
-    motor_driver_->Power(false);
-    *pwm1_ccr_ = 0;
-    *pwm2_ccr_ = 0;
-    *pwm3_ccr_ = 0;
-  }
-
-  void ISR_DoFault() MOTEUS_CCM_ATTRIBUTE {
-    motor_driver_->Power(false);
-
-    *pwm1_ccr_ = 0;
-    *pwm2_ccr_ = 0;
-    *pwm3_ccr_ = 0;
-  }
-
-  void ISR_DoCalibrating() {
-    calibrate_adc1_ += status_.adc_cur1_raw;
-    calibrate_adc2_ += status_.adc_cur2_raw;
-    calibrate_adc3_ += status_.adc_cur3_raw;
-    calibrate_count_++;
-
-    if (calibrate_count_ < kCalibrateCount) {
-      return;
-    }
-
-    const uint16_t new_adc1_offset = calibrate_adc1_ / kCalibrateCount;
-    const uint16_t new_adc2_offset = calibrate_adc2_ / kCalibrateCount;
-    const uint16_t new_adc3_offset = calibrate_adc3_ / kCalibrateCount;
-
-    if (std::abs(static_cast<int>(new_adc1_offset) - 2048) > 200 ||
-        std::abs(static_cast<int>(new_adc2_offset) - 2048) > 200 ||
-        std::abs(static_cast<int>(new_adc3_offset) - 2048) > 200) {
-      // Error calibrating.  Just fault out.
-      status_.mode = kFault;
-      status_.fault = errc::kCalibrationFault;
-      return;
-    }
-
-    status_.adc_cur1_offset = new_adc1_offset;
-    status_.adc_cur2_offset = new_adc2_offset;
-    status_.adc_cur3_offset = new_adc3_offset;
-    status_.mode = kCalibrationComplete;
-  }
-
-  void ISR_DoPwmControl(const Vec3& pwm) MOTEUS_CCM_ATTRIBUTE {
-    control_.pwm.a = LimitPwm(pwm.a);
-    control_.pwm.b = LimitPwm(pwm.b);
-    control_.pwm.c = LimitPwm(pwm.c);
-
-    const uint16_t pwm1 = static_cast<uint16_t>(control_.pwm.a * pwm_counts_);
-    const uint16_t pwm2 = static_cast<uint16_t>(control_.pwm.b * pwm_counts_);
-    const uint16_t pwm3 = static_cast<uint16_t>(control_.pwm.c * pwm_counts_);
-
-    // NOTE(jpieper): The default ordering has pwm2 and pwm3 flipped.
-    // Why you may ask?  No good reason.  It does require that the
-    // currents be similarly swapped in ISR_CalculateCurrentState.
-    // Changing it back now would reverse the sign of position for any
-    // existing motor, so it isn't an easy change to make.
-    *pwm1_ccr_ = pwm1;
-    if (!motor_.phase_invert) {
-      *pwm2_ccr_ = pwm3;
-      *pwm3_ccr_ = pwm2;
-    } else {
-      *pwm2_ccr_ = pwm2;
-      *pwm3_ccr_ = pwm3;
-    }
-
-    motor_driver_->Power(true);
-  }
-
-  void ISR_DoBalancedVoltageControlRotated(const Vec3& voltage, int shift) MOTEUS_CCM_ATTRIBUTE {
-    // We can assume that voltage.a is the smallest of the three.
-    const float db = voltage.b - voltage.a;
-    const float dc = voltage.c - voltage.a;
-
-    // Switch into full scale ratios.
-    const float fdb = db / status_.filt_bus_V;
-    const float fdc = dc / status_.filt_bus_V;
-
-    constexpr float blend_min = 0.2f;
-    constexpr float blend_max = 0.6f;
-    constexpr float blend_region = blend_max - blend_min;
-
-    // TODO: explain
-    const auto scale =
-        [&](float fdx, float fd_other) {
-          if (fdx < blend_min * fd_other) {
-            return fdx;
-          }
-          const float scaled = BilinearRate(
-              adjusted_pwm_comp_off_,
-              config_.pwm_comp_mag,
-              fdx);
-          if (fdx < blend_max * fd_other) {
-            const float frac = (fdx - blend_min * fd_other) /
-                (blend_region * fd_other);
-            return fdx + frac * (scaled - fdx);
-          }
-          return scaled;
-        };
-
-    // Apply a correction to get these B and C phases relative to the A
-    // phase.
-    const float dpb = scale(fdb, fdc) * config_.pwm_scale;
-    const float dpc = scale(fdc, fdb) * config_.pwm_scale;
-
-    // And then balance them.
-    const float avg = (dpb + dpc) / 3.0f;
-    const float pwm1 = 0.5f - avg;
-    const float pwm2 = pwm1 + dpb;
-    const float pwm3 = pwm1 + dpc;
-
-    // Finally, unshift things.
-    if (shift == 0) {
-      ISR_DoPwmControl(Vec3{pwm1, pwm2, pwm3});
-    } else if (shift == 1) {
-      ISR_DoPwmControl(Vec3{pwm3, pwm1, pwm2});
-    } else {
-      ISR_DoPwmControl(Vec3{pwm2, pwm3, pwm1});
-    }
-  }
-
-  /// Assume that the voltages are intended to be balanced around the
-  /// midpoint and can be shifted accordingly.
-  void ISR_DoBalancedVoltageControl(const Vec3& voltage) MOTEUS_CCM_ATTRIBUTE {
-    control_.voltage = voltage;
-
-    if (voltage.a <= voltage.b && voltage.a <= voltage.c) {
-      ISR_DoBalancedVoltageControlRotated(voltage, 0);
-    } else if (voltage.b <= voltage.a && voltage.b <= voltage.c) {
-      ISR_DoBalancedVoltageControlRotated(Vec3{voltage.b, voltage.c, voltage.a}, 1);
-    } else {
-      ISR_DoBalancedVoltageControlRotated(Vec3{voltage.c, voltage.a, voltage.b}, 2);
-    }
-  }
-
-  void ISR_DoVoltageFOC(CommandData* data) MOTEUS_CCM_ATTRIBUTE {
-    data->theta += data->theta_rate * rate_config_.period_s;
-    SinCos sc = cordic_(RadiansToQ31(data->theta));
-    const float max_voltage = (0.5f - rate_config_.min_pwm) * status_.filt_bus_V;
-    InverseDqTransform idt(sc, Limit(data->voltage, -max_voltage, max_voltage), 0);
-    ISR_DoBalancedVoltageControl(Vec3{idt.a, idt.b, idt.c});
-  }
-
-  void ISR_DoCurrent(const SinCos& sin_cos, float i_d_A_in, float i_q_A_in,
-                     float feedforward_velocity_rotor) MOTEUS_CCM_ATTRIBUTE {
-    if (motor_.poles == 0) {
-      // We aren't configured yet.
-      status_.mode = kFault;
-      status_.fault = errc::kMotorNotConfigured;
-      return;
-    }
-    if (!position_.theta_valid) {
-      status_.mode = kFault;
-      status_.fault = errc::kThetaInvalid;
-      return;
-    }
-
-    auto limit_q_current = [&](float in) MOTEUS_CCM_ATTRIBUTE {
-      if (!std::isnan(position_config_.position_max) &&
-          position_.position > position_config_.position_max &&
-          in > 0.0f) {
-        // We derate the request in the direction that moves it
-        // further outside the position limits.  This is mostly useful
-        // when feedforward is applied, as otherwise, the position
-        // limits could easily be exceeded.  Without feedforward, we
-        // shouldn't really be trying to push outside the limits
-        // anyhow.
-        return in *
-            std::max(0.0f,
-                     1.0f - (position_.position -
-                             position_config_.position_max) /
-                     config_.position_derate);
-      }
-      if (!std::isnan(position_config_.position_min) &&
-          position_.position < position_config_.position_min &&
-          in < 0.0f) {
-        return in *
-            std::max(0.0f,
-                     1.0f - (position_config_.position_min -
-                             position_.position) /
-                     config_.position_derate);
-      }
-
-      return in;
-    };
-
-    auto limit_q_velocity = [&](float in) MOTEUS_CCM_ATTRIBUTE {
-      const float abs_velocity = std::abs(position_.velocity);
-      if (abs_velocity < config_.max_velocity ||
-          position_.velocity * in < 0.0f) {
-        return in;
-      }
-      const float derate_fraction =
-          1.0f - ((abs_velocity - config_.max_velocity) /
-                  config_.max_velocity_derate);
-      const float current_limit =
-          std::max(0.0f, derate_fraction * config_.max_current_A);
-      return Limit(in, -current_limit, current_limit);
-    };
-
-    float derate_fraction =
-        (status_.filt_fet_temp_C - config_.derate_temperature) /
-        (config_.fault_temperature - config_.derate_temperature);
-    if (std::isfinite(config_.motor_fault_temperature)) {
-      derate_fraction = std::min<float>(
-          derate_fraction,
-          ((status_.filt_motor_temp_C - config_.motor_derate_temperature) /
-           (config_.motor_fault_temperature - config_.motor_derate_temperature)));
-    }
-
-    const float derate_current_A =
-        std::max<float>(
-            0.0f,
-            derate_fraction *
-            (config_.derate_current_A - config_.max_current_A) +
-            config_.max_current_A);
-
-    const float temp_limit_A = std::min<float>(
-        config_.max_current_A, derate_current_A);
-
-    auto limit_either_current = [&](float in) MOTEUS_CCM_ATTRIBUTE {
-      return Limit(in, -temp_limit_A, temp_limit_A);
-    };
-
-    const float i_q_A =
-        limit_either_current(
-            limit_q_velocity(
-                limit_q_current(i_q_A_in)));
-    const float i_d_A = limit_either_current(i_d_A_in);
-
-    control_.i_d_A = i_d_A;
-    control_.i_q_A = i_q_A;
-
-    // This is conservative... we could use std::hypot(d, q), however
-    // that would take more CPU cycles, and most of the time we'll
-    // only be seeing q != 0.
-    const float max_V = adjusted_max_power_W_ /
-        (std::abs(status_.d_A) + std::abs(status_.q_A));
-
-    if (!config_.voltage_mode_control) {
-      const float d_V =
-          Limit(
-              pid_d_.Apply(status_.d_A, i_d_A, rate_config_.rate_hz) +
-              i_d_A * config_.current_feedforward * motor_.resistance_ohm,
-              -max_V, max_V);
-
-      const float max_current_integral =
-          rate_config_.max_voltage_ratio * 0.5f * status_.filt_bus_V;
-      status_.pid_d.integral = Limit(
-          status_.pid_d.integral,
-          -max_current_integral, max_current_integral);
-
-      const float q_V =
-          Limit(
-              pid_q_.Apply(status_.q_A, i_q_A, rate_config_.rate_hz) +
-              i_q_A * config_.current_feedforward * motor_.resistance_ohm +
-              feedforward_velocity_rotor * config_.bemf_feedforward * motor_.v_per_hz,
-              -max_V, max_V);
-      status_.pid_q.integral = Limit(
-          status_.pid_q.integral,
-          -max_current_integral, max_current_integral);
-
-      ISR_DoVoltageDQ(sin_cos, d_V, q_V);
-    } else {
-      ISR_DoVoltageDQ(sin_cos,
-                      i_d_A * motor_.resistance_ohm,
-                      i_q_A * motor_.resistance_ohm +
-                      feedforward_velocity_rotor * config_.bemf_feedforward * motor_.v_per_hz);
-    }
-  }
-
-  // The idiomatic thing to do in DoMeasureInductance would be to just
-  // call DoVoltageDQ.  However, because of
-  // https://gcc.gnu.org/bugzilla/show_bug.cgi?id=41091 that results
-  // in a compile time error.  Instead, we construct a similar
-  // factorization by delegating most of the work to this helper
-  // function.
-  Vec3 ISR_CalculatePhaseVoltage(const SinCos& sin_cos, float d_V, float q_V) MOTEUS_CCM_ATTRIBUTE {
-    if (position_.epoch != motor_position_epoch_) {
-      status_.mode = kFault;
-      status_.fault = errc::kConfigChanged;
-
-      return Vec3{0.f, 0.f, 0.f};
-    }
-
-    control_.d_V = d_V;
-    control_.q_V = q_V;
-
-    const float max_voltage = (0.5f - rate_config_.min_pwm) * status_.filt_bus_V;
-    auto limit_v = [&](float in) MOTEUS_CCM_ATTRIBUTE {
-      return Limit(in, -max_voltage, max_voltage);
-    };
-    InverseDqTransform idt(sin_cos, limit_v(control_.d_V),
-                           limit_v(control_.q_V));
-
-#ifdef MOTEUS_PERFORMANCE_MEASURE
-    status_.dwt.control_done_cur = DWT->CYCCNT;
-#endif
-
-    return Vec3{idt.a, idt.b, idt.c};
-  }
-
-  void ISR_DoVoltageDQ(const SinCos& sin_cos, float d_V, float q_V) MOTEUS_CCM_ATTRIBUTE {
-    ISR_DoBalancedVoltageControl(ISR_CalculatePhaseVoltage(sin_cos, d_V, q_V));
-  }
-
-  void ISR_DoVoltageDQCommand(const SinCos& sin_cos, float d_V, float q_V) MOTEUS_CCM_ATTRIBUTE {
-    if (motor_.poles == 0) {
-      // We aren't configured yet.
-      status_.mode = kFault;
-      status_.fault = errc::kMotorNotConfigured;
-      return;
-    }
-    if (!position_.theta_valid) {
-      status_.mode = kFault;
-      status_.fault = errc::kThetaInvalid;
-      return;
-    }
-
-    ISR_DoBalancedVoltageControl(ISR_CalculatePhaseVoltage(sin_cos, d_V, q_V));
-  }
-
-  void ISR_DoPositionTimeout(const SinCos& sin_cos, CommandData* data) MOTEUS_CCM_ATTRIBUTE {
-    if (config_.timeout_mode == kStopped) {
-      ISR_DoStopped(sin_cos);
-    } else if (config_.timeout_mode == kPosition) {
-      CommandData timeout_data;
-      timeout_data.mode = kPosition;
-      timeout_data.position = std::numeric_limits<float>::quiet_NaN();
-      timeout_data.velocity_limit = config_.default_velocity_limit;
-      timeout_data.accel_limit = config_.default_accel_limit;
-      timeout_data.timeout_s = std::numeric_limits<float>::quiet_NaN();
-
-      PID::ApplyOptions apply_options;
-      ISR_DoPositionCommon(
-          sin_cos, &timeout_data, apply_options,
-          timeout_data.max_torque_Nm,
-          0.0f,
-          0.0f);
-    } else if (config_.timeout_mode == kZeroVelocity) {
-      ISR_DoZeroVelocity(sin_cos, data);
-    } else if (config_.timeout_mode == kBrake) {
-      ISR_DoBrake();
-    } else {
-      ISR_DoStopped(sin_cos);
-    }
-  }
-
-  void ISR_DoZeroVelocity(const SinCos& sin_cos, CommandData* data) MOTEUS_CCM_ATTRIBUTE {
-    CommandData zero_velocity;
-
-    zero_velocity.mode = kPosition;
-    zero_velocity.position = std::numeric_limits<float>::quiet_NaN();
-    zero_velocity.velocity = 0.0f;
-    zero_velocity.timeout_s = std::numeric_limits<float>::quiet_NaN();
-
-    PID::ApplyOptions apply_options;
-    apply_options.kp_scale = 0.0f;
-    apply_options.kd_scale = data->kd_scale;
-    apply_options.ki_scale = 0.0f;
-
-    ISR_DoPositionCommon(sin_cos, &zero_velocity,
-                         apply_options, config_.timeout_max_torque_Nm,
-                         0.0f, 0.0f);
-  }
-
-  void ISR_DoPosition(const SinCos& sin_cos, CommandData* data) MOTEUS_CCM_ATTRIBUTE {
-    PID::ApplyOptions apply_options;
-    apply_options.kp_scale = data->kp_scale;
-    apply_options.kd_scale = data->kd_scale;
-
-    ISR_DoPositionCommon(sin_cos, data, apply_options, data->max_torque_Nm,
-                         data->feedforward_Nm, data->velocity);
-  }
-
-  void ISR_DoPositionCommon(
-      const SinCos& sin_cos, CommandData* data,
-      const PID::ApplyOptions& pid_options,
-      float max_torque_Nm,
-      float feedforward_Nm,
-      float velocity) MOTEUS_CCM_ATTRIBUTE {
-    const int64_t absolute_relative_delta =
-        static_cast<int64_t>(
-            motor_position_->absolute_relative_delta.load()) << 32ll;
-
-    const float velocity_command =
-        BldcServoPosition::UpdateCommand(
-            &status_,
-            &config_,
-            &position_config_,
-            &position_,
-            absolute_relative_delta,
-            rate_config_.rate_hz,
-            data,
-            velocity);
-
-    // At this point, our control position and velocity are known.
-
-    if (config_.fixed_voltage_mode ||
-        !std::isnan(data->fixed_voltage_override)) {
-      status_.position =
-          static_cast<float>(
-              static_cast<int32_t>(
-                  *status_.control_position_raw >> 32)) /
-          65536.0f;
-      status_.velocity = velocity_command;
-
-      // For "fixed voltage" mode, we skip all position and current
-      // PID loops and all their associated calculations, including
-      // everything that uses the encoder.  Instead we just burn power
-      // with a fixed voltage drive based on the desired position.
-      const float synthetic_electrical_theta =
-          WrapZeroToTwoPi(
-              MotorPosition::IntToFloat(*status_.control_position_raw)
-              / motor_position_->config()->rotor_to_output_ratio
-              * motor_.poles
-              * 0.5f
-              * k2Pi);
-      const SinCos synthetic_sin_cos =
-          cordic_(RadiansToQ31(synthetic_electrical_theta));
-      const float fixed_voltage =
-          std::isnan(data->fixed_voltage_override) ?
-          config_.fixed_voltage_control_V +
-          (std::abs(status_.velocity) *
-           motor_.v_per_hz *
-           config_.bemf_feedforward) :
-          data->fixed_voltage_override;
-      ISR_DoVoltageDQ(synthetic_sin_cos, fixed_voltage, 0.0f);
-      return;
-    }
-
-    // From this point, we require actual valid position.
-    if (!position_.position_relative_valid) {
-      status_.mode = kFault;
-      status_.fault = errc::kPositionInvalid;
-      return;
-    }
-    if (position_.error != MotorPosition::Status::kNone) {
-      status_.mode = kFault;
-      status_.fault = errc::kEncoderFault;
-      return;
-    }
-
-    const float measured_velocity = velocity_command +
-        Threshold(
-            position_.velocity - velocity_command, -config_.velocity_threshold,
-            config_.velocity_threshold);
-
-    // We always control relative to the control position of 0, so
-    // that we get equal performance across the entire viable integral
-    // position range.
-    const float unlimited_torque_Nm =
-        motor_position_config()->output.sign *
-        (pid_position_.Apply(
-            (static_cast<int32_t>(
-                (position_.position_relative_raw -
-                 *status_.control_position_raw) >> 32) /
-             65536.0f),
-            0.0,
-            measured_velocity, velocity_command,
-            rate_config_.rate_hz,
-            pid_options) +
-         feedforward_Nm);
-
-    const float limited_torque_Nm =
-        Limit(unlimited_torque_Nm, -max_torque_Nm, max_torque_Nm);
-
-    control_.torque_Nm = limited_torque_Nm;
-    status_.torque_error_Nm = status_.torque_Nm - control_.torque_Nm;
-
-    const float limited_q_A =
-        torque_to_current(limited_torque_Nm *
-                          motor_position_->config()->rotor_to_output_ratio);
-
-    {
-      const auto& pos_config = motor_position_->config();
-      const auto commutation_source = pos_config->commutation_source;
-      const float cpr = static_cast<float>(
-          pos_config->sources[commutation_source].cpr);
-      const float commutation_position =
-          position_.sources[commutation_source].filtered_value / cpr;
-
-      auto sample =
-          [&](const auto& table, float scale) {
-            const int left_index = std::min<int>(
-                table.size() - 1,
-                static_cast<int>(table.size() * commutation_position));
-            const int right_index = (left_index + 1) % table.size();
-            const float comp_fraction =
-                (commutation_position -
-                 static_cast<float>(left_index) / table.size()) *
-                static_cast<float>(table.size());
-            const float left_comp = table[left_index] * scale;
-            const float right_comp = table[right_index] * scale;
-
-            return (right_comp - left_comp) * comp_fraction + left_comp;
-          };
-      const float q_comp_A = sample(motor_.cogging_dq_comp,
-                                    motor_.cogging_dq_scale);
-
-      control_.q_comp_A = q_comp_A;
-    }
-
-    const float compensated_q_A = limited_q_A + control_.q_comp_A;
-
-    const float q_A =
-        is_torque_constant_configured() ?
-        compensated_q_A :
-        Limit(compensated_q_A, -kMaxUnconfiguredCurrent, kMaxUnconfiguredCurrent);
-
-    const float d_A = [&]() MOTEUS_CCM_ATTRIBUTE {
-      if (config_.flux_brake_min_voltage <= 0.0f) {
-        return 0.0f;
-      }
-
-      const auto error = (
-          status_.filt_1ms_bus_V - config_.flux_brake_min_voltage);
-
-      if (error <= 0.0f) {
-        return 0.0f;
-      }
-
-      return (error / config_.flux_brake_resistance_ohm);
-    }();
-
-#ifdef MOTEUS_PERFORMANCE_MEASURE
-    status_.dwt.control_done_pos = DWT->CYCCNT;
-#endif
-
-    ISR_DoCurrent(
-        sin_cos, d_A, q_A,
-        velocity_command / motor_position_->config()->rotor_to_output_ratio);
-  }
-
-  void ISR_DoStayWithinBounds(const SinCos& sin_cos, CommandData* data) MOTEUS_CCM_ATTRIBUTE {
-    const auto target_position = [&]() MOTEUS_CCM_ATTRIBUTE -> std::optional<float> {
-      if (!std::isnan(data->bounds_min) &&
-          position_.position < data->bounds_min) {
-        return data->bounds_min;
-      }
-      if (!std::isnan(data->bounds_max) &&
-          position_.position > data->bounds_max) {
-        return data->bounds_max;
-      }
-      return {};
-    }();
-
-    if (!target_position) {
-      status_.pid_position.Clear();
-      status_.control_position_raw = {};
-      status_.control_position = std::numeric_limits<float>::quiet_NaN();
-      status_.control_velocity = {};
-
-      // In this region, we still apply feedforward torques if they
-      // are present.
-      const float limited_torque_Nm =
-          Limit(data->feedforward_Nm, -data->max_torque_Nm, data->max_torque_Nm);
-      control_.torque_Nm = limited_torque_Nm;
-      status_.torque_error_Nm = status_.torque_Nm - control_.torque_Nm;
-      const float limited_q_A =
-          torque_to_current(
-              limited_torque_Nm *
-              motor_position_->config()->rotor_to_output_ratio);
-
-      ISR_DoCurrent(sin_cos, 0.0f, limited_q_A, 0.0f);
-      return;
-    }
-
-    // Control position to whichever bound we are currently violating.
-    PID::ApplyOptions apply_options;
-    apply_options.kp_scale = data->kp_scale;
-    apply_options.kd_scale = data->kd_scale;
-
-    const int64_t absolute_relative_delta =
-        (static_cast<int64_t>(
-            motor_position_->absolute_relative_delta.load()) << 32ll);
-    data->position_relative_raw =
-        MotorPosition::FloatToInt(*target_position) -
-        absolute_relative_delta;
-    data->velocity = 0.0;
-    status_.control_position_raw = data->position_relative_raw;
-    status_.control_position = *target_position;
-    status_.control_velocity = 0.0f;
-
-    ISR_DoPositionCommon(
-        sin_cos, data, apply_options,
-        data->max_torque_Nm, data->feedforward_Nm, 0.0f);
-  }
-
-  void ISR_DoMeasureInductance(const SinCos& sin_cos, CommandData* data) MOTEUS_CCM_ATTRIBUTE {
-    const int8_t old_sign = status_.meas_ind_phase > 0 ? 1 : -1;
-    const float old_sign_float = old_sign > 0 ? 1.0f : -1.0f;
-
-    status_.meas_ind_phase += -old_sign;
-
-    // When measuring inductance, we just drive a 0 centered square
-    // wave at some integral multiple of the control period.
-    if (status_.meas_ind_phase == 0) {
-      status_.meas_ind_phase = -old_sign * data->meas_ind_period;
-    }
-
-    const float d_V =
-        data->d_V * (status_.meas_ind_phase > 0 ? 1.0f : -1.0f);
-
-    // We also integrate the difference in current.
-    status_.meas_ind_integrator +=
-        (status_.d_A - status_.meas_ind_old_d_A) *
-        old_sign_float;
-    status_.meas_ind_old_d_A = status_.d_A;
-
-    ISR_DoBalancedVoltageControl(ISR_CalculatePhaseVoltage(sin_cos, d_V, 0.0f));
-  }
-
-  void ISR_DoBrake() MOTEUS_CCM_ATTRIBUTE {
-    *pwm1_ccr_ = 0;
-    *pwm2_ccr_ = 0;
-    *pwm3_ccr_ = 0;
-
-    motor_driver_->Power(true);
-  }
-
   void ISR_MaybeEmitDebug() MOTEUS_CCM_ATTRIBUTE {
-    if (config_.emit_debug == 0 || !debug_uart_) { return; }
+    if (config().emit_debug == 0 || !debug_uart_) { return; }
 
     debug_buf_[0] = 0x5a;
 
@@ -2194,59 +803,59 @@ class BldcServo::Impl {
           pos += sizeof(value);
         };
 
-    if (config_.emit_debug & (1 << 0)) {
+    if (config().emit_debug & (1 << 0)) {
       write_scalar(static_cast<uint16_t>(aux1_port_->status()->spi.value * 4));
     }
 
-    if (config_.emit_debug & (1 << 1)) {
+    if (config().emit_debug & (1 << 1)) {
       write_scalar(static_cast<int16_t>(32767.0f * status_.velocity / 100.0f));
     }
 
-    if (config_.emit_debug & (1 << 2)) {
+    if (config().emit_debug & (1 << 2)) {
       write_scalar(static_cast<int16_t>(32767.0f * status_.d_A / 100.0f));
     }
-    if (config_.emit_debug & (1 << 3)) {
+    if (config().emit_debug & (1 << 3)) {
       write_scalar(static_cast<int16_t>(32767.0f * status_.q_A / 100.0f));
     }
-    if (config_.emit_debug & (1 << 4)) {
+    if (config().emit_debug & (1 << 4)) {
       write_scalar(status_.adc_cur1_raw);
     }
-    if (config_.emit_debug & (1 << 5)) {
+    if (config().emit_debug & (1 << 5)) {
       write_scalar(status_.adc_cur2_raw);
     }
-    if (config_.emit_debug & (1 << 6)) {
+    if (config().emit_debug & (1 << 6)) {
       write_scalar(status_.adc_cur3_raw);
     }
 
-    if (config_.emit_debug & (1 << 7)) {
+    if (config().emit_debug & (1 << 7)) {
       write_scalar(static_cast<int16_t>(32767.0f * status_.cur1_A / 100.0f));
     }
 
-    if (config_.emit_debug & (1 << 8)) {
+    if (config().emit_debug & (1 << 8)) {
       write_scalar(static_cast<int16_t>(32767.0f * status_.cur2_A / 100.0f));
     }
 
-    if (config_.emit_debug & (1 << 9)) {
+    if (config().emit_debug & (1 << 9)) {
       write_scalar(static_cast<int16_t>(32767.0f * status_.cur3_A / 100.0f));
     }
 
-    if (config_.emit_debug & (1 << 10)) {
-      write_scalar(static_cast<int16_t>(32767.0f * control_.torque_Nm / 30.0f));
+    if (config().emit_debug & (1 << 10)) {
+      write_scalar(static_cast<int16_t>(32767.0f * control().torque_Nm / 30.0f));
     }
 
-    if (config_.emit_debug & (1 << 11)) {
+    if (config().emit_debug & (1 << 11)) {
       write_scalar(static_cast<uint16_t>(position_.sources[0].raw));
     }
 
-    if (config_.emit_debug & (1 << 12)) {
+    if (config().emit_debug & (1 << 12)) {
       write_scalar(static_cast<uint16_t>(position_.sources[1].raw));
     }
 
-    if (config_.emit_debug & (1 << 13)) {
+    if (config().emit_debug & (1 << 13)) {
       write_scalar(static_cast<uint16_t>(position_.sources[2].raw));
     }
 
-    if (config_.emit_debug & (1 << 14)) {
+    if (config().emit_debug & (1 << 14)) {
       write_scalar(static_cast<uint16_t>(status_.final_timer));
     }
 
@@ -2256,26 +865,23 @@ class BldcServo::Impl {
     }
   }
 
-  float LimitPwm(float in) MOTEUS_CCM_ATTRIBUTE {
-    // We can't go full duty cycle or we wouldn't have time to sample
-    // the current.
-    return Limit(in, rate_config_.min_pwm, rate_config_.max_pwm);
+  const BldcServoRateConfig& rate_config() const {
+    return core_.rate_config();
   }
 
   const Options options_;
   MillisecondTimer* const ms_timer_;
-  MotorDriver* const motor_driver_;
   AuxADC* const aux_adc_;
   AuxPort* const aux1_port_;
   AuxPort* const aux2_port_;
   MotorPosition* const motor_position_;
 
+  BldcServoCore core_;
 
-  Motor& motor_ = *motor_position_->motor();
+  // The hardware side stores raw samples into, and reads timing
+  // results from, the core's status.
+  Status& status_ = *core_.mutable_status();
   const MotorPosition::Status& position_ = motor_position_->status();
-  Config config_;
-  PositionConfig position_config_;
-  uint8_t motor_position_epoch_ = 0;
 
   TIM_TypeDef* timer_ = nullptr;
   volatile uint32_t* timer_sr_ = nullptr;
@@ -2320,34 +926,8 @@ class BldcServo::Impl {
   DigitalOut debug_out_;
 #endif
 
-  RateConfig rate_config_;
-
   int32_t phase_ = 0;
 
-  CommandData data_buffers_[2] = {};
-
-  // CommandData has its data updated to the ISR by first writing the
-  // new command into (*next_data_) and then swapping it with
-  // current_data_.
-  CommandData* volatile current_data_{&data_buffers_[0]};
-  CommandData* volatile next_data_{&data_buffers_[1]};
-
-  // This copy of CommandData exists solely for telemetry, and should
-  // never be read by an ISR.
-  CommandData telemetry_data_;
-
-  // These values should only be modified from within the ISR.
-  Status status_;
-  Control control_;
-  uint32_t calibrate_adc1_ = 0;
-  uint32_t calibrate_adc2_ = 0;
-  uint32_t calibrate_adc3_ = 0;
-  uint16_t calibrate_count_ = 0;
-
-  SimplePI pid_d_{&config_.pid_dq, &status_.pid_d};
-  SimplePI pid_q_{&config_.pid_dq, &status_.pid_q};
-  PID pid_position_{&config_.pid_position, &status_.pid_position};
-
   USART_TypeDef* debug_uart_ = nullptr;
   USART_TypeDef* onboard_debug_uart_ = nullptr;
 
@@ -2355,16 +935,7 @@ class BldcServo::Impl {
   // 40000Hz.
   uint8_t debug_buf_[7] = {};
 
-  float torque_constant_ = 0.01f;
-
-  float adc_scale_ = 0.0f;
-  float adjusted_pwm_comp_off_ = 0.0f;
-  float adjusted_max_power_W_ = 0.0f;
-
-  float vsense_adc_scale_ = 0.0f;
-
   uint32_t pwm_counts_ = 0;
-  Cordic cordic_;
 
   uint32_t adc1_sqr_ = 0;
   uint32_t adc2_sqr_ = 0;
@@ -2411,6 +982,19 @@ void BldcServo::Command(const CommandData& data) {
   impl_->Command(data);
 }
 
+bool BldcServo::PushWaypoint(float position, float velocity,
+                             float feedforward_Nm, float duration_s) {
+  return impl_->PushWaypoint(position, velocity, feedforward_Nm, duration_s);
+}
+
+void BldcServo::ClearWaypoints() {
+  impl_->ClearWaypoints();
+}
+
+int BldcServo::waypoint_count() const {
+  return impl_->waypoint_count();
+}
+
 const BldcServo::Status& BldcServo::status() const {
   return impl_->status();
 }
@@ -2455,6 +1039,14 @@ void BldcServo::RequireReindex() {
   impl_->RequireReindex();
 }
 
+const IsrProfile& BldcServo::profile() const {
+  return impl_->profile();
+}
+
+void BldcServo::ResetProfile() {
+  impl_->ResetProfile();
+}
+
 void BldcServo::Fault(moteus::errc fault_code) {
   impl_->Fault(fault_code);
 }
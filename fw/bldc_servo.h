@@ -52,6 +52,7 @@ In summary, this header file defines a crucial component of a BLDC motor control
 #include "fw/aux_port.h"
 #include "fw/bldc_servo_structs.h"
 #include "fw/error.h"
+#include "fw/isr_profile.h"
 #include "fw/millisecond_timer.h"
 #include "fw/moteus_hw.h"
 #include "fw/motor_driver.h"
@@ -109,59 +110,22 @@ class BldcServo {
   using Config = BldcServoConfig;
   using PositionConfig = BldcServoPositionConfig;
 
-  // Intermediate control outputs.
-  struct Control {
-    Vec3 pwm;
-    Vec3 voltage;
-
-    float d_V = 0.0f;
-    float q_V = 0.0f;
-
-    float i_d_A = 0.0f;
-    float i_q_A = 0.0f;
-
-    float q_comp_A = 0.0f;
-    float torque_Nm = 0.0f;
-
-    void Clear() {
-      // We implement this manually merely because it is faster than
-      // using the constructor which delegates to memset.  It is
-      // definitely more brittle.
-      pwm.a = 0.0f;
-      pwm.b = 0.0f;
-      pwm.c = 0.0f;
-
-      voltage.a = 0.0f;
-      voltage.b = 0.0f;
-      voltage.c = 0.0f;
-
-      d_V = 0.0f;
-      q_V = 0.0f;
-      i_d_A = 0.0f;
-      i_q_A = 0.0f;
-      q_comp_A = 0.0f;
-      torque_Nm = 0.0f;
-    }
-
-    template <typename Archive>
-    void Serialize(Archive* a) {
-      a->Visit(MJ_NVP(pwm));
-      a->Visit(MJ_NVP(voltage));
-      a->Visit(MJ_NVP(d_V));
-      a->Visit(MJ_NVP(q_V));
-      a->Visit(MJ_NVP(i_d_A));
-      a->Visit(MJ_NVP(i_q_A));
-      a->Visit(MJ_NVP(q_comp_A));
-      a->Visit(MJ_NVP(torque_Nm));
-    }
-  };
+  using Control = BldcServoControl;
 
   void Start();
   void Command(const CommandData&);
 
+  /// Queue a waypoint for position mode.  Return false if it could
+  /// not be queued.
+  bool PushWaypoint(float position, float velocity,
+                    float feedforward_Nm, float duration_s);
+  void ClearWaypoints();
+  int waypoint_count() const;
+
   const Status& status() const;
   const Config& config() const;
   const Control& control() const;
+  const IsrProfile& profile() const;
   const AuxPort::Status& aux1() const;
   const AuxPort::Status& aux2() const;
   const MotorPosition::Status& motor_position() const;
@@ -171,6 +135,7 @@ class BldcServo {
   void SetOutputPositionNearest(float position);
   void SetOutputPosition(float position);
   void RequireReindex();
+  void ResetProfile();
   void Fault(moteus::errc fault_code);
 
  private:
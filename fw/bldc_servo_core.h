@@ -0,0 +1,1833 @@
+// Copyright 2023 mjbots Robotic Systems, LLC.  info@mjbots.com
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <optional>
+#include <utility>
+
+#include "mjlib/base/assert.h"
+
+#include "fw/bldc_servo_position.h"
+#include "fw/bldc_servo_structs.h"
+#include "fw/ccm.h"
+#include "fw/error.h"
+#include "fw/foc.h"
+#include "fw/isr_profile.h"
+#include "fw/math.h"
+#include "fw/measured_hw_rev.h"
+#include "fw/motor_driver.h"
+#include "fw/motor_position.h"
+#include "fw/pid.h"
+#include "fw/simple_pi.h"
+#include "fw/svpwm.h"
+#include "fw/torque_model.h"
+#include "fw/waypoint_queue.h"
+
+namespace moteus {
+
+// All of these constants depend upon the pwm rate.
+struct BldcServoRateConfig {
+  // This is used to determine the maximum allowable PWM value so that
+  // the current sampling is guaranteed to occur while the FETs are
+  // still low.  It was calibrated using the scope and trial and error.
+  //
+  // The primary test is a high torque pulse with absolute position
+  // limits in place of +-1.0.  Something like "d pos nan 0 1 p0 d0 f1".
+  // This all but ensures the current controller will saturate.
+  //
+  // As of 2020-09-13, 0.98 was the highest value that failed.
+  static constexpr float kCurrentSampleTime = 1.03e-6f;
+
+  int int_rate_hz;
+  int interrupt_divisor;
+  uint32_t interrupt_mask;
+  int pwm_rate_hz;
+  float min_pwm;
+  float max_pwm;
+  float max_voltage_ratio;
+  float rate_hz;
+  float period_s;
+  int16_t max_position_delta;
+
+  // The position loop runs once every this many control cycles.
+  static constexpr int kMaxPositionDivisor = 16;
+  int position_divisor;
+  float position_rate_hz;
+
+  BldcServoRateConfig(int pwm_rate_hz_in = 30000,
+                      int position_divisor_in = 1) {
+    const int board_min_pwm_rate_hz =
+        (g_measured_hw_family == 0 &&
+         g_measured_hw_rev == 2) ? 60000 :
+        15000;
+
+    // Limit our PWM rate to even frequencies between 15kHz and 60kHz.
+    pwm_rate_hz =
+        ((std::max(board_min_pwm_rate_hz,
+                   std::min(60000, pwm_rate_hz_in))) / 2) * 2;
+
+    interrupt_divisor = (pwm_rate_hz > 30000) ? 2 : 1;
+    interrupt_mask = [&]() -> uint32_t {
+                       switch (interrupt_divisor) {
+                         case 1: return 0;
+                         case 2: return 1;
+                       }
+                       MJ_ASSERT(false);
+                       return 0;
+                     }();
+
+    // The maximum interrupt rate is 30kHz, so if our PWM rate is
+    // higher than that, then set up the interrupt at half rate.
+    int_rate_hz = pwm_rate_hz / interrupt_divisor;
+
+    min_pwm = kCurrentSampleTime / (0.5f / static_cast<float>(pwm_rate_hz));
+    max_pwm = 1.0f - min_pwm;
+    max_voltage_ratio = (max_pwm - 0.5f) * 2.0f;
+
+    rate_hz = int_rate_hz;
+    period_s = 1.0f / rate_hz;
+
+    // The maximum amount the absolute encoder can change in one cycle
+    // without triggering a fault.  Measured as a fraction of a uint16_t
+    // and corresponds to roughly 28krpm, which is the limit of the AS5047
+    // encoder.
+    //  28000 / 60 = 467 Hz
+    //  467 Hz * 65536 / kIntRate ~= 763
+    max_position_delta = 28000 / 60 * 65536 / int_rate_hz;
+
+    position_divisor =
+        std::max(1, std::min(kMaxPositionDivisor, position_divisor_in));
+    position_rate_hz = rate_hz / position_divisor;
+  }
+};
+
+/// The hardware independent portion of BldcServo.  It owns the
+/// configuration, status, and command state, and implements
+/// everything from the sampled ADC values through to the PWM duty
+/// cycles written to the timer.
+///
+/// The hardware specific portion is responsible for sampling the
+/// ADCs and aux ports, storing the raw results into the status
+/// structure, and then invoking the ISR_ stages below in order.
+/// Everything this class knows about the hardware is captured in the
+/// Registers structure, which on the host may just point to plain
+/// memory.
+class BldcServoCore {
+ public:
+  using Mode = BldcServoMode;
+  using Status = BldcServoStatus;
+  using CommandData = BldcServoCommandData;
+  using Motor = BldcServoMotor;
+  using Config = BldcServoConfig;
+  using PositionConfig = BldcServoPositionConfig;
+  using Control = BldcServoControl;
+  using RateConfig = BldcServoRateConfig;
+
+  struct Registers {
+    // The capture compare registers of the three PWM outputs.
+    volatile uint32_t* pwm1_ccr = nullptr;
+    volatile uint32_t* pwm2_ccr = nullptr;
+    volatile uint32_t* pwm3_ccr = nullptr;
+
+    // A free running CPU cycle counter, used to profile the ISR.
+    volatile uint32_t* cycle_count = nullptr;
+  };
+
+  BldcServoCore(MotorDriver* motor_driver,
+                MotorPosition* motor_position,
+                float vsense_adc_scale)
+      : motor_driver_(motor_driver),
+        motor_position_(motor_position),
+        vsense_adc_scale_(vsense_adc_scale) {
+    UpdateConfig();
+  }
+
+  void SetRegisters(const Registers& registers) {
+    registers_ = registers;
+    profiler_.SetCounter(registers.cycle_count);
+  }
+
+  // The number of timer counts in one half of a center aligned PWM
+  // period, i.e. the value that corresponds to a duty cycle of 1.0.
+  void SetPwmCounts(uint32_t pwm_counts) {
+    pwm_counts_ = pwm_counts;
+  }
+
+  void UpdateConfig() {
+    rate_config_ = RateConfig(config_.pwm_rate_hz,
+                              config_.position_rate_divisor);
+    // Update the saved config to match our limits.
+    config_.pwm_rate_hz = rate_config_.pwm_rate_hz;
+    config_.position_rate_divisor = rate_config_.position_divisor;
+    position_hold_count_ = 0;
+
+    const float kv = 0.5f * 60.0f / motor_.v_per_hz;
+
+    // I have no idea why this fudge is necessary, but it seems to be
+    // consistent across every motor I have tried.
+    constexpr float kFudge = 0.78;
+
+    torque_constant_ =
+        is_torque_constant_configured() ?
+        kFudge * 60.0f / (2.0f * kPi * kv) :
+        kDefaultTorqueConstant;
+
+    torque_model_ = TorqueModel(torque_constant_,
+                                motor_.rotation_current_cutoff_A,
+                                motor_.rotation_current_scale,
+                                motor_.rotation_torque_scale);
+    static_assert(std::tuple_size<decltype(motor_.torque_table_Nm)>::value ==
+                  TorqueTable::kSize);
+    // An invalid table leaves the analytic model in use.
+    torque_table_.Configure(motor_.torque_table_Nm, motor_.torque_table_max_A);
+
+    uint32_t features = 0;
+    if (config_.voltage_mode_control) { features |= kFeatureVoltageMode; }
+    if (config_.fixed_voltage_mode) { features |= kFeatureFixedVoltage; }
+    if (motor_.cogging_dq_scale != 0.0f) { features |= kFeatureCogging; }
+    if (config_.flux_brake_min_voltage > 0.0f) { features |= kFeatureFluxBrake; }
+    if (std::isfinite(config_.motor_fault_temperature)) {
+      features |= kFeatureMotorTemperature;
+    }
+    if (torque_table_.active()) { features |= kFeatureTorqueTable; }
+
+    // Only the most common sets are instantiated, to limit the code
+    // size.  Flux braking is enabled by default.  Anything else uses
+    // the handlers which check everything.
+    constexpr uint32_t kDefaultFeatures = kFeatureFluxBrake;
+    constexpr uint32_t kMotorTemperatureFeatures =
+        kFeatureFluxBrake | kFeatureMotorTemperature;
+    if (features == 0 || features == kDefaultFeatures) {
+      mode_handlers_ = GetModeHandlers<kDefaultFeatures>();
+    } else if (features == kFeatureMotorTemperature ||
+               features == kMotorTemperatureFeatures) {
+      mode_handlers_ = GetModeHandlers<kMotorTemperatureFeatures>();
+    } else {
+      mode_handlers_ = GetModeHandlers<kAllFeatures>();
+    }
+    motor_config_epoch_ = position_.epoch;
+
+    adc_scale_ = 3.3f / (4096.0f * config_.current_sense_ohm * config_.i_gain);
+
+    const float pwm_derate =
+        (static_cast<float>(config_.pwm_rate_hz) / 40000.0f);
+    pwm_compensation_.offset = config_.pwm_comp_off * pwm_derate;
+    pwm_compensation_.mag = config_.pwm_comp_mag;
+    pwm_compensation_.scale = config_.pwm_scale;
+    adjusted_max_power_W_ = config_.max_power_W * pwm_derate;
+  }
+
+  void Command(const CommandData& data) {
+    if (data.mode == kFault ||
+        data.mode == kEnabling ||
+        data.mode == kCalibrating ||
+        data.mode == kCalibrationComplete) {
+      // These are not valid states to command.  Ignore the command
+      // entirely.
+      return;
+    }
+
+    // Actually setting values will happen in the interrupt routine,
+    // so we need to update this atomically.
+    CommandData* next = next_data_;
+    *next = data;
+    next->sequence = ++command_sequence_;
+
+    if (next->timeout_s == 0.0f) {
+      next->timeout_s = config_.default_timeout_s;
+    }
+    if (std::isnan(next->velocity_limit)) {
+      next->velocity_limit = config_.default_velocity_limit;
+    }
+    if (std::isnan(next->accel_limit)) {
+      next->accel_limit = config_.default_accel_limit;
+    }
+    if (std::isnan(next->jerk_limit)) {
+      next->jerk_limit = config_.default_jerk_limit;
+    }
+    // If we are going to limit at all, ensure that we have a velocity
+    // limit, and that is is no more than the configured maximum
+    // velocity.
+    if (!std::isnan(next->velocity_limit) ||
+        !std::isnan(next->accel_limit) ||
+        !std::isnan(next->jerk_limit)) {
+      if (std::isnan(next->velocity_limit)) {
+        next->velocity_limit = config_.max_velocity;
+      } else {
+        next->velocity_limit =
+            std::min(next->velocity_limit, config_.max_velocity);
+      }
+    }
+
+    // If we have a velocity command and velocity_limit, ensure that
+    // the command does not violate the limit.
+    if (!std::isnan(next->velocity_limit) &&
+        !std::isnan(next->velocity)) {
+      next->velocity = Limit(next->velocity,
+                             -next->velocity_limit,
+                             next->velocity_limit);
+    }
+
+    // Transform any position and stop_position command into the
+    // relative raw space.
+    const auto delta = static_cast<int64_t>(
+        motor_position_->absolute_relative_delta.load()) << 32ll;
+    if (!std::isnan(next->position)) {
+      next->position_relative_raw =
+          MotorPosition::FloatToInt(next->position) - delta;
+    } else {
+      next->position_relative_raw.reset();
+    }
+
+    if (!std::isnan(next->stop_position)) {
+      next->stop_position_relative_raw =
+          MotorPosition::FloatToInt(next->stop_position) - delta;
+    }
+
+    // If we have a case where the position is left unspecified, but
+    // we have a velocity and stop condition, then we pick the sign of
+    // the velocity so that we actually move.
+    if (!next->position_relative_raw &&
+        !!next->stop_position_relative_raw &&
+        !std::isnan(next->velocity) &&
+        next->velocity != 0.0f) {
+
+      next->velocity = std::abs(next->velocity) *
+          (((*next->stop_position_relative_raw -
+             position_.position_relative_raw) > 0) ?
+           1.0f : -1.0f);
+    }
+
+    telemetry_data_ = *next;
+
+    if (next->mode == kStopped) {
+      waypoints_.Clear();
+    }
+
+    if (!!next->stop_position_relative_raw &&
+        (std::isfinite(next->accel_limit) ||
+         std::isfinite(next->velocity_limit) ||
+         std::isfinite(next->jerk_limit))) {
+      // There is no valid use case for using a stop position along
+      // with an acceleration or velocity limit.
+      volatile auto* mode_volatile = &status_.mode;
+      volatile auto* fault_volatile = &status_.fault;
+      *fault_volatile = errc::kStopPositionDeprecated;
+      *mode_volatile = kFault;
+    }
+
+    std::swap(current_data_, next_data_);
+  }
+
+  // Queue a waypoint to be followed in position mode.  @p position
+  // is in the same units as CommandData::position.  Return false if
+  // the queue is full or the waypoint is invalid.
+  bool PushWaypoint(float position, float velocity,
+                    float feedforward_Nm, float duration_s) {
+    if (!std::isfinite(position) ||
+        !std::isfinite(velocity) ||
+        !(duration_s >= 0.0f)) {
+      return false;
+    }
+
+    const auto delta = static_cast<int64_t>(
+        motor_position_->absolute_relative_delta.load()) << 32ll;
+
+    Waypoint waypoint;
+    waypoint.position_relative_raw =
+        MotorPosition::FloatToInt(position) - delta;
+    waypoint.velocity = velocity;
+    waypoint.feedforward_Nm = feedforward_Nm;
+    waypoint.duration_s = duration_s;
+    return waypoints_.Push(waypoint);
+  }
+
+  // Discard all queued waypoints.  The one currently being moved
+  // toward, if any, is still reached.
+  void ClearWaypoints() {
+    waypoints_.Clear();
+  }
+
+  int waypoint_count() const { return waypoints_.size(); }
+
+  void PollMillisecond() {
+    // The motor configuration is owned by MotorPosition, and we only
+    // learn that it has changed through the epoch.
+    if (position_.epoch != motor_config_epoch_) {
+      UpdateConfig();
+    }
+
+    profiler_.PollMillisecond();
+    motor_position_->PollMillisecond();
+
+    volatile auto* mode_volatile = &status_.mode;
+    volatile auto* fault_volatile = &status_.fault;
+    Mode mode = *mode_volatile;
+    if (mode == kEnabling) {
+      const auto enable_result = motor_driver_->StartEnable(true);
+      switch (enable_result) {
+        case MotorDriver::kEnabled: {
+          *mode_volatile = kCalibrating;
+          break;
+        }
+        case MotorDriver::kCalibrateFailed: {
+          *fault_volatile = errc::kDriverEnableFault;
+          *mode_volatile = kFault;
+          break;
+        }
+        case MotorDriver::kDisabled:
+        case MotorDriver::kEnabling1:
+        case MotorDriver::kEnabling2:
+        case MotorDriver::kEnabling3: {
+          // Not done yet.
+          break;
+        }
+      }
+    }
+  }
+
+  const Status& status() const { return status_; }
+  const Config& config() const { return config_; }
+  const PositionConfig& position_config() const { return position_config_; }
+  const Control& control() const { return control_; }
+  const RateConfig& rate_config() const { return rate_config_; }
+  const Motor& motor() const { return motor_; }
+
+  // The hardware layer stores its raw samples directly into the
+  // status structure.
+  Status* mutable_status() { return &status_; }
+  Config* mutable_config() { return &config_; }
+  PositionConfig* mutable_position_config() { return &position_config_; }
+  CommandData* telemetry_data() { return &telemetry_data_; }
+  Control* mutable_control() { return &control_; }
+
+  // The hardware layer marks the stages of the ISR which are outside
+  // of this class.
+  const IsrProfile& profile() const { return profiler_.profile(); }
+  IsrProfile* mutable_profile() { return profiler_.mutable_profile(); }
+  IsrProfiler* profiler() { return &profiler_; }
+
+  bool is_torque_constant_configured() const {
+    return motor_.v_per_hz != 0.0f;
+  }
+
+  float current_to_torque(float current) const MOTEUS_CCM_ATTRIBUTE {
+    if (torque_table_.active()) {
+      return torque_table_.current_to_torque(current);
+    }
+    return torque_model_.current_to_torque(current);
+  }
+
+  float torque_to_current(float torque) const MOTEUS_CCM_ATTRIBUTE {
+    return ISR_TorqueToCurrent<kAllFeatures>(torque);
+  }
+
+  /////////////////////////////////////////////////////
+  // The ISR stages, in the order they must be invoked each control
+  // cycle.
+
+  // Called as soon as the current ADCs have been triggered.
+  void ISR_BeginSense() MOTEUS_CCM_ATTRIBUTE {
+    if (std::isnan(current_data_->timeout_s) ||
+        current_data_->timeout_s != 0.0f) {
+      status_.timeout_s = current_data_->timeout_s;
+      current_data_->timeout_s = 0.0;
+    }
+  }
+
+  // Called once the aux ports have completed sampling.
+  void ISR_UpdatePosition() MOTEUS_CCM_ATTRIBUTE {
+    motor_position_->ISR_Update(rate_config_.period_s);
+
+    if (!std::isnan(status_.position_to_set)) {
+      motor_position_->ISR_SetOutputPositionNearest(status_.position_to_set);
+      status_.position_to_set = std::numeric_limits<float>::quiet_NaN();
+    }
+
+    ISR_UpdateFilteredValue(position_.velocity, &status_.velocity_filt, 0.01f);
+  }
+
+  // Called once all raw ADC values are present in the status
+  // structure.
+  void ISR_FinishSense() MOTEUS_CCM_ATTRIBUTE {
+    constexpr int adc_max = 4096;
+    constexpr size_t size_thermistor_table =
+        sizeof(kThermistorLookup) / sizeof(*kThermistorLookup);
+
+    const auto calculate_temp =
+        [&](uint16_t adc_raw) {
+          const size_t offset = std::max<size_t>(
+              1, std::min<size_t>(
+                  size_thermistor_table - 2,
+                  adc_raw * size_thermistor_table / adc_max));
+          const int16_t this_value = offset * adc_max / size_thermistor_table;
+          const int16_t next_value = (offset + 1) * adc_max / size_thermistor_table;
+          const float temp1 = kThermistorLookup[offset];
+          const float temp2 = kThermistorLookup[offset + 1];
+          return temp1 +
+              (temp2 - temp1) *
+              static_cast<float>(adc_raw - this_value) /
+              static_cast<float>(next_value - this_value);
+        };
+
+    status_.fet_temp_C = calculate_temp(status_.adc_fet_temp_raw);
+    ISR_UpdateFilteredValue(status_.fet_temp_C, &status_.filt_fet_temp_C, 0.01f);
+
+    if (config_.enable_motor_temperature) {
+      status_.motor_temp_C = calculate_temp(status_.adc_motor_temp_raw);
+      ISR_UpdateFilteredValue(status_.motor_temp_C, &status_.filt_motor_temp_C, 0.01f);
+    } else {
+      status_.motor_temp_C = status_.filt_motor_temp_C = 0.0f;
+    }
+
+    status_.position = position_.position;
+    status_.velocity = position_.velocity;
+  }
+
+  // Calculate the current state from the sensed values, run
+  // whichever control mode is active, and write the resulting PWM
+  // values.
+  void ISR_DoControlCycle() MOTEUS_CCM_ATTRIBUTE {
+    SinCos sin_cos =
+        cordic_(static_cast<int32_t>(position_.electrical_phase));
+    status_.sin = sin_cos.s;
+    status_.cos = sin_cos.c;
+
+    ISR_CalculateCurrentState(sin_cos);
+
+    if (config_.fixed_voltage_mode) {
+      // Don't pretend we know where we are.
+      status_.position = 0.0f;
+      status_.velocity = 0.0f;
+      status_.torque_Nm = 0.0f;
+      status_.torque_error_Nm = 0.0f;
+    }
+
+#ifdef MOTEUS_PERFORMANCE_MEASURE
+    status_.dwt.curstate = *registers_.cycle_count;
+#endif
+    profiler_.ISR_Mark(&profiler_.mutable_profile()->curstate);
+
+    ISR_DoControl(sin_cos);
+
+    if (motor_position_->has_sensorless()) {
+      const ClarkTransform current(
+          status_.cur1_A, status_.cur3_A, status_.cur2_A);
+      const ClarkTransform voltage(
+          control_.voltage.a, control_.voltage.b, control_.voltage.c);
+      motor_position_->ISR_SetSensorlessInput(
+          current.x, current.y, voltage.x, voltage.y);
+    }
+
+#ifdef MOTEUS_PERFORMANCE_MEASURE
+    status_.dwt.control = *registers_.cycle_count;
+#endif
+    profiler_.ISR_Mark(&profiler_.mutable_profile()->control);
+  }
+
+  // Run every stage in sequence.  This is for use on hosts, where
+  // there is no need to overlap the stages with peripheral activity.
+  void ISR_DoCycle() {
+    auto* const profile = profiler_.mutable_profile();
+    profiler_.ISR_Start();
+    ISR_BeginSense();
+    ISR_UpdatePosition();
+    ISR_FinishSense();
+    profiler_.ISR_Mark(&profile->sense);
+    ISR_DoControlCycle();
+    profiler_.ISR_Mark(&profile->emit);
+    profiler_.ISR_Finish();
+  }
+
+ private:
+  static constexpr int kCalibrateCount = 256;
+
+  static constexpr float kDefaultTorqueConstant = 0.1f;
+  static constexpr float kMaxUnconfiguredCurrent = 5.0f;
+
+  // Optional features of the control modes.  The mode handlers are
+  // instantiated for several sets of these, and a handler only checks
+  // the configuration for the features in its set.  The rest are
+  // compiled out, so a handler may only be used when those features
+  // are disabled.
+  enum ControlFeature : uint32_t {
+    kFeatureVoltageMode = 1 << 0,
+    kFeatureFixedVoltage = 1 << 1,
+    kFeatureCogging = 1 << 2,
+    kFeatureFluxBrake = 1 << 3,
+    kFeatureMotorTemperature = 1 << 4,
+    kFeatureTorqueTable = 1 << 5,
+
+    kAllFeatures = (1 << 6) - 1,
+  };
+
+  using ModeHandler = void (BldcServoCore::*)(const SinCos&, CommandData*);
+  // kNumModes is included, and is treated the same as kStopped.
+  using ModeHandlers = std::array<ModeHandler, kNumModes + 1>;
+
+  // From make_thermistor_table.py
+  static constexpr float kThermistorLookup[] = {
+    -74.17f, // 0
+    -11.36f, // 128
+    1.53f, // 256
+    9.97f, // 384
+    16.51f, // 512
+    21.98f, // 640
+    26.79f, // 768
+    31.15f, // 896
+    35.19f, // 1024
+    39.00f, // 1152
+    42.65f, // 1280
+    46.18f, // 1408
+    49.64f, // 1536
+    53.05f, // 1664
+    56.45f, // 1792
+    59.87f, // 1920
+    63.33f, // 2048
+    66.87f, // 2176
+    70.51f, // 2304
+    74.29f, // 2432
+    78.25f, // 2560
+    82.44f, // 2688
+    86.92f, // 2816
+    91.78f, // 2944
+    97.13f, // 3072
+    103.13f, // 3200
+    110.01f, // 3328
+    118.16f, // 3456
+    128.23f, // 3584
+    141.49f, // 3712
+    161.02f, // 3840
+    197.66f, // 3968
+  };
+
+  static float Limit(float a, float min, float max) MOTEUS_CCM_ATTRIBUTE {
+    if (a < min) { return min; }
+    if (a > max) { return max; }
+    return a;
+  }
+
+  static float Threshold(float value, float lower, float upper) MOTEUS_CCM_ATTRIBUTE {
+    if (value > lower && value < upper) { return 0.0f; }
+    return value;
+  }
+
+  void ISR_UpdateFilteredValue(float input, float* filtered, float period_s) const MOTEUS_CCM_ATTRIBUTE {
+    if (std::isnan(*filtered)) {
+      *filtered = input;
+    } else {
+      const float alpha = 1.0f / (rate_config_.rate_hz * period_s);
+      *filtered = alpha * input + (1.0f - alpha) * *filtered;
+    }
+  }
+
+  void ISR_UpdateFilteredBusV(float* filtered, float period_s) const MOTEUS_CCM_ATTRIBUTE {
+    ISR_UpdateFilteredValue(status_.bus_V, filtered, period_s);
+  }
+
+  void ISR_SetPwmRegisters(uint32_t pwm1, uint32_t pwm2, uint32_t pwm3) MOTEUS_CCM_ATTRIBUTE {
+    *registers_.pwm1_ccr = pwm1;
+    *registers_.pwm2_ccr = pwm2;
+    *registers_.pwm3_ccr = pwm3;
+  }
+
+  // This is called from the ISR.
+  void ISR_CalculateCurrentState(const SinCos& sin_cos) MOTEUS_CCM_ATTRIBUTE {
+    status_.cur1_A = (status_.adc_cur1_raw - status_.adc_cur1_offset) * adc_scale_;
+    status_.cur2_A = (status_.adc_cur2_raw - status_.adc_cur2_offset) * adc_scale_;
+    status_.cur3_A = (status_.adc_cur3_raw - status_.adc_cur3_offset) * adc_scale_;
+    if (motor_.phase_invert) {
+      std::swap(status_.cur2_A, status_.cur3_A);
+    }
+    status_.bus_V = status_.adc_voltage_sense_raw * vsense_adc_scale_;
+
+    ISR_UpdateFilteredBusV(&status_.filt_bus_V, 0.5f);
+    ISR_UpdateFilteredBusV(&status_.filt_1ms_bus_V, 0.001f);
+
+    DqTransform dq{sin_cos,
+          status_.cur1_A,
+          status_.cur3_A,
+          status_.cur2_A
+          };
+    status_.d_A = dq.d;
+    status_.q_A = dq.q;
+    status_.torque_Nm = torque_on() ? (
+        current_to_torque(status_.q_A) /
+        motor_position_->config()->rotor_to_output_ratio) : 0.0f;
+    if (!torque_on()) {
+      status_.torque_error_Nm = 0.0f;
+    }
+  }
+
+  bool current_control() const {
+    switch (status_.mode) {
+      case kNumModes: {
+        MJ_ASSERT(false);
+        return false;
+      }
+      case kFault:
+      case kCalibrating:
+      case kCalibrationComplete:
+      case kEnabling:
+      case kStopped:
+      case kPwm:
+      case kVoltage:
+      case kVoltageFoc:
+      case kVoltageDq:
+      case kMeasureInductance:
+      case kBrake: {
+        return false;
+      }
+      case kCurrent:
+      case kPosition:
+      case kZeroVelocity:
+      case kStayWithinBounds: {
+        return true;
+      }
+      case kPositionTimeout: {
+        return (config_.timeout_mode == BldcServoMode::kZeroVelocity ||
+                config_.timeout_mode == BldcServoMode::kPosition);
+      }
+    }
+    return false;
+  }
+
+  bool torque_on() const {
+    switch (status_.mode) {
+      case kNumModes: {
+        MJ_ASSERT(false);
+        return false;
+      }
+      case kFault:
+      case kCalibrating:
+      case kCalibrationComplete:
+      case kEnabling:
+      case kStopped: {
+        return false;
+      }
+      case kPwm:
+      case kVoltage:
+      case kVoltageFoc:
+      case kVoltageDq:
+      case kCurrent:
+      case kPosition:
+      case kZeroVelocity:
+      case kStayWithinBounds:
+      case kMeasureInductance:
+      case kBrake: {
+        return true;
+      }
+      case kPositionTimeout: {
+        return config_.timeout_mode != 0;
+      }
+    }
+    return false;
+  }
+
+  void ISR_MaybeChangeMode(CommandData* data) MOTEUS_CCM_ATTRIBUTE {
+    // We are requesting a different mode than we are in now.  Do our
+    // best to advance if possible.
+    switch (data->mode) {
+      case kNumModes:
+      case kFault:
+      case kCalibrating:
+      case kCalibrationComplete: {
+        // These should not be possible.
+        MJ_ASSERT(false);
+        return;
+      }
+      case kStopped: {
+        // It is always valid to enter stopped mode.
+        status_.mode = kStopped;
+        return;
+      }
+      case kEnabling: {
+        // We can never change out from enabling in ISR context.
+        return;
+      }
+      case kPwm:
+      case kVoltage:
+      case kVoltageFoc:
+      case kVoltageDq:
+      case kCurrent:
+      case kPosition:
+      case kPositionTimeout:
+      case kZeroVelocity:
+      case kStayWithinBounds:
+      case kMeasureInductance:
+      case kBrake: {
+        switch (status_.mode) {
+          case kNumModes: {
+            MJ_ASSERT(false);
+            return;
+          }
+          case kFault: {
+            // We cannot leave a fault state directly into an active state.
+            return;
+          }
+          case kStopped: {
+            // From a stopped state, we first have to enter the
+            // calibrating state.
+            ISR_StartCalibrating();
+            return;
+          }
+          case kEnabling:
+          case kCalibrating: {
+            // We can only leave this state when calibration is
+            // complete.
+            return;
+          }
+          case kCalibrationComplete:
+          case kPwm:
+          case kVoltage:
+          case kVoltageFoc:
+          case kVoltageDq:
+          case kCurrent:
+          case kPosition:
+          case kZeroVelocity:
+          case kStayWithinBounds:
+          case kMeasureInductance:
+          case kBrake: {
+            if ((data->mode == kPosition || data->mode == kStayWithinBounds) &&
+                ISR_IsOutsideLimits()) {
+              status_.mode = kFault;
+              status_.fault = errc::kStartOutsideLimit;
+            } else {
+              // Yep, we can do this.
+              status_.mode = data->mode;
+
+              // We are entering a new active control mode.  Require
+              // our PID loops to start from scratch.
+              ISR_ClearPid(kAlwaysClear);
+            }
+
+            if (data->mode == kMeasureInductance) {
+              status_.meas_ind_phase = 0;
+              status_.meas_ind_integrator = 0.0f;
+              status_.meas_ind_old_d_A = status_.d_A;
+            }
+
+            return;
+          }
+          case kPositionTimeout: {
+            // We cannot leave this mode except through a stop.
+            return;
+          }
+        }
+      }
+    }
+  }
+
+  bool ISR_IsOutsideLimits() {
+    return ((!std::isnan(position_config_.position_min) &&
+             position_.position < position_config_.position_min) ||
+            (!std::isnan(position_config_.position_max) &&
+             position_.position > position_config_.position_max));
+  }
+
+  void ISR_StartCalibrating() {
+    // Capture the current motor position epoch.
+    motor_position_epoch_ = position_.epoch;
+
+    status_.mode = kEnabling;
+
+    // The main context will set our state to kCalibrating when the
+    // motor driver is fully enabled.
+
+    ISR_SetPwmRegisters(0, 0, 0);
+
+    // Power should already be false for any state we could possibly
+    // be in, but lets just be certain.
+    motor_driver_->Power(false);
+
+    calibrate_adc1_ = 0;
+    calibrate_adc2_ = 0;
+    calibrate_adc3_ = 0;
+    calibrate_count_ = 0;
+  }
+
+  enum ClearMode {
+    kClearIfMode,
+    kAlwaysClear,
+  };
+
+  void ISR_ClearPid(ClearMode force_clear) MOTEUS_CCM_ATTRIBUTE {
+    const bool current_pid_active = [&]() MOTEUS_CCM_ATTRIBUTE {
+      switch (status_.mode) {
+        case kNumModes:
+        case kFault:
+        case kEnabling:
+        case kCalibrating:
+        case kCalibrationComplete:
+        case kPwm:
+        case kVoltage:
+        case kVoltageFoc:
+        case kVoltageDq:
+        case kMeasureInductance:
+        case kBrake:
+          return false;
+        case kCurrent:
+        case kPosition:
+        case kPositionTimeout:
+        case kZeroVelocity:
+        case kStayWithinBounds:
+          return true;
+        case kStopped: {
+          return status_.cooldown_count != 0;
+        }
+      }
+      return false;
+    }();
+
+    if (!current_pid_active || force_clear == kAlwaysClear) {
+      status_.pid_d.Clear();
+      status_.pid_q.Clear();
+
+      // We always want to start from 0 current when initiating
+      // current control of some form.
+      status_.pid_d.desired = 0.0f;
+      status_.pid_q.desired = 0.0f;
+    }
+
+    const bool position_pid_active = [&]() MOTEUS_CCM_ATTRIBUTE {
+      switch (status_.mode) {
+        case kNumModes:
+        case kStopped:
+        case kFault:
+        case kEnabling:
+        case kCalibrating:
+        case kCalibrationComplete:
+        case kPwm:
+        case kVoltage:
+        case kVoltageFoc:
+        case kVoltageDq:
+        case kCurrent:
+        case kMeasureInductance:
+        case kBrake:
+          return false;
+        case kPosition:
+        case kPositionTimeout:
+        case kZeroVelocity:
+        case kStayWithinBounds:
+          return true;
+      }
+      return false;
+    }();
+
+    if (!position_pid_active || force_clear == kAlwaysClear) {
+      position_hold_count_ = 0;
+      status_.pid_position.Clear();
+      status_.control_position_raw = {};
+      status_.control_position = std::numeric_limits<float>::quiet_NaN();
+      status_.control_velocity = {};
+      status_.control_acceleration = 0.0f;
+      waypoint_segment_.active = false;
+      waypoints_.ISR_HandleClear();
+      interpolation_ = {};
+      trajectory_plan_ = {};
+    }
+  }
+
+  void ISR_DoControl(const SinCos& sin_cos) MOTEUS_CCM_ATTRIBUTE {
+    // current_data_ is volatile, so read it out now, and operate on
+    // the pointer for the rest of the routine.
+    CommandData* data = current_data_;
+
+    control_.Clear();
+
+    if (!std::isnan(status_.timeout_s) && status_.timeout_s > 0.0f) {
+      status_.timeout_s =
+          std::max(0.0f, status_.timeout_s - rate_config_.period_s);
+    }
+
+    // See if we need to update our current mode.
+    if (data->mode != status_.mode) {
+      ISR_MaybeChangeMode(data);
+    }
+
+    // Handle our persistent fault conditions.
+    if (status_.mode != kStopped && status_.mode != kFault) {
+      if (motor_driver_->fault()) {
+        status_.mode = kFault;
+        status_.fault = errc::kMotorDriverFault;
+      }
+      if (status_.bus_V > config_.max_voltage) {
+        status_.mode = kFault;
+        status_.fault = errc::kOverVoltage;
+      }
+      // NOTE: This is mostly to identify faulty voltage sense
+      // components.  Actual undervolts are more likely to trigger the
+      // drv8323 first.  If we erroneously use a very low voltage
+      // here, we can command a very large current due to the voltage
+      // compensation.
+      if (status_.bus_V < 4.0f) {
+        status_.mode = kFault;
+        status_.fault = errc::kUnderVoltage;
+      }
+      if (status_.filt_fet_temp_C > config_.fault_temperature) {
+        status_.mode = kFault;
+        status_.fault = errc::kOverTemperature;
+      }
+      if (std::isfinite(config_.motor_fault_temperature) &&
+          status_.filt_motor_temp_C > config_.motor_fault_temperature) {
+        status_.mode = kFault;
+        status_.fault = errc::kOverTemperature;
+      }
+    }
+
+    if ((status_.mode == kPosition || status_.mode == kStayWithinBounds) &&
+        !std::isnan(status_.timeout_s) &&
+        status_.timeout_s <= 0.0f) {
+      status_.mode = kPositionTimeout;
+    }
+
+    // Ensure unused PID controllers have zerod state.
+    ISR_ClearPid(kClearIfMode);
+
+    if (status_.mode != kFault) {
+      status_.fault = errc::kSuccess;
+    }
+
+#ifdef MOTEUS_PERFORMANCE_MEASURE
+    status_.dwt.control_sel_mode = *registers_.cycle_count;
+#endif
+
+    if (current_control()) {
+      status_.cooldown_count = config_.cooldown_cycles;
+    }
+
+    (this->*(*mode_handlers_)[status_.mode])(sin_cos, data);
+  }
+
+  // Run the control for the mode @p kMode.  This is instantiated for
+  // each mode and feature set, see UpdateConfig.
+  template <Mode kMode, uint32_t kFeatures>
+  void ISR_DoMode(const SinCos& sin_cos, CommandData* data) MOTEUS_CCM_ATTRIBUTE {
+    if constexpr (kMode == kStopped || kMode == kNumModes) {
+      ISR_DoStopped<kFeatures>(sin_cos);
+    } else if constexpr (kMode == kFault) {
+      ISR_DoFault();
+    } else if constexpr (kMode == kCalibrating) {
+      ISR_DoCalibrating();
+    } else if constexpr (kMode == kPwm) {
+      ISR_DoPwmControl(data->pwm);
+    } else if constexpr (kMode == kVoltage) {
+      ISR_DoBalancedVoltageControl(data->phase_v);
+    } else if constexpr (kMode == kVoltageFoc) {
+      ISR_DoVoltageFOC(data);
+    } else if constexpr (kMode == kVoltageDq) {
+      ISR_DoVoltageDQCommand(sin_cos, data->d_V, data->q_V);
+    } else if constexpr (kMode == kCurrent) {
+      ISR_DoCurrent<kFeatures>(sin_cos, data->i_d_A, data->i_q_A, 0.0f);
+    } else if constexpr (kMode == kPosition) {
+      ISR_DoPosition<kFeatures>(sin_cos, data);
+    } else if constexpr (kMode == kPositionTimeout) {
+      ISR_DoPositionTimeout<kFeatures>(sin_cos, data);
+    } else if constexpr (kMode == kZeroVelocity) {
+      ISR_DoZeroVelocity<kFeatures>(sin_cos, data);
+    } else if constexpr (kMode == kStayWithinBounds) {
+      ISR_DoStayWithinBounds<kFeatures>(sin_cos, data);
+    } else if constexpr (kMode == kMeasureInductance) {
+      ISR_DoMeasureInductance(sin_cos, data);
+    } else if constexpr (kMode == kBrake) {
+      ISR_DoBrake();
+    }
+    // kEnabling and kCalibrationComplete have nothing to do.
+  }
+
+  template <uint32_t kFeatures, size_t... kModes>
+  static constexpr ModeHandlers MakeModeHandlers(std::index_sequence<kModes...>) {
+    return {{ &BldcServoCore::ISR_DoMode<static_cast<Mode>(kModes), kFeatures>... }};
+  }
+
+  template <uint32_t kFeatures>
+  static const ModeHandlers* GetModeHandlers() {
+    static constexpr ModeHandlers handlers =
+        MakeModeHandlers<kFeatures>(std::make_index_sequence<kNumModes + 1>());
+    return &handlers;
+  }
+
+  template <uint32_t kFeatures>
+  void ISR_DoStopped(const SinCos& sin_cos) MOTEUS_CCM_ATTRIBUTE {
+    if (status_.cooldown_count) {
+      status_.cooldown_count--;
+      ISR_DoCurrent<kFeatures>(sin_cos, 0.0f, 0.0f, 0.0f);
+      return;
+    }
+
+    const auto result = motor_driver_->StartEnable(false);
+    // We should always be able to disable immediately.
+    MJ_ASSERT(result == MotorDriver::kDisabled);
+    motor_driver_->Power(false);
+    ISR_SetPwmRegisters(0, 0, 0);
+  }
+
+  void ISR_DoFault() MOTEUS_CCM_ATTRIBUTE {
+    motor_driver_->Power(false);
+
+    ISR_SetPwmRegisters(0, 0, 0);
+  }
+
+  void ISR_DoCalibrating() {
+    calibrate_adc1_ += status_.adc_cur1_raw;
+    calibrate_adc2_ += status_.adc_cur2_raw;
+    calibrate_adc3_ += status_.adc_cur3_raw;
+    calibrate_count_++;
+
+    if (calibrate_count_ < kCalibrateCount) {
+      return;
+    }
+
+    const uint16_t new_adc1_offset = calibrate_adc1_ / kCalibrateCount;
+    const uint16_t new_adc2_offset = calibrate_adc2_ / kCalibrateCount;
+    const uint16_t new_adc3_offset = calibrate_adc3_ / kCalibrateCount;
+
+    if (std::abs(static_cast<int>(new_adc1_offset) - 2048) > 200 ||
+        std::abs(static_cast<int>(new_adc2_offset) - 2048) > 200 ||
+        std::abs(static_cast<int>(new_adc3_offset) - 2048) > 200) {
+      // Error calibrating.  Just fault out.
+      status_.mode = kFault;
+      status_.fault = errc::kCalibrationFault;
+      return;
+    }
+
+    status_.adc_cur1_offset = new_adc1_offset;
+    status_.adc_cur2_offset = new_adc2_offset;
+    status_.adc_cur3_offset = new_adc3_offset;
+    status_.mode = kCalibrationComplete;
+  }
+
+  void ISR_DoPwmControl(const Vec3& pwm) MOTEUS_CCM_ATTRIBUTE {
+    control_.pwm.a = LimitPwm(pwm.a);
+    control_.pwm.b = LimitPwm(pwm.b);
+    control_.pwm.c = LimitPwm(pwm.c);
+
+    const uint16_t pwm1 = static_cast<uint16_t>(control_.pwm.a * pwm_counts_);
+    const uint16_t pwm2 = static_cast<uint16_t>(control_.pwm.b * pwm_counts_);
+    const uint16_t pwm3 = static_cast<uint16_t>(control_.pwm.c * pwm_counts_);
+
+    // NOTE(jpieper): The default ordering has pwm2 and pwm3 flipped.
+    // Why you may ask?  No good reason.  It does require that the
+    // currents be similarly swapped in ISR_CalculateCurrentState.
+    // Changing it back now would reverse the sign of position for any
+    // existing motor, so it isn't an easy change to make.
+    if (!motor_.phase_invert) {
+      ISR_SetPwmRegisters(pwm1, pwm3, pwm2);
+    } else {
+      ISR_SetPwmRegisters(pwm1, pwm2, pwm3);
+    }
+
+    motor_driver_->Power(true);
+  }
+
+  /// Assume that the voltages are intended to be balanced around the
+  /// midpoint and can be shifted accordingly.
+  void ISR_DoBalancedVoltageControl(const Vec3& voltage) MOTEUS_CCM_ATTRIBUTE {
+    control_.voltage = voltage;
+
+    const BalancedPwm pwm(voltage.a, voltage.b, voltage.c,
+                          status_.filt_bus_V, pwm_compensation_);
+    ISR_DoPwmControl(Vec3{pwm.a, pwm.b, pwm.c});
+  }
+
+  void ISR_DoVoltageFOC(CommandData* data) MOTEUS_CCM_ATTRIBUTE {
+    data->theta += data->theta_rate * rate_config_.period_s;
+    SinCos sc = cordic_(RadiansToQ31(data->theta));
+    const float max_voltage = (0.5f - rate_config_.min_pwm) * status_.filt_bus_V;
+    InverseDqTransform idt(sc, Limit(data->voltage, -max_voltage, max_voltage), 0);
+    ISR_DoBalancedVoltageControl(Vec3{idt.a, idt.b, idt.c});
+  }
+
+  template <uint32_t kFeatures>
+  void ISR_DoCurrent(const SinCos& sin_cos, float i_d_A_in, float i_q_A_in,
+                     float feedforward_velocity_rotor) MOTEUS_CCM_ATTRIBUTE {
+    if (motor_.poles == 0) {
+      // We aren't configured yet.
+      status_.mode = kFault;
+      status_.fault = errc::kMotorNotConfigured;
+      return;
+    }
+    if (!position_.theta_valid) {
+      status_.mode = kFault;
+      status_.fault = errc::kThetaInvalid;
+      return;
+    }
+
+    auto limit_q_current = [&](float in) MOTEUS_CCM_ATTRIBUTE {
+      if (!std::isnan(position_config_.position_max) &&
+          position_.position > position_config_.position_max &&
+          in > 0.0f) {
+        // We derate the request in the direction that moves it
+        // further outside the position limits.  This is mostly useful
+        // when feedforward is applied, as otherwise, the position
+        // limits could easily be exceeded.  Without feedforward, we
+        // shouldn't really be trying to push outside the limits
+        // anyhow.
+        return in *
+            std::max(0.0f,
+                     1.0f - (position_.position -
+                             position_config_.position_max) /
+                     config_.position_derate);
+      }
+      if (!std::isnan(position_config_.position_min) &&
+          position_.position < position_config_.position_min &&
+          in < 0.0f) {
+        return in *
+            std::max(0.0f,
+                     1.0f - (position_config_.position_min -
+                             position_.position) /
+                     config_.position_derate);
+      }
+
+      return in;
+    };
+
+    auto limit_q_velocity = [&](float in) MOTEUS_CCM_ATTRIBUTE {
+      const float abs_velocity = std::abs(position_.velocity);
+      if (abs_velocity < config_.max_velocity ||
+          position_.velocity * in < 0.0f) {
+        return in;
+      }
+      const float derate_fraction =
+          1.0f - ((abs_velocity - config_.max_velocity) /
+                  config_.max_velocity_derate);
+      const float current_limit =
+          std::max(0.0f, derate_fraction * config_.max_current_A);
+      return Limit(in, -current_limit, current_limit);
+    };
+
+    float derate_fraction =
+        (status_.filt_fet_temp_C - config_.derate_temperature) /
+        (config_.fault_temperature - config_.derate_temperature);
+    if ((kFeatures & kFeatureMotorTemperature) &&
+        std::isfinite(config_.motor_fault_temperature)) {
+      derate_fraction = std::min<float>(
+          derate_fraction,
+          ((status_.filt_motor_temp_C - config_.motor_derate_temperature) /
+           (config_.motor_fault_temperature - config_.motor_derate_temperature)));
+    }
+
+    const float derate_current_A =
+        std::max<float>(
+            0.0f,
+            derate_fraction *
+            (config_.derate_current_A - config_.max_current_A) +
+            config_.max_current_A);
+
+    const float temp_limit_A = std::min<float>(
+        config_.max_current_A, derate_current_A);
+
+    auto limit_either_current = [&](float in) MOTEUS_CCM_ATTRIBUTE {
+      return Limit(in, -temp_limit_A, temp_limit_A);
+    };
+
+    const float i_q_A =
+        limit_either_current(
+            limit_q_velocity(
+                limit_q_current(i_q_A_in)));
+    const float i_d_A = limit_either_current(i_d_A_in);
+
+    control_.i_d_A = i_d_A;
+    control_.i_q_A = i_q_A;
+
+    // This is conservative... we could use std::hypot(d, q), however
+    // that would take more CPU cycles, and most of the time we'll
+    // only be seeing q != 0.
+    const float max_V = adjusted_max_power_W_ /
+        (std::abs(status_.d_A) + std::abs(status_.q_A));
+
+    if (!((kFeatures & kFeatureVoltageMode) &&
+          config_.voltage_mode_control)) {
+      const float d_V =
+          Limit(
+              pid_d_.Apply(status_.d_A, i_d_A, rate_config_.rate_hz) +
+              i_d_A * config_.current_feedforward * motor_.resistance_ohm,
+              -max_V, max_V);
+
+      const float max_current_integral =
+          rate_config_.max_voltage_ratio * 0.5f * status_.filt_bus_V;
+      status_.pid_d.integral = Limit(
+          status_.pid_d.integral,
+          -max_current_integral, max_current_integral);
+
+      const float q_V =
+          Limit(
+              pid_q_.Apply(status_.q_A, i_q_A, rate_config_.rate_hz) +
+              i_q_A * config_.current_feedforward * motor_.resistance_ohm +
+              feedforward_velocity_rotor * config_.bemf_feedforward * motor_.v_per_hz,
+              -max_V, max_V);
+      status_.pid_q.integral = Limit(
+          status_.pid_q.integral,
+          -max_current_integral, max_current_integral);
+
+      ISR_DoVoltageDQ(sin_cos, d_V, q_V);
+    } else {
+      ISR_DoVoltageDQ(sin_cos,
+                      i_d_A * motor_.resistance_ohm,
+                      i_q_A * motor_.resistance_ohm +
+                      feedforward_velocity_rotor * config_.bemf_feedforward * motor_.v_per_hz);
+    }
+  }
+
+  // The idiomatic thing to do in DoMeasureInductance would be to just
+  // call DoVoltageDQ.  However, because of
+  // https://gcc.gnu.org/bugzilla/show_bug.cgi?id=41091 that results
+  // in a compile time error.  Instead, we construct a similar
+  // factorization by delegating most of the work to this helper
+  // function.
+  void ISR_DoVoltageDQPwm(const SinCos& sin_cos, float d_V, float q_V) MOTEUS_CCM_ATTRIBUTE {
+    if (position_.epoch != motor_position_epoch_) {
+      status_.mode = kFault;
+      status_.fault = errc::kConfigChanged;
+
+      ISR_DoBalancedVoltageControl(Vec3{0.f, 0.f, 0.f});
+      return;
+    }
+
+    control_.d_V = d_V;
+    control_.q_V = q_V;
+
+    const float max_voltage = (0.5f - rate_config_.min_pwm) * status_.filt_bus_V;
+    auto limit_v = [&](float in) MOTEUS_CCM_ATTRIBUTE {
+      return Limit(in, -max_voltage, max_voltage);
+    };
+    const SpaceVectorPwm pwm(sin_cos, limit_v(control_.d_V),
+                             limit_v(control_.q_V),
+                             1.0f / status_.filt_bus_V,
+                             pwm_compensation_);
+
+#ifdef MOTEUS_PERFORMANCE_MEASURE
+    status_.dwt.control_done_cur = *registers_.cycle_count;
+#endif
+
+    control_.voltage = Vec3{pwm.va, pwm.vb, pwm.vc};
+    ISR_DoPwmControl(Vec3{pwm.a, pwm.b, pwm.c});
+  }
+
+  void ISR_DoVoltageDQ(const SinCos& sin_cos, float d_V, float q_V) MOTEUS_CCM_ATTRIBUTE {
+    ISR_DoVoltageDQPwm(sin_cos, d_V, q_V);
+  }
+
+  void ISR_DoVoltageDQCommand(const SinCos& sin_cos, float d_V, float q_V) MOTEUS_CCM_ATTRIBUTE {
+    if (motor_.poles == 0) {
+      // We aren't configured yet.
+      status_.mode = kFault;
+      status_.fault = errc::kMotorNotConfigured;
+      return;
+    }
+    if (!position_.theta_valid) {
+      status_.mode = kFault;
+      status_.fault = errc::kThetaInvalid;
+      return;
+    }
+
+    ISR_DoVoltageDQPwm(sin_cos, d_V, q_V);
+  }
+
+  template <uint32_t kFeatures>
+  void ISR_DoPositionTimeout(const SinCos& sin_cos, CommandData* data) MOTEUS_CCM_ATTRIBUTE {
+    if (config_.timeout_mode == kStopped) {
+      ISR_DoStopped<kFeatures>(sin_cos);
+    } else if (config_.timeout_mode == kPosition) {
+      CommandData timeout_data;
+      timeout_data.mode = kPosition;
+      timeout_data.position = std::numeric_limits<float>::quiet_NaN();
+      timeout_data.velocity_limit = config_.default_velocity_limit;
+      timeout_data.accel_limit = config_.default_accel_limit;
+      timeout_data.jerk_limit = config_.default_jerk_limit;
+      timeout_data.timeout_s = std::numeric_limits<float>::quiet_NaN();
+
+      PID::ApplyOptions apply_options;
+      ISR_DoPositionCommon<kFeatures>(
+          sin_cos, &timeout_data, apply_options,
+          timeout_data.max_torque_Nm,
+          0.0f,
+          0.0f);
+    } else if (config_.timeout_mode == kZeroVelocity) {
+      ISR_DoZeroVelocity<kFeatures>(sin_cos, data);
+    } else if (config_.timeout_mode == kBrake) {
+      ISR_DoBrake();
+    } else {
+      ISR_DoStopped<kFeatures>(sin_cos);
+    }
+  }
+
+  template <uint32_t kFeatures>
+  void ISR_DoZeroVelocity(const SinCos& sin_cos, CommandData* data) MOTEUS_CCM_ATTRIBUTE {
+    CommandData zero_velocity;
+
+    zero_velocity.mode = kPosition;
+    zero_velocity.position = std::numeric_limits<float>::quiet_NaN();
+    zero_velocity.velocity = 0.0f;
+    zero_velocity.timeout_s = std::numeric_limits<float>::quiet_NaN();
+
+    PID::ApplyOptions apply_options;
+    apply_options.kp_scale = 0.0f;
+    apply_options.kd_scale = data->kd_scale;
+    apply_options.ki_scale = 0.0f;
+
+    ISR_DoPositionCommon<kFeatures>(sin_cos, &zero_velocity,
+                         apply_options, config_.timeout_max_torque_Nm,
+                         0.0f, 0.0f);
+  }
+
+  template <uint32_t kFeatures>
+  void ISR_DoPosition(const SinCos& sin_cos, CommandData* data) MOTEUS_CCM_ATTRIBUTE {
+    PID::ApplyOptions apply_options;
+    apply_options.kp_scale = data->kp_scale;
+    apply_options.kd_scale = data->kd_scale;
+
+    ISR_DoPositionCommon<kFeatures>(
+        sin_cos, data, apply_options, data->max_torque_Nm,
+        data->feedforward_Nm, data->velocity);
+  }
+
+  template <uint32_t kFeatures>
+  void ISR_DoPositionCommon(
+      const SinCos& sin_cos, CommandData* data,
+      const PID::ApplyOptions& pid_options,
+      float max_torque_Nm,
+      float feedforward_Nm,
+      float velocity) MOTEUS_CCM_ATTRIBUTE {
+    const bool fixed_voltage =
+        ((kFeatures & kFeatureFixedVoltage) && config_.fixed_voltage_mode) ||
+        !std::isnan(data->fixed_voltage_override);
+
+    // Between updates of the position loop, the current loop keeps
+    // running with the most recent command.  Fixed voltage mode has
+    // no current loop to hold, so it always runs at the full rate.
+    if (position_hold_count_ != 0 && !fixed_voltage) {
+      position_hold_count_--;
+      ISR_DoPositionHold<kFeatures>(sin_cos);
+      return;
+    }
+
+    const float rate_hz =
+        fixed_voltage ? rate_config_.rate_hz : rate_config_.position_rate_hz;
+
+    const int64_t absolute_relative_delta =
+        static_cast<int64_t>(
+            motor_position_->absolute_relative_delta.load()) << 32ll;
+
+    // Queued waypoints take precedence over the command itself, but
+    // only in the actual position mode.
+    const bool follow_waypoint =
+        status_.mode == kPosition &&
+        BldcServoPosition::UpdateWaypoint(
+            &status_,
+            &config_,
+            &position_,
+            rate_hz,
+            data,
+            &waypoints_,
+            &waypoint_segment_,
+            &feedforward_Nm);
+
+    const bool new_command = data->sequence != last_command_sequence_;
+    last_command_sequence_ = data->sequence;
+    if (follow_waypoint) {
+      // Commands received while following waypoints are not
+      // interpolated from.
+      interpolation_ = {};
+    }
+    const bool follow_interpolation =
+        !follow_waypoint &&
+        status_.mode == kPosition &&
+        config_.interpolation_max_period_s > 0.0f &&
+        BldcServoPosition::UpdateInterpolation(
+            &status_,
+            &config_,
+            &position_,
+            rate_hz,
+            data,
+            new_command,
+            &interpolation_);
+
+    // A plan is only good for the command it was made for, and only
+    // while nothing else is moving the control position.
+    if (new_command || follow_waypoint || follow_interpolation) {
+      trajectory_plan_.active = false;
+    }
+
+    const float velocity_command =
+        (follow_waypoint || follow_interpolation) ?
+        BldcServoPosition::AdvanceControlPosition(
+            &status_,
+            &config_,
+            &position_config_,
+            &position_,
+            absolute_relative_delta,
+            rate_hz,
+            data) :
+        BldcServoPosition::UpdateCommand(
+            &status_,
+            &config_,
+            &position_config_,
+            &position_,
+            absolute_relative_delta,
+            rate_hz,
+            data,
+            velocity,
+            &trajectory_plan_);
+
+    // At this point, our control position and velocity are known.
+
+    if (fixed_voltage) {
+      status_.position =
+          static_cast<float>(
+              static_cast<int32_t>(
+                  *status_.control_position_raw >> 32)) /
+          65536.0f;
+      status_.velocity = velocity_command;
+
+      // For "fixed voltage" mode, we skip all position and current
+      // PID loops and all their associated calculations, including
+      // everything that uses the encoder.  Instead we just burn power
+      // with a fixed voltage drive based on the desired position.
+      const uint32_t synthetic_electrical_phase =
+          motor_position_->OutputPositionToElectricalPhase(
+              *status_.control_position_raw);
+      const SinCos synthetic_sin_cos =
+          cordic_(static_cast<int32_t>(synthetic_electrical_phase));
+      const float fixed_voltage =
+          std::isnan(data->fixed_voltage_override) ?
+          config_.fixed_voltage_control_V +
+          (std::abs(status_.velocity) *
+           motor_.v_per_hz *
+           config_.bemf_feedforward) :
+          data->fixed_voltage_override;
+      ISR_DoVoltageDQ(synthetic_sin_cos, fixed_voltage, 0.0f);
+      return;
+    }
+
+    // From this point, we require actual valid position.
+    if (!ISR_CheckPositionValid()) { return; }
+
+    const float measured_velocity = velocity_command +
+        Threshold(
+            position_.velocity - velocity_command, -config_.velocity_threshold,
+            config_.velocity_threshold);
+
+    // We always control relative to the control position of 0, so
+    // that we get equal performance across the entire viable integral
+    // position range.
+    const float unlimited_torque_Nm =
+        motor_position_->config()->output.sign *
+        (pid_position_.Apply(
+            (static_cast<int32_t>(
+                (position_.position_relative_raw -
+                 *status_.control_position_raw) >> 32) /
+             65536.0f),
+            0.0,
+            measured_velocity, velocity_command,
+            rate_hz,
+            pid_options) +
+         feedforward_Nm);
+
+    const float limited_torque_Nm =
+        Limit(unlimited_torque_Nm, -max_torque_Nm, max_torque_Nm);
+
+    control_.torque_Nm = limited_torque_Nm;
+    status_.torque_error_Nm = status_.torque_Nm - control_.torque_Nm;
+
+    const float limited_q_A =
+        ISR_TorqueToCurrent<kFeatures>(limited_torque_Nm *
+                          motor_position_->config()->rotor_to_output_ratio);
+
+    if constexpr ((kFeatures & kFeatureCogging) != 0) {
+      const auto& pos_config = motor_position_->config();
+      const auto commutation_source = pos_config->commutation_source;
+      const float cpr = static_cast<float>(
+          pos_config->sources[commutation_source].cpr);
+      const float commutation_position =
+          position_.sources[commutation_source].filtered_value / cpr;
+
+      auto sample =
+          [&](const auto& table, float scale) {
+            const int left_index = std::min<int>(
+                table.size() - 1,
+                static_cast<int>(table.size() * commutation_position));
+            const int right_index = (left_index + 1) % table.size();
+            const float comp_fraction =
+                (commutation_position -
+                 static_cast<float>(left_index) / table.size()) *
+                static_cast<float>(table.size());
+            const float left_comp = table[left_index] * scale;
+            const float right_comp = table[right_index] * scale;
+
+            return (right_comp - left_comp) * comp_fraction + left_comp;
+          };
+      const float q_comp_A = sample(motor_.cogging_dq_comp,
+                                    motor_.cogging_dq_scale);
+
+      control_.q_comp_A = q_comp_A;
+    }
+
+    const float compensated_q_A = limited_q_A + control_.q_comp_A;
+
+    const float q_A =
+        is_torque_constant_configured() ?
+        compensated_q_A :
+        Limit(compensated_q_A, -kMaxUnconfiguredCurrent, kMaxUnconfiguredCurrent);
+
+    const float d_A = [&]() MOTEUS_CCM_ATTRIBUTE {
+      if (!(kFeatures & kFeatureFluxBrake) ||
+          config_.flux_brake_min_voltage <= 0.0f) {
+        return 0.0f;
+      }
+
+      const auto error = (
+          status_.filt_1ms_bus_V - config_.flux_brake_min_voltage);
+
+      if (error <= 0.0f) {
+        return 0.0f;
+      }
+
+      return (error / config_.flux_brake_resistance_ohm);
+    }();
+
+#ifdef MOTEUS_PERFORMANCE_MEASURE
+    status_.dwt.control_done_pos = *registers_.cycle_count;
+#endif
+
+    position_hold_.torque_Nm = control_.torque_Nm;
+    position_hold_.q_comp_A = control_.q_comp_A;
+    position_hold_.d_A = d_A;
+    position_hold_.q_A = q_A;
+    position_hold_.velocity_rotor =
+        velocity_command / motor_position_->config()->rotor_to_output_ratio;
+    position_hold_count_ = rate_config_.position_divisor - 1;
+
+    ISR_DoCurrent<kFeatures>(
+        sin_cos, d_A, q_A, position_hold_.velocity_rotor);
+  }
+
+  template <uint32_t kFeatures>
+  void ISR_DoPositionHold(const SinCos& sin_cos) MOTEUS_CCM_ATTRIBUTE {
+    if (!ISR_CheckPositionValid()) { return; }
+
+    control_.torque_Nm = position_hold_.torque_Nm;
+    control_.q_comp_A = position_hold_.q_comp_A;
+    status_.torque_error_Nm = status_.torque_Nm - control_.torque_Nm;
+
+    ISR_DoCurrent<kFeatures>(
+        sin_cos, position_hold_.d_A, position_hold_.q_A,
+        position_hold_.velocity_rotor);
+  }
+
+  bool ISR_CheckPositionValid() MOTEUS_CCM_ATTRIBUTE {
+    if (!position_.position_relative_valid) {
+      status_.mode = kFault;
+      status_.fault = errc::kPositionInvalid;
+      return false;
+    }
+    if (position_.error != MotorPosition::Status::kNone) {
+      status_.mode = kFault;
+      status_.fault = errc::kEncoderFault;
+      return false;
+    }
+    return true;
+  }
+
+  template <uint32_t kFeatures>
+  void ISR_DoStayWithinBounds(const SinCos& sin_cos, CommandData* data) MOTEUS_CCM_ATTRIBUTE {
+    const auto target_position = [&]() MOTEUS_CCM_ATTRIBUTE -> std::optional<float> {
+      if (!std::isnan(data->bounds_min) &&
+          position_.position < data->bounds_min) {
+        return data->bounds_min;
+      }
+      if (!std::isnan(data->bounds_max) &&
+          position_.position > data->bounds_max) {
+        return data->bounds_max;
+      }
+      return {};
+    }();
+
+    if (!target_position) {
+      position_hold_count_ = 0;
+      status_.pid_position.Clear();
+      status_.control_position_raw = {};
+      status_.control_position = std::numeric_limits<float>::quiet_NaN();
+      status_.control_velocity = {};
+      status_.control_acceleration = 0.0f;
+
+      // In this region, we still apply feedforward torques if they
+      // are present.
+      const float limited_torque_Nm =
+          Limit(data->feedforward_Nm, -data->max_torque_Nm, data->max_torque_Nm);
+      control_.torque_Nm = limited_torque_Nm;
+      status_.torque_error_Nm = status_.torque_Nm - control_.torque_Nm;
+      const float limited_q_A =
+          ISR_TorqueToCurrent<kFeatures>(
+              limited_torque_Nm *
+              motor_position_->config()->rotor_to_output_ratio);
+
+      ISR_DoCurrent<kFeatures>(sin_cos, 0.0f, limited_q_A, 0.0f);
+      return;
+    }
+
+    // Control position to whichever bound we are currently violating.
+    PID::ApplyOptions apply_options;
+    apply_options.kp_scale = data->kp_scale;
+    apply_options.kd_scale = data->kd_scale;
+
+    const int64_t absolute_relative_delta =
+        (static_cast<int64_t>(
+            motor_position_->absolute_relative_delta.load()) << 32ll);
+    data->position_relative_raw =
+        MotorPosition::FloatToInt(*target_position) -
+        absolute_relative_delta;
+    data->velocity = 0.0;
+    status_.control_position_raw = data->position_relative_raw;
+    status_.control_position = *target_position;
+    status_.control_velocity = 0.0f;
+    status_.control_acceleration = 0.0f;
+
+    ISR_DoPositionCommon<kFeatures>(
+        sin_cos, data, apply_options,
+        data->max_torque_Nm, data->feedforward_Nm, 0.0f);
+  }
+
+  void ISR_DoMeasureInductance(const SinCos& sin_cos, CommandData* data) MOTEUS_CCM_ATTRIBUTE {
+    const int8_t old_sign = status_.meas_ind_phase > 0 ? 1 : -1;
+    const float old_sign_float = old_sign > 0 ? 1.0f : -1.0f;
+
+    status_.meas_ind_phase += -old_sign;
+
+    // When measuring inductance, we just drive a 0 centered square
+    // wave at some integral multiple of the control period.
+    if (status_.meas_ind_phase == 0) {
+      status_.meas_ind_phase = -old_sign * data->meas_ind_period;
+    }
+
+    const float d_V =
+        data->d_V * (status_.meas_ind_phase > 0 ? 1.0f : -1.0f);
+
+    // We also integrate the difference in current.
+    status_.meas_ind_integrator +=
+        (status_.d_A - status_.meas_ind_old_d_A) *
+        old_sign_float;
+    status_.meas_ind_old_d_A = status_.d_A;
+
+    ISR_DoVoltageDQPwm(sin_cos, d_V, 0.0f);
+  }
+
+  void ISR_DoBrake() MOTEUS_CCM_ATTRIBUTE {
+    ISR_SetPwmRegisters(0, 0, 0);
+
+    motor_driver_->Power(true);
+  }
+
+  template <uint32_t kFeatures>
+  float ISR_TorqueToCurrent(float torque) const MOTEUS_CCM_ATTRIBUTE {
+    if ((kFeatures & kFeatureTorqueTable) && torque_table_.active()) {
+      return torque_table_.torque_to_current(torque);
+    }
+    return torque_model_.torque_to_current(torque);
+  }
+
+  float LimitPwm(float in) MOTEUS_CCM_ATTRIBUTE {
+    // We can't go full duty cycle or we wouldn't have time to sample
+    // the current.
+    return Limit(in, rate_config_.min_pwm, rate_config_.max_pwm);
+  }
+
+  MotorDriver* const motor_driver_;
+  MotorPosition* const motor_position_;
+
+  Motor& motor_ = *motor_position_->motor();
+  const MotorPosition::Status& position_ = motor_position_->status();
+  Config config_;
+  PositionConfig position_config_;
+  uint8_t motor_position_epoch_ = 0;
+
+  Registers registers_;
+  uint32_t pwm_counts_ = 0;
+  IsrProfiler profiler_;
+
+  RateConfig rate_config_;
+
+  CommandData data_buffers_[2] = {};
+
+  // CommandData has its data updated to the ISR by first writing the
+  // new command into (*next_data_) and then swapping it with
+  // current_data_.
+  CommandData* volatile current_data_{&data_buffers_[0]};
+  CommandData* volatile next_data_{&data_buffers_[1]};
+
+  // This copy of CommandData exists solely for telemetry, and should
+  // never be read by an ISR.
+  CommandData telemetry_data_;
+
+  // These values should only be modified from within the ISR.
+  Status status_;
+  Control control_;
+  uint32_t calibrate_adc1_ = 0;
+  uint32_t calibrate_adc2_ = 0;
+  uint32_t calibrate_adc3_ = 0;
+  uint16_t calibrate_count_ = 0;
+
+  SimplePI pid_d_{&config_.pid_dq, &status_.pid_d};
+  SimplePI pid_q_{&config_.pid_dq, &status_.pid_q};
+  PID pid_position_{&config_.pid_position, &status_.pid_position};
+
+  float torque_constant_ = 0.01f;
+  TorqueModel torque_model_{torque_constant_,
+                            motor_.rotation_current_cutoff_A,
+                            motor_.rotation_current_scale,
+                            motor_.rotation_torque_scale};
+  TorqueTable torque_table_;
+
+  const ModeHandlers* mode_handlers_ = GetModeHandlers<kAllFeatures>();
+
+  // The output of the most recent position loop update, which is
+  // held for the following position_hold_count_ control cycles.
+  struct PositionHold {
+    float torque_Nm = 0.0f;
+    float q_comp_A = 0.0f;
+    float d_A = 0.0f;
+    float q_A = 0.0f;
+    float velocity_rotor = 0.0f;
+  };
+  PositionHold position_hold_;
+  uint8_t position_hold_count_ = 0;
+
+  WaypointQueue waypoints_;
+  WaypointSegment waypoint_segment_;
+  PositionInterpolation interpolation_;
+  TrajectoryPlan trajectory_plan_;
+
+  // Command numbers each command it receives.  This cannot be done
+  // by which of the two buffers is current, as two commands may
+  // arrive between position updates.
+  uint32_t command_sequence_ = 0;
+  uint32_t last_command_sequence_ = 0;
+  uint8_t motor_config_epoch_ = 0;
+
+  float adc_scale_ = 0.0f;
+  PwmCompensation pwm_compensation_;
+  float adjusted_max_power_W_ = 0.0f;
+
+  const float vsense_adc_scale_;
+
+  Cordic cordic_;
+};
+
+}
@@ -22,9 +22,52 @@ This header file defines the BldcServoPosition class, which appears to focus on
 #include "fw/ccm.h"
 #include "fw/measured_hw_rev.h"
 #include "fw/motor_position.h"
+#include "fw/waypoint_queue.h"
 
 namespace moteus {
 
+// The state used to interpolate between position mode commands.
+struct PositionInterpolation {
+  WaypointSegment segment;
+
+  // The number of control cycles since the last command, saturating
+  // at BldcServoPosition::kMaxInterpolationCycles.
+  uint32_t cycles = 1u << 24;
+};
+
+// A constant acceleration move toward a position mode command, which
+// is planned once and then evaluated from the elapsed time.
+struct TrajectoryPlan {
+  bool active = false;
+
+  // The velocity of the target.
+  float vf = 0.0f;
+
+  // The velocity is v0 + a1 * t until t1, vc until t2, then
+  // vc + a3 * (t - t2) until the target is reached at t3.
+  float v0 = 0.0f;
+  float a1 = 0.0f;
+  float vc = 0.0f;
+  float a3 = 0.0f;
+  float t1 = 0.0f;
+  float t2 = 0.0f;
+  float t3 = 0.0f;
+
+  uint32_t cycles = 0;
+
+  // The number of cycles since the command was received, which
+  // unlike cycles is kept when we plan again.
+  uint32_t command_cycles = 0;
+
+  // The part of a count which AdvanceControlPosition has truncated
+  // and we have yet to add back.
+  float residual = 0.0f;
+
+  // Where the control position will be after this cycle if nothing
+  // else moves it.  If something does, we plan again.
+  int64_t next_raw = 0;
+};
+
 // We put these functions into a class merely so that we can leave
 // them in the header and also have a section definition.
 class BldcServoPosition {
@@ -192,27 +235,404 @@ class BldcServoPosition {
     }
   }
 
-  static void UpdateTrajectory(
+  // Plan a move from the current control state to the target of
+  // @p data, which is itself moving at @p velocity.  The move takes
+  // @p duration_s if that is possible, otherwise it is as fast as
+  // possible.
+  static void PlanTrajectory(
+      TrajectoryPlan* plan,
+      const BldcServoStatus* status,
+      const BldcServoCommandData* data,
+      float rate_hz,
+      float velocity,
+      float duration_s) MOTEUS_CCM_ATTRIBUTE {
+    const float a = data->accel_limit;
+    const float v_limit =
+        std::isfinite(data->velocity_limit) ?
+        data->velocity_limit : std::numeric_limits<float>::infinity();
+
+    const float v0 = *status->control_velocity;
+    // The target moves in truncated steps, so this is how fast it
+    // actually goes.
+    const float vf =
+        static_cast<float>(static_cast<int32_t>(
+            static_cast<float>(1ll << 32) * (velocity / rate_hz))) *
+        (rate_hz / static_cast<float>(1ll << 32));
+    const float dx = FineIntToFloat(
+        *data->position_relative_raw - *status->control_position_raw);
+
+    // Work in the frame of the target, mirrored so that we first
+    // accelerate in the positive direction, i.e. either we are short
+    // of the target or moving away from it.
+    const float u = v0 - vf;
+    const float s = (u * std::abs(u) <= 2.0f * a * dx) ? 1.0f : -1.0f;
+    const float u0 = s * u;
+    const float x = s * dx;
+
+    // The peak velocity with no cruise phase, limited by the
+    // absolute velocity limit.
+    float uc = std::min(std::sqrt(std::max(0.0f, a * x + 0.5f * u0 * u0)),
+                        v_limit - s * vf);
+
+    float accel_s = std::abs(uc - u0) / a;
+    float decel_s = uc / a;
+    const float accel_distance = 0.5f * (u0 + uc) * accel_s;
+    const float decel_distance = 0.5f * uc * decel_s;
+    const float cruise_distance = x - accel_distance - decel_distance;
+    // If the target is moving away at the velocity limit, we will
+    // never catch it, and cruise forever.
+    float cruise_s =
+        uc > 0.0f ? std::max(0.0f, cruise_distance / uc) :
+        cruise_distance > 0.0f ? std::numeric_limits<float>::infinity() :
+        0.0f;
+
+    if (duration_s > accel_s + cruise_s + decel_s) {
+      // We have time to spare, so cruise at the lowest velocity
+      // which still arrives on time.
+      if (x >= u0 * duration_s - 0.5f * u0 * u0 / a) {
+        // We accelerate up to it, which leaves a quadratic for uc.
+        // Of its two roots, we want the smaller.
+        const float b = a * duration_s + u0;
+        const float c = a * x + 0.5f * u0 * u0;
+        uc = 2.0f * c / (b + std::sqrt(std::max(0.0f, b * b - 4.0f * c)));
+      } else {
+        // We decelerate down to it.
+        uc = (x - 0.5f * u0 * u0 / a) / (duration_s - u0 / a);
+      }
+      accel_s = std::abs(uc - u0) / a;
+      decel_s = uc / a;
+      cruise_s = std::max(0.0f, duration_s - accel_s - decel_s);
+    }
+
+    plan->active = true;
+    plan->vf = vf;
+    plan->v0 = v0;
+    plan->a1 = uc >= u0 ? s * a : -s * a;
+    plan->vc = vf + s * uc;
+    plan->a3 = -s * a;
+    plan->t1 = accel_s;
+    plan->t2 = accel_s + cruise_s;
+    plan->t3 = accel_s + cruise_s + decel_s;
+    plan->cycles = 0;
+  }
+
+  static float PlanVelocity(
+      const TrajectoryPlan* plan, float t) MOTEUS_CCM_ATTRIBUTE {
+    if (t < plan->t1) { return plan->v0 + plan->a1 * t; }
+    if (t < plan->t2) { return plan->vc; }
+    return plan->vc + plan->a3 * (t - plan->t2);
+  }
+
+  // The same as DoVelocityAndAccelLimits, but the move is planned
+  // once, then followed from the elapsed time rather than being
+  // re-decided every cycle.  This reaches the target exactly, and
+  // costs less per cycle.  It also allows the move to be stretched
+  // to BldcServoCommandData::move_duration_s.
+  static void DoPlannedVelocityAndAccelLimits(
+      BldcServoStatus* status,
+      const BldcServoConfig* config,
+      float rate_hz,
+      BldcServoCommandData* data,
+      float velocity,
+      TrajectoryPlan* plan) MOTEUS_CCM_ATTRIBUTE {
+    if (!(data->accel_limit > 0.0f)) {
+      DoVelocityAndAccelLimits(status, config, rate_hz, data, velocity);
+      return;
+    }
+
+    const float period_s = 1.0f / rate_hz;
+
+    if (!plan->active) { plan->command_cycles = 0; }
+    if (!plan->active ||
+        plan->next_raw != *status->control_position_raw) {
+      PlanTrajectory(
+          plan, status, data, rate_hz, velocity,
+          data->move_duration_s -
+          static_cast<float>(plan->command_cycles) * period_s);
+    }
+
+    const float t0 = static_cast<float>(plan->cycles) * period_s;
+    const float t1 = t0 + period_s;
+
+    if (t1 >= plan->t3) {
+      // Land exactly on the target, then carry on with it.
+      status->control_velocity =
+          velocity +
+          FineIntToFloat(*data->position_relative_raw -
+                         *status->control_position_raw) * rate_hz;
+      data->position = std::numeric_limits<float>::quiet_NaN();
+      data->position_relative_raw.reset();
+      status->trajectory_done = true;
+      plan->active = false;
+      plan->residual = 0.0f;
+      return;
+    }
+
+    // The velocity is linear within each phase, so this is exact
+    // except in the cycles which span two.
+    float step_velocity =
+        0.5f * (PlanVelocity(plan, t0) + PlanVelocity(plan, t1));
+    plan->cycles++;
+    plan->command_cycles++;
+
+    if (t0 >= plan->t2) {
+      // Any error which has built up from the precision of a float
+      // is made up over the deceleration so that we arrive exactly.
+      const float u = PlanVelocity(plan, t0) - plan->vf;
+      const float error =
+          FineIntToFloat(*data->position_relative_raw -
+                         *status->control_position_raw) -
+          plan->residual / static_cast<float>(1ll << 32) -
+          u * std::abs(u) / (2.0f * data->accel_limit);
+      step_velocity += error / (plan->t3 - t0);
+    }
+
+    // This must match the step AdvanceControlPosition applies.  What
+    // it truncates is added back to the position a count at a time,
+    // so that it neither builds up nor disturbs the velocity.
+    const float fine_step =
+        static_cast<float>(1ll << 32) * (step_velocity / rate_hz);
+    const int32_t step = static_cast<int32_t>(fine_step);
+    plan->residual += fine_step - static_cast<float>(step);
+    const int32_t carry = static_cast<int32_t>(plan->residual);
+    if (carry != 0) {
+      plan->residual -= static_cast<float>(carry);
+      status->control_position_raw =
+          *status->control_position_raw +
+          (static_cast<int64_t>(carry) << 16);
+    }
+    plan->next_raw = *status->control_position_raw +
+        (static_cast<int64_t>(step) << 16);
+    status->control_velocity = step_velocity;
+  }
+
+  // The same as MotorPosition::IntToFloat, but keeping the fraction
+  // below 16 bits, as the final cycles of a jerk limited profile
+  // move much less than that.
+  static float FineIntToFloat(int64_t value) MOTEUS_CCM_ATTRIBUTE {
+    return MotorPosition::IntToFloat(value) +
+        static_cast<float>(static_cast<int32_t>((value >> 16) & 0xffff)) *
+        (1.0f / 4294967296.0f);
+  }
+
+  // Return how far we travel in the direction of positive velocity,
+  // starting with velocity @p u and acceleration @p b, when stopping
+  // as quickly as possible with acceleration limit @p a and jerk
+  // limit @p j.
+  static float StopDistance(
+      float u, float b, float a, float j) MOTEUS_CCM_ATTRIBUTE {
+    // The velocity we would reach if we ramped the acceleration to 0
+    // right now.
+    const float w = u + b * std::abs(b) / (2.0f * j);
+
+    if (w <= 0.0f) {
+      if (u <= 0.0f) { return 0.0f; }
+      // We are already decelerating at least enough.  Find when the
+      // velocity reaches 0 while ramping the acceleration to 0.
+      const float t = (-b - std::sqrt(std::max(0.0f, b * b - 2.0f * j * u))) / j;
+      return t * (u + t * (0.5f * b + t * j * (1.0f / 6.0f)));
+    }
+
+    // Ramp down to a peak deceleration, hold it if it is limited,
+    // then ramp back to 0.
+    float peak = std::sqrt(j * u + 0.5f * b * b);
+    float t2 = 0.0f;
+    if (peak > a) {
+      peak = a;
+      t2 = (u + 0.5f * b * b / j - a * a / j) / a;
+    }
+
+    const float t1 = (b + peak) / j;
+    const float x1 = t1 * (u + t1 * (0.5f * b - t1 * j * (1.0f / 6.0f)));
+    const float u1 = u + t1 * (b - 0.5f * j * t1);
+    const float x2 = t2 * (u1 - 0.5f * peak * t2);
+    const float u2 = u1 - peak * t2;
+    const float t3 = peak / j;
+    const float x3 = t3 * (u2 + t3 * (-0.5f * peak + t3 * j * (1.0f / 6.0f)));
+
+    return x1 + x2 + x3;
+  }
+
+  // Advance the control velocity and acceleration when a jerk limit
+  // is present, with or without a target position.  Each cycle the
+  // acceleration changes by at most the jerk limit, and we pick the
+  // change that moves most quickly toward the target while still
+  // allowing us to stop there without violating any limit.
+  static void DoJerkLimits(
       BldcServoStatus* status,
       const BldcServoConfig* config,
       float rate_hz,
       BldcServoCommandData* data,
       float velocity) MOTEUS_CCM_ATTRIBUTE {
+    const float period_s = 1.0f / rate_hz;
+    const float j = data->jerk_limit;
+    const float a_limit =
+        std::isnan(data->accel_limit) ?
+        std::numeric_limits<float>::infinity() : data->accel_limit;
+    const float v_limit =
+        std::isnan(data->velocity_limit) ?
+        std::numeric_limits<float>::infinity() : data->velocity_limit;
+    const float da = j * period_s;
+
+    const float v0 = *status->control_velocity;
+    const float a0 = status->control_acceleration;
+    const float vf = velocity;
+
+    const bool have_position = !!data->position_relative_raw;
+    const float dx =
+        have_position ?
+        FineIntToFloat(
+            *data->position_relative_raw - *status->control_position_raw) :
+        0.0f;
+
+    // The direction we need to accelerate to approach the target.
+    const float s = [&]() {
+      if (have_position && dx != 0.0f) { return dx > 0.0f ? 1.0f : -1.0f; }
+      return (vf - v0 - a0 * std::abs(a0) / (2.0f * j)) >= 0.0f ?
+          1.0f : -1.0f;
+    }();
+
+    const auto limit_accel = [&](float a) MOTEUS_CCM_ATTRIBUTE {
+      return std::max(-a_limit, std::min(a_limit, a));
+    };
+
+    const auto next_velocity = [&](float a) MOTEUS_CCM_ATTRIBUTE {
+      return v0 + 0.5f * (a0 + a) * period_s;
+    };
+
+    // Return how much room we would have left to reach the target
+    // after accelerating at @p a this cycle, or NaN if that would
+    // exceed the velocity limit.
+    const auto margin = [&](float a) MOTEUS_CCM_ATTRIBUTE {
+      const float next_v = next_velocity(a);
+      // The velocity we would peak at if we began ramping the
+      // acceleration to 0 after this cycle.
+      const float peak_v = next_v + a * std::abs(a) / (2.0f * j);
+      if (std::abs(peak_v) > v_limit) {
+        return std::numeric_limits<float>::quiet_NaN();
+      }
+
+      if (!have_position) { return s * (vf - peak_v); }
+
+      const float moved =
+          period_s * (v0 + period_s * (2.0f * a0 + a) * (1.0f / 6.0f));
+      const float remaining = s * (dx - moved + vf * period_s);
+      return remaining -
+          StopDistance(s * (next_v - vf), s * a, a_limit, j);
+    };
+
+    // Try each choice from most to least aggressive.  When one is
+    // safe and the previous was not, we interpolate between them so
+    // as to land on the stopping curve rather than chatter about it.
+    const float candidates[] = {
+      limit_accel(a0 + s * da),
+      limit_accel(a0),
+      limit_accel(a0 - s * da),
+    };
+    float a1 = std::numeric_limits<float>::quiet_NaN();
+    float last_margin = std::numeric_limits<float>::quiet_NaN();
+    for (int i = 0; i < 3; i++) {
+      const float this_margin = margin(candidates[i]);
+      if (this_margin >= 0.0f) {
+        a1 = candidates[i];
+        if (last_margin < 0.0f) {
+          a1 += (candidates[i - 1] - a1) *
+              this_margin / (this_margin - last_margin);
+        }
+        break;
+      }
+      last_margin = this_margin;
+    }
+
+    if (std::isnan(a1)) {
+      // Nothing is safe, so reduce our speed if we are over the
+      // limit, otherwise brake toward the target as hard as possible.
+      const float brake =
+          (std::abs(v0) > v_limit) ? (v0 > 0.0f ? -1.0f : 1.0f) : -s;
+      a1 = limit_accel(a0 + brake * da);
+    }
+    // The velocity changes by only a few parts in a thousand of its
+    // value each cycle, so we carry the rounding error forward.
+    // Otherwise braking would fall measurably short of the limit.
+    const float dv =
+        0.5f * (a0 + a1) * period_s - status->control_velocity_residual;
+    const float v1 = v0 + dv;
+    status->control_velocity_residual = (v1 - v0) - dv;
+
+    status->control_velocity = v1;
+    status->control_acceleration = a1;
+
+    // We are done once what remains is too small to matter: less
+    // than a cycle of jerk, a velocity that barely advances
+    // control_position_raw, and a fraction of the resolution of a
+    // position command.
+    const float min_velocity = 2.0f * rate_hz / 4294967296.0f;
+    const bool velocity_near =
+        std::abs(v1 - vf) <= std::max(da * period_s, min_velocity) &&
+        std::abs(a1) <= da;
+    const bool position_near =
+        !have_position || std::abs(dx) <= (1.0f / 262144.0f);
+    if (velocity_near && position_near) {
+      data->position = std::numeric_limits<float>::quiet_NaN();
+      data->position_relative_raw.reset();
+      status->control_velocity = vf;
+      status->control_acceleration = 0.0f;
+      status->trajectory_done = true;
+    }
+  }
+
+  // If @p plan is nullptr, moves under an acceleration limit are
+  // re-decided each cycle by DoVelocityAndAccelLimits.  That is
+  // retained as a reference for the planned version.
+  static void UpdateTrajectory(
+      BldcServoStatus* status,
+      const BldcServoConfig* config,
+      float rate_hz,
+      BldcServoCommandData* data,
+      float velocity,
+      TrajectoryPlan* plan = nullptr) MOTEUS_CCM_ATTRIBUTE {
     // Clamp the desired velocity to our limit if we have one.
     if (!std::isnan(data->velocity_limit)) {
       if (velocity > data->velocity_limit) { velocity = data->velocity_limit; }
       if (velocity < -data->velocity_limit) { velocity = -data->velocity_limit; }
     }
 
+    if (std::isfinite(data->jerk_limit)) {
+      DoJerkLimits(status, config, rate_hz, data, velocity);
+      return;
+    }
+
+    // Only the jerk limited profile tracks acceleration.
+    status->control_acceleration = 0.0f;
+
     if (!data->position_relative_raw) {
       DoVelocityModeLimits(
           status, config, rate_hz, data, velocity);
-    } else {
+    } else if (plan == nullptr) {
       DoVelocityAndAccelLimits(
           status, config, rate_hz, data, velocity);
+    } else {
+      DoPlannedVelocityAndAccelLimits(
+          status, config, rate_hz, data, velocity, plan);
     }
   }
 
+  // Start the control position from the measured position.
+  static void CaptureControlPosition(
+      BldcServoStatus* status,
+      const BldcServoConfig* config,
+      const MotorPosition::Status* position) MOTEUS_CCM_ATTRIBUTE {
+    status->control_position_raw = position->position_relative_raw;
+
+    if (std::abs(status->velocity_filt) <
+        config->velocity_zero_capture_threshold) {
+      status->control_velocity = 0.0f;
+    } else {
+      status->control_velocity = status->velocity_filt;
+    }
+    status->control_acceleration = 0.0f;
+  }
+
   static float UpdateCommand(
       BldcServoStatus* status,
       const BldcServoConfig* config,
@@ -221,7 +641,8 @@ class BldcServoPosition {
       int64_t absolute_relative_delta,
       float rate_hz,
       BldcServoCommandData* data,
-      float velocity) MOTEUS_CCM_ATTRIBUTE {
+      float velocity,
+      TrajectoryPlan* plan = nullptr) MOTEUS_CCM_ATTRIBUTE {
 
     if (std::isnan(velocity)) {
       velocity = 0.0f;
@@ -232,18 +653,21 @@ class BldcServoPosition {
     // an int64, which calls out to a system library that is pretty
     // slow.
 
-    if (std::isnan(data->velocity_limit) &&
-        std::isnan(data->accel_limit)) {
+    const bool no_limits =
+        std::isnan(data->velocity_limit) &&
+        std::isnan(data->accel_limit) &&
+        std::isnan(data->jerk_limit);
+
+    if (no_limits) {
       status->trajectory_done = true;
       status->control_velocity = velocity;
+      status->control_acceleration = 0.0f;
     } else if (!!data->position_relative_raw ||
                !std::isnan(velocity)) {
       status->trajectory_done = false;
     }
 
-    if (!!data->position_relative_raw &&
-        std::isnan(data->velocity_limit) &&
-        std::isnan(data->accel_limit)) {
+    if (!!data->position_relative_raw && no_limits) {
       // With no limits, we immediately set the control position and
       // velocity.
       status->control_position_raw = *data->position_relative_raw;
@@ -251,20 +675,38 @@ class BldcServoPosition {
       data->position_relative_raw.reset();
       status->control_velocity = velocity;
     } else if (!status->control_position_raw) {
-      status->control_position_raw = position->position_relative_raw;
-
-      if (std::abs(status->velocity_filt) <
-          config->velocity_zero_capture_threshold) {
-        status->control_velocity = 0.0f;
-      } else {
-        status->control_velocity = status->velocity_filt;
-      }
+      CaptureControlPosition(status, config, position);
     }
 
     if (!status->trajectory_done) {
-      UpdateTrajectory(status, config, rate_hz, data, velocity);
+      UpdateTrajectory(status, config, rate_hz, data, velocity, plan);
     }
 
+    if (data->position_relative_raw && !std::isnan(velocity)) {
+      const float tstep = velocity / rate_hz;
+      const int64_t tint64_step =
+        (static_cast<int64_t>(
+            static_cast<int32_t>((static_cast<float>(1ll << 32) * tstep))) <<
+         16);
+      data->position_relative_raw = *data->position_relative_raw + tint64_step;
+    }
+
+    return AdvanceControlPosition(
+        status, config, position_config, position, absolute_relative_delta,
+        rate_hz, data);
+  }
+
+  // Integrate control_velocity into control_position_raw, then apply
+  // the slip, position, and stop position limits.  Return the
+  // resulting velocity command.
+  static float AdvanceControlPosition(
+      BldcServoStatus* status,
+      const BldcServoConfig* config,
+      const BldcServoPositionConfig* position_config,
+      const MotorPosition::Status* position,
+      int64_t absolute_relative_delta,
+      float rate_hz,
+      BldcServoCommandData* data) MOTEUS_CCM_ATTRIBUTE {
     auto velocity_command = *status->control_velocity;
 
     // This limits our usable velocity to 20kHz modulo the position
@@ -277,15 +719,6 @@ class BldcServoPosition {
          16);
     status->control_position_raw = *status->control_position_raw + int64_step;
 
-    if (data->position_relative_raw && !std::isnan(velocity)) {
-      const float tstep = velocity / rate_hz;
-      const int64_t tint64_step =
-        (static_cast<int64_t>(
-            static_cast<int32_t>((static_cast<float>(1ll << 32) * tstep))) <<
-         16);
-      data->position_relative_raw = *data->position_relative_raw + tint64_step;
-    }
-
     if (std::isfinite(config->max_position_slip)) {
       const int64_t current_position = position->position_relative_raw;
       const int64_t slip =
@@ -331,6 +764,7 @@ class BldcServoPosition {
         // there and zero out our velocity command.
         status->control_position_raw = stop_position_raw;
         status->control_velocity = 0.0f;
+        status->control_acceleration = 0.0f;
         status->trajectory_done = true;
         data->position = std::numeric_limits<float>::quiet_NaN();
         data->position_relative_raw.reset();
@@ -343,6 +777,7 @@ class BldcServoPosition {
       // We have hit a limit.  Assume a velocity of 0.
       velocity_command = 0.0f;
       status->control_velocity = 0.0f;
+      status->control_acceleration = 0.0f;
     }
 
     status->control_position =
@@ -353,6 +788,265 @@ class BldcServoPosition {
 
     return velocity_command;
   }
+
+  static void StartWaypointSegment(
+      WaypointSegment* segment,
+      int64_t start_raw,
+      float start_velocity,
+      float start_feedforward_Nm,
+      const Waypoint& end,
+      float feedforward_Nm) MOTEUS_CCM_ATTRIBUTE {
+    segment->active = true;
+    segment->start_raw = start_raw;
+    segment->start_velocity = start_velocity;
+    segment->start_feedforward_Nm = start_feedforward_Nm;
+    segment->end = end;
+    segment->end_feedforward_Nm =
+        std::isnan(end.feedforward_Nm) ? feedforward_Nm : end.feedforward_Nm;
+    segment->start_s = 0.0f;
+    segment->cycles = 0;
+    segment->residual = 0.0f;
+
+    // The cubic Hermite polynomial which matches the position and
+    // velocity at each end.
+    const float duration_s = end.duration_s;
+    if (duration_s > 0.0f) {
+      const float slope =
+          FineIntToFloat(end.position_relative_raw - start_raw) / duration_s;
+      segment->c2 =
+          (3.0f * slope - 2.0f * start_velocity - end.velocity) / duration_s;
+      segment->c3 =
+          (start_velocity + end.velocity - 2.0f * slope) /
+          (duration_s * duration_s);
+    } else {
+      segment->c2 = 0.0f;
+      segment->c3 = 0.0f;
+    }
+  }
+
+  // Set the control velocity so that AdvanceControlPosition moves
+  // along @p segment from time @p t0 to @p t0 + @p dt.  If
+  // @p restart, the control position is first brought to the start
+  // of the segment.
+  static void StepWaypointSegment(
+      BldcServoStatus* status,
+      WaypointSegment* segment,
+      float rate_hz,
+      float t0,
+      float dt,
+      bool restart) MOTEUS_CCM_ATTRIBUTE {
+    // Evaluating the polynomial at each end of the cycle and
+    // differencing would lose most of the precision of a float, so
+    // instead we step forward from the start of the cycle.
+    const float c2 = segment->c2;
+    const float c3 = segment->c3;
+    const float v = segment->start_velocity + t0 * (2.0f * c2 + 3.0f * c3 * t0);
+    const float a = 2.0f * c2 + 6.0f * c3 * t0;
+    float step = dt * (v + dt * (0.5f * a + dt * c3));
+    if (restart) {
+      step += FineIntToFloat(
+          segment->start_raw - *status->control_position_raw);
+      segment->start_s = dt;
+      segment->cycles = 0;
+    } else {
+      step += segment->residual;
+      segment->cycles++;
+    }
+
+    // AdvanceControlPosition rounds each step, always in the same
+    // direction, which over a long segment would add up to a
+    // noticeable lag.  So we work out exactly what it will apply, and
+    // carry the remainder forward.
+    const float velocity = step * rate_hz;
+    constexpr float kStepScale = static_cast<float>(1ll << 32);
+    segment->residual =
+        step - static_cast<float>(
+            static_cast<int32_t>(kStepScale * (velocity / rate_hz))) /
+        kStepScale;
+    status->control_velocity = velocity;
+  }
+
+  // Advance the control velocity along the queued waypoints, if there
+  // are any.  Return false if there are not, in which case the
+  // position mode command applies as usual.  Otherwise, the caller
+  // should use AdvanceControlPosition rather than UpdateCommand, and
+  // @p feedforward_Nm is updated to the one for this cycle.
+  static bool UpdateWaypoint(
+      BldcServoStatus* status,
+      const BldcServoConfig* config,
+      const MotorPosition::Status* position,
+      float rate_hz,
+      BldcServoCommandData* data,
+      WaypointQueue* queue,
+      WaypointSegment* segment,
+      float* feedforward_Nm) MOTEUS_CCM_ATTRIBUTE {
+    if (!segment->active) {
+      const Waypoint* next = queue->ISR_Front();
+      if (next == nullptr) { return false; }
+
+      if (!status->control_position_raw) {
+        CaptureControlPosition(status, config, position);
+      }
+      StartWaypointSegment(
+          segment, *status->control_position_raw,
+          status->control_velocity.value_or(0.0f),
+          *feedforward_Nm, *next, *feedforward_Nm);
+      queue->ISR_Pop();
+    }
+
+    status->trajectory_done = false;
+    status->control_acceleration = 0.0f;
+
+    const float period_s = 1.0f / rate_hz;
+    float t0 = segment->start_s +
+        static_cast<float>(segment->cycles) * period_s;
+    float dt = period_s;
+    bool crossed = false;
+
+    // The slack allows for rounding in the period, so that a
+    // waypoint a whole number of cycles away is reached on time.
+    while (t0 + dt + 0.01f * period_s >= segment->end.duration_s) {
+      // We reach the end of this segment during this cycle, so we
+      // start the next from exactly its waypoint with whatever time
+      // remains.
+      dt = std::max(0.0f, t0 + dt - segment->end.duration_s);
+      t0 = 0.0f;
+      crossed = true;
+
+      const Waypoint* next = queue->ISR_Front();
+      if (next == nullptr) {
+        segment->active = false;
+        return FinishWaypoints(status, config, data, segment, rate_hz, dt,
+                               feedforward_Nm);
+      }
+
+      StartWaypointSegment(
+          segment, segment->end.position_relative_raw,
+          segment->end.velocity, segment->end_feedforward_Nm,
+          *next, *feedforward_Nm);
+      queue->ISR_Pop();
+    }
+
+    StepWaypointSegment(status, segment, rate_hz, t0, dt, crossed);
+
+    const float fraction = (t0 + dt) / segment->end.duration_s;
+    *feedforward_Nm =
+        segment->start_feedforward_Nm +
+        (segment->end_feedforward_Nm - segment->start_feedforward_Nm) *
+        fraction;
+
+    return true;
+  }
+
+  // The final waypoint is reached during this cycle with @p dt
+  // remaining, and no more are queued.
+  static bool FinishWaypoints(
+      BldcServoStatus* status,
+      const BldcServoConfig* config,
+      BldcServoCommandData* data,
+      const WaypointSegment* segment,
+      float rate_hz,
+      float dt,
+      float* feedforward_Nm) MOTEUS_CCM_ATTRIBUTE {
+    const Waypoint& end = segment->end;
+    float step =
+        FineIntToFloat(end.position_relative_raw -
+                       *status->control_position_raw);
+
+    // Leave the position mode command in a state to carry on from
+    // here.
+    data->feedforward_Nm = segment->end_feedforward_Nm;
+    if (config->waypoint_underrun_mode == 1) {
+      data->position = std::numeric_limits<float>::quiet_NaN();
+      data->position_relative_raw.reset();
+      data->velocity = end.velocity;
+      step += end.velocity * dt;
+    } else {
+      data->position_relative_raw = end.position_relative_raw;
+      data->velocity = 0.0f;
+      if (config->waypoint_underrun_mode == 2) {
+        status->mode = kFault;
+        status->fault = errc::kWaypointUnderrun;
+      }
+    }
+
+    status->control_velocity = step * rate_hz;
+    *feedforward_Nm = segment->end_feedforward_Nm;
+    return true;
+  }
+
+  // Interpolate between consecutive position mode commands when
+  // servo.interpolation_max_period_s is set.  @p new_command should
+  // be true on the first cycle of each command.  Return true if the
+  // control velocity has been set, in which case the caller should
+  // use AdvanceControlPosition rather than UpdateCommand.
+  static bool UpdateInterpolation(
+      BldcServoStatus* status,
+      const BldcServoConfig* config,
+      const MotorPosition::Status* position,
+      float rate_hz,
+      BldcServoCommandData* data,
+      bool new_command,
+      PositionInterpolation* interpolation) MOTEUS_CCM_ATTRIBUTE {
+    const float period_s = 1.0f / rate_hz;
+    WaypointSegment* const segment = &interpolation->segment;
+
+    if (new_command) {
+      const float since_s =
+          static_cast<float>(interpolation->cycles) * period_s;
+      interpolation->cycles = 0;
+
+      const bool interpolate =
+          since_s <= config->interpolation_max_period_s &&
+          !!data->position_relative_raw &&
+          !data->stop_position_relative_raw;
+      if (!interpolate) {
+        segment->active = false;
+      } else {
+        if (!status->control_position_raw) {
+          CaptureControlPosition(status, config, position);
+        }
+
+        // Start from wherever we are now, which is normally the
+        // previous command, but need not be if it arrived early.
+        Waypoint end;
+        end.position_relative_raw = *data->position_relative_raw;
+        end.velocity = std::isnan(data->velocity) ? 0.0f : data->velocity;
+        end.duration_s = since_s;
+        StartWaypointSegment(
+            segment, *status->control_position_raw,
+            status->control_velocity.value_or(0.0f), 0.0f, end, 0.0f);
+      }
+    }
+
+    if (interpolation->cycles < kMaxInterpolationCycles) {
+      interpolation->cycles++;
+    }
+
+    if (!segment->active) { return false; }
+
+    status->trajectory_done = false;
+    status->control_acceleration = 0.0f;
+
+    const float t0 = segment->start_s +
+        static_cast<float>(segment->cycles) * period_s;
+    if (t0 + 1.01f * period_s >= segment->end.duration_s) {
+      // This is the last cycle of the segment, so we land exactly on
+      // the command and let UpdateCommand carry on from there.
+      segment->active = false;
+      status->control_velocity =
+          FineIntToFloat(segment->end.position_relative_raw -
+                         *status->control_position_raw) * rate_hz;
+      return true;
+    }
+
+    StepWaypointSegment(status, segment, rate_hz, t0, period_s, false);
+    return true;
+  }
+
+  // Beyond this, the time since the previous command is only used to
+  // know that it was too long ago to interpolate from.
+  static constexpr uint32_t kMaxInterpolationCycles = 1u << 24;
 };
 
 }
@@ -0,0 +1,258 @@
+// Copyright 2023 mjbots Robotic Systems, LLC.  info@mjbots.com
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <functional>
+#include <limits>
+
+#include "mjlib/micro/persistent_config.h"
+#include "mjlib/micro/telemetry_manager.h"
+
+#include "fw/aux_common.h"
+#include "fw/bldc_servo_core.h"
+#include "fw/motor_driver.h"
+#include "fw/motor_position.h"
+#include "fw/pmsm_plant.h"
+
+namespace moteus {
+
+/// Runs BldcServoCore against a PmsmPlant on the host.  This stands
+/// in for BldcServo::Impl, the motor driver, and the onboard
+/// encoder, with the same phase and ADC channel mapping that the
+/// hardware uses.
+class BldcServoSim : public MotorDriver {
+ public:
+  struct Options {
+    PmsmPlant::Options plant;
+
+    float bus_V = 24.0f;
+    int pwm_rate_hz = 40000;
+
+    // The frequency of the clock feeding the PWM timer.
+    uint32_t timer_clock_hz = 170000000;
+
+    // Matches the hv >= 6 boards.
+    float vsense_adc_scale = 0.017947f;
+
+    // ~24C on the onboard thermistor.
+    uint16_t adc_fet_temp_raw = 700;
+
+    uint32_t encoder_cpr = 16384;
+
+    // The current PI gains are selected to give this closed loop
+    // bandwidth.
+    float current_bandwidth_hz = 1000.0f;
+
+    Options() {}
+  };
+
+  BldcServoSim(mjlib::micro::PersistentConfig* persistent_config,
+               mjlib::micro::TelemetryManager* telemetry_manager,
+               const Options& options = Options())
+      : options_(options),
+        plant_(options.plant),
+        motor_position_(persistent_config, telemetry_manager,
+                        &aux1_status_, &aux2_status_,
+                        &aux1_config_, &aux2_config_),
+        core_(this, &motor_position_, options.vsense_adc_scale) {
+    persistent_config->Register("servo", core_.mutable_config(),
+                                std::bind(&BldcServoSim::UpdateConfig, this));
+    persistent_config->Register("servopos", core_.mutable_position_config(),
+                                std::bind(&BldcServoSim::UpdateConfig, this));
+    telemetry_manager->Register("servo_stats", core_.mutable_status());
+    telemetry_manager->Register("servo_cmd", core_.telemetry_data());
+    telemetry_manager->Register("servo_control", core_.mutable_control());
+    telemetry_manager->Register("servo_profile", core_.mutable_profile());
+
+    BldcServoCore::Registers registers;
+    registers.pwm1_ccr = &ccr_[0];
+    registers.pwm2_ccr = &ccr_[1];
+    registers.pwm3_ccr = &ccr_[2];
+    registers.cycle_count = &cycle_count_;
+    core_.SetRegisters(registers);
+
+    // Describe the plant to the controller, as a calibration would.
+    auto& motor = *motor_position_.motor();
+    const auto& plant = options.plant;
+    motor.poles = plant.pole_pairs * 2;
+    motor.resistance_ohm = plant.resistance_ohm;
+    motor.v_per_hz = plant_.v_per_hz();
+    motor.inductance_H = static_cast<float>(plant.inductance_H);
+
+    motor_position_.config()->sources[0].cpr = options.encoder_cpr;
+
+    auto& config = *core_.mutable_config();
+    config.pwm_rate_hz = options.pwm_rate_hz;
+    const float w = 2.0f * kPi * options.current_bandwidth_hz;
+    config.pid_dq.kp = static_cast<float>(plant.inductance_H) * w;
+    config.pid_dq.ki = static_cast<float>(plant.resistance_ohm) * w;
+
+    // The board defaults compensate for the deadtime and switching
+    // characteristics of real hardware.  Instead, exactly compensate
+    // for the simulated deadtime.  'pwm_comp_off' is specified at
+    // 40kHz.
+    config.pwm_comp_mag = 0.0f;
+    config.pwm_comp_off = static_cast<float>(plant.deadtime_s) * 40000.0f;
+
+    // The factory position limits are very narrow, which is
+    // rarely what a simulation wants.
+    auto& position_config = *core_.mutable_position_config();
+    position_config.position_min = std::numeric_limits<float>::quiet_NaN();
+    position_config.position_max = std::numeric_limits<float>::quiet_NaN();
+
+    aux1_status_.spi.active = true;
+    UpdateEncoder();
+
+    UpdateConfig();
+  }
+
+  // MotorDriver
+  EnableResult StartEnable(bool enable) override {
+    enabled_ = enable;
+    return enable ? kEnabled : kDisabled;
+  }
+
+  void Power(bool value) override {
+    powered_ = value;
+  }
+
+  bool fault() override { return false; }
+
+  /// Advance by one PWM period, invoking the control ISR on those
+  /// periods where the firmware would.
+  void Step() {
+    const auto& rate_config = core_.rate_config();
+    phase_ = (phase_ + 1) & rate_config.interrupt_mask;
+    if (phase_ == 0) {
+      Sample();
+
+      // Run the millisecond poll at approximately the right rate.
+      ms_count_ += rate_config.period_s;
+      if (ms_count_ >= 0.001f) {
+        ms_count_ -= 0.001f;
+        core_.PollMillisecond();
+      }
+
+      core_.ISR_DoCycle();
+    }
+
+    const double pwm_counts = pwm_counts_;
+    const double duty[3] = {
+      ccr_[0] / pwm_counts,
+      ccr_[2] / pwm_counts,
+      ccr_[1] / pwm_counts,
+    };
+    const double period_s = 1.0 / rate_config.pwm_rate_hz;
+    plant_.Step(period_s, duty, rate_config.pwm_rate_hz,
+                options_.bus_V, powered_);
+    time_s_ += period_s;
+  }
+
+  /// Advance by the given amount of simulated time.
+  void Run(double duration_s) {
+    const double end = time_s_ + duration_s;
+    while (time_s_ < end) { Step(); }
+  }
+
+  void Command(const BldcServoCommandData& data) {
+    core_.Command(data);
+  }
+
+  BldcServoCore* core() { return &core_; }
+  PmsmPlant* plant() { return &plant_; }
+  MotorPosition* motor_position() { return &motor_position_; }
+  aux::AuxStatus* aux1_status() { return &aux1_status_; }
+  double time_s() const { return time_s_; }
+
+  /// Advance the free running cycle counter used to profile the
+  /// ISR.
+  void AddCycles(uint32_t cycles) { cycle_count_ += cycles; }
+
+ private:
+  void UpdateConfig() {
+    core_.UpdateConfig();
+
+    // This mirrors BldcServo::Impl::ConfigurePwmTimer.
+    pwm_counts_ =
+        options_.timer_clock_hz * 2 / (2 * core_.rate_config().pwm_rate_hz);
+    core_.SetPwmCounts(pwm_counts_);
+  }
+
+  void UpdateEncoder() {
+    const double revs = plant_.mechanical_theta() / (2.0 * M_PI);
+    const double frac = revs - std::floor(revs);
+    aux1_status_.spi.value =
+        std::min<uint32_t>(
+            options_.encoder_cpr - 1,
+            static_cast<uint32_t>(frac * options_.encoder_cpr));
+    aux1_status_.spi.nonce++;
+  }
+
+  void Sample() {
+    auto& status = *core_.mutable_status();
+
+    double abc[3] = {};
+    plant_.phase_currents(abc);
+
+    const double adc_scale =
+        3.3 / (4096.0 *
+               static_cast<double>(core_.config().current_sense_ohm) *
+               static_cast<double>(core_.config().i_gain));
+    auto to_adc = [&](double current) -> uint16_t {
+      const double raw = 2048.0 + current / adc_scale;
+      return static_cast<uint16_t>(std::max(0.0, std::min(4095.0, raw)));
+    };
+
+    // The hardware samples phase A on cur1, phase B on cur3 and phase
+    // C on cur2.
+    status.adc_cur1_raw = to_adc(abc[0]);
+    status.adc_cur3_raw = to_adc(abc[1]);
+    status.adc_cur2_raw = to_adc(abc[2]);
+    status.adc_voltage_sense_raw = static_cast<uint16_t>(
+        std::min(4095.0f, options_.bus_V / options_.vsense_adc_scale));
+    status.adc_fet_temp_raw = options_.adc_fet_temp_raw;
+    status.adc_motor_temp_raw = options_.adc_fet_temp_raw;
+
+    UpdateEncoder();
+  }
+
+  const Options options_;
+
+  PmsmPlant plant_;
+
+  aux::AuxStatus aux1_status_;
+  aux::AuxStatus aux2_status_;
+  aux::AuxConfig aux1_config_;
+  aux::AuxConfig aux2_config_;
+
+  MotorPosition motor_position_;
+  BldcServoCore core_;
+
+  volatile uint32_t ccr_[3] = {};
+  volatile uint32_t cycle_count_ = 0;
+  uint32_t pwm_counts_ = 0;
+
+  bool enabled_ = false;
+  bool powered_ = false;
+
+  int32_t phase_ = 0;
+  float ms_count_ = 0.0f;
+  double time_s_ = 0.0;
+};
+
+}
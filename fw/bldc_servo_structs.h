@@ -165,6 +165,10 @@ struct BldcServoStatus {
   std::optional<int64_t> control_position_raw;
   float control_position = std::numeric_limits<float>::quiet_NaN();
   std::optional<float> control_velocity;
+  float control_acceleration = 0.0f;
+  // The rounding error not yet applied to control_velocity.  This is
+  // only used with a jerk limit.
+  float control_velocity_residual = 0.0f;
   float position_to_set = std::numeric_limits<float>::quiet_NaN();
   float timeout_s = 0.0;
   bool trajectory_done = false;
@@ -258,6 +262,8 @@ struct BldcServoStatus {
     a->Visit(MJ_NVP(control_position_raw));
     a->Visit(MJ_NVP(control_position));
     a->Visit(MJ_NVP(control_velocity));
+    a->Visit(MJ_NVP(control_acceleration));
+    a->Visit(MJ_NVP(control_velocity_residual));
     a->Visit(MJ_NVP(position_to_set));
     a->Visit(MJ_NVP(timeout_s));
     a->Visit(MJ_NVP(trajectory_done));
@@ -322,6 +328,13 @@ struct BldcServoCommandData {
 
   float velocity_limit = std::numeric_limits<float>::quiet_NaN();
   float accel_limit = std::numeric_limits<float>::quiet_NaN();
+  float jerk_limit = std::numeric_limits<float>::quiet_NaN();
+
+  // If finite, a position mode move under an acceleration limit
+  // arrives this long after the command is received, moving no
+  // faster than necessary.  If that is not possible within the
+  // limits, it arrives as soon as it can.
+  float move_duration_s = std::numeric_limits<float>::quiet_NaN();
 
   // If not NaN, temporarily operate in fixed voltage mode.
   float fixed_voltage_override = std::numeric_limits<float>::quiet_NaN();
@@ -335,6 +348,11 @@ struct BldcServoCommandData {
   // For kMeasureInductance
   int8_t meas_ind_period = 4;
 
+  // This should not be set by callers, but is used internally.  It
+  // is different for each command, so that the ISR can tell when a
+  // new one has arrived.
+  uint32_t sequence = 0;
+
   template <typename Archive>
   void Serialize(Archive* a) {
     a->Visit(MJ_NVP(mode));
@@ -364,11 +382,14 @@ struct BldcServoCommandData {
     a->Visit(MJ_NVP(kd_scale));
     a->Visit(MJ_NVP(velocity_limit));
     a->Visit(MJ_NVP(accel_limit));
+    a->Visit(MJ_NVP(jerk_limit));
+    a->Visit(MJ_NVP(move_duration_s));
     a->Visit(MJ_NVP(fixed_voltage_override));
     a->Visit(MJ_NVP(timeout_s));
     a->Visit(MJ_NVP(bounds_min));
     a->Visit(MJ_NVP(bounds_max));
     a->Visit(MJ_NVP(meas_ind_period));
+    a->Visit(MJ_NVP(sequence));
   }
 };
 
@@ -383,6 +404,10 @@ struct BldcServoMotor {
   // Hz is electrical
   float v_per_hz = 0.0f;
 
+  // Per phase inductance.  This is only required for sensorless
+  // operation.
+  float inductance_H = 0.0f;
+
   // Electrical phase offset in radians as a function of encoder
   // position.
   std::array<float, 64> offset = {};
@@ -400,6 +425,14 @@ struct BldcServoMotor {
   float rotation_current_scale = 0.05;
   float rotation_torque_scale = 14.7;
 
+  // If torque_table_max_A is positive, the above model is replaced
+  // with a piecewise linear one.  torque_table_Nm[i] is the torque
+  // at a phase current of i * torque_table_max_A / 16.  It must start
+  // at 0 and be strictly increasing, otherwise the table is ignored.
+  // Beyond torque_table_max_A, the final segment is extrapolated.
+  float torque_table_max_A = 0.0f;
+  std::array<float, 17> torque_table_Nm = {};
+
   // When in position mode, the cogging DQ table provides an
   // additional Q current to apply based on the commutation encoder.
   // Each of the values in cogging_dq_comp is multiplied by
@@ -413,10 +446,13 @@ struct BldcServoMotor {
     a->Visit(MJ_NVP(phase_invert));
     a->Visit(MJ_NVP(resistance_ohm));
     a->Visit(MJ_NVP(v_per_hz));
+    a->Visit(MJ_NVP(inductance_H));
     a->Visit(MJ_NVP(offset));
     a->Visit(MJ_NVP(rotation_current_cutoff_A));
     a->Visit(MJ_NVP(rotation_current_scale));
     a->Visit(MJ_NVP(rotation_torque_scale));
+    a->Visit(MJ_NVP(torque_table_max_A));
+    a->Visit(MJ_NVP(torque_table_Nm));
     a->Visit(MJ_NVP(cogging_dq_scale));
     a->Visit(MJ_NVP(cogging_dq_comp));
   }
@@ -499,10 +535,11 @@ struct BldcServoConfig {
   // based on the desired angular velocity.
   float bemf_feedforward = 1.0f;
 
-  // Default values for the position mode velocity and acceleration
-  // limits.
+  // Default values for the position mode velocity, acceleration, and
+  // jerk limits.
   float default_velocity_limit = std::numeric_limits<float>::quiet_NaN();
   float default_accel_limit = std::numeric_limits<float>::quiet_NaN();
+  float default_jerk_limit = std::numeric_limits<float>::quiet_NaN();
 
   // If true, then the currents in A that are calculated for the D
   // and Q phase are instead directly commanded as voltages on the
@@ -531,6 +568,21 @@ struct BldcServoConfig {
   //  15 - "brake" - all motor phases shorted to ground
   uint8_t timeout_mode = 12;
 
+  // Selects what happens in position mode when the final queued
+  // waypoint is reached:
+  //  0 - decelerate to and hold the final waypoint position
+  //  1 - continue at the velocity of the final waypoint
+  //  2 - fault
+  uint8_t waypoint_underrun_mode = 0;
+
+  // If positive, a position mode command which arrives within this
+  // long of the previous one is reached along a cubic Hermite spline
+  // through the commanded positions and velocities, taking as long as
+  // the time between the two commands.  This delays the motion by
+  // one command period, and velocity, acceleration, and jerk limits
+  // do not apply while interpolating.
+  float interpolation_max_period_s = 0.0f;
+
   // Similar to 'max_voltage', the flux braking default voltage is
   // board rev dependent.
   float flux_brake_min_voltage =
@@ -565,6 +617,11 @@ struct BldcServoConfig {
   // debug UART at full control rate.
   uint32_t emit_debug = 0;
 
+  // The position loop, including the trajectory generator, runs once
+  // every this many control cycles, between 1 and 16.  In between,
+  // the current loop holds the most recent command.
+  uint8_t position_rate_divisor = 1;
+
   BldcServoConfig() {
     pid_dq.kp = 0.005f;
     pid_dq.ki = 30.0f;
@@ -601,6 +658,7 @@ struct BldcServoConfig {
     a->Visit(MJ_NVP(bemf_feedforward));
     a->Visit(MJ_NVP(default_velocity_limit));
     a->Visit(MJ_NVP(default_accel_limit));
+    a->Visit(MJ_NVP(default_jerk_limit));
     a->Visit(MJ_NVP(voltage_mode_control));
     a->Visit(MJ_NVP(fixed_voltage_mode));
     a->Visit(MJ_NVP(fixed_voltage_control_V));
@@ -608,6 +666,8 @@ struct BldcServoConfig {
     a->Visit(MJ_NVP(default_timeout_s));
     a->Visit(MJ_NVP(timeout_max_torque_Nm));
     a->Visit(MJ_NVP(timeout_mode));
+    a->Visit(MJ_NVP(waypoint_underrun_mode));
+    a->Visit(MJ_NVP(interpolation_max_period_s));
     a->Visit(MJ_NVP(flux_brake_min_voltage));
     a->Visit(MJ_NVP(flux_brake_resistance_ohm));
     a->Visit(MJ_NVP(max_current_A));
@@ -618,6 +678,7 @@ struct BldcServoConfig {
     a->Visit(MJ_NVP(velocity_zero_capture_threshold));
     a->Visit(MJ_NVP(timing_fault));
     a->Visit(MJ_NVP(emit_debug));
+    a->Visit(MJ_NVP(position_rate_divisor));
   }
 
   static float invalid_float() {
@@ -626,6 +687,53 @@ struct BldcServoConfig {
   }
 };
 
+// Intermediate control outputs.
+struct BldcServoControl {
+  Vec3 pwm;
+  Vec3 voltage;
+
+  float d_V = 0.0f;
+  float q_V = 0.0f;
+
+  float i_d_A = 0.0f;
+  float i_q_A = 0.0f;
+
+  float q_comp_A = 0.0f;
+  float torque_Nm = 0.0f;
+
+  void Clear() {
+    // We implement this manually merely because it is faster than
+    // using the constructor which delegates to memset.  It is
+    // definitely more brittle.
+    pwm.a = 0.0f;
+    pwm.b = 0.0f;
+    pwm.c = 0.0f;
+
+    voltage.a = 0.0f;
+    voltage.b = 0.0f;
+    voltage.c = 0.0f;
+
+    d_V = 0.0f;
+    q_V = 0.0f;
+    i_d_A = 0.0f;
+    i_q_A = 0.0f;
+    q_comp_A = 0.0f;
+    torque_Nm = 0.0f;
+  }
+
+  template <typename Archive>
+  void Serialize(Archive* a) {
+    a->Visit(MJ_NVP(pwm));
+    a->Visit(MJ_NVP(voltage));
+    a->Visit(MJ_NVP(d_V));
+    a->Visit(MJ_NVP(q_V));
+    a->Visit(MJ_NVP(i_d_A));
+    a->Visit(MJ_NVP(i_q_A));
+    a->Visit(MJ_NVP(q_comp_A));
+    a->Visit(MJ_NVP(torque_Nm));
+  }
+};
+
 // This will commonly be different across every device, so it is
 // separate to minimize resets due to schemas changing during
 // development.
@@ -94,6 +94,14 @@ bool ParseOptions(BldcServo::CommandData* command, base::Tokenizer* tokenizer,
         command->velocity_limit = value;
         break;
       }
+      case 'j': {
+        command->jerk_limit = value;
+        break;
+      }
+      case 'm': {
+        command->move_duration_s = value;
+        break;
+      }
       case 'o': {
         command->fixed_voltage_override = value;
         break;
@@ -567,7 +575,7 @@ class BoardDebug::Impl {
       // We default to no timeout for debug commands.
       command.timeout_s = std::numeric_limits<float>::quiet_NaN();
 
-      if (!ParseOptions(&command, &tokenizer, "pdsftavo")) {
+      if (!ParseOptions(&command, &tokenizer, "pdsftavjmo")) {
         WriteMessage(response, "ERR unknown option\r\n");
         return;
       }
@@ -720,6 +728,13 @@ class BoardDebug::Impl {
       return;
     }
 
+    if (cmd_text == "prof-reset") {
+      bldc_->ResetProfile();
+
+      WriteOk(response);
+      return;
+    }
+
     if (cmd_text == "hstart") {
       histogram_count_ms_ = 0;
 
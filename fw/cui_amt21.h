@@ -150,6 +150,7 @@ class CuiAmt21 {
 
     status->value = value & 0x3fff;
     status->nonce++;
+    status->sample_us = last_query_start_us_;
     status->active = true;
   }
 
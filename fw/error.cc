@@ -65,6 +65,7 @@ struct MoteusErrorCategory : mjlib::micro::error_category {
       case errc::kDriverEnableFault: return "driver enable";
       case errc::kStopPositionDeprecated: return "stop position deprecated";
       case errc::kTimingViolation: return "timing violation";
+      case errc::kWaypointUnderrun: return "waypoint underrun";
     }
     return "unknown";
   }
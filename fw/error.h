@@ -69,6 +69,7 @@ enum class errc {
   kDriverEnableFault = 44,
   kStopPositionDeprecated = 45,
   kTimingViolation = 46,
+  kWaypointUnderrun = 47,
 };
 
 mjlib::micro::error_code make_error_code(errc);
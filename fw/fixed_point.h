@@ -0,0 +1,135 @@
+// Copyright 2023 mjbots Robotic Systems, LLC.  info@mjbots.com
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+
+#include <cstdint>
+
+#ifdef TARGET_STM32G4
+#include "stm32g4xx.h"
+#endif
+
+namespace moteus {
+
+/// Saturating arithmetic on signed fractional fixed point values.
+/// Q31 values are an int32_t representing [-1, 1), and Q15 values are
+/// an int16_t representing the same range.
+
+constexpr int32_t kQ31Max = 0x7fffffff;
+constexpr int32_t kQ31Min = -kQ31Max - 1;
+constexpr int16_t kQ15Max = 0x7fff;
+constexpr int16_t kQ15Min = -kQ15Max - 1;
+
+inline int32_t SaturateQ31(int64_t value) {
+  return (value > kQ31Max) ? kQ31Max :
+      (value < kQ31Min) ? kQ31Min :
+      static_cast<int32_t>(value);
+}
+
+inline int16_t SaturateQ15(int32_t value) {
+#ifdef TARGET_STM32G4
+  return static_cast<int16_t>(__SSAT(value, 16));
+#else
+  return (value > kQ15Max) ? kQ15Max :
+      (value < kQ15Min) ? kQ15Min :
+      static_cast<int16_t>(value);
+#endif
+}
+
+inline int32_t AddQ31(int32_t a, int32_t b) {
+#ifdef TARGET_STM32G4
+  return __QADD(a, b);
+#else
+  return SaturateQ31(static_cast<int64_t>(a) + b);
+#endif
+}
+
+inline int32_t SubQ31(int32_t a, int32_t b) {
+#ifdef TARGET_STM32G4
+  return __QSUB(a, b);
+#else
+  return SaturateQ31(static_cast<int64_t>(a) - b);
+#endif
+}
+
+inline int32_t MulQ31(int32_t a, int32_t b) {
+  // Only -1 * -1 can overflow.
+  return SaturateQ31((static_cast<int64_t>(a) * b) >> 31);
+}
+
+inline int16_t AddQ15(int16_t a, int16_t b) {
+  return SaturateQ15(static_cast<int32_t>(a) + b);
+}
+
+inline int16_t SubQ15(int16_t a, int16_t b) {
+  return SaturateQ15(static_cast<int32_t>(a) - b);
+}
+
+inline int16_t MulQ15(int16_t a, int16_t b) {
+  return SaturateQ15((static_cast<int32_t>(a) * b) >> 15);
+}
+
+/// These are intended for compile time constants, and saturate at
+/// the ends of the range.
+constexpr int32_t FloatToQ31(float value) {
+  return (value >= 1.0f) ? kQ31Max :
+      (value < -1.0f) ? kQ31Min :
+      static_cast<int32_t>(value * 2147483648.0f);
+}
+
+constexpr int16_t FloatToQ15(float value) {
+  return (value >= 1.0f) ? kQ15Max :
+      (value < -1.0f) ? kQ15Min :
+      static_cast<int16_t>(value * 32768.0f);
+}
+
+constexpr float Q31ToFloat(int32_t value) {
+  return static_cast<float>(value) * (1.0f / 2147483648.0f);
+}
+
+constexpr float Q15ToFloat(int16_t value) {
+  return static_cast<float>(value) * (1.0f / 32768.0f);
+}
+
+/// Multiplies a position in revolutions, with 2^32 counts per
+/// revolution, by a constant 32.32 fixed point ratio, and returns the
+/// fractional revolution of the result, with 2^32 counts per
+/// revolution.  This is intended for converting encoder positions
+/// into electrical phases, where wrapping is desired.
+struct PhaseMultiplier {
+  uint32_t integer = 0;
+  uint32_t fraction = 0;
+
+  /// This is intended to be used at configuration time, not in an
+  /// ISR.
+  static PhaseMultiplier FromFloat(float ratio) {
+    const uint64_t fixed = static_cast<uint64_t>(
+        static_cast<int64_t>(static_cast<double>(ratio) * 4294967296.0));
+    PhaseMultiplier result;
+    result.integer = static_cast<uint32_t>(fixed >> 32);
+    result.fraction = static_cast<uint32_t>(fixed);
+    return result;
+  }
+
+  uint32_t operator()(int64_t position) const {
+    const uint32_t lo = static_cast<uint32_t>(position);
+    const uint32_t hi = static_cast<uint32_t>(
+        static_cast<uint64_t>(position) >> 32);
+    // Only bits 32 through 63 of the 96 bit product are needed.
+    return lo * integer + hi * fraction +
+        static_cast<uint32_t>((static_cast<uint64_t>(lo) * fraction) >> 32);
+  }
+};
+
+}
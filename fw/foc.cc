@@ -16,4 +16,266 @@
 
 namespace moteus {
 
+#ifndef TARGET_STM32G4
+// Generated by make_sincos_table.py
+const float kSinCosTable[kSinCosTableSize] = {
+  0.0f,  // 0
+  0.0245412285f,  // 1
+  0.0490676743f,  // 2
+  0.0735645636f,  // 3
+  0.0980171403f,  // 4
+  0.122410675f,  // 5
+  0.146730474f,  // 6
+  0.170961889f,  // 7
+  0.195090322f,  // 8
+  0.21910124f,  // 9
+  0.24298018f,  // 10
+  0.266712757f,  // 11
+  0.290284677f,  // 12
+  0.31368174f,  // 13
+  0.336889853f,  // 14
+  0.359895037f,  // 15
+  0.382683432f,  // 16
+  0.405241314f,  // 17
+  0.427555093f,  // 18
+  0.44961133f,  // 19
+  0.471396737f,  // 20
+  0.492898192f,  // 21
+  0.514102744f,  // 22
+  0.53499762f,  // 23
+  0.555570233f,  // 24
+  0.575808191f,  // 25
+  0.595699304f,  // 26
+  0.615231591f,  // 27
+  0.634393284f,  // 28
+  0.653172843f,  // 29
+  0.671558955f,  // 30
+  0.689540545f,  // 31
+  0.707106781f,  // 32
+  0.724247083f,  // 33
+  0.740951125f,  // 34
+  0.757208847f,  // 35
+  0.773010453f,  // 36
+  0.788346428f,  // 37
+  0.803207531f,  // 38
+  0.817584813f,  // 39
+  0.831469612f,  // 40
+  0.844853565f,  // 41
+  0.85772861f,  // 42
+  0.870086991f,  // 43
+  0.881921264f,  // 44
+  0.893224301f,  // 45
+  0.903989293f,  // 46
+  0.914209756f,  // 47
+  0.923879533f,  // 48
+  0.932992799f,  // 49
+  0.941544065f,  // 50
+  0.949528181f,  // 51
+  0.956940336f,  // 52
+  0.963776066f,  // 53
+  0.970031253f,  // 54
+  0.97570213f,  // 55
+  0.98078528f,  // 56
+  0.985277642f,  // 57
+  0.98917651f,  // 58
+  0.992479535f,  // 59
+  0.995184727f,  // 60
+  0.997290457f,  // 61
+  0.998795456f,  // 62
+  0.999698819f,  // 63
+  1.0f,  // 64
+  0.999698819f,  // 65
+  0.998795456f,  // 66
+  0.997290457f,  // 67
+  0.995184727f,  // 68
+  0.992479535f,  // 69
+  0.98917651f,  // 70
+  0.985277642f,  // 71
+  0.98078528f,  // 72
+  0.97570213f,  // 73
+  0.970031253f,  // 74
+  0.963776066f,  // 75
+  0.956940336f,  // 76
+  0.949528181f,  // 77
+  0.941544065f,  // 78
+  0.932992799f,  // 79
+  0.923879533f,  // 80
+  0.914209756f,  // 81
+  0.903989293f,  // 82
+  0.893224301f,  // 83
+  0.881921264f,  // 84
+  0.870086991f,  // 85
+  0.85772861f,  // 86
+  0.844853565f,  // 87
+  0.831469612f,  // 88
+  0.817584813f,  // 89
+  0.803207531f,  // 90
+  0.788346428f,  // 91
+  0.773010453f,  // 92
+  0.757208847f,  // 93
+  0.740951125f,  // 94
+  0.724247083f,  // 95
+  0.707106781f,  // 96
+  0.689540545f,  // 97
+  0.671558955f,  // 98
+  0.653172843f,  // 99
+  0.634393284f,  // 100
+  0.615231591f,  // 101
+  0.595699304f,  // 102
+  0.575808191f,  // 103
+  0.555570233f,  // 104
+  0.53499762f,  // 105
+  0.514102744f,  // 106
+  0.492898192f,  // 107
+  0.471396737f,  // 108
+  0.44961133f,  // 109
+  0.427555093f,  // 110
+  0.405241314f,  // 111
+  0.382683432f,  // 112
+  0.359895037f,  // 113
+  0.336889853f,  // 114
+  0.31368174f,  // 115
+  0.290284677f,  // 116
+  0.266712757f,  // 117
+  0.24298018f,  // 118
+  0.21910124f,  // 119
+  0.195090322f,  // 120
+  0.170961889f,  // 121
+  0.146730474f,  // 122
+  0.122410675f,  // 123
+  0.0980171403f,  // 124
+  0.0735645636f,  // 125
+  0.0490676743f,  // 126
+  0.0245412285f,  // 127
+  1.2246468e-16f,  // 128
+  -0.0245412285f,  // 129
+  -0.0490676743f,  // 130
+  -0.0735645636f,  // 131
+  -0.0980171403f,  // 132
+  -0.122410675f,  // 133
+  -0.146730474f,  // 134
+  -0.170961889f,  // 135
+  -0.195090322f,  // 136
+  -0.21910124f,  // 137
+  -0.24298018f,  // 138
+  -0.266712757f,  // 139
+  -0.290284677f,  // 140
+  -0.31368174f,  // 141
+  -0.336889853f,  // 142
+  -0.359895037f,  // 143
+  -0.382683432f,  // 144
+  -0.405241314f,  // 145
+  -0.427555093f,  // 146
+  -0.44961133f,  // 147
+  -0.471396737f,  // 148
+  -0.492898192f,  // 149
+  -0.514102744f,  // 150
+  -0.53499762f,  // 151
+  -0.555570233f,  // 152
+  -0.575808191f,  // 153
+  -0.595699304f,  // 154
+  -0.615231591f,  // 155
+  -0.634393284f,  // 156
+  -0.653172843f,  // 157
+  -0.671558955f,  // 158
+  -0.689540545f,  // 159
+  -0.707106781f,  // 160
+  -0.724247083f,  // 161
+  -0.740951125f,  // 162
+  -0.757208847f,  // 163
+  -0.773010453f,  // 164
+  -0.788346428f,  // 165
+  -0.803207531f,  // 166
+  -0.817584813f,  // 167
+  -0.831469612f,  // 168
+  -0.844853565f,  // 169
+  -0.85772861f,  // 170
+  -0.870086991f,  // 171
+  -0.881921264f,  // 172
+  -0.893224301f,  // 173
+  -0.903989293f,  // 174
+  -0.914209756f,  // 175
+  -0.923879533f,  // 176
+  -0.932992799f,  // 177
+  -0.941544065f,  // 178
+  -0.949528181f,  // 179
+  -0.956940336f,  // 180
+  -0.963776066f,  // 181
+  -0.970031253f,  // 182
+  -0.97570213f,  // 183
+  -0.98078528f,  // 184
+  -0.985277642f,  // 185
+  -0.98917651f,  // 186
+  -0.992479535f,  // 187
+  -0.995184727f,  // 188
+  -0.997290457f,  // 189
+  -0.998795456f,  // 190
+  -0.999698819f,  // 191
+  -1.0f,  // 192
+  -0.999698819f,  // 193
+  -0.998795456f,  // 194
+  -0.997290457f,  // 195
+  -0.995184727f,  // 196
+  -0.992479535f,  // 197
+  -0.98917651f,  // 198
+  -0.985277642f,  // 199
+  -0.98078528f,  // 200
+  -0.97570213f,  // 201
+  -0.970031253f,  // 202
+  -0.963776066f,  // 203
+  -0.956940336f,  // 204
+  -0.949528181f,  // 205
+  -0.941544065f,  // 206
+  -0.932992799f,  // 207
+  -0.923879533f,  // 208
+  -0.914209756f,  // 209
+  -0.903989293f,  // 210
+  -0.893224301f,  // 211
+  -0.881921264f,  // 212
+  -0.870086991f,  // 213
+  -0.85772861f,  // 214
+  -0.844853565f,  // 215
+  -0.831469612f,  // 216
+  -0.817584813f,  // 217
+  -0.803207531f,  // 218
+  -0.788346428f,  // 219
+  -0.773010453f,  // 220
+  -0.757208847f,  // 221
+  -0.740951125f,  // 222
+  -0.724247083f,  // 223
+  -0.707106781f,  // 224
+  -0.689540545f,  // 225
+  -0.671558955f,  // 226
+  -0.653172843f,  // 227
+  -0.634393284f,  // 228
+  -0.615231591f,  // 229
+  -0.595699304f,  // 230
+  -0.575808191f,  // 231
+  -0.555570233f,  // 232
+  -0.53499762f,  // 233
+  -0.514102744f,  // 234
+  -0.492898192f,  // 235
+  -0.471396737f,  // 236
+  -0.44961133f,  // 237
+  -0.427555093f,  // 238
+  -0.405241314f,  // 239
+  -0.382683432f,  // 240
+  -0.359895037f,  // 241
+  -0.336889853f,  // 242
+  -0.31368174f,  // 243
+  -0.290284677f,  // 244
+  -0.266712757f,  // 245
+  -0.24298018f,  // 246
+  -0.21910124f,  // 247
+  -0.195090322f,  // 248
+  -0.170961889f,  // 249
+  -0.146730474f,  // 250
+  -0.122410675f,  // 251
+  -0.0980171403f,  // 252
+  -0.0735645636f,  // 253
+  -0.0490676743f,  // 254
+  -0.0245412285f,  // 255
+};
+#endif
+
 }
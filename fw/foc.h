@@ -50,6 +50,7 @@ The library is a clear example of the application of mathematical concepts in ro
 #include <algorithm>
 #include <cmath>
 
+#include "fw/fixed_point.h"
 #include "fw/math.h"
 
 #ifdef TARGET_STM32G4
@@ -64,6 +65,85 @@ struct SinCos {
   float c;
 };
 
+struct SinCosQ31 {
+  int32_t s;
+  int32_t c;
+};
+
+struct SinCosQ15 {
+  int16_t s;
+  int16_t c;
+};
+
+/// The ADC count range that maps to the full scale of each numeric
+/// policy's FromAdc.
+constexpr int32_t kAdcFullScaleCounts = 4096;
+
+/// Numeric policies for the transforms below.  Each provides the
+/// value type, a matching SinCos, the arithmetic operations, and
+/// FromAdc, which maps an offset corrected ADC reading to a fraction
+/// of kAdcFullScaleCounts.
+struct FloatPolicy {
+  using Value = float;
+  using SinCosType = SinCos;
+
+  static constexpr Value Constant(float value) { return value; }
+  static Value Add(Value a, Value b) { return a + b; }
+  static Value Sub(Value a, Value b) { return a - b; }
+  static Value Mul(Value a, Value b) { return a * b; }
+  static Value Neg(Value a) { return -a; }
+
+  static Value FromAdc(uint16_t raw, uint16_t offset) {
+    return static_cast<float>(static_cast<int32_t>(raw) - offset) *
+        (1.0f / kAdcFullScaleCounts);
+  }
+  static float ToFloat(Value value) { return value; }
+};
+
+/// Q31 with saturating arithmetic.
+struct Q31Policy {
+  using Value = int32_t;
+  using SinCosType = SinCosQ31;
+
+  static constexpr Value Constant(float value) { return FloatToQ31(value); }
+  static Value Add(Value a, Value b) { return AddQ31(a, b); }
+  static Value Sub(Value a, Value b) { return SubQ31(a, b); }
+  static Value Mul(Value a, Value b) { return MulQ31(a, b); }
+  static Value Neg(Value a) { return SubQ31(0, a); }
+
+  static Value FromAdc(uint16_t raw, uint16_t offset) {
+    // A 12 bit difference fits in 13 signed bits.
+    return (static_cast<int32_t>(raw) - offset) * (1 << 19);
+  }
+  static float ToFloat(Value value) { return Q31ToFloat(value); }
+};
+
+/// Q15 with saturating arithmetic.
+struct Q15Policy {
+  using Value = int16_t;
+  using SinCosType = SinCosQ15;
+
+  static constexpr Value Constant(float value) { return FloatToQ15(value); }
+  static Value Add(Value a, Value b) { return AddQ15(a, b); }
+  static Value Sub(Value a, Value b) { return SubQ15(a, b); }
+  static Value Mul(Value a, Value b) { return MulQ15(a, b); }
+  static Value Neg(Value a) { return SubQ15(0, a); }
+
+  static Value FromAdc(uint16_t raw, uint16_t offset) {
+    return static_cast<int16_t>(
+        (static_cast<int32_t>(raw) - offset) * (1 << 3));
+  }
+  static float ToFloat(Value value) { return Q15ToFloat(value); }
+};
+
+#ifndef TARGET_STM32G4
+constexpr int kSinCosTableBits = 8;
+constexpr int kSinCosTableSize = 1 << kSinCosTableBits;
+
+/// sin(2 * pi * i / kSinCosTableSize)
+extern const float kSinCosTable[kSinCosTableSize];
+#endif
+
 class Cordic {
  public:
 #ifdef TARGET_STM32G4
@@ -88,16 +168,61 @@ class Cordic {
     return result;
   };
 
+  SinCosQ31 q31(int32_t theta_q31) const {
+    LL_CORDIC_WriteData(CORDIC, theta_q31);
+    SinCosQ31 result;
+    result.c = static_cast<int32_t>(LL_CORDIC_ReadData(CORDIC));
+    result.s = static_cast<int32_t>(LL_CORDIC_ReadData(CORDIC));
+    return result;
+  }
+
   static float from_q31(uint32_t val) {
     return static_cast<float>(static_cast<int32_t>(val)) * (1.0f / 2147483648.0f);
   }
 #else
   Cordic() {}
 
+  /// This uses a table lookup followed by a short polynomial
+  /// correction.  It is deterministic, is accurate to within a few
+  /// float LSBs, which is better than the hardware CORDIC, and is
+  /// much faster than libm.
   SinCos operator()(int32_t theta_q31) const {
+    // Round to the nearest table entry, leaving a signed residual of
+    // at most half a step.
+    const uint32_t theta = static_cast<uint32_t>(theta_q31);
+    const uint32_t index = (theta + (1u << (31 - kSinCosTableBits))) >>
+        (32 - kSinCosTableBits);
+    const int32_t residual = static_cast<int32_t>(
+        theta - (index << (32 - kSinCosTableBits)));
+    const float h = static_cast<float>(residual) * (kPi / 2147483648.0f);
+
+    const float h2 = h * h;
+    const float sin_h = h - h * h2 * (1.0f / 6.0f);
+    const float cos_h = 1.0f - h2 * 0.5f;
+
+    const uint32_t mask = kSinCosTableSize - 1;
+    const float sin_a = kSinCosTable[index & mask];
+    const float cos_a = kSinCosTable[(index + kSinCosTableSize / 4) & mask];
+
     SinCos result;
-    result.s = std::sin(static_cast<float>(theta_q31) * kPi * (1.0f / 2147483648.0f));
-    result.c = std::cos(static_cast<float>(theta_q31) * kPi * (1.0f / 2147483648.0f));
+    result.s = sin_a * cos_h + cos_a * sin_h;
+    result.c = cos_a * cos_h - sin_a * sin_h;
+    return result;
+  }
+
+  /// Evaluate many angles at once.  This is written so that the
+  /// compiler can vectorize it.
+  void operator()(const int32_t* theta_q31, SinCos* result, int count) const {
+    for (int i = 0; i < count; i++) {
+      result[i] = (*this)(theta_q31[i]);
+    }
+  }
+
+  SinCosQ31 q31(int32_t theta_q31) const {
+    const SinCos sc = (*this)(theta_q31);
+    SinCosQ31 result;
+    result.s = FloatToQ31(sc.s);
+    result.c = FloatToQ31(sc.c);
     return result;
   }
 
@@ -105,11 +230,85 @@ class Cordic {
     return (*this)(RadiansToQ31(theta));
   }
 #endif
+
+  SinCosQ15 q15(int32_t theta_q31) const {
+    const SinCosQ31 sc = q31(theta_q31);
+    SinCosQ15 result;
+    result.s = static_cast<int16_t>(sc.s >> 16);
+    result.c = static_cast<int16_t>(sc.c >> 16);
+    return result;
+  }
+};
+
+
+/// The fixed point instantiations scale each phase before summing so
+/// that no intermediate value exceeds the magnitude of the result.
+/// The float instantiations are specialized to retain their original
+/// evaluation order.
+template <typename Policy>
+struct ClarkTransformT {
+  using P = Policy;
+  using Value = typename P::Value;
+
+  ClarkTransformT(Value a, Value b, Value c)
+      : x(P::Sub(P::Sub(P::Mul(a, P::Constant(2.0f / 3.0f)),
+                        P::Mul(b, P::Constant(1.0f / 3.0f))),
+                 P::Mul(c, P::Constant(1.0f / 3.0f)))),
+        y(P::Sub(P::Mul(b, P::Constant(1.0f / kSqrt3)),
+                 P::Mul(c, P::Constant(1.0f / kSqrt3)))) {}
+
+  const Value x;
+  const Value y;
+};
+
+template <>
+struct ClarkTransformT<FloatPolicy> {
+  ClarkTransformT(float a, float b, float c)
+      : x((2.0f * a - b  - c) * (1.0f / 3.0f)),
+        y((b - c) * (1.0f / kSqrt3)) {}
+
+  const float x;
+  const float y;
 };
 
+using ClarkTransform = ClarkTransformT<FloatPolicy>;
+
+template <typename Policy>
+struct ParkTransformT {
+  using P = Policy;
+  using Value = typename P::Value;
+
+  ParkTransformT(const typename P::SinCosType& sc, Value x, Value y)
+      : d(P::Add(P::Mul(sc.c, x), P::Mul(sc.s, y))),
+        q(P::Sub(P::Mul(sc.c, y), P::Mul(sc.s, x))) {}
+
+  const Value d;
+  const Value q;
+};
+
+using ParkTransform = ParkTransformT<FloatPolicy>;
+
+template <typename Policy>
+struct DqTransformT {
+  using P = Policy;
+  using Value = typename P::Value;
+
+  DqTransformT(const typename P::SinCosType& sc, Value a, Value b, Value c)
+      : DqTransformT(sc, ClarkTransformT<P>(a, b, c)) {}
+
+  const Value d;
+  const Value q;
 
-struct DqTransform {
-  DqTransform(const SinCos& sc, float a, float b, float c)
+ private:
+  DqTransformT(const typename P::SinCosType& sc,
+               const ClarkTransformT<P>& clark)
+      : d(P::Add(P::Mul(sc.c, clark.x), P::Mul(sc.s, clark.y))),
+        q(P::Sub(P::Mul(sc.c, clark.y), P::Mul(sc.s, clark.x))) {}
+};
+
+template <>
+struct DqTransformT<FloatPolicy> {
+  DqTransformT(const SinCos& sc, float a, float b, float c)
       : d((2.0f / 3.0f) *
           (a * sc.c +
            (kSqrt3_4 * sc.s - 0.5f * sc.c) * b +
@@ -123,25 +322,30 @@ struct DqTransform {
   const float q;
 };
 
-struct InverseDqTransform {
-  InverseDqTransform(const SinCos& sc, float d, float q)
-      : a(sc.c * d - sc.s * q),
-        b((kSqrt3_4 * sc.s - 0.5f * sc.c) * d - (-kSqrt3_4 * sc.c - 0.5f * sc.s) * q),
-        c((-kSqrt3_4 * sc.s - 0.5f * sc.c) * d - (kSqrt3_4 * sc.c - 0.5f * sc.s) * q) {}
-
-  const float a;
-  const float b;
-  const float c;
+using DqTransform = DqTransformT<FloatPolicy>;
+
+template <typename Policy>
+struct InverseDqTransformT {
+  using P = Policy;
+  using Value = typename P::Value;
+
+  InverseDqTransformT(const typename P::SinCosType& sc, Value d, Value q)
+      : a(P::Sub(P::Mul(sc.c, d), P::Mul(sc.s, q))),
+        b(P::Sub(P::Mul(P::Sub(P::Mul(P::Constant(kSqrt3_4), sc.s),
+                               P::Mul(P::Constant(0.5f), sc.c)), d),
+                 P::Mul(P::Sub(P::Mul(P::Constant(-kSqrt3_4), sc.c),
+                               P::Mul(P::Constant(0.5f), sc.s)), q))),
+        c(P::Sub(P::Mul(P::Sub(P::Mul(P::Constant(-kSqrt3_4), sc.s),
+                               P::Mul(P::Constant(0.5f), sc.c)), d),
+                 P::Mul(P::Sub(P::Mul(P::Constant(kSqrt3_4), sc.c),
+                               P::Mul(P::Constant(0.5f), sc.s)), q))) {}
+
+  const Value a;
+  const Value b;
+  const Value c;
 };
 
-struct ClarkTransform {
-  ClarkTransform(float a, float b, float c)
-      : x((2.0f * a - b  - c) * (1.0f / 3.0f)),
-        y((b - c) * (1.0f / kSqrt3)) {}
-
-  const float x;
-  const float y;
-};
+using InverseDqTransform = InverseDqTransformT<FloatPolicy>;
 
 struct InverseClarkTransform {
   InverseClarkTransform(float x, float y)
@@ -154,15 +358,6 @@ struct InverseClarkTransform {
   const float c;
 };
 
-struct ParkTransform {
-  ParkTransform(const SinCos& sc, float x, float y)
-      : d(sc.c * x + sc.s * y),
-        q(sc.c * y - sc.s * x) {}
-
-  const float d;
-  const float q;
-};
-
 struct InverseParkTransform {
   InverseParkTransform(const SinCos& sc, float d, float q)
       : x(sc.c * d - sc.s * q),
@@ -0,0 +1,155 @@
+// Copyright 2023 mjbots Robotic Systems, LLC.  info@mjbots.com
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+
+#include "fw/math.h"
+
+namespace moteus {
+
+/// Incrementally fits a periodic function of one revolution with a
+/// Fourier series by least squares:
+///
+///   f(x) = c[0] + sum_k c[2k-1] * cos(2 pi k x) + c[2k] * sin(2 pi k x)
+///
+/// Samples need not be evenly spaced.  This is intended to be used
+/// outside of any ISR.
+template <int kMaxHarmonics>
+class HarmonicFit {
+ public:
+  static constexpr int kMaxTerms = 1 + 2 * kMaxHarmonics;
+  using Coefficients = std::array<float, kMaxTerms>;
+
+  HarmonicFit() { Reset(kMaxHarmonics); }
+
+  void Reset(int harmonics) {
+    terms_ = 1 + 2 * std::max(0, std::min(kMaxHarmonics, harmonics));
+    matrix_ = {};
+    vector_ = {};
+    reference_ = 0.0f;
+    sum_ = 0.0f;
+    sum_squares_ = 0.0f;
+    count_ = 0;
+  }
+
+  /// Add a sample at @p x revolutions.
+  void Add(float x, float value) {
+    // Everything is accumulated relative to the first sample, so that
+    // a small variation on a large constant is not lost when the sums
+    // of squares are differenced.
+    if (count_ == 0) { reference_ = value; }
+    value -= reference_;
+
+    Coefficients basis = {};
+    basis[0] = 1.0f;
+    const float s1 = std::sin(k2Pi * x);
+    const float c1 = std::cos(k2Pi * x);
+    float c = 1.0f;
+    float s = 0.0f;
+    for (int i = 1; i < terms_; i += 2) {
+      const float next_c = c * c1 - s * s1;
+      const float next_s = s * c1 + c * s1;
+      c = next_c;
+      s = next_s;
+      basis[i] = c;
+      basis[i + 1] = s;
+    }
+
+    for (int i = 0; i < terms_; i++) {
+      vector_[i] += basis[i] * value;
+      for (int j = 0; j <= i; j++) {
+        matrix_[i][j] += basis[i] * basis[j];
+      }
+    }
+    sum_ += value;
+    sum_squares_ += value * value;
+    count_++;
+  }
+
+  int count() const { return count_; }
+  int terms() const { return terms_; }
+
+  /// The RMS of all samples about their mean.
+  float rms() const {
+    if (count_ == 0) { return 0.0f; }
+    const float mean = sum_ / count_;
+    return std::sqrt(std::max(0.0f, sum_squares_ / count_ - mean * mean));
+  }
+
+  /// Solve for the coefficients, and optionally the RMS of the
+  /// residual.  This consumes the accumulated samples, so Reset must
+  /// be called before any more are added.  Return false if the
+  /// samples did not determine every coefficient.
+  bool Solve(Coefficients* result, float* residual_rms = nullptr) {
+    // Cholesky factorization in place, using the lower triangle.
+    for (int j = 0; j < terms_; j++) {
+      float diagonal = matrix_[j][j];
+      for (int k = 0; k < j; k++) {
+        diagonal -= matrix_[j][k] * matrix_[j][k];
+      }
+      // Anything this small relative to the number of samples means
+      // that some part of the revolution was never seen.
+      if (!(diagonal > 1e-4f * count_)) { return false; }
+      const float root = std::sqrt(diagonal);
+      matrix_[j][j] = root;
+      for (int i = j + 1; i < terms_; i++) {
+        float value = matrix_[i][j];
+        for (int k = 0; k < j; k++) {
+          value -= matrix_[i][k] * matrix_[j][k];
+        }
+        matrix_[i][j] = value / root;
+      }
+    }
+
+    *result = {};
+    auto& c = *result;
+    // Forward, then back substitution.
+    for (int i = 0; i < terms_; i++) {
+      float value = vector_[i];
+      for (int k = 0; k < i; k++) { value -= matrix_[i][k] * c[k]; }
+      c[i] = value / matrix_[i][i];
+    }
+    for (int i = terms_ - 1; i >= 0; i--) {
+      float value = c[i];
+      for (int k = i + 1; k < terms_; k++) { value -= matrix_[k][i] * c[k]; }
+      c[i] = value / matrix_[i][i];
+    }
+
+    if (residual_rms) {
+      float explained = 0.0f;
+      for (int i = 0; i < terms_; i++) { explained += c[i] * vector_[i]; }
+      *residual_rms = std::sqrt(
+          std::max(0.0f, (sum_squares_ - explained) / count_));
+    }
+
+    c[0] += reference_;
+
+    return true;
+  }
+
+ private:
+  int terms_ = 1;
+  std::array<std::array<float, kMaxTerms>, kMaxTerms> matrix_ = {};
+  Coefficients vector_ = {};
+  float reference_ = 0.0f;
+  float sum_ = 0.0f;
+  float sum_squares_ = 0.0f;
+  int count_ = 0;
+};
+
+}
@@ -0,0 +1,168 @@
+// Copyright 2023 mjbots Robotic Systems, LLC.  info@mjbots.com
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+
+#include <array>
+#include <cstdint>
+
+#include "mjlib/base/visitor.h"
+
+#include "fw/ccm.h"
+
+namespace moteus {
+
+/// Statistics on the number of CPU cycles taken by one stage of the
+/// control ISR.
+struct IsrStageProfile {
+  // Bin N of the histogram counts durations with a bit length of N,
+  // i.e. in [2^(N-1), 2^N).  The last bin counts everything longer.
+  static constexpr int kHistogramSize = 16;
+
+  uint32_t last = 0;
+  uint32_t min = 0;
+  uint32_t max = 0;
+  uint32_t count = 0;
+  uint64_t total = 0;
+
+  // This is only updated from PollMillisecond, as a division is too
+  // expensive to do every cycle.
+  float mean = 0.0f;
+
+  std::array<uint32_t, kHistogramSize> histogram = {};
+
+  void ISR_Update(uint32_t cycles) MOTEUS_CCM_ATTRIBUTE {
+    last = cycles;
+    if (count == 0 || cycles < min) { min = cycles; }
+    if (cycles > max) { max = cycles; }
+    count++;
+    total += cycles;
+
+    const int bits = (cycles == 0) ? 0 : (32 - __builtin_clz(cycles));
+    histogram[(bits < kHistogramSize) ? bits : (kHistogramSize - 1)]++;
+  }
+
+  void UpdateMean() {
+    // The ISR may run while we read, and on a 32 bit target the total
+    // takes two loads, so a read could see half of an update.  Every
+    // update changes the count, so retry until it is stable across
+    // the read of the total.
+    const volatile uint32_t* const volatile_count = &count;
+    const volatile uint64_t* const volatile_total = &total;
+    uint32_t this_count = 0;
+    uint64_t this_total = 0;
+    do {
+      this_count = *volatile_count;
+      this_total = *volatile_total;
+    } while (this_count != *volatile_count);
+
+    mean = (this_count == 0) ? 0.0f :
+        static_cast<float>(this_total) / static_cast<float>(this_count);
+  }
+
+  template <typename Archive>
+  void Serialize(Archive* a) {
+    a->Visit(MJ_NVP(last));
+    a->Visit(MJ_NVP(min));
+    a->Visit(MJ_NVP(max));
+    a->Visit(MJ_NVP(mean));
+    a->Visit(MJ_NVP(count));
+    a->Visit(MJ_NVP(histogram));
+  }
+};
+
+/// The per-stage statistics for the control ISR.  Each stage is
+/// measured from the end of the previous one.
+struct IsrProfile {
+  // From the start of the PWM interrupt until all ADCs and position
+  // sources have been sampled.
+  IsrStageProfile sense;
+  // Calculating the current state from the sensed values.
+  IsrStageProfile curstate;
+  // Running the active control mode and writing the PWM outputs.
+  IsrStageProfile control;
+  // Emitting the debug stream, if enabled.
+  IsrStageProfile emit;
+  // The entire ISR.
+  IsrStageProfile total;
+
+  uint32_t reset_count = 0;
+
+  template <typename Archive>
+  void Serialize(Archive* a) {
+    a->Visit(MJ_NVP(sense));
+    a->Visit(MJ_NVP(curstate));
+    a->Visit(MJ_NVP(control));
+    a->Visit(MJ_NVP(emit));
+    a->Visit(MJ_NVP(total));
+    a->Visit(MJ_NVP(reset_count));
+  }
+};
+
+/// Fills in an IsrProfile from a free running cycle counter.  The
+/// ISR calls ISR_Start once at the beginning of each cycle, then
+/// ISR_Mark at the end of each stage, and ISR_Finish at the end.
+class IsrProfiler {
+ public:
+  /// Until this is called, every stage is measured as taking no
+  /// cycles.
+  void SetCounter(volatile uint32_t* counter) { counter_ = counter; }
+
+  const IsrProfile& profile() const { return profile_; }
+  IsrProfile* mutable_profile() { return &profile_; }
+
+  /// Request that all statistics be cleared.  This is safe to call
+  /// outside of the ISR, as the clearing is done at the start of the
+  /// next cycle.
+  void Reset() { reset_requested_ = true; }
+
+  void PollMillisecond() {
+    profile_.sense.UpdateMean();
+    profile_.curstate.UpdateMean();
+    profile_.control.UpdateMean();
+    profile_.emit.UpdateMean();
+    profile_.total.UpdateMean();
+  }
+
+  void ISR_Start() MOTEUS_CCM_ATTRIBUTE {
+    if (reset_requested_) {
+      const auto reset_count = profile_.reset_count;
+      profile_ = {};
+      profile_.reset_count = reset_count + 1;
+      reset_requested_ = false;
+    }
+    start_ = mark_ = *counter_;
+  }
+
+  void ISR_Mark(IsrStageProfile* stage) MOTEUS_CCM_ATTRIBUTE {
+    const uint32_t now = *counter_;
+    stage->ISR_Update(now - mark_);
+    mark_ = now;
+  }
+
+  void ISR_Finish() MOTEUS_CCM_ATTRIBUTE {
+    profile_.total.ISR_Update(*counter_ - start_);
+  }
+
+ private:
+  volatile uint32_t null_counter_ = 0;
+  volatile uint32_t* counter_ = &null_counter_;
+  IsrProfile profile_;
+  volatile bool reset_requested_ = false;
+
+  uint32_t start_ = 0;
+  uint32_t mark_ = 0;
+};
+
+}
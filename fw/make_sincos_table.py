@@ -0,0 +1,37 @@
+#!/usr/bin/python3
+
+# Copyright 2023 mjbots Robotic Systems, LLC.  info@mjbots.com
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+'''Emit the kSinCosTable used by the non-CORDIC Cordic in foc.cc.'''
+
+import math
+
+SIZE = 256
+
+
+def fmt(value):
+    result = '{:.9g}'.format(value)
+    if '.' not in result and 'e' not in result:
+        result += '.0'
+    return result + 'f'
+
+
+def main():
+    for i in range(SIZE):
+        print("  {},  // {}".format(fmt(math.sin(2.0 * math.pi * i / SIZE)), i))
+
+
+if __name__ == '__main__':
+    main()
@@ -118,6 +118,10 @@ Value ScaleAcceleration(float value, size_t type) {
   return ScaleMapping(value, 0.05f, 0.001f, 0.00001f, type);
 }
 
+Value ScaleJerk(float value, size_t type) {
+  return ScaleMapping(value, 1.0f, 0.1f, 0.001f, type);
+}
+
 Value ScaleTemperature(float value, size_t type) {
   return ScaleMapping(value, 1.0f, 0.1f, 0.001f, type);
 }
@@ -210,6 +214,10 @@ float ReadAcceleration(Value value) {
   return ReadScaleMapping(value, 0.05f, 0.001f, 0.00001f);
 }
 
+float ReadJerk(Value value) {
+  return ReadScaleMapping(value, 1.0f, 0.1f, 0.001f);
+}
+
 float ReadCurrent(Value value) {
   return ReadScaleMapping(value, 1.0f, 0.1f, 0.001f);
 }
@@ -277,6 +285,8 @@ enum class Register {
   kCommandVelocityLimit = 0x028,
   kCommandAccelLimit = 0x029,
   kCommandFixedVoltageOverride = 0x02a,
+  kCommandJerkLimit = 0x02b,
+  kCommandMoveDuration = 0x02c,
 
   kPositionKp = 0x030,
   kPositionKi = 0x031,
@@ -299,6 +309,13 @@ enum class Register {
   kStayWithinMaxTorque = 0x045,
   kStayWithinTimeout = 0x046,
 
+  kWaypointPosition = 0x048,
+  kWaypointVelocity = 0x049,
+  kWaypointFeedforward = 0x04a,
+  kWaypointDuration = 0x04b,
+  kWaypointCount = 0x04c,
+  kWaypointClear = 0x04d,
+
   kEncoder0Position = 0x050,
   kEncoder0Velocity = 0x051,
   kEncoder1Position = 0x052,
@@ -341,6 +358,26 @@ enum class Register {
 
   kDriverFault1 = 0x140,
   kDriverFault2 = 0x141,
+
+  kIsrProfileReset = 0x150,
+
+  kIsrProfileSenseMean = 0x158,
+  kIsrProfileCurrentStateMean = 0x159,
+  kIsrProfileControlMean = 0x15a,
+  kIsrProfileEmitMean = 0x15b,
+  kIsrProfileTotalMean = 0x15c,
+
+  kIsrProfileSenseMax = 0x160,
+  kIsrProfileCurrentStateMax = 0x161,
+  kIsrProfileControlMax = 0x162,
+  kIsrProfileEmitMax = 0x163,
+  kIsrProfileTotalMax = 0x164,
+
+  kIsrProfileSenseMin = 0x168,
+  kIsrProfileCurrentStateMin = 0x169,
+  kIsrProfileControlMin = 0x16a,
+  kIsrProfileEmitMin = 0x16b,
+  kIsrProfileTotalMin = 0x16c,
 };
 
 aux::AuxHardwareConfig GetAux1HardwareConfig() {
@@ -610,6 +647,14 @@ class MoteusController::Impl : public multiplex::MicroServer::Server {
         command_.velocity_limit = ReadVelocity(value);
         return 0;
       }
+      case Register::kCommandJerkLimit: {
+        command_.jerk_limit = ReadJerk(value);
+        return 0;
+      }
+      case Register::kCommandMoveDuration: {
+        command_.move_duration_s = ReadTime(value);
+        return 0;
+      }
       case Register::kCommandFixedVoltageOverride: {
         command_.fixed_voltage_override = ReadVoltage(value);
         return 0;
@@ -638,6 +683,31 @@ class MoteusController::Impl : public multiplex::MicroServer::Server {
         return 0;
       }
 
+      case Register::kWaypointPosition: {
+        waypoint_.position = ReadPosition(value);
+        return 0;
+      }
+      case Register::kWaypointVelocity: {
+        waypoint_.velocity = ReadVelocity(value);
+        return 0;
+      }
+      case Register::kWaypointFeedforward: {
+        waypoint_.feedforward_Nm = ReadTorque(value);
+        return 0;
+      }
+      case Register::kWaypointDuration: {
+        // This is written last, and queues the waypoint.
+        const bool queued = bldc_.PushWaypoint(
+            waypoint_.position, waypoint_.velocity,
+            waypoint_.feedforward_Nm, ReadTime(value));
+        waypoint_ = {};
+        return queued ? 0 : 3;
+      }
+      case Register::kWaypointClear: {
+        bldc_.ClearWaypoints();
+        return 0;
+      }
+
       case Register::kAux1GpioCommand: {
         aux1_port_.WriteDigitalOut(ReadIntMapping(value));
         return 0;
@@ -666,6 +736,10 @@ class MoteusController::Impl : public multiplex::MicroServer::Server {
         bldc_.RequireReindex();
         return 0;
       }
+      case Register::kIsrProfileReset: {
+        bldc_.ResetProfile();
+        return 0;
+      }
 
       case Register::kPosition:
       case Register::kVelocity:
@@ -675,6 +749,7 @@ class MoteusController::Impl : public multiplex::MicroServer::Server {
       case Register::kDCurrent:
       case Register::kAbsPosition:
       case Register::kTrajectoryComplete:
+      case Register::kWaypointCount:
       case Register::kHomeState:
       case Register::kVoltage:
       case Register::kTorque:
@@ -718,7 +793,22 @@ class MoteusController::Impl : public multiplex::MicroServer::Server {
       case Register::kFirmwareVersion:
       case Register::kMultiplexId:
       case Register::kDriverFault1:
-      case Register::kDriverFault2: {
+      case Register::kDriverFault2:
+      case Register::kIsrProfileSenseMean:
+      case Register::kIsrProfileCurrentStateMean:
+      case Register::kIsrProfileControlMean:
+      case Register::kIsrProfileEmitMean:
+      case Register::kIsrProfileTotalMean:
+      case Register::kIsrProfileSenseMax:
+      case Register::kIsrProfileCurrentStateMax:
+      case Register::kIsrProfileControlMax:
+      case Register::kIsrProfileEmitMax:
+      case Register::kIsrProfileTotalMax:
+      case Register::kIsrProfileSenseMin:
+      case Register::kIsrProfileCurrentStateMin:
+      case Register::kIsrProfileControlMin:
+      case Register::kIsrProfileEmitMin:
+      case Register::kIsrProfileTotalMin: {
         // Not writeable
         return 2;
       }
@@ -736,6 +826,17 @@ class MoteusController::Impl : public multiplex::MicroServer::Server {
     return bldc_.motor_position_config()->sources[index];
   }
 
+  const IsrStageProfile& isr_profile_stage(int index) const {
+    const auto& profile = bldc_.profile();
+    switch (index) {
+      case 0: { return profile.sense; }
+      case 1: { return profile.curstate; }
+      case 2: { return profile.control; }
+      case 3: { return profile.emit; }
+    }
+    return profile.total;
+  }
+
   multiplex::MicroServer::ReadResult Read(
       multiplex::MicroServer::Register reg,
       size_t type) const override
@@ -846,6 +947,12 @@ class MoteusController::Impl : public multiplex::MicroServer::Server {
       case Register::kCommandAccelLimit: {
         return ScaleAcceleration(command_.accel_limit, type);
       }
+      case Register::kCommandJerkLimit: {
+        return ScaleJerk(command_.jerk_limit, type);
+      }
+      case Register::kCommandMoveDuration: {
+        return ScaleTime(command_.move_duration_s, type);
+      }
       case Register::kCommandFixedVoltageOverride: {
         return ScaleVoltage(command_.fixed_voltage_override, type);
       }
@@ -907,6 +1014,23 @@ class MoteusController::Impl : public multiplex::MicroServer::Server {
         return ScalePosition(command_.bounds_max, type);
       }
 
+      case Register::kWaypointPosition: {
+        return ScalePosition(waypoint_.position, type);
+      }
+      case Register::kWaypointVelocity: {
+        return ScaleVelocity(waypoint_.velocity, type);
+      }
+      case Register::kWaypointFeedforward: {
+        return ScaleTorque(waypoint_.feedforward_Nm, type);
+      }
+      case Register::kWaypointCount: {
+        return IntMapping(bldc_.waypoint_count(), type);
+      }
+      case Register::kWaypointDuration:
+      case Register::kWaypointClear: {
+        break;
+      }
+
       case Register::kEncoder0Position: {
         return ScalePosition(encoder_value(0).filtered_value / encoder_config(0).cpr, type);
       }
@@ -1012,7 +1136,8 @@ class MoteusController::Impl : public multiplex::MicroServer::Server {
       }
       case Register::kSetOutputNearest:
       case Register::kSetOutputExact:
-      case Register::kRequireReindex: {
+      case Register::kRequireReindex:
+      case Register::kIsrProfileReset: {
         break;
       }
       case Register::kDriverFault1: {
@@ -1021,6 +1146,37 @@ class MoteusController::Impl : public multiplex::MicroServer::Server {
       case Register::kDriverFault2: {
         return IntMapping(drv8323_.status()->fsr2, type);
       }
+
+      case Register::kIsrProfileSenseMean:
+      case Register::kIsrProfileCurrentStateMean:
+      case Register::kIsrProfileControlMean:
+      case Register::kIsrProfileEmitMean:
+      case Register::kIsrProfileTotalMean: {
+        const auto& stage = isr_profile_stage(
+            static_cast<int>(reg) -
+            static_cast<int>(Register::kIsrProfileSenseMean));
+        return IntMapping(static_cast<int32_t>(stage.mean), type);
+      }
+      case Register::kIsrProfileSenseMax:
+      case Register::kIsrProfileCurrentStateMax:
+      case Register::kIsrProfileControlMax:
+      case Register::kIsrProfileEmitMax:
+      case Register::kIsrProfileTotalMax: {
+        const auto& stage = isr_profile_stage(
+            static_cast<int>(reg) -
+            static_cast<int>(Register::kIsrProfileSenseMax));
+        return IntMapping(stage.max, type);
+      }
+      case Register::kIsrProfileSenseMin:
+      case Register::kIsrProfileCurrentStateMin:
+      case Register::kIsrProfileControlMin:
+      case Register::kIsrProfileEmitMin:
+      case Register::kIsrProfileTotalMin: {
+        const auto& stage = isr_profile_stage(
+            static_cast<int>(reg) -
+            static_cast<int>(Register::kIsrProfileSenseMin));
+        return IntMapping(stage.min, type);
+      }
     }
 
     // If we made it here, then we had an unknown register.
@@ -1039,6 +1195,14 @@ class MoteusController::Impl : public multiplex::MicroServer::Server {
 
   bool command_valid_ = false;
   BldcServo::CommandData command_;
+
+  // The waypoint being assembled from the kWaypoint registers.
+  struct WaypointRegisters {
+    float position = std::numeric_limits<float>::quiet_NaN();
+    float velocity = 0.0f;
+    float feedforward_Nm = std::numeric_limits<float>::quiet_NaN();
+  };
+  WaypointRegisters waypoint_;
 };
 
 MoteusController::MoteusController(micro::Pool* pool,
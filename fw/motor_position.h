@@ -23,6 +23,7 @@ IntToFloat and FloatToInt Utility Functions: Convert between integer and floatin
 
 #pragma once
 
+#include <algorithm>
 #include <array>
 #include <atomic>
 #include <cmath>
@@ -35,6 +36,8 @@ IntToFloat and FloatToInt Utility Functions: Convert between integer and floatin
 #include "fw/aux_common.h"
 #include "fw/bldc_servo_structs.h"
 #include "fw/ccm.h"
+#include "fw/fixed_point.h"
+#include "fw/harmonic_fit.h"
 #include "fw/math.h"
 
 namespace moteus {
@@ -43,7 +46,16 @@ class MotorPosition {
  public:
   static constexpr int kNumSources = 3;
   static constexpr int kHallCounts = 6;
+  // Interpolated hall sources have this many counts per transition.
+  static constexpr int kHallInterpolation = 256;
   static constexpr int kCompensationSize = 32;
+  static constexpr int kCompensationHarmonics = 8;
+  // The total number of lookup table entries shared among all
+  // compensated sources.
+  static constexpr int kCompensationLutSize = 1024;
+  // Sensorless sources have this many counts per electrical
+  // revolution.
+  static constexpr int kSensorlessCounts = 65536;
 
   struct SourceConfig {
     uint8_t aux_number = 1;
@@ -80,6 +92,26 @@ class MotorPosition {
 
     float pll_filter_hz = 400.0;
 
+    // Selects how the position, velocity, and acceleration of this
+    // source are estimated from the compensated value.  pll_filter_hz
+    // sets the bandwidth for all of them.
+    enum Estimator {
+      // A second order PLL, critically damped.  This has no estimate
+      // of acceleration.
+      kPll,
+      // A third order PLL, with all poles at pll_filter_hz.  This
+      // tracks constant acceleration with no steady state error.
+      kPll3,
+      // The steady state Kalman filter for a constant jerk process,
+      // where pll_filter_hz is (process noise / measurement
+      // noise)^(1/6) / 2pi.  This has the same tracking properties
+      // as kPll3, with less overshoot for the same bandwidth.
+      kKalman,
+
+      kNumEstimators,
+    };
+    Estimator estimator = kPll;
+
     // The CPR for this source is subdivided into N equal segments.
     // This table specifies a fraction of CPR that should be applied
     // when at the *center* of that offset region.  Other counts will
@@ -96,6 +128,56 @@ class MotorPosition {
     //  31    248-255        252
     std::array<float, kCompensationSize> compensation_table = {};
 
+    // Terms of a Fourier series which are summed with the
+    // compensation table.
+    struct CompensationHarmonic {
+      // The number of cycles per CPR.  0 disables this term.
+      uint16_t order = 0;
+      // Amplitudes as a fraction of CPR.
+      float cos_term = 0.0f;
+      float sin_term = 0.0f;
+
+      template <typename Archive>
+      void Serialize(Archive* a) {
+        a->Visit(MJ_NVP(order));
+        a->Visit(MJ_NVP(cos_term));
+        a->Visit(MJ_NVP(sin_term));
+      }
+    };
+    std::array<CompensationHarmonic, kCompensationHarmonics>
+        compensation_harmonics = {};
+
+    // The table and harmonics are combined into a lookup table with
+    // 2^compensation_bits entries, which is linearly interpolated at
+    // runtime.  This may be from 5 to 10, and the total across all
+    // compensated sources must fit in kCompensationLutSize.
+    uint8_t compensation_bits = 8;
+
+    // Only used for sensorless sources.  The bandwidth at which the
+    // magnitude of the estimated rotor flux is corrected towards
+    // that implied by motor.v_per_hz.
+    float observer_hz = 100.0f;
+
+    // A fixed delay between when this source measures the position
+    // and when its reading is stamped, for instance from filtering
+    // internal to the encoder.  This is added to the measured age of
+    // each sample, and the sample is extrapolated by the estimated
+    // velocity over the total.
+    int32_t latency_us = 0;
+
+    // Only used for hall sources.  If non-zero, the position is
+    // interpolated between transitions at the speed measured from the
+    // interval between the last two, and the CPR is multiplied by
+    // kHallInterpolation.  Below this electrical frequency, or after
+    // a reversal, the position steps at each transition as usual.
+    float hall_interpolation_min_hz = 0.0f;
+
+    // Only used for quadrature sources.  If non-zero, the velocity is
+    // measured from the time between edges when below this many
+    // counts per second, and taken from the filter alone when above
+    // twice this.  In between, the two are blended.
+    float edge_velocity_max = 0.0f;
+
     template <typename Archive>
     void Serialize(Archive* a) {
       a->Visit(MJ_NVP(aux_number));
@@ -109,6 +191,13 @@ class MotorPosition {
       a->Visit(MJ_NVP(reference));
       a->Visit(MJ_NVP(pll_filter_hz));
       a->Visit(MJ_NVP(compensation_table));
+      a->Visit(MJ_NVP(observer_hz));
+      a->Visit(MJ_NVP(estimator));
+      a->Visit(MJ_NVP(latency_us));
+      a->Visit(MJ_NVP(compensation_harmonics));
+      a->Visit(MJ_NVP(compensation_bits));
+      a->Visit(MJ_NVP(hall_interpolation_min_hz));
+      a->Visit(MJ_NVP(edge_velocity_max));
     }
   };
 
@@ -138,12 +227,22 @@ class MotorPosition {
       // crossed.
       int8_t reference_source = -1;
 
+      // If set, the output position and velocity are fused from
+      // 'source', above the crossover frequency, and this source,
+      // below it.  This is intended to combine a fast, noisy source,
+      // like a rotor encoder, with a slow and accurate absolute one,
+      // like an encoder after a reducer.
+      int8_t fusion_source = -1;
+      float fusion_crossover_hz = 2.0f;
+
       template <typename Archive>
       void Serialize(Archive* a) {
         a->Visit(MJ_NVP(source));
         a->Visit(MJ_NVP(offset));
         a->Visit(MJ_NVP(sign));
         a->Visit(MJ_NVP(reference_source));
+        a->Visit(MJ_NVP(fusion_source));
+        a->Visit(MJ_NVP(fusion_crossover_hz));
       }
     };
     Output output;
@@ -152,6 +251,34 @@ class MotorPosition {
     // should be less than 1.0f, otherwise greater.
     float rotor_to_output_ratio = 1.0f;
 
+    // When enabled, the periodic error of a rotor referenced source
+    // is learned while the motor turns, by comparing it against
+    // output.reference_source.  The result is written to the first
+    // 'harmonics' entries of the source's compensation_harmonics.
+    struct SelfCalibration {
+      bool enabled = false;
+      int8_t source = 0;
+      uint8_t harmonics = 4;
+
+      // The number of samples, taken once per millisecond, used for
+      // each update.  Every 1/32 of a revolution must be seen at
+      // least once.
+      int32_t samples = 5000;
+
+      // The fraction of each estimated correction which is applied.
+      float gain = 0.5f;
+
+      template <typename Archive>
+      void Serialize(Archive* a) {
+        a->Visit(MJ_NVP(enabled));
+        a->Visit(MJ_NVP(source));
+        a->Visit(MJ_NVP(harmonics));
+        a->Visit(MJ_NVP(samples));
+        a->Visit(MJ_NVP(gain));
+      }
+    };
+    SelfCalibration self_calibration;
+
     Config() {
       // The factory default is to get rotor position directly from
       // the onboard SPI encoder (attached to aux1).
@@ -166,6 +293,7 @@ class MotorPosition {
       a->Visit(MJ_NVP(commutation_source));
       a->Visit(MJ_NVP(output));
       a->Visit(MJ_NVP(rotor_to_output_ratio));
+      a->Visit(MJ_NVP(self_calibration));
     }
   };
 
@@ -190,6 +318,14 @@ class MotorPosition {
 
     float velocity = 0.0f;
 
+    // This is only estimated by third order estimators, and is
+    // otherwise 0.
+    float acceleration = 0.0f;
+
+    // How old the most recent value was at the current sample
+    // instant, including the configured latency.
+    int32_t age_us = 0;
+
     template <typename Archive>
     void Serialize(Archive* a) {
       a->Visit(MJ_NVP(active_velocity));
@@ -202,6 +338,8 @@ class MotorPosition {
       a->Visit(MJ_NVP(compensated_value));
       a->Visit(MJ_NVP(filtered_value));
       a->Visit(MJ_NVP(velocity));
+      a->Visit(MJ_NVP(acceleration));
+      a->Visit(MJ_NVP(age_us));
     }
   };
 
@@ -259,6 +397,12 @@ class MotorPosition {
     // The velocity is the same for both absolute and relative
     // position.
     float velocity = 0.0f;
+    float acceleration = 0.0f;
+
+    // When fusion is enabled, the amount added to the position and
+    // velocity from the output source.
+    float fusion_correction = 0.0f;
+    float fusion_velocity = 0.0f;
 
 
     //////////////////////////////
@@ -266,7 +410,30 @@ class MotorPosition {
 
     // The current electrical phase for commutation.
     bool theta_valid = false;
+    // This is derived from electrical_phase and is only for
+    // telemetry.
     float electrical_theta = 0.0f;
+    // 2^32 counts per electrical revolution.
+    uint32_t electrical_phase = 0;
+
+    struct SelfCalibration {
+      int32_t samples = 0;
+      uint16_t updates = 0;
+      // The RMS error of the calibrated source, as a fraction of a
+      // rotor revolution, over the samples of the last update.
+      float error_rms = 0.0f;
+      // The RMS error left after removing the estimated correction.
+      float residual_rms = 0.0f;
+
+      template <typename Archive>
+      void Serialize(Archive* a) {
+        a->Visit(MJ_NVP(samples));
+        a->Visit(MJ_NVP(updates));
+        a->Visit(MJ_NVP(error_rms));
+        a->Visit(MJ_NVP(residual_rms));
+      }
+    };
+    SelfCalibration self_calibration;
 
     template <typename Archive>
     void Serialize(Archive* a) {
@@ -280,8 +447,13 @@ class MotorPosition {
       a->Visit(MJ_NVP(position));
       a->Visit(MJ_NVP(homed));
       a->Visit(MJ_NVP(velocity));
+      a->Visit(MJ_NVP(acceleration));
       a->Visit(MJ_NVP(theta_valid));
       a->Visit(MJ_NVP(electrical_theta));
+      a->Visit(MJ_NVP(electrical_phase));
+      a->Visit(MJ_NVP(self_calibration));
+      a->Visit(MJ_NVP(fusion_correction));
+      a->Visit(MJ_NVP(fusion_velocity));
     }
   };
 
@@ -312,15 +484,90 @@ class MotorPosition {
     ISR_UpdateSources(dt);
 
     // Then update our output structures.
-    ISR_UpdateState();
+    ISR_UpdateState(dt);
+
+    if (calibration_sample_requested_) {
+      ISR_SampleCalibration();
+    }
   }
 
+  // Learn the compensation of the self calibration source.  This
+  // must not be called from an ISR.
+  void PollMillisecond() {
+    if (!calibration_enabled_) { return; }
+
+    if (calibration_build_index_ >= 0) {
+      ContinueCalibrationBuild();
+      return;
+    }
+
+    if (!calibration_sample_requested_) {
+      if (calibration_sample_.valid) {
+        AddCalibrationSample();
+      }
+      calibration_sample_requested_ = true;
+    }
+
+    auto& status = status_.self_calibration;
+    status.samples = calibration_fit_.count();
+    if (status.samples < config_.self_calibration.samples ||
+        calibration_coverage_ != 0xffffffffu) {
+      return;
+    }
+
+    const auto& calibration = config_.self_calibration;
+    CalibrationFit::Coefficients coefficients;
+    status.error_rms = calibration_fit_.rms();
+    const bool solved =
+        calibration_fit_.Solve(&coefficients, &status.residual_rms);
+    ResetCalibrationFit();
+    if (!solved) { return; }
+
+    // Remove the estimated error from the existing compensation.
+    auto& harmonics = config_.sources[calibration.source].compensation_harmonics;
+    for (int k = 1; k <= calibration.harmonics; k++) {
+      auto& harmonic = harmonics[k - 1];
+      if (harmonic.order != k) {
+        harmonic = {};
+        harmonic.order = k;
+      }
+      harmonic.cos_term -= calibration.gain * coefficients[2 * k - 1];
+      harmonic.sin_term -= calibration.gain * coefficients[2 * k];
+    }
+
+    calibration_build_index_ = 0;
+    calibration_build_max_ = 0.0f;
+  }
+
+  // Provide the stationary frame currents measured this cycle and
+  // the voltages commanded for the next period.  These are only used
+  // by sensorless sources.
+  void ISR_SetSensorlessInput(float i_alpha_A, float i_beta_A,
+                              float v_alpha_V, float v_beta_V) MOTEUS_CCM_ATTRIBUTE {
+    sensorless_.i_alpha_A = i_alpha_A;
+    sensorless_.i_beta_A = i_beta_A;
+    sensorless_.v_alpha_V = v_alpha_V;
+    sensorless_.v_beta_V = v_beta_V;
+  }
+
+  bool has_sensorless() const { return has_sensorless_; }
+
   void RegisterConfigUpdated(mjlib::base::inplace_function<void ()> handler) {
     config_updated_ = handler;
   }
 
   // Force the output position to be the given value.
   void ISR_SetOutputPosition(float value) MOTEUS_CCM_ATTRIBUTE {
+    // The fusion source must not pull the position back into its own
+    // frame.  If it was already being fused, keep its error as it
+    // was, otherwise take its frame from the next update.
+    if (status_.homed != Status::kRelative) {
+      fusion_offset_ = WrapBalancedCpr(
+          fusion_offset_ + value - status_.position, fusion_ambiguity_scale_);
+    } else {
+      fusion_capture_offset_ = true;
+    }
+
     status_.position = value;
     status_.position_raw = static_cast<int64_t>(static_cast<double>(value) * (1ll << 48));
     status_.homed = Status::kOutput;
@@ -368,6 +615,13 @@ class MotorPosition {
   // The high 32 bits of (position - position_relative).
   std::atomic<int32_t> absolute_relative_delta;
 
+  /// Return the electrical phase, with 2^32 counts per revolution,
+  /// that corresponds to the given output position.
+  uint32_t OutputPositionToElectricalPhase(int64_t position_raw) const MOTEUS_CCM_ATTRIBUTE {
+    // The raw position has 2^48 counts per revolution.
+    return output_phase_(position_raw >> 16);
+  }
+
   static float WrapBalancedCpr(float value, float cpr) MOTEUS_CCM_ATTRIBUTE {
     return WrapCpr(value + 1.5f * cpr, cpr) - 0.5f * cpr;
   }
@@ -380,11 +634,105 @@ class MotorPosition {
     return (mod >= 0.0f) ? mod : (mod + cpr);
   }
 
+  // Identical to WrapCpr, but without a division for values less
+  // than one CPR outside of the range, which is all the ISR sees.
+  static float WrapCprFast(float value, float cpr) MOTEUS_CCM_ATTRIBUTE {
+    if (value >= cpr) {
+      if (value < 2.0f * cpr) { return value - cpr; }
+    } else if (value >= 0.0f) {
+      return value;
+    } else if (value > -cpr) {
+      return value + cpr;
+    }
+    return WrapCpr(value, cpr);
+  }
+
   static uint32_t WrapIntCpr(int32_t value, uint32_t cpr) MOTEUS_CCM_ATTRIBUTE {
     return (value + cpr) % cpr;
   }
 
  private:
+  struct Compensation {
+    // A slice of compensation_lut_, in units of counts_per_lsb.
+    int16_t* table = nullptr;
+    // If zero, this source is not compensated.
+    float counts_per_lsb = 0.0f;
+    float lsb_per_fraction = 0.0f;
+    // Converts a value in [0, cpr) to a fraction of a revolution in
+    // 0.32.
+    uint32_t phase_scale = 0;
+    int index_shift = 0;
+    uint32_t index_mask = 0;
+  };
+
+  struct SourceKernel;
+  using SourceReader = bool (MotorPosition::*)(
+      const SourceKernel&, SourceStatus*, uint32_t* sample_us, float dt);
+
+  // Everything the ISR needs to update one configured source, built
+  // by HandleConfigUpdate.
+  struct SourceKernel {
+    SourceReader read = nullptr;
+    uint8_t index = 0;
+    const aux::AuxStatus* aux = nullptr;
+    // Sensorless sources do not depend upon their aux port.
+    bool check_aux_error = true;
+    bool edge_velocity = false;
+    uint32_t cpr = 0;
+    float float_cpr = 0.0f;
+    // floor(2^32 / cpr), used to wrap non power of two values
+    // without a hardware divide.
+    uint32_t cpr_reciprocal = 0;
+  };
+
+  static SourceReader SelectReader(const SourceConfig& config) {
+    const bool power_of_two =
+        config.cpr != 0 && (config.cpr & (config.cpr - 1)) == 0;
+    using M = MotorPosition;
+    switch (config.type) {
+      case SourceConfig::kSpi: {
+        return power_of_two ? &M::ISR_ReadSpi<true> : &M::ISR_ReadSpi<false>;
+      }
+      case SourceConfig::kUart: {
+        return power_of_two ? &M::ISR_ReadUart<true> : &M::ISR_ReadUart<false>;
+      }
+      case SourceConfig::kSineCosine: {
+        return power_of_two ?
+            &M::ISR_ReadSineCosine<true> : &M::ISR_ReadSineCosine<false>;
+      }
+      case SourceConfig::kI2C: {
+        return power_of_two ? &M::ISR_ReadI2c<true> : &M::ISR_ReadI2c<false>;
+      }
+      case SourceConfig::kHall: {
+        if (config.hall_interpolation_min_hz > 0.0f) {
+          return power_of_two ?
+              &M::ISR_ReadHallInterpolated<true> :
+              &M::ISR_ReadHallInterpolated<false>;
+        }
+        return power_of_two ? &M::ISR_ReadHall<true> : &M::ISR_ReadHall<false>;
+      }
+      case SourceConfig::kQuadrature: {
+        if (config.edge_velocity_max > 0.0f) {
+          return power_of_two ?
+              &M::ISR_ReadQuadratureTimed<true> :
+              &M::ISR_ReadQuadratureTimed<false>;
+        }
+        return power_of_two ?
+            &M::ISR_ReadQuadrature<true> : &M::ISR_ReadQuadrature<false>;
+      }
+      case SourceConfig::kIndex: {
+        return &M::ISR_ReadIndex;
+      }
+      case SourceConfig::kSensorless: {
+        return power_of_two ?
+            &M::ISR_ReadSensorless<true> : &M::ISR_ReadSensorless<false>;
+      }
+      default: {
+        return nullptr;
+      }
+    }
+  }
+
   bool IsThetaCapable(const SourceConfig& config) const MOTEUS_CCM_ATTRIBUTE {
       // TODO: eventually exclude spi options that are incremental
 
@@ -392,7 +740,8 @@ class MotorPosition {
         config.type == SourceConfig::kI2C ||
         config.type == SourceConfig::kHall ||
         config.type == SourceConfig::kSineCosine ||
-        config.type == SourceConfig::kUart;
+        config.type == SourceConfig::kUart ||
+        config.type == SourceConfig::kSensorless;
   };
 
   void HandleConfigUpdate() {
@@ -402,6 +751,13 @@ class MotorPosition {
 
     status_.epoch = old_epoch + 1;
 
+    num_source_kernels_ = 0;
+    hall_state_ = {};
+    edge_timing_ = {};
+    has_sensorless_ = false;
+    calibration_enabled_ = false;
+    calibration_sample_requested_ = false;
+
     for (size_t i = 0; i < config_.sources.size(); i++) {
       auto& source_config = config_.sources[i];
 
@@ -444,12 +800,36 @@ class MotorPosition {
           // require the CPR to be directly related to the motor pole
           // count.
           source_config.cpr = kHallCounts * motor_.poles / 2;
+          if (source_config.hall_interpolation_min_hz > 0.0f) {
+            source_config.cpr *= kHallInterpolation;
+            hall_state_[i].max_interval_s =
+                1.0f / (kHallCounts * source_config.hall_interpolation_min_hz);
+          }
           break;
         }
         case SourceConfig::kSineCosine: {
           source_config.cpr = 65536;
           break;
         }
+        case SourceConfig::kSensorless: {
+          // Like hall effect sources, these measure the electrical
+          // phase, so are relative to the rotor and count each pole
+          // pair separately.
+          // There is only one flux observer.
+          if (source_config.reference != SourceConfig::kRotor ||
+              has_sensorless_) {
+            status_.error = Status::kInvalidConfig;
+            return;
+          }
+          if (motor_.poles == 0 || motor_.v_per_hz <= 0.0f ||
+              motor_.inductance_H <= 0.0f) {
+            status_.error = Status::kMotorNotConfigured;
+            return;
+          }
+          source_config.cpr = kSensorlessCounts * motor_.poles / 2;
+          has_sensorless_ = true;
+          break;
+        }
         case SourceConfig::kIndex: {
           if (source_config.reference != SourceConfig::kOutput) {
             status_.error = Status::kInvalidConfig;
@@ -463,6 +843,35 @@ class MotorPosition {
       }
     }
 
+    // The ISR only visits the configured sources.
+    for (size_t i = 0; i < config_.sources.size(); i++) {
+      const auto& source_config = config_.sources[i];
+      if (source_config.type == SourceConfig::kNone) { continue; }
+
+      auto& kernel = source_kernels_[num_source_kernels_];
+      kernel = {};
+      kernel.read = SelectReader(source_config);
+      if (kernel.read == nullptr) {
+        status_.error = Status::kInvalidConfig;
+        return;
+      }
+      kernel.index = i;
+      kernel.aux = aux_status_[source_config.aux_number - 1];
+      kernel.check_aux_error = source_config.type != SourceConfig::kSensorless;
+      kernel.edge_velocity =
+          source_config.type == SourceConfig::kQuadrature &&
+          source_config.edge_velocity_max > 0.0f;
+      if (kernel.edge_velocity) {
+        edge_timing_[i].inverse_max_velocity =
+            1.0f / source_config.edge_velocity_max;
+      }
+      kernel.cpr = source_config.cpr;
+      kernel.float_cpr = source_config.cpr;
+      kernel.cpr_reciprocal =
+          source_config.cpr > 1 ? (0xffffffffu / source_config.cpr) : 0;
+      num_source_kernels_++;
+    }
+
     if (config_.commutation_source < 0 ||
         (config_.commutation_source >=
          static_cast<int>(config_.sources.size()))) {
@@ -509,12 +918,23 @@ class MotorPosition {
         }
       }
     }
-    commutation_pole_scale_ = motor_.poles * 0.5f * k2Pi;
-
-    commutation_rotor_scale_ =
+    const float pole_pairs = motor_.poles * 0.5f;
+    const float commutation_rotor_scale =
         (commutation_config_->reference == SourceConfig::kRotor ?
          1.0f :
          config_.rotor_to_output_ratio);
+    commutation_cpr_scale_ = 4294967296.0f / commutation_config_->cpr;
+    commutation_phase_ =
+        PhaseMultiplier::FromFloat(pole_pairs / commutation_rotor_scale);
+    for (size_t i = 0; i < motor_.offset.size(); i++) {
+      // The offsets are calibrated for an encoder, whereas a
+      // sensorless source measures the electrical phase directly.
+      commutation_offset_[i] =
+          (commutation_config_->type == SourceConfig::kSensorless) ? 0u :
+          static_cast<uint32_t>(RadiansToQ31(motor_.offset[i]));
+    }
+    output_phase_ =
+        PhaseMultiplier::FromFloat(pole_pairs / config_.rotor_to_output_ratio);
 
 
     // If we have a reference source, check it out.
@@ -566,13 +986,111 @@ class MotorPosition {
     output_encoder_step_hb_3_4_ =
         (output_encoder_step_ / 4 * 3) >> 32;
 
+    source_relative_raw_ = 0;
+    fusion_source_ = nullptr;
+    fusion_correction_raw_ = 0;
+    fusion_offset_ = 0.0f;
+    fusion_capture_offset_ = false;
+    if (config_.output.fusion_source >= 0) {
+      const auto fusion_index = config_.output.fusion_source;
+      if (fusion_index >= kNumSources ||
+          fusion_index == config_.output.source ||
+          config_.sources[fusion_index].type == SourceConfig::kNone ||
+          !(config_.output.fusion_crossover_hz > 0.0f)) {
+        status_.error = Status::kInvalidConfig;
+        return;
+      }
+      const auto& fusion_config = config_.sources[fusion_index];
+      fusion_source_ = &status_.sources[fusion_index];
+      fusion_ambiguity_scale_ =
+          (fusion_config.reference == SourceConfig::kRotor) ?
+          config_.rotor_to_output_ratio : 1.0f;
+      fusion_cpr_scale_ = fusion_ambiguity_scale_ / fusion_config.cpr;
+
+      // Critically damped, so that the step response of the position
+      // has no overshoot.
+      const float w = k2Pi * config_.output.fusion_crossover_hz;
+      fusion_kp_ = 2.0f * w;
+      fusion_ki_ = w * w;
+    }
+
     for (size_t i = 0; i < pll_filter_constants_.size(); i++) {
       const auto& config = config_.sources[i];
       auto& constants = pll_filter_constants_[i];
 
       const float w_3db = config.pll_filter_hz * k2Pi;
-      constants.kp = 2.0f * w_3db;
-      constants.ki = w_3db * w_3db;
+      switch (config.estimator) {
+        case SourceConfig::kPll:
+        case SourceConfig::kNumEstimators: {
+          // (s + w)^2
+          constants.kp = 2.0f * w_3db;
+          constants.ki = w_3db * w_3db;
+          constants.ka = 0.0f;
+          break;
+        }
+        case SourceConfig::kPll3: {
+          // (s + w)^3
+          constants.kp = 3.0f * w_3db;
+          constants.ki = 3.0f * w_3db * w_3db;
+          constants.ka = w_3db * w_3db * w_3db;
+          break;
+        }
+        case SourceConfig::kKalman: {
+          // The steady state Kalman-Bucy filter for a triple
+          // integrator driven by white jerk has its poles in a third
+          // order Butterworth pattern, (s + w)(s^2 + w s + w^2).
+          constants.kp = 2.0f * w_3db;
+          constants.ki = 2.0f * w_3db * w_3db;
+          constants.ka = w_3db * w_3db * w_3db;
+          break;
+        }
+      }
+    }
+
+    if (config_.self_calibration.enabled) {
+      const auto& calibration = config_.self_calibration;
+      if (calibration.source < 0 || calibration.source >= kNumSources ||
+          config_.output.reference_source < 0 ||
+          config_.output.reference_source >= kNumSources ||
+          calibration.harmonics < 1 ||
+          calibration.harmonics > kCompensationHarmonics) {
+        status_.error = Status::kInvalidConfig;
+        return;
+      }
+      if (config_.sources[calibration.source].reference !=
+          SourceConfig::kRotor ||
+          config_.sources[config_.output.reference_source].reference !=
+          SourceConfig::kOutput) {
+        status_.error = Status::kInvalidConfig;
+        return;
+      }
+      // The rotor must make a whole number of revolutions per output
+      // revolution for its position to be known from the reference.
+      const float inverse = 1.0f / config_.rotor_to_output_ratio;
+      if (std::abs(std::round(inverse) - inverse) > 0.001f) {
+        status_.error = Status::kInvalidConfig;
+        return;
+      }
+      calibration_ratio_ = std::round(inverse);
+      calibration_enabled_ = true;
+    }
+    ResetCalibrationFit();
+    calibration_sample_ = {};
+    calibration_build_index_ = -1;
+
+    if (!UpdateCompensation()) {
+      status_.error = Status::kInvalidConfig;
+      return;
+    }
+
+    if (has_sensorless_) {
+      // The peak flux linkage of the magnet.
+      const float flux_Wb = motor_.v_per_hz / (k2Pi * motor_.poles * 0.5f);
+      sensorless_ = {};
+      sensorless_.psi_alpha_Wb = flux_Wb;
+      sensorless_inv_flux2_ = 1.0f / (flux_Wb * flux_Wb);
+      // The squared magnitude error decays at twice this rate.
+      sensorless_gain_ = kPi * config_.sources[FindSensorless()].observer_hz;
     }
 
     if (config_updated_) {
@@ -580,33 +1098,36 @@ class MotorPosition {
     }
   }
 
-  void ISR_UpdateState() MOTEUS_CCM_ATTRIBUTE {
+  void ISR_UpdateState(float dt) MOTEUS_CCM_ATTRIBUTE {
     if (status_.error != Status::kNone) { return; }
 
     ISR_UpdateCommutation();
-    ISR_UpdateOutput();
+    ISR_UpdateOutput(dt);
   }
 
   void ISR_UpdateCommutation() MOTEUS_CCM_ATTRIBUTE {
-    const auto& commutation_config = *commutation_config_;
     const auto& commutation_status = *commutation_status_;
 
     if (commutation_status.active_theta) {
-      const float ratio =
-          commutation_status.filtered_value / commutation_config.cpr;
-      const int offset_size = motor_.offset.size();
-      const int offset_index =
-          std::min<int>(offset_size - 1, ratio * offset_size);
-      // MJ_ASSERT(offset_index >= 0 && offset_index < offset_size);
+      // The encoder position as a fraction of a revolution, with 2^32
+      // counts per revolution.  The limit guards against rounding
+      // up to a full revolution, which would overflow.
+      const uint32_t ratio = static_cast<uint32_t>(
+          std::min(commutation_status.filtered_value * commutation_cpr_scale_,
+                   kMaxRatio));
+      const uint32_t offset_index = static_cast<uint32_t>(
+          (static_cast<uint64_t>(ratio) * commutation_offset_.size()) >> 32);
 
       status_.theta_valid = true;
-      status_.electrical_theta = WrapZeroToTwoPi(
-          ratio * commutation_pole_scale_ / commutation_rotor_scale_ +
-          motor_.offset[offset_index]);
+      status_.electrical_phase =
+          commutation_phase_(ratio) + commutation_offset_[offset_index];
+      status_.electrical_theta =
+          static_cast<float>(status_.electrical_phase) *
+          (k2Pi / 4294967296.0f);
     }
   }
 
-  void ISR_UpdateOutput() MOTEUS_CCM_ATTRIBUTE {
+  void ISR_UpdateOutput(float dt) MOTEUS_CCM_ATTRIBUTE {
     const auto& output_status = *output_status_;
 
     if (output_status.active_velocity) {
@@ -637,7 +1158,7 @@ class MotorPosition {
       // cycles.  This ensures that our relative position remains
       // exactly in sync with the encoder value.
       const auto modulo_delta =
-          status_.position_relative_raw - status_.position_relative_modulo;
+          source_relative_raw_ - status_.position_relative_modulo;
       if ((modulo_delta >> 32) < output_encoder_step_hb_1_4_ &&
           encoder_ratio > 0.75f) {
         status_.position_relative_modulo -= output_encoder_step_;
@@ -646,10 +1167,18 @@ class MotorPosition {
         status_.position_relative_modulo += output_encoder_step_;
       }
 
-      status_.position_relative_raw =
+      source_relative_raw_ =
           status_.position_relative_modulo +
           scaled_int_encoder_ratio;
 
+      const float source_velocity = output_status.velocity * output_cpr_scale_;
+      if (fusion_source_) {
+        ISR_UpdateFusion(dt);
+      }
+
+      status_.position_relative_raw =
+          source_relative_raw_ + fusion_correction_raw_;
+
       // Since position_relative is integral and exact, we can exactly
       // update our absolute position with no loss by applying its
       // incremental change to the absolute position.
@@ -672,11 +1201,14 @@ class MotorPosition {
 
         status_.position_raw = int64_first_output;
         status_.homed = Status::kRotor;
+        fusion_offset_ = 0.0f;
+        fusion_capture_offset_ = false;
       }
 
       status_.position_relative = IntToFloat(status_.position_relative_raw);
       status_.position = IntToFloat(status_.position_raw);
-      status_.velocity = output_status.velocity * output_cpr_scale_;
+      status_.velocity = source_velocity + status_.fusion_velocity;
+      status_.acceleration = output_status.acceleration * output_cpr_scale_;
     }
 
     if (!output_status.active_velocity &&
@@ -715,23 +1247,276 @@ class MotorPosition {
     }
   }
 
-  void ISR_UpdateSources(float dt) MOTEUS_CCM_ATTRIBUTE {
-    for (size_t i = 0; i < status_.sources.size(); i++) {
-      const auto& config = config_.sources[i];
+  // A second order complementary filter.  The correction, and a
+  // velocity bias, are driven towards the difference between the
+  // fusion source and the current output position.
+  void ISR_UpdateFusion(float dt) MOTEUS_CCM_ATTRIBUTE {
+    const auto& fusion_status = *fusion_source_;
+    if (!fusion_status.active_theta || status_.homed == Status::kRelative) {
+      return;
+    }
+
+    const float fusion_value =
+        (fusion_status.filtered_value * fusion_cpr_scale_ +
+         config_.output.offset) * config_.output.sign;
+    if (fusion_capture_offset_) {
+      fusion_offset_ = WrapBalancedCpr(status_.position - fusion_value,
+                                       fusion_ambiguity_scale_);
+      fusion_capture_offset_ = false;
+    }
+    const float error =
+        WrapBalancedCpr(fusion_value + fusion_offset_ - status_.position,
+                        fusion_ambiguity_scale_);
+
+    // Only the bias is applied to the velocity, as the proportional
+    // term would add the noise of the fusion source.
+    status_.fusion_velocity += dt * fusion_ki_ * error;
+    status_.fusion_correction +=
+        dt * (fusion_kp_ * error + status_.fusion_velocity);
+    // This can exceed the range of an int32 after a long run with
+    // slip in the reducer.
+    fusion_correction_raw_ =
+        (1ll << 24) *
+        static_cast<int64_t>((1l << 24) * status_.fusion_correction);
+  }
 
-      if (config.type == SourceConfig::kNone) {
+  // Return the compensation for the given source, as a fraction of
+  // CPR, at a position of 'x' revolutions.
+  static float EvaluateCompensation(const SourceConfig& config, float x) {
+    // The table values apply at the center of each bin.
+    const float t = x * kCompensationSize - 0.5f;
+    const float left_bin = std::floor(t);
+    const float fraction = t - left_bin;
+    const int left = (static_cast<int>(left_bin) + kCompensationSize) %
+        kCompensationSize;
+    const int right = (left + 1) % kCompensationSize;
+    float result =
+        (config.compensation_table[right] - config.compensation_table[left]) *
+        fraction + config.compensation_table[left];
+
+    for (const auto& harmonic : config.compensation_harmonics) {
+      if (harmonic.order == 0) { continue; }
+      const float angle = k2Pi * harmonic.order * x;
+      result += harmonic.cos_term * std::cos(angle) +
+          harmonic.sin_term * std::sin(angle);
+    }
+    return result;
+  }
+
+  // Expand the compensation configuration of each source into its
+  // lookup table.  Return false if they do not all fit.
+  bool UpdateCompensation() {
+    size_t lut_used = 0;
+
+    calibration_spare_ = {};
+    calibration_staging_ = &calibration_spare_;
+
+    for (size_t i = 0; i < config_.sources.size(); i++) {
+      auto& config = config_.sources[i];
+      auto& comp = compensation_[i];
+      comp = {};
+      active_compensation_[i] = &comp;
+
+      config.compensation_bits =
+          std::max<uint8_t>(5, std::min<uint8_t>(10, config.compensation_bits));
+
+      const bool any_table =
+          std::any_of(config.compensation_table.begin(),
+                      config.compensation_table.end(),
+                      [](float v) { return v != 0.0f; });
+      const bool any_harmonic =
+          std::any_of(config.compensation_harmonics.begin(),
+                      config.compensation_harmonics.end(),
+                      [](const auto& h) {
+                        return h.order != 0 &&
+                            (h.cos_term != 0.0f || h.sin_term != 0.0f);
+                      });
+      const bool calibrated =
+          calibration_enabled_ &&
+          config_.self_calibration.source == static_cast<int>(i);
+      if (config.type == SourceConfig::kNone ||
+          (!any_table && !any_harmonic && !calibrated)) {
         continue;
       }
 
+      const size_t size = 1u << config.compensation_bits;
+      const size_t needed = calibrated ? (2 * size) : size;
+      if (lut_used + needed > compensation_lut_.size()) { return false; }
+
+      ConfigureCompensation(config, &compensation_lut_[lut_used], &comp);
+      lut_used += size;
+      for (size_t j = 0; j < size; j++) {
+        comp.table[j] = QuantizeCompensation(config, comp, j);
+      }
+
+      if (calibrated) {
+        // Updates are built here, then swapped with the active one.
+        ConfigureCompensation(
+            config, &compensation_lut_[lut_used], &calibration_spare_);
+        lut_used += size;
+      }
+    }
+
+    return true;
+  }
+
+  static size_t CompensationSize(const SourceConfig& config) {
+    return 1u << config.compensation_bits;
+  }
+
+  static float CompensationMaxAbs(const SourceConfig& config,
+                                  size_t begin, size_t end) {
+    const size_t size = CompensationSize(config);
+    float result = 0.0f;
+    for (size_t j = begin; j < end; j++) {
+      result = std::max(
+          result,
+          std::abs(EvaluateCompensation(
+                       config, static_cast<float>(j) / size)));
+    }
+    return result;
+  }
+
+  void ConfigureCompensation(const SourceConfig& config,
+                             int16_t* table,
+                             Compensation* comp) {
+    const size_t size = CompensationSize(config);
+    comp->table = table;
+    comp->index_shift = 32 - config.compensation_bits;
+    comp->index_mask = size - 1;
+    comp->phase_scale = static_cast<uint32_t>(
+        std::min<uint64_t>(0xffffffffu,
+                           (1ull << 32) / std::max<uint32_t>(1, config.cpr)));
+    SetCompensationScale(config, CompensationMaxAbs(config, 0, size), comp);
+  }
+
+  static void SetCompensationScale(const SourceConfig& config,
+                                   float max_abs,
+                                   Compensation* comp) {
+    comp->counts_per_lsb = max_abs * config.cpr / 32767.0f;
+    comp->lsb_per_fraction = (max_abs == 0.0f) ? 0.0f : (32767.0f / max_abs);
+  }
+
+  static int16_t QuantizeCompensation(const SourceConfig& config,
+                                      const Compensation& comp,
+                                      size_t index) {
+    const size_t size = CompensationSize(config);
+    return static_cast<int16_t>(
+        std::round(EvaluateCompensation(
+                       config, static_cast<float>(index) / size) *
+                   comp.lsb_per_fraction));
+  }
+
+  void ResetCalibrationFit() {
+    calibration_fit_.Reset(config_.self_calibration.harmonics);
+    calibration_coverage_ = 0;
+  }
+
+  // Called from the ISR when the main loop has asked for a sample.
+  void ISR_SampleCalibration() MOTEUS_CCM_ATTRIBUTE {
+    const auto& calibration = config_.self_calibration;
+    const auto& rotor = status_.sources[calibration.source];
+    const auto& reference = status_.sources[config_.output.reference_source];
+
+    auto& sample = calibration_sample_;
+    sample.valid = rotor.active_theta && reference.active_absolute;
+    sample.offset_value = rotor.offset_value;
+    sample.compensated_value = rotor.compensated_value;
+    sample.reference_value = reference.filtered_value;
+
+    calibration_sample_requested_ = false;
+  }
+
+  void AddCalibrationSample() {
+    const auto& calibration = config_.self_calibration;
+    const auto& rotor_config = config_.sources[calibration.source];
+    const auto& reference_config =
+        config_.sources[config_.output.reference_source];
+    const auto& sample = calibration_sample_;
+
+    const float rotor_cpr = rotor_config.cpr;
+    const float x = sample.offset_value / rotor_cpr;
+    // Each output revolution is an integral number of rotor
+    // revolutions, which is checked in HandleConfigUpdate.
+    const float reference_revs =
+        sample.reference_value / reference_config.cpr * calibration_ratio_;
+    const float expected = reference_revs - std::floor(reference_revs);
+    const float raw_error = WrapBalancedCpr(
+        sample.compensated_value / rotor_cpr - expected, 1.0f);
+
+    // The error includes the arbitrary offset between the zeros of
+    // the two encoders.  It is only wrapped relative to that, taken
+    // from the first sample of each fit, so that when the offset is
+    // near half a revolution the samples do not split across the
+    // wrap.  The constant term of the fit is not used.
+    if (calibration_fit_.count() == 0) { calibration_dc_ = raw_error; }
+    const float error = WrapBalancedCpr(raw_error - calibration_dc_, 1.0f);
+
+    calibration_fit_.Add(x, error);
+    calibration_coverage_ |= 1u << std::min(31, static_cast<int>(x * 32.0f));
+  }
+
+  // Build a portion of the updated table each call, so as to not
+  // stall the main loop.
+  void ContinueCalibrationBuild() {
+    const auto& calibration = config_.self_calibration;
+    const auto& config = config_.sources[calibration.source];
+    const int size = CompensationSize(config);
+    const int kStep = 64;
+
+    // The first pass over the table finds the scale, and the second
+    // fills in the entries.
+    auto& index = calibration_build_index_;
+    if (index < size) {
+      const int end = std::min(size, index + kStep);
+      calibration_build_max_ = std::max(
+          calibration_build_max_,
+          CompensationMaxAbs(config, index, end));
+      index = end;
+      if (index == size) {
+        SetCompensationScale(
+            config, calibration_build_max_, calibration_staging_);
+      }
+      return;
+    }
+
+    auto* const staging = calibration_staging_;
+    const int end = std::min(2 * size, index + kStep);
+    for (; index < end; index++) {
+      staging->table[index - size] =
+          QuantizeCompensation(config, *staging, index - size);
+    }
+    if (index < 2 * size) { return; }
+
+    // This single write is seen atomically by the ISR, which cannot
+    // be in the middle of using the old table while we run.
+    auto& active = active_compensation_[calibration.source];
+    calibration_staging_ = active;
+    active = staging;
+
+    // Discard any sample taken with the old table.
+    calibration_sample_requested_ = false;
+    calibration_sample_.valid = false;
+
+    calibration_build_index_ = -1;
+    status_.self_calibration.updates++;
+  }
+
+  void ISR_UpdateSources(float dt) MOTEUS_CCM_ATTRIBUTE {
+    for (size_t k = 0; k < num_source_kernels_; k++) {
+      const auto& kernel = source_kernels_[k];
+      const auto i = kernel.index;
+      const auto& config = config_.sources[i];
+
       auto& status = status_.sources[i];
       const auto& filter = pll_filter_constants_[i];
 
-      bool updated = false;
       const bool old_active_theta = status.active_theta;
       const bool old_active_velocity = status.active_velocity;
 
-      const auto* this_aux = aux_status_[config.aux_number - 1];
-      if (this_aux->error != aux::AuxError::kNone) {
+      const auto& this_aux = *kernel.aux;
+      if (kernel.check_aux_error &&
+          this_aux.error != aux::AuxError::kNone) {
         status_.error = Status::kSourceError;
         status.active_theta = false;
         status.active_velocity = false;
@@ -739,145 +1524,11 @@ class MotorPosition {
         continue;
       }
 
-      switch (config.type) {
-        case SourceConfig::kSpi: {
-          // We check this in HandleConfigUpdate
-          // MJ_ASSERT(config.aux_number == 1);
-
-          const auto* spi_data = &this_aux->spi;
-          if (!spi_data->active) { break; }
-          status.raw = spi_data->value;
-
-          updated = ISR_UpdateAbsoluteSource(
-              spi_data->nonce, spi_data->value,
-              config.offset, config.sign, config.cpr,
-              &status);
-          status.active_absolute = true;
-          break;
-        }
-        case SourceConfig::kUart: {
-          const auto* uart_data = &this_aux->uart;
-          if (!uart_data->active) { break; }
-          status.raw = uart_data->value;
-
-          updated = ISR_UpdateAbsoluteSource(
-              uart_data->nonce, uart_data->value,
-              config.offset, config.sign, config.cpr,
-              &status);
-          status.active_absolute = true;
-          break;
-        }
-        case SourceConfig::kSineCosine: {
-          const auto* sc_data = &this_aux->sine_cosine;
-
-          if (!sc_data->active) { break; }
-          status.raw = sc_data->value;
-          updated = ISR_UpdateAbsoluteSource(
-              status.nonce + 1, sc_data->value,
-              config.offset, config.sign, config.cpr, &status);
-          status.active_absolute = true;
-          break;
-        }
-        case SourceConfig::kI2C: {
-          const auto* i2c_data = &this_aux->i2c.devices[config.i2c_device];
-          if (!i2c_data->active) { break; }
-          status.raw = i2c_data->value;
-
-          updated = ISR_UpdateAbsoluteSource(
-              i2c_data->nonce, i2c_data->value,
-              config.offset, config.sign, config.cpr, &status);
-          status.active_absolute = true;
-          break;
-        }
-        case SourceConfig::kHall: {
-          const auto* hall_data = &this_aux->hall;
-          if (!hall_data->active) { break; }
-          status.raw = hall_data->bits;
-
-          const uint32_t cpr = kHallCounts / 2 * motor_.poles;
-          const int32_t current_with_offset =
-              ((hall_data->count +
-                static_cast<int32_t>(config.offset)) * config.sign +
-               kHallCounts) % kHallCounts;
-          const int32_t old_with_offset =
-              status.offset_value % kHallCounts;
-          const int32_t delta =
-              (current_with_offset - old_with_offset +
-               kHallCounts + kHallCounts / 2) %
-              kHallCounts -
-              (kHallCounts / 2);
-
-          const uint32_t new_value = (status.offset_value + cpr + delta) % cpr;
-
-          updated = ISR_UpdateAbsoluteSource(
-              status.nonce + 1, new_value,
-              0, 1, config.cpr,
-              &status);
-          status.active_absolute = false;
-          break;
-        }
-        case SourceConfig::kQuadrature: {
-          const auto* quad_status = &this_aux->quadrature;
-          if (!quad_status->active) { break; }
-          const auto old_raw = status.raw;
-          const auto old_filtered_value = status.filtered_value;
-
-          status.raw = quad_status->value;
-          const auto delta = WrapIntCpr(status.raw - old_raw, config.cpr);
-          status.offset_value = WrapIntCpr(
-              static_cast<int32_t>(status.offset_value + delta * config.sign),
-              config.cpr);
-          status.nonce++;
-          status.active_velocity = true;
-
-          if (!status.active_theta &&
-              config.incremental_index >= 1) {
-            const auto* index_status =
-                &aux_status_[config.incremental_index == 2 ? 1 : 0]->index;
-            // TODO: Maybe optionally require a minimum velocity?
-            if (index_status->value) {
-              // This is our index time.
-              status.offset_value = config.offset;
-              status.active_theta = true;
-              status.active_absolute = true;
-
-              if (config_.output.source == static_cast<int8_t>(i)) {
-                // This is an "absolute" encoder which can warp its
-                // position.  In order for our "position_relative" to
-                // remain continuous, the modulo must be updated
-                // correspondingly.
-                const float ratio = WrapBalancedCpr(
-                    static_cast<float>(status.offset_value) -
-                    static_cast<float>(old_filtered_value),
-                    config.cpr) * output_cpr_scale_;
-                const int64_t adjustment =
-                    (1ll << 24) * static_cast<int32_t>((1l << 24) * ratio);
-                status_.position_relative_modulo -= adjustment;
-              }
-            }
-          }
-          updated = true;
-          break;
-        }
-        case SourceConfig::kIndex: {
-          const auto& index_status = &this_aux->index;
-          if (!index_status->active) { break; }
-          if (index_status->value) {
-            status.offset_value = config.offset;
-            status.filtered_value = status.offset_value;
-            status.active_theta = true;
-            status.active_absolute = true;
-          } else {
-            status.active_theta = false;
-            status.active_absolute = false;
-          }
-          break;
-        }
-        default: {
-          MJ_ASSERT(false);
-          break;
-        }
-      }
+      // Sources which are sampled asynchronously override this with
+      // the time their value was actually measured.
+      uint32_t sample_us = this_aux.sample_us;
+
+      bool updated = (this->*kernel.read)(kernel, &status, &sample_us, dt);
 
       if (config.debug_override >= 0) {
         status.active_theta = true;
@@ -888,28 +1539,25 @@ class MotorPosition {
         status.filtered_value = config.debug_override;
         updated = true;
       } else {
-        const int bin_size = std::max<int>(1, config.cpr / kCompensationSize);
-        // Perform compensation.
-        const int left_offset =
-            ((status.offset_value - bin_size / 2) *
-             kCompensationSize / config.cpr + kCompensationSize) %
-            kCompensationSize;
-        const int right_offset = (left_offset + 1) % kCompensationSize;
-        const int delta =
-            (status.offset_value + config.cpr -
-             left_offset * bin_size -
-             bin_size / 2) % bin_size;
-        const float fraction =
-            static_cast<float>(delta) / bin_size;
-        const float left_comp = config.compensation_table[left_offset];
-        const float right_comp = config.compensation_table[right_offset];
-        const float comp_fraction =
-            (right_comp - left_comp) * fraction + left_comp;
-
-        status.compensated_value =
-            WrapCpr(
-                status.offset_value +
-                comp_fraction * config.cpr, config.cpr);
+        const auto& comp = *active_compensation_[i];
+        if (comp.counts_per_lsb == 0.0f) {
+          status.compensated_value = status.offset_value;
+        } else {
+          // Perform compensation.  The offset value is always less
+          // than CPR, so this is a fraction of a revolution in 0.32.
+          const uint32_t phase = status.offset_value * comp.phase_scale;
+          const uint32_t index = phase >> comp.index_shift;
+          const int32_t fraction =
+              (phase >> (comp.index_shift - 15)) & 0x7fff;
+          const int32_t left = comp.table[index];
+          const int32_t right = comp.table[(index + 1) & comp.index_mask];
+          const int32_t value = left + (((right - left) * fraction) >> 15);
+
+          status.compensated_value =
+              WrapCprFast(
+                  status.offset_value + value * comp.counts_per_lsb,
+                  kernel.float_cpr);
+        }
       }
 
       if (!status.active_theta &&
@@ -920,25 +1568,36 @@ class MotorPosition {
       status.time_since_update += dt;
 
       status.filtered_value += dt * status.velocity;
+      // The acceleration is always 0 for second order estimators.
+      status.velocity += dt * status.acceleration;
 
-      const float cpr = config.cpr;
+      const float cpr = kernel.float_cpr;
 
       if (updated) {
+        status.age_us =
+            static_cast<int32_t>(this_aux.sample_us - sample_us) +
+            config.latency_us;
+        // Extrapolate the measurement to the current sample instant.
+        const float measured_value =
+            status.compensated_value +
+            static_cast<float>(status.age_us) * 1e-6f * status.velocity;
+
         if (!old_active_velocity && status.active_velocity) {
           // This is our first update.  Just snap to the position.
           status.filtered_value = status.compensated_value;
           status.velocity = 0;
+          status.acceleration = 0;
         } else if (!old_active_theta && status.active_theta) {
           // Our velocity was valid before, so leave it alone.
-          status.filtered_value = status.compensated_value;
+          status.filtered_value = measured_value;
         } else if (config.pll_filter_hz != 0.0f) {
           // We check this in config.
           // MJ_ASSERT(config.pll_filter.enabled);
 
           const float unwrapped_error =
-              -(status.filtered_value - status.compensated_value);
+              -(status.filtered_value - measured_value);
           const float error =
-              WrapBalancedCpr(unwrapped_error, cpr);
+              WrapCprFast(unwrapped_error + 1.5f * cpr, cpr) - 0.5f * cpr;
 
           status.filtered_value +=
               status.time_since_update * filter.kp * error;
@@ -946,43 +1605,434 @@ class MotorPosition {
           status.velocity +=
               status.time_since_update * filter.ki * error;
 
+          status.acceleration +=
+              status.time_since_update * filter.ka * error;
+
           // We don't let our velocity get beyond 1 revolution in 8
-          // encoder samples.
+          // encoder samples.  The acceleration is discarded when we
+          // do, otherwise it would wind up pushing against the limit.
           const float max_velocity =
               0.125f * config.cpr / status.time_since_update;
           if (status.velocity > max_velocity) {
             status.velocity = max_velocity;
+            status.acceleration = 0.0f;
           } else if (status.velocity < -max_velocity) {
             status.velocity = -max_velocity;
+            status.acceleration = 0.0f;
           }
         } else {
           status.filtered_value = status.compensated_value;
           status.velocity = 0.0f;
+          status.acceleration = 0.0f;
         }
 
         status.time_since_update = 0.0f;
       }
 
-      status.filtered_value = WrapCpr(status.filtered_value, cpr);
+      if (kernel.edge_velocity) {
+        ISR_BlendEdgeVelocity(kernel, &status);
+      }
+
+      status.filtered_value = WrapCprFast(status.filtered_value, cpr);
+    }
+  }
+
+  // The readers for each source type.  These update the status from
+  // the aux port, and return true if there was a new measurement.
+  // Those which wrap by the CPR are specialized for when it is a
+  // power of two.
+
+  template <bool kPowerOfTwo>
+  bool ISR_ReadSpi(const SourceKernel& kernel, SourceStatus* status,
+                   uint32_t* sample_us, float) MOTEUS_CCM_ATTRIBUTE {
+    // We check this in HandleConfigUpdate
+    // MJ_ASSERT(config.aux_number == 1);
+    const auto& config = config_.sources[kernel.index];
+    const auto& spi_data = kernel.aux->spi;
+    if (!spi_data.active) { return false; }
+    status->raw = spi_data.value;
+    *sample_us = spi_data.sample_us;
+
+    status->active_absolute = true;
+    return ISR_UpdateAbsoluteSource<kPowerOfTwo>(
+        kernel, spi_data.nonce, spi_data.value,
+        config.offset, config.sign, status);
+  }
+
+  template <bool kPowerOfTwo>
+  bool ISR_ReadUart(const SourceKernel& kernel, SourceStatus* status,
+                    uint32_t* sample_us, float) MOTEUS_CCM_ATTRIBUTE {
+    const auto& config = config_.sources[kernel.index];
+    const auto& uart_data = kernel.aux->uart;
+    if (!uart_data.active) { return false; }
+    status->raw = uart_data.value;
+    *sample_us = uart_data.sample_us;
+
+    status->active_absolute = true;
+    return ISR_UpdateAbsoluteSource<kPowerOfTwo>(
+        kernel, uart_data.nonce, uart_data.value,
+        config.offset, config.sign, status);
+  }
+
+  template <bool kPowerOfTwo>
+  bool ISR_ReadSineCosine(const SourceKernel& kernel, SourceStatus* status,
+                          uint32_t*, float) MOTEUS_CCM_ATTRIBUTE {
+    const auto& config = config_.sources[kernel.index];
+    const auto& sc_data = kernel.aux->sine_cosine;
+    if (!sc_data.active) { return false; }
+    status->raw = sc_data.value;
+
+    status->active_absolute = true;
+    return ISR_UpdateAbsoluteSource<kPowerOfTwo>(
+        kernel, status->nonce + 1, sc_data.value,
+        config.offset, config.sign, status);
+  }
+
+  template <bool kPowerOfTwo>
+  bool ISR_ReadI2c(const SourceKernel& kernel, SourceStatus* status,
+                   uint32_t* sample_us, float) MOTEUS_CCM_ATTRIBUTE {
+    const auto& config = config_.sources[kernel.index];
+    const auto& i2c_data = kernel.aux->i2c.devices[config.i2c_device];
+    if (!i2c_data.active) { return false; }
+    status->raw = i2c_data.value;
+    *sample_us = i2c_data.sample_us;
+
+    status->active_absolute = true;
+    return ISR_UpdateAbsoluteSource<kPowerOfTwo>(
+        kernel, i2c_data.nonce, i2c_data.value,
+        config.offset, config.sign, status);
+  }
+
+  template <bool kPowerOfTwo>
+  bool ISR_ReadHall(const SourceKernel& kernel, SourceStatus* status,
+                    uint32_t*, float) MOTEUS_CCM_ATTRIBUTE {
+    const auto& config = config_.sources[kernel.index];
+    const auto& hall_data = kernel.aux->hall;
+    if (!hall_data.active) { return false; }
+    status->raw = hall_data.bits;
+
+    const int32_t delta =
+        HallDelta(config, hall_data.count, status->offset_value);
+
+    const uint32_t new_value = WrapIntCpr<kPowerOfTwo>(
+        kernel, static_cast<int32_t>(status->offset_value + delta));
+
+    status->active_absolute = false;
+    return ISR_UpdateAbsoluteSource<kPowerOfTwo>(
+        kernel, status->nonce + 1, new_value, 0, 1, status);
+  }
+
+  template <bool kPowerOfTwo>
+  bool ISR_ReadHallInterpolated(const SourceKernel& kernel,
+                                SourceStatus* status,
+                                uint32_t*, float dt) MOTEUS_CCM_ATTRIBUTE {
+    const auto& config = config_.sources[kernel.index];
+    const auto& hall_data = kernel.aux->hall;
+    if (!hall_data.active) { return false; }
+    status->raw = hall_data.bits;
+
+    auto& hall = hall_state_[kernel.index];
+    const uint32_t steps = kernel.cpr / kHallInterpolation;
+    const int32_t delta = HallDelta(config, hall_data.count, hall.step);
+
+    hall.time_since_edge_s += dt;
+    if (delta != 0) {
+      const int8_t direction = (delta > 0) ? 1 : -1;
+      // Only an interval between two transitions in the same
+      // direction tells us the speed.
+      hall.interpolating =
+          (delta == direction) &&
+          (direction == hall.direction) &&
+          (hall.time_since_edge_s < hall.max_interval_s);
+      if (hall.interpolating) {
+        hall.steps_per_s = 1.0f / hall.time_since_edge_s;
+      }
+      hall.direction = direction;
+      hall.time_since_edge_s = 0.0f;
+      hall.step = (hall.step + steps + delta) % steps;
+    } else if (hall.time_since_edge_s > hall.max_interval_s) {
+      hall.interpolating = false;
+    }
+
+    // The step value is at the center of each sector, so the edge we
+    // last crossed is half a step behind it.
+    int32_t fraction = 0;
+    if (hall.interpolating) {
+      const float progress =
+          std::min(1.0f, hall.time_since_edge_s * hall.steps_per_s);
+      fraction = hall.direction *
+          static_cast<int32_t>((progress - 0.5f) * kHallInterpolation);
+    }
+
+    const uint32_t new_value = WrapIntCpr<kPowerOfTwo>(
+        kernel,
+        static_cast<int32_t>(hall.step * kHallInterpolation) + fraction);
+
+    status->active_absolute = false;
+    return ISR_UpdateAbsoluteSource<kPowerOfTwo>(
+        kernel, status->nonce + 1, new_value, 0, 1, status);
+  }
+
+  // The number of hall transitions from 'old_step' to 'count', in
+  // the range [-3, 2].
+  static int32_t HallDelta(const SourceConfig& config,
+                           int32_t count,
+                           uint32_t old_step) MOTEUS_CCM_ATTRIBUTE {
+    const int32_t current_with_offset =
+        ((count +
+          static_cast<int32_t>(config.offset)) * config.sign +
+         kHallCounts) % kHallCounts;
+    const int32_t old_with_offset = old_step % kHallCounts;
+    return (current_with_offset - old_with_offset +
+            kHallCounts + kHallCounts / 2) %
+        kHallCounts -
+        (kHallCounts / 2);
+  }
+
+  template <bool kPowerOfTwo>
+  bool ISR_ReadQuadrature(const SourceKernel& kernel, SourceStatus* status,
+                          uint32_t*, float) MOTEUS_CCM_ATTRIBUTE {
+    const auto& config = config_.sources[kernel.index];
+    const auto& quad_status = kernel.aux->quadrature;
+    if (!quad_status.active) { return false; }
+    const auto old_raw = status->raw;
+    const auto old_filtered_value = status->filtered_value;
+
+    status->raw = quad_status.value;
+    const auto delta =
+        WrapIntCpr<kPowerOfTwo>(kernel, status->raw - old_raw);
+    status->offset_value = WrapIntCpr<kPowerOfTwo>(
+        kernel, static_cast<int32_t>(status->offset_value + delta * config.sign));
+    status->nonce++;
+    status->active_velocity = true;
+
+    if (!status->active_theta &&
+        config.incremental_index >= 1) {
+      const auto* index_status =
+          &aux_status_[config.incremental_index == 2 ? 1 : 0]->index;
+      // TODO: Maybe optionally require a minimum velocity?
+      if (index_status->value) {
+        // This is our index time.
+        status->offset_value = config.offset;
+        status->active_theta = true;
+        status->active_absolute = true;
+
+        if (config_.output.source == static_cast<int8_t>(kernel.index)) {
+          // This is an "absolute" encoder which can warp its
+          // position.  In order for our "position_relative" to
+          // remain continuous, the modulo must be updated
+          // correspondingly.
+          const float ratio = WrapBalancedCpr(
+              static_cast<float>(status->offset_value) -
+              static_cast<float>(old_filtered_value),
+              config.cpr) * output_cpr_scale_;
+          const int64_t adjustment =
+              (1ll << 24) * static_cast<int32_t>((1l << 24) * ratio);
+          status_.position_relative_modulo -= adjustment;
+        }
+      }
+    }
+    return true;
+  }
+
+  // A quadrature source which also measures its velocity from the
+  // time between edges.
+  template <bool kPowerOfTwo>
+  bool ISR_ReadQuadratureTimed(const SourceKernel& kernel,
+                               SourceStatus* status,
+                               uint32_t* sample_us,
+                               float dt) MOTEUS_CCM_ATTRIBUTE {
+    const auto old_raw = status->raw;
+    const bool old_active_velocity = status->active_velocity;
+    if (!ISR_ReadQuadrature<kPowerOfTwo>(kernel, status, sample_us, dt)) {
+      return false;
+    }
+
+    auto& timing = edge_timing_[kernel.index];
+    if (!old_active_velocity) {
+      // We have no idea when the last edge was.
+      timing.valid = false;
+      timing.measured = false;
+      return true;
     }
+
+    const auto& config = config_.sources[kernel.index];
+    const auto& quad_status = kernel.aux->quadrature;
+    int32_t delta = WrapIntCpr<kPowerOfTwo>(kernel, status->raw - old_raw);
+    if (delta > static_cast<int32_t>(kernel.cpr / 2)) {
+      delta -= kernel.cpr;
+    }
+    delta *= config.sign;
+
+    if (quad_status.edge_count != 0) {
+      const int8_t direction = (delta > 0) ? 1 : ((delta < 0) ? -1 : 0);
+      // If there were more edges than counts, or the direction is
+      // not the same as last time, then we passed through zero.
+      const bool same_direction =
+          direction != 0 &&
+          direction == timing.direction &&
+          quad_status.edge_count == std::abs(delta);
+      if (timing.valid && same_direction) {
+        const uint32_t interval_us = quad_status.edge_us - timing.edge_us;
+        if (interval_us != 0) {
+          timing.velocity = delta * 1e6f / interval_us;
+          timing.measured = true;
+        }
+      } else if (timing.measured &&
+                 std::abs(timing.velocity) * timing.inverse_max_velocity <
+                 2.0f) {
+        // We were slow enough that this was most likely a reversal.
+        timing.velocity = 0.0f;
+      } else {
+        // Otherwise, it may have been a glitch, and the filter is
+        // left alone until we have measured a whole interval.
+        timing.measured = false;
+      }
+      timing.valid = true;
+      timing.direction = direction;
+      timing.edge_us = quad_status.edge_us;
+    } else if (timing.velocity != 0.0f) {
+      // Without another edge, we must be going slower than one count
+      // in the time since the last one.
+      const float since_s =
+          static_cast<float>(kernel.aux->sample_us - timing.edge_us) * 1e-6f;
+      if (since_s * std::abs(timing.velocity) > 1.0f) {
+        timing.velocity = timing.direction / since_s;
+      }
+    }
+
+    return true;
   }
 
-  bool ISR_UpdateAbsoluteSource(
+  // At low speed, replace the velocity of the filter with that from
+  // the edge timing.
+  void ISR_BlendEdgeVelocity(const SourceKernel& kernel,
+                             SourceStatus* status) MOTEUS_CCM_ATTRIBUTE {
+    const auto& timing = edge_timing_[kernel.index];
+    if (!timing.measured) { return; }
+
+    const float weight =
+        2.0f - std::abs(timing.velocity) * timing.inverse_max_velocity;
+    if (weight <= 0.0f) { return; }
+    if (weight >= 1.0f) {
+      status->velocity = timing.velocity;
+    } else {
+      status->velocity += weight * (timing.velocity - status->velocity);
+    }
+  }
+
+  bool ISR_ReadIndex(const SourceKernel& kernel, SourceStatus* status,
+                     uint32_t*, float) MOTEUS_CCM_ATTRIBUTE {
+    const auto& config = config_.sources[kernel.index];
+    const auto& index_status = kernel.aux->index;
+    if (!index_status.active) { return false; }
+    if (index_status.value) {
+      status->offset_value = config.offset;
+      status->filtered_value = status->offset_value;
+      status->active_theta = true;
+      status->active_absolute = true;
+    } else {
+      status->active_theta = false;
+      status->active_absolute = false;
+    }
+    return false;
+  }
+
+  template <bool kPowerOfTwo>
+  bool ISR_ReadSensorless(const SourceKernel& kernel, SourceStatus* status,
+                          uint32_t*, float dt) MOTEUS_CCM_ATTRIBUTE {
+    const int32_t current = ISR_UpdateSensorless(dt);
+    status->raw = current;
+
+    // Track which pole pair we are in, as for hall sources.
+    const int32_t old = status->offset_value % kSensorlessCounts;
+    const int32_t delta =
+        ((current - old + kSensorlessCounts + kSensorlessCounts / 2) %
+         kSensorlessCounts) - (kSensorlessCounts / 2);
+    const uint32_t new_value = WrapIntCpr<kPowerOfTwo>(
+        kernel, static_cast<int32_t>(status->offset_value + delta));
+
+    status->active_absolute = false;
+    return ISR_UpdateAbsoluteSource<kPowerOfTwo>(
+        kernel, status->nonce + 1, new_value, 0, 1, status);
+  }
+
+  // Advance the flux observer by one period, and return the
+  // electrical phase of the rotor in the range [0, kSensorlessCounts).
+  //
+  // This is the nonlinear observer from Ortega et al, "Estimation of
+  // Rotor Position and Speed of Permanent Magnet Synchronous Motors
+  // With Guaranteed Stability", 2011.  The stator flux is integrated
+  // from the voltage equation, and the rotor flux derived from it is
+  // pushed towards the known magnitude.
+  int32_t ISR_UpdateSensorless(float dt) MOTEUS_CCM_ATTRIBUTE {
+    auto& s = sensorless_;
+    const float inductance_H = motor_.inductance_H;
+    const float resistance_ohm = motor_.resistance_ohm;
+
+    const float rotor_alpha = s.psi_alpha_Wb - inductance_H * s.i_alpha_A;
+    const float rotor_beta = s.psi_beta_Wb - inductance_H * s.i_beta_A;
+    const float correction =
+        sensorless_gain_ *
+        (1.0f - (rotor_alpha * rotor_alpha + rotor_beta * rotor_beta) *
+         sensorless_inv_flux2_);
+
+    s.psi_alpha_Wb += dt * (s.v_alpha_V - resistance_ohm * s.i_alpha_A +
+                            correction * rotor_alpha);
+    s.psi_beta_Wb += dt * (s.v_beta_V - resistance_ohm * s.i_beta_A +
+                           correction * rotor_beta);
+
+    // The voltage just integrated is the one applied over this
+    // period, so this estimate is for the end of it.
+    const float theta = FastAtan2(s.psi_beta_Wb - inductance_H * s.i_beta_A,
+                                  s.psi_alpha_Wb - inductance_H * s.i_alpha_A);
+    return static_cast<int32_t>(theta * (kSensorlessCounts / k2Pi) +
+                                kSensorlessCounts) &
+        (kSensorlessCounts - 1);
+  }
+
+  int FindSensorless() const {
+    for (size_t i = 0; i < config_.sources.size(); i++) {
+      if (config_.sources[i].type == SourceConfig::kSensorless) {
+        return i;
+      }
+    }
+    return 0;
+  }
+
+  template <bool kPowerOfTwo>
+  static bool ISR_UpdateAbsoluteSource(
+      const SourceKernel& kernel,
       uint8_t nonce, uint32_t value,
       int32_t offset,
       int32_t sign,
-      uint32_t cpr,
       SourceStatus* status) MOTEUS_CCM_ATTRIBUTE {
     if (nonce == status->nonce) { return false; }
 
-    status->offset_value = WrapIntCpr(
-        (static_cast<int32_t>(value) + offset) * sign, cpr);
+    status->offset_value = WrapIntCpr<kPowerOfTwo>(
+        kernel, (static_cast<int32_t>(value) + offset) * sign);
     status->nonce = nonce;
     status->active_velocity = true;
     status->active_theta = true;
     return true;
   }
 
+  template <bool kPowerOfTwo>
+  static uint32_t WrapIntCpr(const SourceKernel& kernel,
+                             int32_t value) MOTEUS_CCM_ATTRIBUTE {
+    const uint32_t unwrapped = value + kernel.cpr;
+    if (kPowerOfTwo) {
+      return unwrapped & (kernel.cpr - 1);
+    }
+    // The quotient estimated from the reciprocal is at most one
+    // short, so a single correction gives the same result as %.
+    const uint32_t quotient = static_cast<uint32_t>(
+        (static_cast<uint64_t>(unwrapped) * kernel.cpr_reciprocal) >> 32);
+    uint32_t result = unwrapped - quotient * kernel.cpr;
+    if (result >= kernel.cpr) { result -= kernel.cpr; }
+    return result;
+  }
+
   void ISR_SetOutputPositionNearestHelper(float value) MOTEUS_CCM_ATTRIBUTE {
     const auto& output_status =
         status_.sources[config_.output.source];
@@ -1065,8 +2115,16 @@ class MotorPosition {
     status_.position = IntToFloat(status_.position_raw);
 
     status_.homed = Status::kOutput;
+
+    // This position is consistent with the absolute sources, so the
+    // fusion source is used in its own frame.
+    fusion_offset_ = 0.0f;
+    fusion_capture_offset_ = false;
   }
 
+  // The largest float less than 2^32.
+  static constexpr float kMaxRatio = 4294967040.0f;
+
   Config config_;
   BldcServoMotor motor_;
   Status status_;
@@ -1080,8 +2138,11 @@ class MotorPosition {
   // faster.
   const SourceConfig* commutation_config_ = nullptr;
   const SourceStatus* commutation_status_ = nullptr;
-  float commutation_pole_scale_ = 1.0f;
-  float commutation_rotor_scale_ = 1.0f;
+  float commutation_cpr_scale_ = 1.0f;
+  PhaseMultiplier commutation_phase_;
+  std::array<uint32_t, std::tuple_size<decltype(BldcServoMotor::offset)>::value>
+      commutation_offset_ = {};
+  PhaseMultiplier output_phase_;
   float output_ambiguity_scale_ = 1.0f;
   const SourceConfig* output_config_ = nullptr;
   const SourceStatus* output_status_ = nullptr;
@@ -1090,11 +2151,110 @@ class MotorPosition {
   int32_t output_encoder_step_hb_1_4_ = 0;
   int32_t output_encoder_step_hb_3_4_ = 0;
 
+  // The relative position from the output source alone, before any
+  // fusion correction.
+  int64_t source_relative_raw_ = 0;
+
+  const SourceStatus* fusion_source_ = nullptr;
+  float fusion_cpr_scale_ = 1.0f;
+  float fusion_ambiguity_scale_ = 1.0f;
+  float fusion_kp_ = 0.0f;
+  float fusion_ki_ = 0.0f;
+  int64_t fusion_correction_raw_ = 0;
+
+  // Added to the fusion source to bring it into the frame of an
+  // explicitly set output position.
+  float fusion_offset_ = 0.0f;
+  bool fusion_capture_offset_ = false;
+
+  std::array<SourceKernel, kNumSources> source_kernels_;
+  size_t num_source_kernels_ = 0;
+
+  struct HallState {
+    // Set from the configuration.
+    float max_interval_s = 0.0f;
+
+    // The current sector, in [0, kHallCounts * poles / 2).
+    uint32_t step = 0;
+    int8_t direction = 0;
+    bool interpolating = false;
+    float time_since_edge_s = 0.0f;
+    float steps_per_s = 0.0f;
+  };
+  std::array<HallState, kNumSources> hall_state_ = {};
+
+  struct EdgeTiming {
+    // Set from the configuration.
+    float inverse_max_velocity = 0.0f;
+
+    // Once an edge has been seen.
+    bool valid = false;
+    int8_t direction = 0;
+    uint32_t edge_us = 0;
+
+    // Once the velocity has been measured from the interval between
+    // two edges.
+    bool measured = false;
+    // In counts per second.
+    float velocity = 0.0f;
+  };
+  std::array<EdgeTiming, kNumSources> edge_timing_ = {};
+
   struct PllFilterConstants {
     float kp = 0.0f;
     float ki = 0.0f;
+    float ka = 0.0f;
   };
   std::array<PllFilterConstants, kNumSources> pll_filter_constants_;
+
+  std::array<Compensation, kNumSources> compensation_;
+  // The ISR uses these, which only differ from compensation_ for a
+  // source which is being calibrated.
+  std::array<Compensation*, kNumSources> active_compensation_ = {
+    &compensation_[0], &compensation_[1], &compensation_[2] };
+  std::array<int16_t, kCompensationLutSize> compensation_lut_ = {};
+
+  using CalibrationFit = HarmonicFit<kCompensationHarmonics>;
+  bool calibration_enabled_ = false;
+  float calibration_ratio_ = 1.0f;
+  CalibrationFit calibration_fit_;
+  // The error is fit relative to this.
+  float calibration_dc_ = 0.0f;
+  // One bit for each 1/32 of a revolution that has been sampled.
+  uint32_t calibration_coverage_ = 0;
+
+  // The table not in use by the ISR, which updates are built into.
+  Compensation calibration_spare_;
+  Compensation* calibration_staging_ = &calibration_spare_;
+  // When non-negative, an updated table is being built.
+  int calibration_build_index_ = -1;
+  float calibration_build_max_ = 0.0f;
+
+  // The main loop sets this to ask for a sample, and the ISR clears
+  // it once calibration_sample_ has been filled in.
+  volatile bool calibration_sample_requested_ = false;
+  struct CalibrationSample {
+    bool valid = false;
+    uint32_t offset_value = 0;
+    float compensated_value = 0.0f;
+    float reference_value = 0.0f;
+  };
+  CalibrationSample calibration_sample_;
+
+  struct Sensorless {
+    float i_alpha_A = 0.0f;
+    float i_beta_A = 0.0f;
+    float v_alpha_V = 0.0f;
+    float v_beta_V = 0.0f;
+
+    // The estimated stator flux.
+    float psi_alpha_Wb = 0.0f;
+    float psi_beta_Wb = 0.0f;
+  };
+  Sensorless sensorless_;
+  bool has_sensorless_ = false;
+  float sensorless_gain_ = 0.0f;
+  float sensorless_inv_flux2_ = 0.0f;
 };
 
 }
@@ -1135,6 +2295,20 @@ struct IsEnum<moteus::MotorPosition::SourceConfig::Reference> {
   }
 };
 
+template <>
+struct IsEnum<moteus::MotorPosition::SourceConfig::Estimator> {
+  static constexpr bool value = true;
+
+  using E = moteus::MotorPosition::SourceConfig::Estimator;
+  static std::array<std::pair<E, const char*>, E::kNumEstimators> map() {
+    return { {
+        { E::kPll, "pll" },
+        { E::kPll3, "pll3" },
+        { E::kKalman, "kalman" },
+      }};
+  }
+};
+
 template <>
 struct IsEnum<moteus::MotorPosition::Status::Error> {
   static constexpr bool value = true;
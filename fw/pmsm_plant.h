@@ -0,0 +1,222 @@
+// Copyright 2023 mjbots Robotic Systems, LLC.  info@mjbots.com
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+
+namespace moteus {
+
+/// A lumped parameter model of a surface mount three phase permanent
+/// magnet synchronous motor driven from a two level inverter.  It is
+/// only intended for use on the host, and thus all state is kept in
+/// double precision.
+///
+/// The d/q frame uses the same amplitude invariant convention as
+/// DqTransform in foc.h, so that a positive q current results in a
+/// positive torque and an increasing electrical angle.
+class PmsmPlant {
+ public:
+  struct Options {
+    // Per phase winding resistance and inductance.
+    double resistance_ohm = 0.050;
+    double inductance_H = 25e-6;
+
+    // Peak permanent magnet flux linkage per phase.
+    double flux_linkage_Wb = 0.0025;
+
+    int pole_pairs = 7;
+
+    // Rotor plus load inertia.
+    double inertia_kgm2 = 5e-5;
+    double viscous_Nms = 2e-5;
+    double coulomb_Nm = 0.002;
+
+    // An external torque applied to the rotor.
+    double load_Nm = 0.0;
+
+    // Inverter deadtime.  During this portion of each switching
+    // edge, the phase voltage is determined by the direction of the
+    // phase current rather than the gate command.
+    double deadtime_s = 0.0;
+
+    // Each call to Step is divided into this many integration steps.
+    int substeps = 8;
+
+    Options() {}
+  };
+
+  PmsmPlant(const Options& options = Options()) : options_(options) {}
+
+  /// Advance the plant by @p dt seconds.  @p duty is the high side
+  /// on-time fraction of each phase, and @p powered false indicates
+  /// that all switches are open.
+  void Step(double dt, const double duty[3], double pwm_rate_hz,
+            double bus_V, bool powered) {
+    const double h = dt / options_.substeps;
+    PhaseAngles angles(electrical_theta());
+    for (int i = 0; i < options_.substeps; i++) {
+      Integrate(h, &angles, duty, pwm_rate_hz, bus_V, powered);
+    }
+  }
+
+  /// The rotor mechanical angle in radians, unwrapped.
+  double mechanical_theta() const { return theta_m_; }
+  double mechanical_velocity() const { return omega_m_; }
+
+  /// The rotor electrical angle in radians, wrapped to [0, 2pi).
+  double electrical_theta() const {
+    const double result =
+        std::fmod(theta_m_ * options_.pole_pairs, 2.0 * M_PI);
+    return result < 0.0 ? result + 2.0 * M_PI : result;
+  }
+
+  double d_A() const { return i_d_; }
+  double q_A() const { return i_q_; }
+
+  void phase_currents(double* abc) const {
+    const PhaseAngles angles(electrical_theta());
+    PhaseCurrents(angles, abc);
+  }
+
+  double torque_Nm() const {
+    return 1.5 * options_.pole_pairs * options_.flux_linkage_Wb * i_q_;
+  }
+
+  /// The peak phase back-EMF in volts per rotor revolution per
+  /// second.  This corresponds to the 'motor.v_per_hz' configuration
+  /// value.
+  double v_per_hz() const {
+    return 2.0 * M_PI * options_.pole_pairs * options_.flux_linkage_Wb;
+  }
+
+  void set_load_Nm(double load) { options_.load_Nm = load; }
+  void set_mechanical_theta(double value) { theta_m_ = value; }
+  void set_mechanical_velocity(double value) { omega_m_ = value; }
+
+  const Options& options() const { return options_; }
+
+ private:
+  /// The cosine and sine of the electrical angle relative to each
+  /// phase.  Only one sin/cos is evaluated per Step, and the others
+  /// are found by rotating it.
+  struct PhaseAngles {
+    double c[3] = {};
+    double s[3] = {};
+
+    PhaseAngles(double th) {
+      c[0] = std::cos(th);
+      s[0] = std::sin(th);
+      Update();
+    }
+
+    /// Advance by a small angle @p delta.
+    void Rotate(double delta) {
+      const double d2 = delta * delta;
+      const double cd = 1.0 - d2 * (0.5 - d2 * (1.0 / 24.0));
+      const double sd = delta * (1.0 - d2 * (1.0 / 6.0 - d2 * (1.0 / 120.0)));
+      const double c0 = c[0] * cd - s[0] * sd;
+      s[0] = s[0] * cd + c[0] * sd;
+      c[0] = c0;
+      Update();
+    }
+
+   private:
+    void Update() {
+      // cos(120 deg) and sin(120 deg)
+      constexpr double kC120 = -0.5;
+      constexpr double kS120 = 0.86602540378443864676;
+
+      // th - 120 deg
+      c[1] = c[0] * kC120 + s[0] * kS120;
+      s[1] = s[0] * kC120 - c[0] * kS120;
+      // th - 240 deg
+      c[2] = c[0] * kC120 - s[0] * kS120;
+      s[2] = s[0] * kC120 + c[0] * kS120;
+    }
+  };
+
+  void PhaseCurrents(const PhaseAngles& angles, double* abc) const {
+    for (int k = 0; k < 3; k++) {
+      abc[k] = angles.c[k] * i_d_ - angles.s[k] * i_q_;
+    }
+  }
+
+  void Integrate(double h, PhaseAngles* angles_in, const double duty[3],
+                 double pwm_rate_hz, double bus_V, bool powered) {
+    const PhaseAngles& angles = *angles_in;
+    const double omega_e = omega_m_ * options_.pole_pairs;
+
+    if (powered) {
+      double abc_i[3] = {};
+      PhaseCurrents(angles, abc_i);
+
+      double v[3] = {};
+      for (int k = 0; k < 3; k++) {
+        // Current flowing out of the phase holds the output low
+        // during the deadtime, and vice versa.
+        const double deadtime_error =
+            options_.deadtime_s * pwm_rate_hz *
+            ((abc_i[k] > 0.0) ? 1.0 : (abc_i[k] < 0.0) ? -1.0 : 0.0);
+        const double effective_duty =
+            std::max(0.0, std::min(1.0, duty[k] - deadtime_error));
+        v[k] = effective_duty * bus_V;
+      }
+
+      // The neutral floats, so only the differential portion matters.
+      const double common = (v[0] + v[1] + v[2]) / 3.0;
+      double v_d = 0.0;
+      double v_q = 0.0;
+      for (int k = 0; k < 3; k++) {
+        v_d += (2.0 / 3.0) * (v[k] - common) * angles.c[k];
+        v_q += -(2.0 / 3.0) * (v[k] - common) * angles.s[k];
+      }
+
+      const double R = options_.resistance_ohm;
+      const double L = options_.inductance_H;
+      const double did =
+          (v_d - R * i_d_ + omega_e * L * i_q_) / L;
+      const double diq =
+          (v_q - R * i_q_ - omega_e * L * i_d_ -
+           omega_e * options_.flux_linkage_Wb) / L;
+      i_d_ += did * h;
+      i_q_ += diq * h;
+    } else {
+      // With every switch open, the windings discharge through the
+      // body diodes much faster than our time step.
+      i_d_ = 0.0;
+      i_q_ = 0.0;
+    }
+
+    const double friction =
+        options_.viscous_Nms * omega_m_ +
+        ((omega_m_ > 0.0) ? options_.coulomb_Nm :
+         (omega_m_ < 0.0) ? -options_.coulomb_Nm : 0.0);
+    const double accel =
+        (torque_Nm() - friction - options_.load_Nm) / options_.inertia_kgm2;
+    omega_m_ += accel * h;
+    theta_m_ += omega_m_ * h;
+    angles_in->Rotate(omega_m_ * options_.pole_pairs * h);
+  }
+
+  Options options_;
+
+  double i_d_ = 0.0;
+  double i_q_ = 0.0;
+  double theta_m_ = 0.0;
+  double omega_m_ = 0.0;
+};
+
+}
@@ -0,0 +1,321 @@
+// Copyright 2023 mjbots Robotic Systems, LLC.  info@mjbots.com
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+
+namespace moteus {
+namespace replay {
+
+/// A compact capture of the inputs to MotorPosition and
+/// BldcServoPosition, as used by the replay tool.  This is only
+/// intended for the host.
+///
+/// A file is a FileHeader followed by a stream of records.  Each
+/// record is one byte holding its Type, followed by the payload
+/// struct for that type, packed and little endian.  Inputs hold their
+/// value until a new record changes them, and each kCycle record runs
+/// one control cycle.
+
+constexpr char kMagic[8] = { 'M', 'J', 'R', 'E', 'P', 'L', 'A', 'Y' };
+constexpr uint16_t kVersion = 1;
+
+struct __attribute__((packed)) FileHeader {
+  char magic[8] = {};
+  uint16_t version = 0;
+  uint16_t reserved = 0;
+  // The rate at which kCycle records were captured.
+  float rate_hz = 0.0f;
+};
+static_assert(sizeof(FileHeader) == 16);
+
+enum class Type : uint8_t {
+  kCycle = 0,
+  kSampleTime = 1,
+  kSpi = 2,
+  kUart = 3,
+  kI2c = 4,
+  kQuadrature = 5,
+  kHall = 6,
+  kIndex = 7,
+  kSineCosine = 8,
+  kCommand = 9,
+
+  kNumTypes,
+};
+
+// In each of these, 'aux' is 1 or 2.
+
+struct __attribute__((packed)) SampleTime {
+  static constexpr Type kType = Type::kSampleTime;
+  uint8_t aux = 1;
+  uint32_t sample_us = 0;
+};
+
+struct __attribute__((packed)) Spi {
+  static constexpr Type kType = Type::kSpi;
+  uint8_t aux = 1;
+  uint8_t nonce = 0;
+  uint32_t value = 0;
+  uint32_t sample_us = 0;
+};
+
+struct __attribute__((packed)) Uart {
+  static constexpr Type kType = Type::kUart;
+  uint8_t aux = 1;
+  uint8_t nonce = 0;
+  uint32_t value = 0;
+  uint32_t sample_us = 0;
+};
+
+struct __attribute__((packed)) I2c {
+  static constexpr Type kType = Type::kI2c;
+  uint8_t aux = 1;
+  uint8_t device = 0;
+  uint8_t nonce = 0;
+  uint16_t value = 0;
+  uint32_t sample_us = 0;
+};
+
+struct __attribute__((packed)) Quadrature {
+  static constexpr Type kType = Type::kQuadrature;
+  uint8_t aux = 1;
+  uint8_t edge_count = 0;
+  uint32_t value = 0;
+  uint32_t edge_us = 0;
+};
+
+struct __attribute__((packed)) Hall {
+  static constexpr Type kType = Type::kHall;
+  uint8_t aux = 1;
+  uint8_t bits = 0;
+  uint8_t count = 0;
+};
+
+struct __attribute__((packed)) Index {
+  static constexpr Type kType = Type::kIndex;
+  uint8_t aux = 1;
+  uint8_t value = 0;
+};
+
+struct __attribute__((packed)) SineCosine {
+  static constexpr Type kType = Type::kSineCosine;
+  uint8_t aux = 1;
+  uint16_t value = 0;
+};
+
+/// A position mode command.  Any field may be NaN, with the same
+/// meaning as in BldcServoCommandData.
+struct __attribute__((packed)) Command {
+  static constexpr Type kType = Type::kCommand;
+  float position = 0.0f;
+  float velocity = 0.0f;
+  float velocity_limit = 0.0f;
+  float accel_limit = 0.0f;
+};
+
+/// Return the size of the payload for @p type, or -1 if it is not
+/// known.
+inline int PayloadSize(Type type) {
+  switch (type) {
+    case Type::kCycle: { return 0; }
+    case Type::kSampleTime: { return sizeof(SampleTime); }
+    case Type::kSpi: { return sizeof(Spi); }
+    case Type::kUart: { return sizeof(Uart); }
+    case Type::kI2c: { return sizeof(I2c); }
+    case Type::kQuadrature: { return sizeof(Quadrature); }
+    case Type::kHall: { return sizeof(Hall); }
+    case Type::kIndex: { return sizeof(Index); }
+    case Type::kSineCosine: { return sizeof(SineCosine); }
+    case Type::kCommand: { return sizeof(Command); }
+    case Type::kNumTypes: { break; }
+  }
+  return -1;
+}
+
+class Writer {
+ public:
+  Writer(std::FILE* file, float rate_hz) : file_(file) {
+    FileHeader header;
+    std::memcpy(header.magic, kMagic, sizeof(kMagic));
+    header.version = kVersion;
+    header.rate_hz = rate_hz;
+    std::fwrite(&header, sizeof(header), 1, file_);
+  }
+
+  template <typename Payload>
+  void Write(const Payload& payload) {
+    std::fputc(static_cast<uint8_t>(Payload::kType), file_);
+    std::fwrite(&payload, sizeof(payload), 1, file_);
+  }
+
+  void Cycle() {
+    std::fputc(static_cast<uint8_t>(Type::kCycle), file_);
+  }
+
+ private:
+  std::FILE* const file_;
+};
+
+/// Reads a file by mapping a window of it at a time, so that files
+/// much larger than memory can be streamed.
+class Reader {
+ public:
+  struct Record {
+    Type type = Type::kCycle;
+    const uint8_t* payload = nullptr;
+
+    template <typename Payload>
+    Payload as() const {
+      Payload result;
+      std::memcpy(&result, payload, sizeof(result));
+      return result;
+    }
+  };
+
+  explicit Reader(const char* filename, size_t window_size = 64 << 20)
+      : window_size_(window_size),
+        page_size_(sysconf(_SC_PAGESIZE)) {
+    fd_ = ::open(filename, O_RDONLY);
+    if (fd_ < 0) {
+      error_ = std::string("could not open: ") + std::strerror(errno);
+      return;
+    }
+    struct stat st = {};
+    if (::fstat(fd_, &st) != 0) {
+      error_ = std::string("could not stat: ") + std::strerror(errno);
+      return;
+    }
+    file_size_ = st.st_size;
+
+    if (!Map(0, sizeof(header_))) {
+      error_ = "file too short for header";
+      return;
+    }
+    std::memcpy(&header_, data_, sizeof(header_));
+    if (std::memcmp(header_.magic, kMagic, sizeof(kMagic)) != 0) {
+      error_ = "not a replay file";
+      return;
+    }
+    if (header_.version != kVersion) {
+      error_ = "unsupported version " + std::to_string(header_.version);
+      return;
+    }
+    offset_ = sizeof(header_);
+  }
+
+  ~Reader() {
+    Unmap();
+    if (fd_ >= 0) { ::close(fd_); }
+  }
+
+  Reader(const Reader&) = delete;
+  Reader& operator=(const Reader&) = delete;
+
+  /// Empty unless the file could not be opened or is malformed.
+  const std::string& error() const { return error_; }
+  const FileHeader& header() const { return header_; }
+  uint64_t offset() const { return offset_; }
+  uint64_t size() const { return file_size_; }
+
+  /// Return false at the end of the file, or if it is malformed, in
+  /// which case error() is set.  The record payload remains valid
+  /// until the next call.
+  bool Next(Record* record) {
+    if (!error_.empty() || offset_ >= file_size_) { return false; }
+
+    if (!Map(offset_, 1)) {
+      error_ = "read failed";
+      return false;
+    }
+    const uint8_t type_byte = data_[offset_ - map_offset_];
+    const int size = PayloadSize(static_cast<Type>(type_byte));
+    if (size < 0) {
+      error_ = "unknown record type " + std::to_string(type_byte) +
+          " at offset " + std::to_string(offset_);
+      return false;
+    }
+    if (!Map(offset_, 1 + size)) {
+      error_ = "truncated record at offset " + std::to_string(offset_);
+      return false;
+    }
+
+    record->type = static_cast<Type>(type_byte);
+    record->payload = data_ + (offset_ + 1 - map_offset_);
+    offset_ += 1 + size;
+    return true;
+  }
+
+ private:
+  // Ensure that [offset, offset + size) is mapped.  Return false if
+  // that extends past the end of the file.
+  bool Map(uint64_t offset, uint64_t size) {
+    if (offset + size > file_size_) { return false; }
+    if (data_ != nullptr &&
+        offset >= map_offset_ &&
+        offset + size <= map_offset_ + map_size_) {
+      return true;
+    }
+
+    Unmap();
+    map_offset_ = offset / page_size_ * page_size_;
+    map_size_ = std::min<uint64_t>(
+        file_size_ - map_offset_,
+        std::max<uint64_t>(window_size_, offset + size - map_offset_));
+    void* const result = ::mmap(nullptr, map_size_, PROT_READ, MAP_PRIVATE,
+                                fd_, map_offset_);
+    if (result == MAP_FAILED) {
+      data_ = nullptr;
+      return false;
+    }
+    data_ = static_cast<const uint8_t*>(result);
+    ::madvise(result, map_size_, MADV_SEQUENTIAL);
+    return true;
+  }
+
+  void Unmap() {
+    if (data_ != nullptr) {
+      ::munmap(const_cast<uint8_t*>(data_), map_size_);
+      data_ = nullptr;
+    }
+  }
+
+  const size_t window_size_;
+  const uint64_t page_size_;
+
+  int fd_ = -1;
+  uint64_t file_size_ = 0;
+  std::string error_;
+  FileHeader header_;
+
+  const uint8_t* data_ = nullptr;
+  uint64_t map_offset_ = 0;
+  uint64_t map_size_ = 0;
+
+  uint64_t offset_ = 0;
+};
+
+}
+}
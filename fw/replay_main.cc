@@ -0,0 +1,366 @@
+// Copyright 2023 mjbots Robotic Systems, LLC.  info@mjbots.com
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+/// Run a capture of position source data and commands, in the format
+/// of fw/replay_log.h, back through MotorPosition and
+/// BldcServoPosition as fast as possible.  The resulting state is
+/// emitted as CSV on stdout, and the throughput on stderr.
+///
+///  replay capture=FILE [key=value ...]
+///
+/// Recognized keys:
+///  capture   - the file to replay
+///  decimate  - emit one row for every N control cycles, 0 for none
+///  poles     - motor pole count
+///  ratio     - rotor_to_output_ratio
+///  commutation_source, output_source, reference_source
+///  position_min, position_max - position limits, default unlimited
+///  sN.type, sN.aux, sN.cpr, sN.offset, sN.sign, sN.reference,
+///  sN.pll_hz, sN.i2c_device - the configuration of source N, where
+///            type and reference are named as in the config
+
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <limits>
+#include <string>
+
+#include <fmt/format.h>
+
+#include "mjlib/micro/test/persistent_config_fixture.h"
+
+#include "fw/bldc_servo_position.h"
+#include "fw/motor_position.h"
+#include "fw/replay_log.h"
+
+namespace moteus {
+volatile uint8_t g_measured_hw_family = 0;
+volatile uint8_t g_measured_hw_rev = 7;
+}
+
+using namespace moteus;
+
+namespace {
+struct Args {
+  std::string capture;
+  int decimate = 1;
+  float position_min = std::numeric_limits<float>::quiet_NaN();
+  float position_max = std::numeric_limits<float>::quiet_NaN();
+};
+
+[[noreturn]] void Fail(const std::string& message) {
+  fmt::print(stderr, "{}\n", message);
+  std::exit(1);
+}
+
+template <typename Enum>
+Enum ParseEnum(const std::string& key, const char* value) {
+  for (const auto& pair : mjlib::base::IsEnum<Enum>::map()) {
+    if (std::strcmp(pair.second, value) == 0) { return pair.first; }
+  }
+  Fail(fmt::format("unknown value for {}: {}", key, value));
+}
+
+void ParseSourceArg(const std::string& key, const char* value,
+                    MotorPosition::Config* config) {
+  const int index = key[1] - '0';
+  if (key.size() < 4 || key[2] != '.' ||
+      index < 0 || index >= MotorPosition::kNumSources) {
+    Fail(fmt::format("unknown key: {}", key));
+  }
+  const std::string field = key.substr(3);
+  auto& source = config->sources[index];
+  if (field == "type") {
+    source.type = ParseEnum<MotorPosition::SourceConfig::Type>(key, value);
+  } else if (field == "aux") { source.aux_number = std::atoi(value); }
+  else if (field == "cpr") { source.cpr = std::strtoul(value, nullptr, 0); }
+  else if (field == "offset") { source.offset = std::atoi(value); }
+  else if (field == "sign") { source.sign = std::atoi(value); }
+  else if (field == "reference") {
+    source.reference =
+        ParseEnum<MotorPosition::SourceConfig::Reference>(key, value);
+  } else if (field == "pll_hz") {
+    source.pll_filter_hz = std::strtof(value, nullptr);
+  } else if (field == "i2c_device") { source.i2c_device = std::atoi(value); }
+  else {
+    Fail(fmt::format("unknown key: {}", key));
+  }
+}
+
+Args ParseArgs(int argc, char** argv, MotorPosition* position) {
+  Args result;
+  auto& config = *position->config();
+  for (int i = 1; i < argc; i++) {
+    const char* eq = std::strchr(argv[i], '=');
+    if (!eq) {
+      Fail(fmt::format("malformed argument: {}", argv[i]));
+    }
+    const std::string key(argv[i], eq - argv[i]);
+    const char* value = eq + 1;
+    if (key == "capture") { result.capture = value; }
+    else if (key == "decimate") { result.decimate = std::atoi(value); }
+    else if (key == "poles") { position->motor()->poles = std::atoi(value); }
+    else if (key == "ratio") {
+      config.rotor_to_output_ratio = std::strtof(value, nullptr);
+    } else if (key == "commutation_source") {
+      config.commutation_source = std::atoi(value);
+    } else if (key == "output_source") {
+      config.output.source = std::atoi(value);
+    } else if (key == "reference_source") {
+      config.output.reference_source = std::atoi(value);
+    } else if (key == "position_min") {
+      result.position_min = std::strtof(value, nullptr);
+    } else if (key == "position_max") {
+      result.position_max = std::strtof(value, nullptr);
+    } else if (key.size() > 1 && key[0] == 's') {
+      ParseSourceArg(key, value, &config);
+    } else {
+      Fail(fmt::format("unknown key: {}", key));
+    }
+  }
+  if (result.capture.empty()) { Fail("capture= must be specified"); }
+  return result;
+}
+
+/// Applies the input records to the aux status.
+class Inputs {
+ public:
+  Inputs(aux::AuxStatus* aux1, aux::AuxStatus* aux2) : aux_{aux1, aux2} {}
+
+  aux::AuxStatus* aux(uint8_t number) {
+    if (number < 1 || number > 2) {
+      Fail(fmt::format("invalid aux number {}", number));
+    }
+    return aux_[number - 1];
+  }
+
+  void Apply(const replay::Reader::Record& record) {
+    switch (record.type) {
+      case replay::Type::kSampleTime: {
+        const auto r = record.as<replay::SampleTime>();
+        aux(r.aux)->sample_us = r.sample_us;
+        break;
+      }
+      case replay::Type::kSpi: {
+        const auto r = record.as<replay::Spi>();
+        auto& spi = aux(r.aux)->spi;
+        spi.active = true;
+        spi.nonce = r.nonce;
+        spi.value = r.value;
+        spi.sample_us = r.sample_us;
+        break;
+      }
+      case replay::Type::kUart: {
+        const auto r = record.as<replay::Uart>();
+        auto& uart = aux(r.aux)->uart;
+        uart.active = true;
+        uart.nonce = r.nonce;
+        uart.value = r.value;
+        uart.sample_us = r.sample_us;
+        break;
+      }
+      case replay::Type::kI2c: {
+        const auto r = record.as<replay::I2c>();
+        auto& devices = aux(r.aux)->i2c.devices;
+        if (r.device >= devices.size()) {
+          Fail(fmt::format("invalid i2c device {}", r.device));
+        }
+        auto& device = devices[r.device];
+        device.active = true;
+        device.nonce = r.nonce;
+        device.value = r.value;
+        device.sample_us = r.sample_us;
+        break;
+      }
+      case replay::Type::kQuadrature: {
+        const auto r = record.as<replay::Quadrature>();
+        auto& quadrature = aux(r.aux)->quadrature;
+        quadrature.active = true;
+        quadrature.value = r.value;
+        quadrature.edge_us = r.edge_us;
+        quadrature.edge_count = r.edge_count;
+        break;
+      }
+      case replay::Type::kHall: {
+        const auto r = record.as<replay::Hall>();
+        auto& hall = aux(r.aux)->hall;
+        hall.active = true;
+        hall.bits = r.bits;
+        hall.count = r.count;
+        break;
+      }
+      case replay::Type::kIndex: {
+        const auto r = record.as<replay::Index>();
+        auto& index = aux(r.aux)->index;
+        index.active = true;
+        index.raw = r.value != 0;
+        index.value = r.value != 0;
+        break;
+      }
+      case replay::Type::kSineCosine: {
+        const auto r = record.as<replay::SineCosine>();
+        auto& sine_cosine = aux(r.aux)->sine_cosine;
+        sine_cosine.active = true;
+        sine_cosine.value = r.value;
+        break;
+      }
+      case replay::Type::kCycle:
+      case replay::Type::kCommand:
+      case replay::Type::kNumTypes: {
+        break;
+      }
+    }
+  }
+
+ private:
+  aux::AuxStatus* const aux_[2];
+};
+}
+
+extern "C" {
+int main(int argc, char** argv) {
+  mjlib::micro::test::PersistentConfigFixture pcf;
+  mjlib::micro::TelemetryManager telemetry_manager{
+    &pcf.pool, &pcf.command_manager, &pcf.write_stream, pcf.output_buffer};
+  aux::AuxStatus aux1_status;
+  aux::AuxStatus aux2_status;
+  aux::AuxConfig aux1_config;
+  aux::AuxConfig aux2_config;
+  MotorPosition position{&pcf.persistent_config, &telemetry_manager,
+                         &aux1_status, &aux2_status,
+                         &aux1_config, &aux2_config};
+
+  const auto args = ParseArgs(argc, argv, &position);
+
+  pcf.persistent_config.Load();
+  if (position.status().error != MotorPosition::Status::kNone) {
+    Fail(fmt::format("invalid position configuration: {}",
+                     static_cast<int>(position.status().error)));
+  }
+
+  replay::Reader reader(args.capture.c_str());
+  if (!reader.error().empty()) {
+    Fail(fmt::format("{}: {}", args.capture, reader.error()));
+  }
+  const float rate_hz = reader.header().rate_hz;
+  if (!(rate_hz > 0.0f)) { Fail("invalid rate in header"); }
+  const float dt = 1.0f / rate_hz;
+  const int cycles_per_ms = std::max(1, static_cast<int>(rate_hz / 1000.0f));
+
+  BldcServoStatus servo_status;
+  BldcServoConfig servo_config;
+  BldcServoPositionConfig position_config;
+  position_config.position_min = args.position_min;
+  position_config.position_max = args.position_max;
+  BldcServoCommandData command;
+  command.mode = kPosition;
+  TrajectoryPlan plan;
+  bool commanded = false;
+
+  Inputs inputs(&aux1_status, &aux2_status);
+  const auto& status = position.status();
+
+  if (args.decimate > 0) {
+    fmt::print("time_s,error,homed,position,velocity,electrical_phase,"
+               "control_position,control_velocity,trajectory_done\n");
+  }
+
+  const auto start = std::chrono::steady_clock::now();
+  int64_t cycles = 0;
+  replay::Reader::Record record;
+  while (reader.Next(&record)) {
+    if (record.type == replay::Type::kCommand) {
+      const auto r = record.as<replay::Command>();
+      const int64_t delta =
+          static_cast<int64_t>(position.absolute_relative_delta.load()) << 32;
+      command.position = r.position;
+      command.velocity = r.velocity;
+      command.velocity_limit = r.velocity_limit;
+      command.accel_limit = r.accel_limit;
+      if (!std::isnan(command.velocity_limit) &&
+          !std::isnan(command.velocity)) {
+        command.velocity = std::max(
+            -command.velocity_limit,
+            std::min(command.velocity_limit, command.velocity));
+      }
+      if (!std::isnan(command.position)) {
+        command.position_relative_raw =
+            MotorPosition::FloatToInt(command.position) - delta;
+      } else {
+        command.position_relative_raw.reset();
+      }
+      if (!commanded) {
+        servo_status.control_position_raw.reset();
+        commanded = true;
+      }
+      plan.active = false;
+      continue;
+    }
+    if (record.type != replay::Type::kCycle) {
+      inputs.Apply(record);
+      continue;
+    }
+
+    position.ISR_Update(dt);
+    if ((cycles % cycles_per_ms) == 0) {
+      position.PollMillisecond();
+    }
+
+    float control_velocity = std::numeric_limits<float>::quiet_NaN();
+    if (commanded && status.position_relative_valid) {
+      const int64_t delta =
+          static_cast<int64_t>(position.absolute_relative_delta.load()) << 32;
+      servo_status.velocity_filt = status.velocity;
+      control_velocity = BldcServoPosition::UpdateCommand(
+          &servo_status, &servo_config, &position_config, &status,
+          delta, rate_hz, &command, command.velocity, &plan);
+    }
+
+    cycles++;
+    if (args.decimate <= 0 || (cycles % args.decimate) != 0) { continue; }
+
+    const int64_t delta =
+        static_cast<int64_t>(position.absolute_relative_delta.load()) << 32;
+    const float control_position =
+        servo_status.control_position_raw ?
+        MotorPosition::IntToFloat(*servo_status.control_position_raw + delta) :
+        std::numeric_limits<float>::quiet_NaN();
+    fmt::print("{:.6f},{},{},{:.6f},{:.5f},{},{:.6f},{:.5f},{}\n",
+               cycles * static_cast<double>(dt),
+               static_cast<int>(status.error),
+               static_cast<int>(status.homed),
+               status.position, status.velocity,
+               status.electrical_phase,
+               control_position, control_velocity,
+               servo_status.trajectory_done ? 1 : 0);
+  }
+  const double elapsed_s = std::chrono::duration<double>(
+      std::chrono::steady_clock::now() - start).count();
+
+  if (!reader.error().empty()) {
+    Fail(fmt::format("{}: {}", args.capture, reader.error()));
+  }
+
+  const double captured_s = cycles * static_cast<double>(dt);
+  fmt::print(stderr,
+             "{} cycles, {:.3f}s captured, {:.3f}s elapsed, "
+             "{:.1f} ns/cycle, {:.0f}x real time\n",
+             cycles, captured_s, elapsed_s,
+             cycles ? (elapsed_s * 1e9 / cycles) : 0.0,
+             elapsed_s > 0.0 ? (captured_s / elapsed_s) : 0.0);
+
+  return 0;
+}
+}
@@ -0,0 +1,162 @@
+// Copyright 2023 mjbots Robotic Systems, LLC.  info@mjbots.com
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+/// Run the servo control loop against a simulated motor and emit a
+/// CSV trace on stdout.
+///
+///  servo_sim [key=value ...]
+///
+/// Recognized keys:
+///  mode      - "current", "position", "voltage_dq", or "stopped"
+///  d_A, q_A  - current mode setpoints
+///  d_V, q_V  - voltage_dq mode setpoints
+///  position, velocity, max_torque - position mode setpoints
+///  kp, kd    - position loop gains
+///  load      - external load torque in Nm
+///  duration  - simulated seconds to run
+///  decimate  - emit one row for every N control cycles
+
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <limits>
+#include <string>
+
+#include <fmt/format.h>
+
+#include "mjlib/micro/test/persistent_config_fixture.h"
+
+#include "fw/bldc_servo_sim.h"
+
+namespace moteus {
+volatile uint8_t g_measured_hw_family = 0;
+volatile uint8_t g_measured_hw_rev = 7;
+}
+
+using namespace moteus;
+
+namespace {
+struct Args {
+  std::string mode = "position";
+  float d_A = 0.0f;
+  float q_A = 0.0f;
+  float d_V = 0.0f;
+  float q_V = 0.0f;
+  float position = 0.5f;
+  float velocity = 0.0f;
+  float max_torque = 0.5f;
+  float kp = 1.0f;
+  float kd = 0.02f;
+  double load = 0.0;
+  double duration = 0.5;
+  int decimate = 20;
+};
+
+Args ParseArgs(int argc, char** argv) {
+  Args result;
+  for (int i = 1; i < argc; i++) {
+    const char* eq = std::strchr(argv[i], '=');
+    if (!eq) {
+      fmt::print(stderr, "malformed argument: {}\n", argv[i]);
+      std::exit(1);
+    }
+    const std::string key(argv[i], eq - argv[i]);
+    const char* value = eq + 1;
+    const float fvalue = std::strtof(value, nullptr);
+    if (key == "mode") { result.mode = value; }
+    else if (key == "d_A") { result.d_A = fvalue; }
+    else if (key == "q_A") { result.q_A = fvalue; }
+    else if (key == "d_V") { result.d_V = fvalue; }
+    else if (key == "q_V") { result.q_V = fvalue; }
+    else if (key == "position") { result.position = fvalue; }
+    else if (key == "velocity") { result.velocity = fvalue; }
+    else if (key == "max_torque") { result.max_torque = fvalue; }
+    else if (key == "kp") { result.kp = fvalue; }
+    else if (key == "kd") { result.kd = fvalue; }
+    else if (key == "load") { result.load = std::strtod(value, nullptr); }
+    else if (key == "duration") { result.duration = std::strtod(value, nullptr); }
+    else if (key == "decimate") { result.decimate = std::atoi(value); }
+    else {
+      fmt::print(stderr, "unknown key: {}\n", key);
+      std::exit(1);
+    }
+  }
+  return result;
+}
+}
+
+extern "C" {
+int main(int argc, char** argv) {
+  const auto args = ParseArgs(argc, argv);
+
+  mjlib::micro::test::PersistentConfigFixture pcf;
+  mjlib::micro::TelemetryManager telemetry_manager{
+    &pcf.pool, &pcf.command_manager, &pcf.write_stream, pcf.output_buffer};
+
+  BldcServoSim sim{&pcf.persistent_config, &telemetry_manager};
+  sim.core()->mutable_config()->pid_position.kp = args.kp;
+  sim.core()->mutable_config()->pid_position.kd = args.kd;
+  sim.plant()->set_load_Nm(args.load);
+
+  pcf.persistent_config.Load();
+
+  BldcServoCommandData command;
+  command.timeout_s = std::numeric_limits<float>::quiet_NaN();
+  if (args.mode == "current") {
+    command.mode = kCurrent;
+    command.i_d_A = args.d_A;
+    command.i_q_A = args.q_A;
+  } else if (args.mode == "voltage_dq") {
+    command.mode = kVoltageDq;
+    command.d_V = args.d_V;
+    command.q_V = args.q_V;
+  } else if (args.mode == "position") {
+    command.mode = kPosition;
+    command.position = args.position;
+    command.velocity = args.velocity;
+    command.max_torque_Nm = args.max_torque;
+  } else if (args.mode == "stopped") {
+    command.mode = kStopped;
+  } else {
+    fmt::print(stderr, "unknown mode: {}\n", args.mode);
+    return 1;
+  }
+  sim.Command(command);
+
+  fmt::print("time_s,mode,fault,position,velocity,d_A,q_A,torque_Nm,"
+             "plant_position,plant_velocity,plant_d_A,plant_q_A\n");
+
+  const auto& status = sim.core()->status();
+  const int pwm_per_row =
+      args.decimate * sim.core()->rate_config().interrupt_divisor;
+  int count = 0;
+  while (sim.time_s() < args.duration) {
+    sim.Step();
+    if (++count % pwm_per_row) { continue; }
+
+    fmt::print("{:.6f},{},{},{:.5f},{:.4f},{:.3f},{:.3f},{:.4f},"
+               "{:.5f},{:.4f},{:.3f},{:.3f}\n",
+               sim.time_s(),
+               static_cast<int>(status.mode),
+               static_cast<int>(status.fault),
+               status.position, status.velocity,
+               status.d_A, status.q_A, status.torque_Nm,
+               sim.plant()->mechanical_theta() / (2.0 * M_PI),
+               sim.plant()->mechanical_velocity() / (2.0 * M_PI),
+               sim.plant()->d_A(), sim.plant()->q_A());
+  }
+
+  return 0;
+}
+}
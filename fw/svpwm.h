@@ -0,0 +1,175 @@
+// Copyright 2023 mjbots Robotic Systems, LLC.  info@mjbots.com
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+
+#include <cmath>
+
+#include "fw/ccm.h"
+#include "fw/foc.h"
+#include "fw/math.h"
+
+namespace moteus {
+
+/// Converts the voltage difference between two phases, as a fraction
+/// of the bus voltage, into a difference in duty cycle.  This
+/// compensates for the deadtime and switching characteristics of the
+/// power stage.
+struct PwmCompensation {
+  // The duty cycle offset applied to small differences.
+  float offset = 0.0f;
+  // Below this magnitude, the offset is linearly ramped in.
+  float mag = 0.0f;
+  // A final scale applied to all differences.
+  float scale = 1.0f;
+
+  static float BilinearRate(float offset, float mag, float val) MOTEUS_CCM_ATTRIBUTE {
+    const float sign = val < 0.0f ? -1.0f : 1.0f;
+    if (std::abs(val) < mag) {
+      return val / mag * offset;
+    } else {
+      return sign * ((0.5f - offset) * (std::abs(val) - mag) / (0.5f - mag) + offset);
+    }
+  }
+
+  /// Return the compensated version of @p fdx, where @p fd_other is
+  /// the difference of the remaining phase from the same lowest
+  /// phase.  The compensation is blended in as @p fdx becomes a
+  /// significant fraction of @p fd_other.
+  float operator()(float fdx, float fd_other) const MOTEUS_CCM_ATTRIBUTE {
+    constexpr float blend_min = 0.2f;
+    constexpr float blend_max = 0.6f;
+    constexpr float blend_region = blend_max - blend_min;
+
+    if (fdx < blend_min * fd_other) {
+      return fdx * scale;
+    }
+    const float scaled = BilinearRate(offset, mag, fdx);
+    if (fdx < blend_max * fd_other) {
+      const float frac = (fdx - blend_min * fd_other) /
+          (blend_region * fd_other);
+      return (fdx + frac * (scaled - fdx)) * scale;
+    }
+    return scaled * scale;
+  }
+};
+
+/// Generate duty cycles for three arbitrary phase voltages, centered
+/// about 50%.  The lowest phase is used as the reference for
+/// compensation.
+struct BalancedPwm {
+  BalancedPwm(float va, float vb, float vc, float bus_V,
+              const PwmCompensation& comp) MOTEUS_CCM_ATTRIBUTE {
+    if (va <= vb && va <= vc) {
+      Rotated(va, vb, vc, bus_V, comp, &a, &b, &c);
+    } else if (vb <= va && vb <= vc) {
+      Rotated(vb, vc, va, bus_V, comp, &b, &c, &a);
+    } else {
+      Rotated(vc, va, vb, bus_V, comp, &c, &a, &b);
+    }
+  }
+
+  float a = 0.0f;
+  float b = 0.0f;
+  float c = 0.0f;
+
+ private:
+  static void Rotated(float v0, float v1, float v2, float bus_V,
+                      const PwmCompensation& comp,
+                      float* p0, float* p1, float* p2) MOTEUS_CCM_ATTRIBUTE {
+    // We can assume that v0 is the smallest of the three.  Switch
+    // into full scale ratios relative to it.
+    const float fd1 = (v1 - v0) / bus_V;
+    const float fd2 = (v2 - v0) / bus_V;
+
+    const float dp1 = comp(fd1, fd2);
+    const float dp2 = comp(fd2, fd1);
+
+    // And then balance them.
+    const float avg = (dp1 + dp2) / 3.0f;
+    *p0 = 0.5f - avg;
+    *p1 = *p0 + dp1;
+    *p2 = *p0 + dp2;
+  }
+};
+
+/// Go directly from a d/q voltage to duty cycles.  This is
+/// equivalent to InverseDqTransform followed by BalancedPwm, but
+/// works from the stationary frame voltage vector.  The 60 degree
+/// sector it lies in selects the lowest phase, and each phase to
+/// phase difference is a single multiply-add.
+///
+/// The zero sequence is the same as BalancedPwm, which keeps the
+/// average duty cycle at 50%, rather than the min/max injection of
+/// textbook SVPWM.
+struct SpaceVectorPwm {
+  SpaceVectorPwm(const SinCos& sc, float d_V, float q_V, float inv_bus_V,
+                 const PwmCompensation& comp) MOTEUS_CCM_ATTRIBUTE {
+    // The stationary frame voltage vector, where phase A is aligned
+    // with alpha.
+    const float alpha = sc.c * d_V - sc.s * q_V;
+    const float beta = sc.s * d_V + sc.c * q_V;
+
+    // The phase voltages are:
+    //   va = alpha
+    //   vb = -alpha / 2 + u
+    //   vc = -alpha / 2 - u
+    const float h = 0.5f * alpha;
+    const float u = kSqrt3_4 * beta;
+    va = alpha;
+    vb = u - h;
+    vc = -u - h;
+
+    // Phase to phase differences, already normalized by the bus.
+    const float s3h = 3.0f * h * inv_bus_V;
+    const float su = u * inv_bus_V;
+    const float fba = su - s3h;
+    const float fca = -su - s3h;
+
+    if (fba >= 0.0f && fca >= 0.0f) {
+      // A is lowest.
+      Sector(fba, fca, comp, &a, &b, &c);
+    } else if (fba <= 0.0f && su <= 0.0f) {
+      // B is lowest.  fcb = -2 * su
+      Sector(-2.0f * su, -fba, comp, &b, &c, &a);
+    } else {
+      // C is lowest.
+      Sector(-fca, 2.0f * su, comp, &c, &a, &b);
+    }
+  }
+
+  // The resulting duty cycles.
+  float a = 0.0f;
+  float b = 0.0f;
+  float c = 0.0f;
+
+  // The phase voltages that were modulated.
+  float va = 0.0f;
+  float vb = 0.0f;
+  float vc = 0.0f;
+
+ private:
+  static void Sector(float fd1, float fd2, const PwmCompensation& comp,
+                     float* p0, float* p1, float* p2) MOTEUS_CCM_ATTRIBUTE {
+    const float dp1 = comp(fd1, fd2);
+    const float dp2 = comp(fd2, fd1);
+
+    const float avg = (dp1 + dp2) * (1.0f / 3.0f);
+    *p0 = 0.5f - avg;
+    *p1 = *p0 + dp1;
+    *p2 = *p0 + dp2;
+  }
+};
+
+}
@@ -0,0 +1,478 @@
+// Copyright 2023 mjbots Robotic Systems, LLC.  info@mjbots.com
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "fw/bldc_servo_core.h"
+
+#include <boost/test/auto_unit_test.hpp>
+
+#include "mjlib/micro/test/persistent_config_fixture.h"
+
+#include "fw/bldc_servo_sim.h"
+
+using namespace moteus;
+
+namespace {
+struct Context {
+  mjlib::micro::test::PersistentConfigFixture pcf;
+  mjlib::micro::TelemetryManager telemetry_manager{
+    &pcf.pool, &pcf.command_manager, &pcf.write_stream, pcf.output_buffer};
+
+  BldcServoSim sim;
+
+  Context(const BldcServoSim::Options& options = BldcServoSim::Options())
+      : sim(&pcf.persistent_config, &telemetry_manager, options) {
+    auto& config = *sim.core()->mutable_config();
+    config.pid_position.kp = 1.0f;
+    config.pid_position.kd = 0.02f;
+
+    pcf.persistent_config.Load();
+  }
+
+  const BldcServoCore::Status& status() {
+    return sim.core()->status();
+  }
+};
+
+BldcServoCommandData MakeCommand(BldcServoMode mode) {
+  BldcServoCommandData result;
+  result.mode = mode;
+  result.timeout_s = std::numeric_limits<float>::quiet_NaN();
+  return result;
+}
+}
+
+BOOST_AUTO_TEST_CASE(BldcServoCoreCalibrate) {
+  Context ctx;
+
+  BOOST_TEST((ctx.status().mode == kStopped));
+
+  ctx.sim.Command(MakeCommand(kCurrent));
+  ctx.sim.Run(0.002);
+  BOOST_TEST((ctx.status().mode == kCalibrating));
+
+  ctx.sim.Run(0.02);
+  BOOST_TEST((ctx.status().mode == kCurrent));
+  BOOST_TEST((ctx.status().fault == errc::kSuccess));
+  BOOST_TEST(ctx.status().adc_cur1_offset == 2048);
+  BOOST_TEST(ctx.status().adc_cur2_offset == 2048);
+  BOOST_TEST(ctx.status().adc_cur3_offset == 2048);
+}
+
+BOOST_AUTO_TEST_CASE(BldcServoCoreCurrentTracking) {
+  Context ctx;
+
+  auto command = MakeCommand(kCurrent);
+  command.i_q_A = 2.0f;
+  ctx.sim.Command(command);
+
+  ctx.sim.Run(0.03);
+  BOOST_TEST_REQUIRE((ctx.status().mode == kCurrent));
+
+  // Both the controller's view and the simulated motor should agree
+  // that we are producing the requested current.
+  BOOST_TEST(std::abs(ctx.status().q_A - 2.0f) < 0.2f);
+  BOOST_TEST(std::abs(ctx.status().d_A) < 0.2f);
+  BOOST_TEST(std::abs(ctx.sim.plant()->q_A() - 2.0) < 0.1);
+  BOOST_TEST(std::abs(ctx.sim.plant()->d_A()) < 0.1);
+
+  // And the motor should be accelerating in the positive direction.
+  BOOST_TEST(ctx.sim.plant()->mechanical_velocity() > 0.0);
+  BOOST_TEST(ctx.status().velocity > 0.0f);
+}
+
+BOOST_AUTO_TEST_CASE(BldcServoCorePositionHold) {
+  Context ctx;
+
+  auto command = MakeCommand(kPosition);
+  command.position = 0.25f;
+  command.velocity = 0.0f;
+  command.max_torque_Nm = 0.5f;
+  ctx.sim.Command(command);
+
+  ctx.sim.Run(0.5);
+  BOOST_TEST_REQUIRE((ctx.status().mode == kPosition));
+
+  const double plant_position =
+      ctx.sim.plant()->mechanical_theta() / (2.0 * M_PI);
+  BOOST_TEST(std::abs(plant_position - 0.25) < 0.005);
+  BOOST_TEST(std::abs(ctx.status().position - 0.25f) < 0.005f);
+  BOOST_TEST(std::abs(ctx.sim.plant()->mechanical_velocity()) < 0.1);
+}
+
+BOOST_AUTO_TEST_CASE(BldcServoCoreStop) {
+  Context ctx;
+
+  auto command = MakeCommand(kCurrent);
+  command.i_q_A = 1.0f;
+  ctx.sim.Command(command);
+  ctx.sim.Run(0.03);
+  BOOST_TEST_REQUIRE((ctx.status().mode == kCurrent));
+
+  ctx.sim.Command(MakeCommand(kStopped));
+
+  // After the cooldown period, everything should be off.
+  ctx.sim.Run(0.05);
+  BOOST_TEST((ctx.status().mode == kStopped));
+  BOOST_TEST(ctx.sim.plant()->q_A() == 0.0);
+  BOOST_TEST(ctx.sim.plant()->d_A() == 0.0);
+}
+
+BOOST_AUTO_TEST_CASE(BldcServoCoreWaypoints) {
+  Context ctx;
+
+  auto command = MakeCommand(kPosition);
+  command.position = std::numeric_limits<float>::quiet_NaN();
+  command.velocity = 0.0f;
+  command.max_torque_Nm = 0.5f;
+  ctx.sim.Command(command);
+  ctx.sim.Run(0.1);
+  BOOST_TEST_REQUIRE((ctx.status().mode == kPosition));
+
+  auto* const core = ctx.sim.core();
+  for (int i = 1; i <= 10; i++) {
+    BOOST_TEST(core->PushWaypoint(0.025f * i, 0.0f, 0.0f, 0.02f));
+  }
+  BOOST_TEST(!core->PushWaypoint(
+                 std::numeric_limits<float>::quiet_NaN(), 0.0f, 0.0f, 0.02f));
+  BOOST_TEST(core->waypoint_count() == 10);
+
+  ctx.sim.Run(0.1);
+  BOOST_TEST(core->waypoint_count() < 6);
+  BOOST_TEST(ctx.status().control_position > 0.05f);
+  BOOST_TEST(ctx.status().control_position < 0.2f);
+
+  // Once the waypoints are exhausted, the final one is held.
+  ctx.sim.Run(0.4);
+  BOOST_TEST(core->waypoint_count() == 0);
+  BOOST_TEST(std::abs(ctx.status().control_position - 0.25f) < 1e-4f);
+  BOOST_TEST(std::abs(ctx.status().position - 0.25f) < 0.005f);
+
+  // Stopping discards anything queued.
+  core->PushWaypoint(0.5f, 0.0f, 0.0f, 0.02f);
+  ctx.sim.Command(MakeCommand(kStopped));
+  ctx.sim.Run(0.05);
+  BOOST_TEST(core->waypoint_count() == 0);
+}
+
+BOOST_AUTO_TEST_CASE(BldcServoCoreInterpolation) {
+  Context ctx;
+  ctx.sim.core()->mutable_config()->interpolation_max_period_s = 0.01f;
+
+  // Stream a ramp at 1kHz.
+  auto command = MakeCommand(kPosition);
+  command.velocity = 0.5f;
+  command.max_torque_Nm = 0.5f;
+  for (int i = 0; i < 200; i++) {
+    command.position = 0.0005f * i;
+    ctx.sim.Command(command);
+    ctx.sim.Run(0.001);
+  }
+  BOOST_TEST_REQUIRE((ctx.status().mode == kPosition));
+
+  // Halfway between commands, we are halfway between the previous
+  // two.
+  command.position = 0.1f;
+  ctx.sim.Command(command);
+  ctx.sim.Run(0.0005);
+  BOOST_TEST(std::abs(ctx.status().control_position - 0.09975f) < 2e-5f);
+  BOOST_TEST(std::abs(ctx.status().control_velocity.value() - 0.5f) < 0.1f);
+  BOOST_TEST(std::abs(ctx.status().position - 0.09975f) < 0.005f);
+}
+
+BOOST_AUTO_TEST_CASE(BldcServoCoreInterpolationBackToBack) {
+  Context ctx;
+  ctx.sim.core()->mutable_config()->interpolation_max_period_s = 0.01f;
+
+  auto command = MakeCommand(kPosition);
+  command.velocity = 0.5f;
+  command.max_torque_Nm = 0.5f;
+
+  // The largest change in control position in one position update,
+  // in revolutions per second.
+  const double position_rate_hz =
+      ctx.sim.core()->rate_config().position_rate_hz;
+  double max_velocity = 0.0;
+  int64_t last_raw = 0;
+  auto run = [&]() {
+    // One millisecond, at the default PWM rate.
+    for (int j = 0; j < 40; j++) {
+      ctx.sim.Step();
+      const int64_t raw = ctx.status().control_position_raw.value_or(0);
+      max_velocity = std::max(
+          max_velocity,
+          std::abs(static_cast<double>(raw - last_raw)) /
+          static_cast<double>(1ll << 48) * position_rate_hz);
+      last_raw = raw;
+    }
+  };
+
+  for (int i = 0; i < 200; i++) {
+    command.position = 0.0005f * i;
+    ctx.sim.Command(command);
+    // Every so often, a command is delayed until just before the
+    // next one, so that both arrive between position updates.  Each
+    // must still be treated as new.
+    if ((i % 37) == 36) { continue; }
+    run();
+    // Ignore the start of the motion.
+    if (i == 20) { max_velocity = 0.0; }
+  }
+  BOOST_TEST_REQUIRE((ctx.status().mode == kPosition));
+
+  // Catching up on a late command takes a little more velocity, but
+  // the control position never jumps.
+  BOOST_TEST(max_velocity < 1.5);
+}
+
+BOOST_AUTO_TEST_CASE(BldcServoCorePlannedBackToBack) {
+  Context ctx;
+
+  auto command = MakeCommand(kPosition);
+  command.position = 0.0f;
+  command.velocity = 0.0f;
+  command.max_torque_Nm = 0.5f;
+  command.accel_limit = 2.0f;
+  command.velocity_limit = 1.0f;
+  ctx.sim.Command(command);
+  ctx.sim.Run(0.05);
+  BOOST_TEST_REQUIRE((ctx.status().mode == kPosition));
+
+  const double position_rate_hz =
+      ctx.sim.core()->rate_config().position_rate_hz;
+  double max_velocity = 0.0;
+  double max_accel = 0.0;
+  int64_t last_raw = ctx.status().control_position_raw.value_or(0);
+  double last_velocity = 0.0;
+  auto run = [&](double duration_s) {
+    for (int j = 0; j < duration_s * 40000.0; j++) {
+      ctx.sim.Step();
+      const int64_t raw = ctx.status().control_position_raw.value_or(0);
+      if (raw == last_raw) { continue; }
+      const double velocity =
+          static_cast<double>(raw - last_raw) /
+          static_cast<double>(1ll << 48) * position_rate_hz;
+      max_velocity = std::max(max_velocity, std::abs(velocity));
+      max_accel = std::max(
+          max_accel, std::abs(velocity - last_velocity) * position_rate_hz);
+      last_raw = raw;
+      last_velocity = velocity;
+    }
+  };
+
+  // Start a short move, then just before it finishes, send two
+  // commands between position updates.  The plan must be made for the
+  // second, rather than carrying on with the first.
+  command.position = 0.2f;
+  ctx.sim.Command(command);
+  run(0.6);
+  BOOST_TEST_REQUIRE(!ctx.status().trajectory_done);
+
+  command.position = 0.3f;
+  ctx.sim.Command(command);
+  command.position = 3.0f;
+  ctx.sim.Command(command);
+  run(4.0);
+
+  BOOST_TEST(ctx.status().trajectory_done);
+  BOOST_TEST(std::abs(ctx.status().control_position - 3.0f) < 1e-4f);
+  BOOST_TEST(max_velocity < 1.01);
+  // The position only has a resolution of 2^-32 revolutions per
+  // update, which adds about 0.1 rev/s^2 to the measured acceleration.
+  BOOST_TEST(max_accel < 2.2);
+}
+
+BOOST_AUTO_TEST_CASE(BldcServoCoreOverVoltage) {
+  BldcServoSim::Options options;
+  options.bus_V = 60.0f;
+  Context ctx(options);
+
+  ctx.sim.Command(MakeCommand(kCurrent));
+  ctx.sim.Run(0.03);
+  BOOST_TEST((ctx.status().mode == kFault));
+  BOOST_TEST((ctx.status().fault == errc::kOverVoltage));
+  BOOST_TEST(ctx.sim.plant()->q_A() == 0.0);
+}
+
+BOOST_AUTO_TEST_CASE(BldcServoCoreCoggingCompensation) {
+  Context ctx;
+
+  auto command = MakeCommand(kPosition);
+  command.position = 0.0f;
+  command.velocity = 0.0f;
+  command.max_torque_Nm = 0.5f;
+  ctx.sim.Command(command);
+  ctx.sim.Run(0.05);
+  BOOST_TEST_REQUIRE((ctx.status().mode == kPosition));
+  BOOST_TEST(ctx.sim.core()->control().q_comp_A == 0.0f);
+
+  // Enabling an optional feature after startup must switch to a
+  // control handler that implements it.
+  auto& motor = *ctx.sim.motor_position()->motor();
+  motor.cogging_dq_comp.fill(50);
+  motor.cogging_dq_scale = 0.02f;
+  ctx.pcf.persistent_config.Load();
+
+  ctx.sim.Command(MakeCommand(kStopped));
+  ctx.sim.Run(0.05);
+  ctx.sim.Command(command);
+  ctx.sim.Run(0.05);
+  BOOST_TEST_REQUIRE((ctx.status().mode == kPosition));
+  BOOST_TEST(ctx.sim.core()->control().q_comp_A == 1.0f,
+             boost::test_tools::tolerance(1e-5f));
+}
+
+BOOST_AUTO_TEST_CASE(BldcServoCoreVoltageModeControl) {
+  Context ctx;
+  ctx.sim.core()->mutable_config()->voltage_mode_control = true;
+  ctx.pcf.persistent_config.Load();
+
+  auto command = MakeCommand(kCurrent);
+  command.i_q_A = 2.0f;
+  ctx.sim.Command(command);
+  ctx.sim.Run(0.03);
+  BOOST_TEST_REQUIRE((ctx.status().mode == kCurrent));
+
+  // In voltage mode, the current loop is open, and the voltage comes
+  // directly from the motor resistance.
+  const float resistance_ohm =
+      ctx.sim.motor_position()->motor()->resistance_ohm;
+  BOOST_TEST(ctx.sim.core()->control().q_V == 2.0f * resistance_ohm);
+  BOOST_TEST(ctx.sim.core()->control().d_V == 0.0f);
+}
+
+BOOST_AUTO_TEST_CASE(BldcServoCorePositionDivisor) {
+  Context ctx;
+  ctx.sim.core()->mutable_config()->position_rate_divisor = 4;
+  ctx.pcf.persistent_config.Load();
+
+  const auto& rate_config = ctx.sim.core()->rate_config();
+  BOOST_TEST(rate_config.position_divisor == 4);
+  BOOST_TEST(rate_config.position_rate_hz == rate_config.rate_hz / 4.0f);
+
+  auto command = MakeCommand(kPosition);
+  command.position = 0.25f;
+  command.velocity = 0.0f;
+  command.max_torque_Nm = 0.5f;
+  ctx.sim.Command(command);
+
+  ctx.sim.Run(0.5);
+  BOOST_TEST_REQUIRE((ctx.status().mode == kPosition));
+
+  const double plant_position =
+      ctx.sim.plant()->mechanical_theta() / (2.0 * M_PI);
+  BOOST_TEST(std::abs(plant_position - 0.25) < 0.005);
+  BOOST_TEST(std::abs(ctx.sim.plant()->mechanical_velocity()) < 0.1);
+
+  // While moving, the torque command only changes on position loop
+  // updates, but the current loop runs every cycle.
+  command.position = std::numeric_limits<float>::quiet_NaN();
+  command.velocity = 1.0f;
+  ctx.sim.Command(command);
+  ctx.sim.Run(0.1);
+
+  int torque_changes = 0;
+  int voltage_changes = 0;
+  float old_torque = ctx.sim.core()->control().torque_Nm;
+  float old_q_V = ctx.sim.core()->control().q_V;
+  constexpr int kCycles = 40;
+  for (int i = 0; i < kCycles * rate_config.interrupt_divisor; i++) {
+    ctx.sim.Step();
+    const auto& control = ctx.sim.core()->control();
+    if (control.torque_Nm != old_torque) { torque_changes++; }
+    if (control.q_V != old_q_V) { voltage_changes++; }
+    old_torque = control.torque_Nm;
+    old_q_V = control.q_V;
+  }
+  BOOST_TEST(torque_changes <= kCycles / 4);
+  BOOST_TEST(torque_changes >= kCycles / 4 - 1);
+  BOOST_TEST(voltage_changes > kCycles / 2);
+
+  // Out of range values are limited.
+  ctx.sim.core()->mutable_config()->position_rate_divisor = 100;
+  ctx.pcf.persistent_config.Load();
+  BOOST_TEST(ctx.sim.core()->config().position_rate_divisor == 16);
+}
+
+BOOST_AUTO_TEST_CASE(BldcServoCoreSensorless) {
+  Context ctx;
+
+  // Commutate from a flux observer, while still measuring the output
+  // with the encoder.
+  auto& position_config = *ctx.sim.motor_position()->config();
+  position_config.sources[1].type = MotorPosition::SourceConfig::kSensorless;
+  position_config.commutation_source = 1;
+  ctx.pcf.persistent_config.Load();
+  BOOST_TEST_REQUIRE(
+      (ctx.sim.motor_position()->status().error ==
+       MotorPosition::Status::kNone));
+  BOOST_TEST(position_config.sources[1].cpr ==
+             static_cast<uint32_t>(MotorPosition::kSensorlessCounts * 7));
+
+  // A flux observer cannot start from rest, so start the motor
+  // already spinning.
+  ctx.sim.plant()->set_mechanical_velocity(2.0 * M_PI * 20.0);
+
+  auto phase_error = [&]() {
+    const double expected = ctx.sim.plant()->electrical_theta();
+    const double actual =
+        ctx.sim.motor_position()->status().electrical_phase *
+        (2.0 * M_PI / 4294967296.0);
+    const double error = std::remainder(actual - expected, 2.0 * M_PI);
+    return std::abs(error);
+  };
+
+  auto command = MakeCommand(kCurrent);
+  ctx.sim.Command(command);
+  ctx.sim.Run(0.05);
+  BOOST_TEST_REQUIRE((ctx.status().mode == kCurrent));
+  BOOST_TEST(phase_error() < 0.1);
+
+  command.i_q_A = 2.0f;
+  ctx.sim.Command(command);
+  const double start_velocity = ctx.sim.plant()->mechanical_velocity();
+  ctx.sim.Run(0.05);
+
+  BOOST_TEST(phase_error() < 0.1);
+  BOOST_TEST(std::abs(ctx.sim.plant()->q_A() - 2.0) < 0.2);
+  BOOST_TEST(std::abs(ctx.sim.plant()->d_A()) < 0.2);
+  BOOST_TEST(ctx.sim.plant()->mechanical_velocity() > start_velocity);
+
+  const float velocity_error =
+      ctx.sim.motor_position()->status().sources[1].velocity /
+      MotorPosition::kSensorlessCounts / 7.0f -
+      static_cast<float>(ctx.sim.plant()->mechanical_velocity() / (2.0 * M_PI));
+  BOOST_TEST(std::abs(velocity_error) < 0.5f);
+}
+
+BOOST_AUTO_TEST_CASE(BldcServoCoreSensorlessConfig) {
+  Context ctx;
+
+  auto& position_config = *ctx.sim.motor_position()->config();
+  auto& motor = *ctx.sim.motor_position()->motor();
+  auto error = [&]() { return ctx.sim.motor_position()->status().error; };
+
+  position_config.sources[1].type = MotorPosition::SourceConfig::kSensorless;
+  ctx.pcf.persistent_config.Load();
+  BOOST_TEST((error() == MotorPosition::Status::kNone));
+
+  // A second one would integrate the same observer twice per cycle.
+  position_config.sources[2].type = MotorPosition::SourceConfig::kSensorless;
+  ctx.pcf.persistent_config.Load();
+  BOOST_TEST((error() == MotorPosition::Status::kInvalidConfig));
+
+  position_config.sources[2].type = MotorPosition::SourceConfig::kNone;
+  motor.inductance_H = 0.0f;
+  ctx.pcf.persistent_config.Load();
+  BOOST_TEST((error() == MotorPosition::Status::kMotorNotConfigured));
+}
@@ -35,6 +35,9 @@ struct Context {
   float rate_hz = 40000.0f;
   BldcServoCommandData data;
 
+  // If set, moves are planned rather than re-decided each cycle.
+  TrajectoryPlan* plan = nullptr;
+
   Context() {
     position_config.position_min = NaN;
     position_config.position_max = NaN;
@@ -82,7 +85,8 @@ struct Context {
         0,
         rate_hz,
         &data,
-        data.velocity);
+        data.velocity,
+        plan);
   }
 };
 }
@@ -584,6 +588,267 @@ BOOST_AUTO_TEST_CASE(AccelVelocityLimits, * boost::unit_test::tolerance(1e-3)) {
   }
 }
 
+BOOST_AUTO_TEST_CASE(PlannedAccelVelocityLimits) {
+  struct TestCase {
+    double x0;
+    double v0;
+
+    double xf;
+    double vf;
+
+    double a;
+    double v;
+    double rate_khz;
+  };
+
+  TestCase test_cases[] = {
+    // No velocity limit.
+    { 0.0,  0.0,    5.0, 0.0,   1.0, NaN, 40 },
+    { 0.0,  1.0,    5.0, 0.0,   1.0, NaN, 40 },
+    { 0.0,  1.0,    5.0, 1.5,   1.0, NaN, 40 },
+    { 0.0, -1.0,   -5.0,-1.5,   1.0, NaN, 40 },
+    { 5.0,  0.0,    0.0, 0.0,   2.0, NaN, 40 },
+
+    // Accel and velocity limits
+    { 0.0,  0.0,    3.0, 0.0,   1.0, 0.5, 40 },
+    { 0.0,  0.3,    3.0, 0.0,   2.0, 0.7, 40 },
+    { 0.3,  2.0,    3.0, 0.0,   2.0, 0.7, 40 },
+    { -0.3, -2.0,  -3.0, 0.0,   2.0, 0.7, 40 },
+    { 0.3,  4.0,    3.0, 0.0,   2.0, 0.7, 40 },
+    { 0.0, 0.0,     3.0, 0.3,   1.0, 0.8, 40 },
+    { 0.0, 0.0,     0.0, -0.5,  1.0, 0.6, 40 },
+    {-0.03, 0.5,    0.0, 0.3,   1.0, 0.6, 40 },
+    {32765.97, 0.5,  32766.0, 0.3,   1.0, 0.6, 15 },
+    {32767.98, 0.5,  -32767.99, 0.3,  1.0, 0.6, 15 },
+    { 10.0, 0.0, 1000.0, 0.0,  50.0, 20.0, 40 },
+  };
+
+  for (const auto& test_case : test_cases) {
+    BOOST_TEST_CONTEXT(test_case.x0 << " "
+                       << test_case.v0 << " "
+                       << test_case.xf << " "
+                       << test_case.vf << " "
+                       << test_case.a << " "
+                       << test_case.v) {
+      // Returns the duration.
+      auto run = [&](bool planned) {
+        Context ctx;
+        TrajectoryPlan plan;
+        if (planned) { ctx.plan = &plan; }
+        ctx.rate_hz = test_case.rate_khz * 1000.0;
+        ctx.data.position = test_case.xf;
+        ctx.data.velocity = test_case.vf;
+        ctx.data.accel_limit = test_case.a;
+        ctx.data.velocity_limit = test_case.v;
+        ctx.set_position(test_case.x0);
+        ctx.set_velocity(test_case.v0);
+
+        bool overspeed = std::abs(test_case.v0) > test_case.v;
+        double old_vel = test_case.v0;
+        int consecutive_accel_violation = 0;
+        // Track the target as UpdateCommand moves it.
+        int64_t target_raw =
+            MotorPosition::FloatToInt(static_cast<float>(test_case.xf));
+        const int64_t target_step =
+            static_cast<int64_t>(static_cast<int32_t>(
+                static_cast<float>(1ll << 32) *
+                static_cast<float>(test_case.vf / ctx.rate_hz))) << 16;
+
+        for (int i = 0; i < 200 * ctx.rate_hz; i++) {
+          ctx.Call();
+
+          const double this_vel = ctx.status.control_velocity.value();
+          if (planned) {
+            if (std::abs(this_vel) < test_case.v + 0.001) {
+              overspeed = false;
+            }
+            if (!overspeed && std::isfinite(test_case.v)) {
+              BOOST_TEST(std::abs(this_vel) <= test_case.v + 0.001);
+            }
+            const double accel = (this_vel - old_vel) * ctx.rate_hz;
+            if (std::abs(accel) > 1.02 * test_case.a) {
+              consecutive_accel_violation++;
+              BOOST_TEST(consecutive_accel_violation <= 2);
+            } else {
+              consecutive_accel_violation = 0;
+            }
+          }
+          old_vel = this_vel;
+
+          if (ctx.status.trajectory_done) {
+            // Any error left over at the end shows up as a small
+            // difference in velocity for one cycle.
+            const double velocity_tolerance =
+                1e-3 * (std::isfinite(test_case.v) ?
+                        std::max(1.0, test_case.v) : 1.0);
+            BOOST_TEST(std::abs(this_vel - test_case.vf) < velocity_tolerance);
+            if (planned) {
+              // The planned version arrives exactly.
+              BOOST_TEST(std::abs(ctx.from_raw(
+                                      *ctx.status.control_position_raw -
+                                      target_raw - target_step)) < 1e-9);
+            }
+            return static_cast<double>((i + 1) / ctx.rate_hz);
+          }
+          target_raw += target_step;
+        }
+        BOOST_TEST(false);
+        return 0.0;
+      };
+
+      const double reference_duration = run(false);
+      const double planned_duration = run(true);
+
+      // The planned version is optimal, while the reference usually
+      // takes a little longer than it needs to.  It can also finish a
+      // little early, by jumping the last part of the way.
+      BOOST_TEST(planned_duration <= reference_duration * 1.001);
+      BOOST_TEST(planned_duration >= reference_duration * 0.98);
+    }
+  }
+}
+
+BOOST_AUTO_TEST_CASE(PlannedTrajectoryReplans) {
+  Context ctx;
+  TrajectoryPlan plan;
+  ctx.plan = &plan;
+  ctx.data.position = 2.0;
+  ctx.data.accel_limit = 1.0f;
+  ctx.data.velocity_limit = 0.5f;
+  ctx.set_position(0.0);
+
+  for (int i = 0; i < 1.0 * ctx.rate_hz; i++) { ctx.Call(); }
+  BOOST_TEST(!ctx.status.trajectory_done);
+
+  // Something else, like the slip limit, moves the control position.
+  *ctx.status.control_position_raw -= ctx.to_raw(0.1);
+
+  double max_velocity = 0.0;
+  int count = 0;
+  while (!ctx.status.trajectory_done && count < 10 * ctx.rate_hz) {
+    ctx.Call();
+    max_velocity = std::max<double>(max_velocity,
+                                    ctx.status.control_velocity.value());
+    count++;
+  }
+  BOOST_TEST(ctx.status.trajectory_done);
+  BOOST_TEST(max_velocity <= 0.5001);
+  BOOST_TEST(std::abs(ctx.from_raw(*ctx.status.control_position_raw) - 2.0)
+             < 1e-8);
+}
+
+BOOST_AUTO_TEST_CASE(PlannedMoveDuration) {
+  struct TestCase {
+    double x0;
+    double v0;
+
+    double xf;
+    double vf;
+
+    double duration;
+  };
+
+  TestCase test_cases[] = {
+    { 0.0,  0.0,   1.0,  0.0,   4.0 },
+    { 0.0,  0.0,   1.0,  0.0,  20.0 },
+    { 0.0,  0.0,  -1.0,  0.0,   4.0 },
+    // Moving toward the target faster than we need to.
+    { 0.0,  0.4,   1.0,  0.0,   6.0 },
+    // Moving away from it.
+    { 0.0, -0.4,   1.0,  0.0,   6.0 },
+    // A moving target.
+    { 0.0,  0.0,   1.0,  0.2,   5.0 },
+    // Too soon, so we go as fast as we can.
+    { 0.0,  0.0,   3.0,  0.0,   1.0 },
+  };
+
+  for (const auto& test_case : test_cases) {
+    BOOST_TEST_CONTEXT(test_case.x0 << " "
+                       << test_case.v0 << " "
+                       << test_case.xf << " "
+                       << test_case.vf << " "
+                       << test_case.duration) {
+      auto run = [&](float duration) {
+        Context ctx;
+        TrajectoryPlan plan;
+        ctx.plan = &plan;
+        ctx.data.position = test_case.xf;
+        ctx.data.velocity = test_case.vf;
+        ctx.data.accel_limit = 1.0f;
+        ctx.data.velocity_limit = 0.5f;
+        ctx.data.move_duration_s = duration;
+        ctx.set_position(test_case.x0);
+        ctx.set_velocity(test_case.v0);
+
+        float max_velocity = 0.0f;
+        float last_velocity = test_case.v0;
+        float max_accel = 0.0f;
+        for (int i = 0; i < 100 * ctx.rate_hz; i++) {
+          ctx.Call();
+          if (ctx.status.trajectory_done) {
+            BOOST_TEST(std::abs(ctx.status.control_velocity.value() -
+                                test_case.vf) < 1e-3f);
+            BOOST_TEST(max_velocity <= 0.5001f);
+            // The error from the precision of a float is made up
+            // when we start to decelerate, which adds a little.
+            BOOST_TEST(max_accel <= 1.05f);
+            return static_cast<double>((i + 1) / ctx.rate_hz);
+          }
+          const float velocity = ctx.status.control_velocity.value();
+          max_velocity = std::max(max_velocity, std::abs(velocity));
+          if (i > 0) {
+            max_accel = std::max(
+                max_accel, std::abs(velocity - last_velocity) * ctx.rate_hz);
+          }
+          last_velocity = velocity;
+        }
+        BOOST_TEST(false);
+        return 0.0;
+      };
+
+      const double fastest = run(NaN);
+      const double actual = run(test_case.duration);
+      if (test_case.duration > fastest) {
+        BOOST_TEST(std::abs(actual - test_case.duration) < 0.0001);
+      } else {
+        BOOST_TEST(actual == fastest);
+      }
+    }
+  }
+}
+
+BOOST_AUTO_TEST_CASE(PlannedMoveDurationSynchronizes) {
+  // Axes with very different distances to travel finish together.
+  std::vector<double> targets = { 0.1, -0.7, 2.0, 0.0 };
+  std::vector<Context> axes(targets.size());
+  std::vector<TrajectoryPlan> plans(targets.size());
+  for (size_t i = 0; i < axes.size(); i++) {
+    auto& ctx = axes[i];
+    ctx.plan = &plans[i];
+    ctx.set_position(0.0f);
+    ctx.data.position = targets[i];
+    ctx.data.velocity = 0.0f;
+    ctx.data.accel_limit = 2.0f;
+    ctx.data.velocity_limit = 1.0f;
+    ctx.data.move_duration_s = 3.0f;
+  }
+
+  for (int cycle = 0; cycle < 3.0 * 40000 - 1; cycle++) {
+    for (auto& ctx : axes) {
+      ctx.Call();
+      BOOST_REQUIRE(!ctx.status.trajectory_done ||
+                    ctx.data.position == 0.0f);
+    }
+  }
+  for (size_t i = 0; i < axes.size(); i++) {
+    auto& ctx = axes[i];
+    ctx.Call();
+    BOOST_TEST(ctx.status.trajectory_done);
+    BOOST_TEST(*ctx.status.control_position_raw ==
+               MotorPosition::FloatToInt(static_cast<float>(targets[i])));
+  }
+}
+
 BOOST_AUTO_TEST_CASE(StopPositionWithLimits, * boost::unit_test::tolerance(1e-3)) {
   Context ctx;
 
@@ -625,3 +890,437 @@ BOOST_AUTO_TEST_CASE(StopPositionWithLimitOvershoot, * boost::unit_test::toleran
   BOOST_TEST(ctx.status.control_velocity.value() == 0.0);
   BOOST_TEST(ctx.status.trajectory_done == true);
 }
+
+BOOST_AUTO_TEST_CASE(JerkLimits, * boost::unit_test::tolerance(1e-3)) {
+  struct TestCase {
+    double x0;
+    double v0;
+
+    double xf;
+    double vf;
+
+    double a;
+    double v;
+    double j;
+    double rate_khz;
+
+    double expected_total_duration;
+  };
+
+  TestCase test_cases[] = {
+    ///////////////////////////////////
+    // "velocity mode"
+    { 0.0,  0.0,   NaN,  0.5,   1.0, 2.0, 10.0, 40,   0.600 },
+    { 0.0,  1.0,   NaN, -0.5,   1.0, 2.0, 10.0, 40,   1.600 },
+
+    /////////////////////////////////
+    // No accel limit.
+    { 0.0,  0.0,   3.0, 0.0,    NaN, 1.0, 10.0, 40,   3.634 },
+
+    /////////////////////////////////
+    // No velocity limit.
+    { 0.0,  0.0,   5.0, 0.0,    1.0, NaN, 10.0, 40,   4.574 },
+    { 0.0,  1.0,   5.0, 0.0,    1.0, NaN, 10.0, 40,   3.771 },
+
+    /////////////////////////////////
+    // Only a jerk limit.
+    { 0.0,  0.0,   3.0, 0.0,    NaN, NaN, 10.0, 40,   2.190 },
+
+    /////////////////////////////////
+    // Accel and velocity limits
+    { 0.0,  0.0,   3.0, 0.0,    1.0, 0.5, 10.0, 40,   6.600 },
+    { 0.0,  0.0,   3.0, 0.0,    1.0, 0.7, 10.0, 40,   5.086 },
+    // overspeed
+    { 0.3,  2.0,   3.0, 0.0,    2.0, 0.7, 20.0, 40,   3.386 },
+    // overshoot
+    { 0.3,  4.0,   3.0, 0.0,    2.0, 0.7, 20.0, 40,   4.593 },
+
+    // non-zero final velocity
+    { 0.0,  0.0,   3.0, 0.5,    1.0, 0.8, 10.0, 40,  11.400 },
+
+    // non-zero targets, including near the wraparound point at a
+    // lower PWM rate.
+    {-0.03, 0.5,   0.0, 0.3,    1.0, 0.6, 10.0, 40,   0.300 },
+    {32765.97, 0.5, 32766.0, 0.3, 1.0, 0.6, 10.0, 15,  0.577 },
+  };
+
+  int case_num = 0;
+
+  for (const auto& test_case : test_cases) {
+    case_num++;
+
+    BOOST_TEST_CONTEXT("Case " << case_num << " : "
+                       << test_case.x0 << " "
+                       << test_case.v0 << " "
+                       << test_case.xf << " "
+                       << test_case.vf << " "
+                       << test_case.a << " "
+                       << test_case.v << " "
+                       << test_case.j) {
+      Context ctx;
+      ctx.rate_hz = test_case.rate_khz * 1000.0;
+      ctx.data.position = test_case.xf;
+      ctx.data.velocity = test_case.vf;
+      ctx.data.accel_limit = test_case.a;
+      ctx.data.velocity_limit = test_case.v;
+      ctx.data.jerk_limit = test_case.j;
+      ctx.set_position(test_case.x0);
+      ctx.set_velocity(test_case.v0);
+
+      bool initial_overspeed = std::isfinite(test_case.v) ?
+          (std::abs(test_case.v0) > test_case.v) :
+          false;
+      const double max_accel_step = test_case.j / ctx.rate_hz;
+
+      double old_accel = 0.0;
+      double total_duration = 0.0;
+
+      const int64_t max_count =
+          (2.0 + test_case.expected_total_duration) * ctx.rate_hz;
+
+      for (int64_t i = 0; i < max_count; i++) {
+        ctx.Call();
+
+        const double this_vel = ctx.status.control_velocity.value();
+        const double this_accel = ctx.status.control_acceleration;
+
+        if (ctx.status.trajectory_done) {
+          total_duration = (i + 1) / ctx.rate_hz;
+          break;
+        }
+
+        // The acceleration, rather than a finite difference of the
+        // velocity, is what the jerk limit is applied to.
+        BOOST_TEST(std::abs(this_accel - old_accel) <=
+                   1.001 * max_accel_step);
+        if (std::isfinite(test_case.a)) {
+          BOOST_TEST(std::abs(this_accel) <= 1.001 * test_case.a);
+        }
+        if (std::isfinite(test_case.v)) {
+          if (!initial_overspeed) {
+            BOOST_TEST(std::abs(this_vel) <= test_case.v + 0.001);
+          } else if (std::abs(this_vel) < test_case.v + 0.001) {
+            initial_overspeed = false;
+          }
+        }
+
+        old_accel = this_accel;
+      }
+
+      BOOST_TEST(ctx.status.trajectory_done == true);
+      BOOST_TEST(total_duration == test_case.expected_total_duration);
+      BOOST_TEST(ctx.status.control_velocity.value() == test_case.vf);
+      BOOST_TEST(ctx.status.control_acceleration == 0.0);
+      if (std::isfinite(test_case.xf)) {
+        BOOST_TEST(ctx.from_raw(ctx.status.control_position_raw.value()) ==
+                   test_case.xf + test_case.vf * total_duration);
+      }
+    }
+  }
+}
+
+BOOST_AUTO_TEST_CASE(JerkLimitOnlyIsLimited) {
+  Context ctx;
+
+  ctx.data.position = 3.0f;
+  ctx.data.velocity = 0.0f;
+  ctx.data.jerk_limit = 10.0f;
+  ctx.set_position(0.0f);
+
+  ctx.Call();
+
+  // With no other limits, the first cycle can only begin to
+  // accelerate.
+  BOOST_TEST(ctx.status.trajectory_done == false);
+  BOOST_TEST(ctx.status.control_velocity.value() < 1e-3f);
+  BOOST_TEST(ctx.status.control_acceleration ==
+             10.0f / ctx.rate_hz, tt::tolerance(1e-3f));
+}
+
+namespace {
+struct WaypointContext : Context {
+  WaypointQueue queue;
+  WaypointSegment segment;
+
+  void Push(double position, float velocity, float duration_s,
+            float feedforward_Nm = NaN) {
+    Waypoint waypoint;
+    waypoint.position_relative_raw = to_raw(position);
+    waypoint.velocity = velocity;
+    waypoint.feedforward_Nm = feedforward_Nm;
+    waypoint.duration_s = duration_s;
+    BOOST_REQUIRE(queue.Push(waypoint));
+  }
+
+  // Return true if a waypoint was followed.
+  bool CallWaypoint(float* feedforward_Nm) {
+    if (!BldcServoPosition::UpdateWaypoint(
+            &status, &config, &position, rate_hz, &data,
+            &queue, &segment, feedforward_Nm)) {
+      // Context::Call would discard any position the waypoints have
+      // left in the command.
+      BldcServoPosition::UpdateCommand(
+          &status, &config, &position_config, &position, 0, rate_hz,
+          &data, data.velocity);
+      return false;
+    }
+    BldcServoPosition::AdvanceControlPosition(
+        &status, &config, &position_config, &position, 0, rate_hz, &data);
+    return true;
+  }
+
+  double control_position() const {
+    return from_raw(status.control_position_raw.value());
+  }
+};
+}
+
+BOOST_AUTO_TEST_CASE(WaypointHermite, * boost::unit_test::tolerance(1e-4)) {
+  WaypointContext ctx;
+  ctx.data.position = NaN;
+  ctx.data.velocity = 0.0f;
+  ctx.set_position(1.0f);
+
+  // Two segments, with a non-zero velocity at the middle knot.
+  ctx.Push(1.5, 1.0f, 0.4f, 0.2f);
+  ctx.Push(2.0, 0.0f, 0.6f, 0.4f);
+
+  // The cubic Hermite polynomials through those knots.
+  const auto expected = [](double t) -> std::pair<double, double> {
+    const auto hermite = [](double p0, double v0, double p1, double v1,
+                            double h, double t) {
+      const double s = t / h;
+      const double p =
+          p0 * (2 * s * s * s - 3 * s * s + 1) +
+          v0 * h * (s * s * s - 2 * s * s + s) +
+          p1 * (-2 * s * s * s + 3 * s * s) +
+          v1 * h * (s * s * s - s * s);
+      const double v =
+          (p0 * (6 * s * s - 6 * s) +
+           v0 * h * (3 * s * s - 4 * s + 1) +
+           p1 * (-6 * s * s + 6 * s) +
+           v1 * h * (3 * s * s - 2 * s)) / h;
+      return std::make_pair(p, v);
+    };
+    if (t < 0.4) { return hermite(1.0, 0.0, 1.5, 1.0, 0.4, t); }
+    return hermite(1.5, 1.0, 2.0, 0.0, 0.6, t - 0.4);
+  };
+
+  const int count = static_cast<int>(1.0f * ctx.rate_hz);
+  float max_position_error = 0.0f;
+  for (int i = 0; i < count; i++) {
+    float feedforward_Nm = 0.0f;
+    BOOST_REQUIRE(ctx.CallWaypoint(&feedforward_Nm));
+    BOOST_TEST(!ctx.status.trajectory_done);
+
+    const double t = (i + 1) / ctx.rate_hz;
+    const auto p_v = expected(t);
+    max_position_error = std::max<float>(
+        max_position_error, std::abs(ctx.control_position() - p_v.first));
+    // The reported velocity is the average over the cycle.  It may
+    // be very slightly off at a waypoint, where any rounding error is
+    // made up.
+    BOOST_TEST(std::abs(ctx.status.control_velocity.value() -
+                        expected(t - 0.5 / ctx.rate_hz).second) < 5e-3);
+
+    if (i == count / 4) {
+      // The feedforward ramps from the command's to the first waypoint's.
+      BOOST_TEST(feedforward_Nm == 0.2f * t / 0.4, tt::tolerance(1e-3));
+    }
+  }
+  BOOST_TEST(max_position_error < 2e-7f);
+
+  BOOST_TEST(ctx.control_position() == 2.0);
+  BOOST_TEST(std::abs(ctx.status.control_velocity.value()) < 1e-3f);
+
+  // And then the position mode command takes over, holding the final
+  // waypoint with its feedforward.
+  BOOST_TEST(ctx.data.feedforward_Nm == 0.4f);
+  float feedforward_Nm = 0.0f;
+  BOOST_TEST(!ctx.CallWaypoint(&feedforward_Nm));
+  BOOST_TEST(ctx.control_position() == 2.0);
+  BOOST_TEST(ctx.status.control_velocity.value() == 0.0f);
+  BOOST_TEST(ctx.status.trajectory_done);
+}
+
+BOOST_AUTO_TEST_CASE(WaypointUnderrunModes, * boost::unit_test::tolerance(1e-4)) {
+  for (uint8_t mode : {0, 1, 2}) {
+    BOOST_TEST_CONTEXT("Mode " << static_cast<int>(mode)) {
+      WaypointContext ctx;
+      ctx.config.waypoint_underrun_mode = mode;
+      ctx.data.position = NaN;
+      ctx.data.velocity = 0.0f;
+      ctx.set_position(0.0f);
+      ctx.status.mode = kPosition;
+
+      ctx.Push(0.5, 1.0f, 0.5f);
+
+      float feedforward_Nm = 0.0f;
+      for (int i = 0; i < 0.75 * ctx.rate_hz; i++) {
+        ctx.CallWaypoint(&feedforward_Nm);
+      }
+
+      if (mode == 0) {
+        BOOST_TEST(ctx.control_position() == 0.5);
+        BOOST_TEST(ctx.status.control_velocity.value() == 0.0f);
+      } else if (mode == 1) {
+        BOOST_TEST(ctx.control_position() == 0.75);
+        BOOST_TEST(ctx.status.control_velocity.value() == 1.0f);
+      } else {
+        BOOST_TEST((ctx.status.mode == kFault));
+        BOOST_TEST((ctx.status.fault == errc::kWaypointUnderrun));
+      }
+    }
+  }
+}
+
+BOOST_AUTO_TEST_CASE(WaypointStartsFromControlPosition,
+                     * boost::unit_test::tolerance(1e-3)) {
+  WaypointContext ctx;
+  ctx.data.position = NaN;
+  ctx.data.velocity = 0.5f;
+  ctx.set_position(0.0f);
+
+  // Move for a while under the normal position command.
+  float feedforward_Nm = 0.0f;
+  for (int i = 0; i < 0.2 * ctx.rate_hz; i++) {
+    BOOST_TEST(!ctx.CallWaypoint(&feedforward_Nm));
+  }
+  BOOST_TEST(ctx.control_position() == 0.1);
+
+  // A waypoint continuing at the same velocity should produce no
+  // discontinuity.
+  ctx.Push(0.2, 0.5f, 0.2f);
+  for (int i = 0; i < 0.2 * ctx.rate_hz; i++) {
+    BOOST_TEST(ctx.CallWaypoint(&feedforward_Nm));
+    BOOST_TEST(std::abs(ctx.status.control_velocity.value() - 0.5f) < 0.05f);
+  }
+  BOOST_TEST(ctx.control_position() == 0.2);
+}
+
+namespace {
+struct InterpolationContext : Context {
+  PositionInterpolation interpolation;
+
+  InterpolationContext() {
+    config.interpolation_max_period_s = 0.01f;
+    data.velocity = 0.0f;
+    set_position(0.0f);
+    status.mode = kPosition;
+  }
+
+  void Command(double position, float velocity) {
+    data.position = position;
+    data.position_relative_raw = to_raw(position);
+    data.velocity = velocity;
+  }
+
+  // Return true if the command was interpolated.
+  bool Call(bool new_command) {
+    if (!BldcServoPosition::UpdateInterpolation(
+            &status, &config, &position, rate_hz, &data, new_command,
+            &interpolation)) {
+      BldcServoPosition::UpdateCommand(
+          &status, &config, &position_config, &position, 0, rate_hz,
+          &data, data.velocity);
+      return false;
+    }
+    BldcServoPosition::AdvanceControlPosition(
+        &status, &config, &position_config, &position, 0, rate_hz, &data);
+    return true;
+  }
+
+  double control_position() const {
+    return from_raw(status.control_position_raw.value());
+  }
+};
+}
+
+BOOST_AUTO_TEST_CASE(InterpolateCommands) {
+  InterpolationContext ctx;
+
+  // A sine wave streamed at 1kHz.
+  constexpr int kCommandCycles = 40;
+  const auto knot = [&](int index) {
+    const double t = index * kCommandCycles / ctx.rate_hz;
+    return std::make_pair(0.2 * std::sin(2 * M_PI * t),
+                          static_cast<float>(0.4 * M_PI *
+                                             std::cos(2 * M_PI * t)));
+  };
+
+  // The first command of a stream has nothing to interpolate from,
+  // so it applies immediately.
+  ctx.Command(knot(0).first, knot(0).second);
+  BOOST_TEST(!ctx.Call(true));
+  for (int i = 1; i < kCommandCycles; i++) { ctx.Call(false); }
+
+  float last_velocity = ctx.status.control_velocity.value();
+  float max_velocity_change = 0.0f;
+  for (int index = 1; index < 200; index++) {
+    // Each command is reached one command period after it arrives.
+    // The first had nothing to lag behind.
+    if (index > 1) {
+      BOOST_TEST(std::abs(ctx.control_position() -
+                          knot(index - 1).first) < 1e-6);
+    }
+    ctx.Command(knot(index).first, knot(index).second);
+    for (int i = 0; i < kCommandCycles; i++) {
+      BOOST_TEST(ctx.Call(i == 0));
+      const float velocity = ctx.status.control_velocity.value();
+      if (index > 2) {
+        max_velocity_change = std::max(
+            max_velocity_change, std::abs(velocity - last_velocity));
+      }
+      last_velocity = velocity;
+    }
+  }
+  // The peak acceleration is 7.9 rev/s^2, or 0.0002 rev/s per cycle.
+  BOOST_TEST(max_velocity_change < 0.0005f);
+  BOOST_TEST(std::abs(ctx.control_position() - knot(199).first) < 1e-6);
+
+  // When the stream stops, the final command carries on as usual.
+  const double final_position = ctx.control_position();
+  const float final_velocity = knot(199).second;
+  for (int i = 0; i < 400; i++) { BOOST_TEST(!ctx.Call(false)); }
+  BOOST_TEST(std::abs(ctx.status.control_velocity.value() -
+                      final_velocity) < 1e-6f);
+  BOOST_TEST(std::abs(ctx.control_position() -
+                      (final_position + 0.01 * final_velocity)) < 1e-5);
+
+  // And after a gap longer than interpolation_max_period_s, the next
+  // command is not interpolated.
+  ctx.Command(0.5, 0.0f);
+  BOOST_TEST(!ctx.Call(true));
+  BOOST_TEST(ctx.control_position() == 0.5);
+}
+
+BOOST_AUTO_TEST_CASE(InterpolateIrregularCommands) {
+  InterpolationContext ctx;
+
+  // Commands at an uneven rate, following a ramp at 1 rev/s.
+  int cycle = 0;
+  float min_velocity = 1.0f;
+  float max_velocity = 1.0f;
+  for (int index = 0; index < 100; index++) {
+    ctx.Command(cycle / ctx.rate_hz, 1.0f);
+    const int period = (index % 3) == 0 ? 28 : 46;
+    for (int i = 0; i < period; i++) {
+      ctx.Call(i == 0);
+      cycle++;
+      if (index > 2) {
+        const float velocity = ctx.status.control_velocity.value();
+        min_velocity = std::min(min_velocity, velocity);
+        max_velocity = std::max(max_velocity, velocity);
+      }
+    }
+  }
+
+  // We lag by somewhere between the shortest and longest period.  A
+  // command arriving early has to be caught up with, but we never
+  // go backwards.
+  const double lag = (cycle / ctx.rate_hz) - ctx.control_position();
+  BOOST_TEST(lag > 27 / ctx.rate_hz);
+  BOOST_TEST(lag < 47 / ctx.rate_hz);
+  BOOST_TEST(min_velocity > 0.0f);
+  BOOST_TEST(max_velocity < 2.0f);
+}
@@ -14,6 +14,8 @@
 
 #include "fw/foc.h"
 
+#include <random>
+
 #include <boost/test/auto_unit_test.hpp>
 
 using namespace moteus;
@@ -81,3 +83,156 @@ BOOST_AUTO_TEST_CASE(FocTest2) {
   BOOST_TEST(idq.b == ict.b);
   BOOST_TEST(idq.c == ict.c);
 }
+
+BOOST_AUTO_TEST_CASE(FocFixedPointTest) {
+  Cordic cordic;
+
+  for (int i = 0; i < 36; i++) {
+    const float theta = i * k2Pi / 36.0f;
+    const int32_t theta_q31 = RadiansToQ31(theta);
+    const SinCos sc = cordic(theta_q31);
+
+    // A balanced set of currents at 60% of full scale, which would
+    // overflow if summed before scaling.
+    const float a = 0.6f * std::cos(theta + 0.3f);
+    const float b = 0.6f * std::cos(theta + 0.3f - k2Pi / 3.0f);
+    const float c = 0.6f * std::cos(theta + 0.3f + k2Pi / 3.0f);
+
+    const DqTransform dq(sc, a, b, c);
+
+    const DqTransformT<Q31Policy> dq31(
+        cordic.q31(theta_q31), FloatToQ31(a), FloatToQ31(b), FloatToQ31(c));
+    BOOST_TEST(std::abs(Q31ToFloat(dq31.d) - dq.d) < 1e-5f);
+    BOOST_TEST(std::abs(Q31ToFloat(dq31.q) - dq.q) < 1e-5f);
+
+    const DqTransformT<Q15Policy> dq15(
+        cordic.q15(theta_q31), FloatToQ15(a), FloatToQ15(b), FloatToQ15(c));
+    BOOST_TEST(std::abs(Q15ToFloat(dq15.d) - dq.d) < 5e-4f);
+    BOOST_TEST(std::abs(Q15ToFloat(dq15.q) - dq.q) < 5e-4f);
+
+    const InverseDqTransform idq(sc, dq.d, dq.q);
+    const InverseDqTransformT<Q31Policy> idq31(
+        cordic.q31(theta_q31), dq31.d, dq31.q);
+    BOOST_TEST(std::abs(Q31ToFloat(idq31.a) - idq.a) < 1e-5f);
+    BOOST_TEST(std::abs(Q31ToFloat(idq31.b) - idq.b) < 1e-5f);
+    BOOST_TEST(std::abs(Q31ToFloat(idq31.c) - idq.c) < 1e-5f);
+  }
+}
+
+BOOST_AUTO_TEST_CASE(FocFixedPointSaturateTest) {
+  // Inputs which are not balanced can produce results outside of
+  // the representable range, which must saturate rather than wrap.
+  Cordic cordic;
+  const ClarkTransformT<Q31Policy> ct(kQ31Max, kQ31Min, kQ31Min);
+  BOOST_TEST(ct.x == kQ31Max);
+
+  const InverseDqTransformT<Q31Policy> idq(
+      cordic.q31(RadiansToQ31(0.0f)), kQ31Min, kQ31Max);
+  BOOST_TEST(idq.b == kQ31Max);
+  BOOST_TEST(idq.c < 0);
+}
+
+BOOST_AUTO_TEST_CASE(FocPhaseMultiplierTest) {
+  {
+    const auto dut = PhaseMultiplier::FromFloat(7.0f);
+    BOOST_TEST(dut(0) == 0u);
+    BOOST_TEST(dut(0x10000000ll) == 0x70000000u);
+    // Whole revolutions of the input wrap away entirely.
+    BOOST_TEST(dut(0x300000000ll + 0x10000000ll) == 0x70000000u);
+    BOOST_TEST(dut(-0x10000000ll) == 0x90000000u);
+  }
+
+  {
+    // A fractional ratio, like a pole count divided by a gear ratio.
+    const auto dut = PhaseMultiplier::FromFloat(3.5f);
+    BOOST_TEST(dut(0x40000000ll) == 0xe0000000u);
+    BOOST_TEST(dut(0x140000000ll) == 0x60000000u);
+  }
+
+  {
+    std::mt19937 rng(1);
+    std::uniform_int_distribution<int64_t> dist(-(1ll << 50), (1ll << 50));
+    const double ratio = 10.0 / 3.0;
+    const auto dut = PhaseMultiplier::FromFloat(static_cast<float>(ratio));
+    const double exact_ratio =
+        dut.integer + dut.fraction / 4294967296.0;
+    for (int i = 0; i < 1000; i++) {
+      const int64_t position = dist(rng);
+      const double expected_revs =
+          static_cast<double>(position) / 4294967296.0 * exact_ratio;
+      const double expected_frac =
+          expected_revs - std::floor(expected_revs);
+      const double actual_frac = dut(position) / 4294967296.0;
+      double error = std::abs(actual_frac - expected_frac);
+      error = std::min(error, 1.0 - error);
+      BOOST_TEST(error < 1e-6);
+    }
+  }
+}
+
+BOOST_AUTO_TEST_CASE(FocFromAdcTest) {
+  BOOST_TEST(FloatPolicy::FromAdc(2048 + 1024, 2048) == 0.25f);
+  BOOST_TEST(Q31Policy::FromAdc(2048 + 1024, 2048) == FloatToQ31(0.25f));
+  BOOST_TEST(Q15Policy::FromAdc(2048 - 1024, 2048) == FloatToQ15(-0.25f));
+  BOOST_TEST(Q31Policy::FromAdc(4095, 0) > 0);
+  BOOST_TEST(Q31Policy::FromAdc(0, 4095) < 0);
+}
+
+BOOST_AUTO_TEST_CASE(FocCordicAccuracyTest) {
+  Cordic cordic;
+
+  // The hardware CORDIC configured for 5 cycles has a residual error
+  // of around 2^-19.
+  constexpr double kMaxError = 1.0 / (1 << 19);
+
+  double max_error = 0.0;
+  auto check = [&](int32_t theta_q31) {
+    const SinCos sc = cordic(theta_q31);
+    const double theta = theta_q31 * (M_PI / 2147483648.0);
+    max_error = std::max(max_error,
+                         std::abs(static_cast<double>(sc.s) - std::sin(theta)));
+    max_error = std::max(max_error,
+                         std::abs(static_cast<double>(sc.c) - std::cos(theta)));
+  };
+
+  std::mt19937 rng(3);
+  std::uniform_int_distribution<int32_t> dist(
+      std::numeric_limits<int32_t>::min(),
+      std::numeric_limits<int32_t>::max());
+  for (int i = 0; i < 100000; i++) {
+    check(dist(rng));
+  }
+
+  // Also look at either side of each table step.
+  for (int64_t i = -(1ll << 31); i < (1ll << 31); i += (1ll << 23)) {
+    for (int32_t delta : { -1, 0, 1 }) {
+      check(static_cast<int32_t>(i + delta));
+    }
+  }
+
+  BOOST_TEST(max_error < kMaxError);
+
+  // The cardinal angles are exact.
+  BOOST_TEST(cordic(0).s == 0.0f);
+  BOOST_TEST(cordic(0).c == 1.0f);
+  BOOST_TEST(cordic(1 << 30).s == 1.0f);
+  BOOST_TEST(cordic(-(1 << 30)).s == -1.0f);
+  BOOST_TEST(cordic(std::numeric_limits<int32_t>::min()).c == -1.0f);
+}
+
+BOOST_AUTO_TEST_CASE(FocCordicBatchTest) {
+  Cordic cordic;
+
+  int32_t theta[37] = {};
+  for (int i = 0; i < 37; i++) {
+    theta[i] = static_cast<int32_t>(i * 116080197u);
+  }
+
+  SinCos batch[37] = {};
+  cordic(theta, batch, 37);
+  for (int i = 0; i < 37; i++) {
+    const SinCos single = cordic(theta[i]);
+    BOOST_TEST(batch[i].s == single.s);
+    BOOST_TEST(batch[i].c == single.c);
+  }
+}
@@ -0,0 +1,101 @@
+// Copyright 2023 mjbots Robotic Systems, LLC.  info@mjbots.com
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "fw/harmonic_fit.h"
+
+#include <random>
+
+#include <boost/test/auto_unit_test.hpp>
+
+using namespace moteus;
+
+BOOST_AUTO_TEST_CASE(HarmonicFitBasic) {
+  HarmonicFit<4> dut;
+  dut.Reset(3);
+  BOOST_TEST(dut.terms() == 7);
+
+  const auto f = [](float x) {
+    return 0.5f +
+        0.25f * std::cos(k2Pi * x) -
+        0.125f * std::sin(k2Pi * 3.0f * x);
+  };
+
+  // Samples which are unevenly distributed, as when the motor does
+  // not turn at a constant speed.
+  std::mt19937 rng(4);
+  std::uniform_real_distribution<float> dist(0.0f, 1.0f);
+  for (int i = 0; i < 500; i++) {
+    const float u = dist(rng);
+    const float x = u * u;
+    dut.Add(x, f(x));
+  }
+  BOOST_TEST(dut.count() == 500);
+
+  HarmonicFit<4>::Coefficients c;
+  float residual = 1.0f;
+  BOOST_TEST(dut.Solve(&c, &residual));
+
+  const float expected[] = { 0.5f, 0.25f, 0.0f, 0.0f, 0.0f, 0.0f, -0.125f };
+  for (int i = 0; i < 7; i++) {
+    BOOST_TEST_CONTEXT("i=" << i) {
+      BOOST_TEST(std::abs(c[i] - expected[i]) < 1e-4f);
+    }
+  }
+  BOOST_TEST(c[7] == 0.0f);
+  BOOST_TEST(residual < 1e-3f);
+}
+
+BOOST_AUTO_TEST_CASE(HarmonicFitUnderdetermined) {
+  HarmonicFit<4> dut;
+  dut.Reset(2);
+
+  // Only a small part of the revolution is seen.
+  for (int i = 0; i < 100; i++) {
+    dut.Add(0.01f * (i % 3), 1.0f);
+  }
+
+  HarmonicFit<4>::Coefficients c;
+  BOOST_TEST(!dut.Solve(&c));
+}
+
+BOOST_AUTO_TEST_CASE(HarmonicFitLargeOffset) {
+  // A small ripple on a constant which is large by comparison, with
+  // one harmonic beyond those fit.
+  for (const float offset : { 0.2f, 0.45f, 0.51f, -3.0f }) {
+    BOOST_TEST_CONTEXT("offset " << offset) {
+      HarmonicFit<4> dut;
+      dut.Reset(2);
+
+      const auto f = [&](float x) {
+        return offset +
+            0.001f * std::cos(k2Pi * x) +
+            0.0005f * std::sin(k2Pi * 3.0f * x);
+      };
+      for (int i = 0; i < 5000; i++) {
+        const float x = (i % 997) / 997.0f;
+        dut.Add(x, f(x));
+      }
+
+      // Both are sqrt(a^2 / 2) summed over the harmonics present.
+      BOOST_TEST(std::abs(dut.rms() - 0.000791f) < 0.00002f);
+
+      HarmonicFit<4>::Coefficients c;
+      float residual = 0.0f;
+      BOOST_TEST(dut.Solve(&c, &residual));
+      BOOST_TEST(std::abs(c[0] - offset) < 1e-5f);
+      BOOST_TEST(std::abs(c[1] - 0.001f) < 1e-5f);
+      BOOST_TEST(std::abs(residual - 0.000354f) < 0.00002f);
+    }
+  }
+}
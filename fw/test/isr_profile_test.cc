@@ -0,0 +1,116 @@
+// Copyright 2023 mjbots Robotic Systems, LLC.  info@mjbots.com
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "fw/isr_profile.h"
+
+#include <boost/test/auto_unit_test.hpp>
+
+using namespace moteus;
+
+BOOST_AUTO_TEST_CASE(IsrStageProfileBasic) {
+  IsrStageProfile dut;
+
+  dut.ISR_Update(1000);
+  dut.ISR_Update(3000);
+  dut.ISR_Update(2000);
+  dut.UpdateMean();
+
+  BOOST_TEST(dut.last == 2000u);
+  BOOST_TEST(dut.min == 1000u);
+  BOOST_TEST(dut.max == 3000u);
+  BOOST_TEST(dut.count == 3u);
+  BOOST_TEST(dut.mean == 2000.0f);
+
+  // These have bit lengths of 10, 12, and 11.
+  BOOST_TEST(dut.histogram[10] == 1u);
+  BOOST_TEST(dut.histogram[11] == 1u);
+  BOOST_TEST(dut.histogram[12] == 1u);
+
+  dut.ISR_Update(0);
+  dut.ISR_Update(0x80000000u);
+  BOOST_TEST(dut.min == 0u);
+  BOOST_TEST(dut.histogram[0] == 1u);
+  BOOST_TEST(dut.histogram[IsrStageProfile::kHistogramSize - 1] == 1u);
+}
+
+BOOST_AUTO_TEST_CASE(IsrProfilerStages) {
+  volatile uint32_t counter = 0xfffffff0u;
+  IsrProfiler dut;
+  dut.SetCounter(&counter);
+  auto* const profile = dut.mutable_profile();
+
+  for (int i = 0; i < 4; i++) {
+    dut.ISR_Start();
+    counter += 100;
+    dut.ISR_Mark(&profile->sense);
+    counter += 20 + i;
+    dut.ISR_Mark(&profile->curstate);
+    counter += 300;
+    dut.ISR_Mark(&profile->control);
+    dut.ISR_Mark(&profile->emit);
+    dut.ISR_Finish();
+
+    counter += 5000;
+  }
+  dut.PollMillisecond();
+
+  // The counter wraps during the first cycle.
+  BOOST_TEST(profile->sense.min == 100u);
+  BOOST_TEST(profile->sense.max == 100u);
+  BOOST_TEST(profile->curstate.min == 20u);
+  BOOST_TEST(profile->curstate.max == 23u);
+  BOOST_TEST(profile->curstate.mean == 21.5f);
+  BOOST_TEST(profile->control.last == 300u);
+  BOOST_TEST(profile->emit.max == 0u);
+  BOOST_TEST(profile->total.min == 420u);
+  BOOST_TEST(profile->total.max == 423u);
+  BOOST_TEST(profile->total.count == 4u);
+
+  // A reset takes effect at the start of the next cycle.
+  dut.Reset();
+  BOOST_TEST(profile->total.count == 4u);
+
+  dut.ISR_Start();
+  BOOST_TEST(profile->total.count == 0u);
+  BOOST_TEST(profile->reset_count == 1u);
+  counter += 50;
+  dut.ISR_Mark(&profile->sense);
+  dut.ISR_Finish();
+  BOOST_TEST(profile->sense.min == 50u);
+  BOOST_TEST(profile->sense.max == 50u);
+  BOOST_TEST(profile->total.count == 1u);
+}
+
+BOOST_AUTO_TEST_CASE(IsrProfilerNoCounter) {
+  IsrProfiler dut;
+  auto* const profile = dut.mutable_profile();
+
+  dut.ISR_Start();
+  dut.ISR_Mark(&profile->sense);
+  dut.ISR_Finish();
+
+  BOOST_TEST(profile->sense.count == 1u);
+  BOOST_TEST(profile->sense.max == 0u);
+  BOOST_TEST(profile->total.max == 0u);
+}
+
+BOOST_AUTO_TEST_CASE(IsrStageProfileLargeTotal) {
+  IsrStageProfile dut;
+
+  // The total needs more than 32 bits.
+  for (int i = 0; i < 4; i++) { dut.ISR_Update(0x60000000u); }
+  BOOST_TEST(dut.total == 0x180000000ull);
+  dut.UpdateMean();
+  BOOST_TEST(dut.mean == static_cast<float>(0x60000000u));
+}
@@ -14,6 +14,9 @@
 
 #include "fw/motor_position.h"
 
+#include <cstring>
+#include <functional>
+
 #include <boost/test/auto_unit_test.hpp>
 #include <boost/random.hpp>
 
@@ -88,6 +91,7 @@ BOOST_AUTO_TEST_CASE(MotorPositionBasicOperation) {
 
     BOOST_TEST(status.theta_valid == true);
     BOOST_TEST(status.electrical_theta == 3.14159274f);
+    BOOST_TEST(status.electrical_phase == 0x80000000u);
   }
 
   // Now make an update and verify that things change.
@@ -657,6 +661,206 @@ BOOST_AUTO_TEST_CASE(MotorPositionCompensation,
   }
 }
 
+BOOST_AUTO_TEST_CASE(MotorPositionHarmonicCompensation) {
+  Context ctx;
+  auto& source = ctx.dut.config()->sources[0];
+  source.compensation_bits = 10;
+  source.compensation_harmonics[0].order = 7;
+  source.compensation_harmonics[0].cos_term = 0.002f;
+  source.compensation_harmonics[1].order = 1;
+  source.compensation_harmonics[1].sin_term = -0.0005f;
+  source.pll_filter_hz = 0.0f;
+  ctx.pcf.persistent_config.Load();
+
+  BOOST_TEST(ctx.dut.status().error == MotorPosition::Status::kNone);
+
+  constexpr float kCpr = 16384.0f;
+  ctx.aux1_status.spi.active = true;
+  for (uint32_t raw = 0; raw < 16384; raw += 97) {
+    BOOST_TEST_CONTEXT("raw=" << raw) {
+      ctx.aux1_status.spi.value = raw;
+      ctx.aux1_status.spi.nonce += 1;
+      ctx.dut.ISR_Update(kDt);
+
+      const float x = raw / kCpr;
+      const float expected =
+          raw + kCpr * (0.002f * std::cos(k2Pi * 7.0f * x) -
+                        0.0005f * std::sin(k2Pi * x));
+      const float error = MotorPosition::WrapBalancedCpr(
+          ctx.dut.status().sources[0].compensated_value - expected, kCpr);
+      // The 32 bin table could only represent the 7th harmonic to
+      // within several counts.
+      BOOST_TEST(std::abs(error) < 0.1f);
+    }
+  }
+
+  // The lookup tables of all sources must fit in the shared space.
+  ctx.dut.config()->sources[1].type = MotorPosition::SourceConfig::kSpi;
+  ctx.dut.config()->sources[1].compensation_table[3] = 0.01f;
+  ctx.dut.config()->sources[1].compensation_bits = 10;
+  ctx.pcf.persistent_config.Load();
+  BOOST_TEST(ctx.dut.status().error == MotorPosition::Status::kInvalidConfig);
+
+  ctx.dut.config()->sources[1].compensation_bits = 8;
+  ctx.pcf.persistent_config.Load();
+  BOOST_TEST(ctx.dut.status().error == MotorPosition::Status::kInvalidConfig);
+
+  ctx.dut.config()->sources[0].compensation_bits = 9;
+  ctx.pcf.persistent_config.Load();
+  BOOST_TEST(ctx.dut.status().error == MotorPosition::Status::kNone);
+}
+
+BOOST_AUTO_TEST_CASE(MotorPositionSelfCalibration) {
+  using Source = MotorPosition::SourceConfig;
+
+  Context ctx;
+  auto& config = *ctx.dut.config();
+  // The rotor encoder has a periodic error, and a perfect encoder is
+  // on the output of a 2:1 reducer.
+  config.sources[1].aux_number = 2;
+  config.sources[1].type = Source::kUart;
+  config.sources[1].reference = Source::kOutput;
+  config.output.reference_source = 1;
+  config.rotor_to_output_ratio = 0.5f;
+  config.self_calibration.enabled = true;
+  config.self_calibration.harmonics = 3;
+  config.self_calibration.samples = 1000;
+  config.self_calibration.gain = 1.0f;
+  ctx.pcf.persistent_config.Load();
+  BOOST_TEST(ctx.dut.status().error == MotorPosition::Status::kNone);
+
+  const auto rotor_error = [](double x) {
+    return 0.004 * std::cos(2.0 * M_PI * 2.0 * x) +
+        0.002 * std::sin(2.0 * M_PI * x);
+  };
+
+  ctx.aux1_status.spi.active = true;
+  ctx.aux2_status.uart.active = true;
+
+  constexpr double kCpr = 16384.0;
+  constexpr double kOutputVelocity = 0.7;
+  double max_error = 0.0;
+  for (int i = 0; i < 200000; i++) {
+    const double output = kOutputVelocity * i * static_cast<double>(kDt);
+    const double output_frac = output - std::floor(output);
+    const double rotor = output * 2.0;
+    const double rotor_frac = rotor - std::floor(rotor);
+    const double measured = rotor_frac + rotor_error(rotor_frac);
+
+    ctx.aux1_status.spi.value = static_cast<uint32_t>(
+        std::round((measured - std::floor(measured)) * kCpr)) % 16384;
+    ctx.aux1_status.spi.nonce++;
+    ctx.aux2_status.uart.value =
+        static_cast<uint32_t>(std::round(output_frac * kCpr)) % 16384;
+    ctx.aux2_status.uart.nonce++;
+
+    ctx.dut.ISR_Update(kDt);
+    if ((i % 10) == 0) { ctx.dut.PollMillisecond(); }
+
+    if (i > 190000) {
+      const double compensated =
+          ctx.dut.status().sources[0].compensated_value / kCpr;
+      double error = std::abs(compensated - rotor_frac);
+      error = std::min(error, 1.0 - error);
+      max_error = std::max(max_error, error);
+    }
+  }
+
+  const auto& status = ctx.dut.status().self_calibration;
+  BOOST_TEST(status.updates >= 10);
+  BOOST_TEST(status.error_rms < 1e-4f);
+
+  const auto& harmonics = config.sources[0].compensation_harmonics;
+  BOOST_TEST(harmonics[0].order == 1);
+  BOOST_TEST(std::abs(harmonics[0].sin_term + 0.002f) < 1e-4f);
+  BOOST_TEST(harmonics[1].order == 2);
+  BOOST_TEST(std::abs(harmonics[1].cos_term + 0.004f) < 1e-4f);
+  BOOST_TEST(harmonics[3].order == 0);
+
+  // The uncompensated error is up to 0.006 revolutions.
+  BOOST_TEST(max_error < 3e-4);
+
+  // A reducer which is not integral can not be calibrated.
+  config.rotor_to_output_ratio = 0.4f;
+  ctx.pcf.persistent_config.Load();
+  BOOST_TEST(ctx.dut.status().error == MotorPosition::Status::kInvalidConfig);
+}
+
+BOOST_AUTO_TEST_CASE(MotorPositionSelfCalibrationMountingOffset) {
+  using Source = MotorPosition::SourceConfig;
+
+  // As in MotorPositionSelfCalibration, but the zero of the rotor
+  // encoder is arbitrary relative to that of the output encoder.
+  for (const double mounting : { 0.2, 0.45, 0.497, 0.5, 0.503, 0.506 }) {
+    BOOST_TEST_CONTEXT("mounting " << mounting) {
+      Context ctx;
+      auto& config = *ctx.dut.config();
+      config.sources[1].aux_number = 2;
+      config.sources[1].type = Source::kUart;
+      config.sources[1].reference = Source::kOutput;
+      config.output.reference_source = 1;
+      config.rotor_to_output_ratio = 0.5f;
+      config.self_calibration.enabled = true;
+      config.self_calibration.harmonics = 3;
+      config.self_calibration.samples = 1000;
+      config.self_calibration.gain = 1.0f;
+      ctx.pcf.persistent_config.Load();
+
+      const auto rotor_error = [](double x) {
+        return 0.004 * std::cos(2.0 * M_PI * 2.0 * x) +
+            0.002 * std::sin(2.0 * M_PI * x);
+      };
+
+      ctx.aux1_status.spi.active = true;
+      ctx.aux2_status.uart.active = true;
+
+      constexpr double kCpr = 16384.0;
+      constexpr double kOutputVelocity = 0.7;
+      double max_error = 0.0;
+      float first_error_rms = 0.0f;
+      for (int i = 0; i < 200000; i++) {
+        const double output = kOutputVelocity * i * static_cast<double>(kDt);
+        const double output_frac = output - std::floor(output);
+        const double rotor = output * 2.0 + mounting;
+        const double rotor_frac = rotor - std::floor(rotor);
+        const double measured = rotor_frac + rotor_error(rotor_frac);
+
+        ctx.aux1_status.spi.value = static_cast<uint32_t>(
+            std::round((measured - std::floor(measured)) * kCpr)) % 16384;
+        ctx.aux1_status.spi.nonce++;
+        ctx.aux2_status.uart.value =
+            static_cast<uint32_t>(std::round(output_frac * kCpr)) % 16384;
+        ctx.aux2_status.uart.nonce++;
+
+        ctx.dut.ISR_Update(kDt);
+        if ((i % 10) == 0) { ctx.dut.PollMillisecond(); }
+
+        const auto& status = ctx.dut.status().self_calibration;
+        if (status.updates == 1 && first_error_rms == 0.0f) {
+          first_error_rms = status.error_rms;
+        }
+
+        if (i > 190000) {
+          const double compensated =
+              ctx.dut.status().sources[0].compensated_value / kCpr;
+          double error = std::abs(compensated - rotor_frac);
+          error = std::min(error, 1.0 - error);
+          max_error = std::max(max_error, error);
+        }
+      }
+
+      const auto& status = ctx.dut.status().self_calibration;
+      BOOST_TEST(status.updates >= 10);
+      BOOST_TEST(max_error < 3e-4);
+
+      // The uncompensated error has an RMS of about 0.0032.
+      BOOST_TEST(std::abs(first_error_rms - 0.0032f) < 0.0005f);
+      BOOST_TEST(status.error_rms > 0.0f);
+      BOOST_TEST(status.error_rms < 1e-4f);
+    }
+  }
+}
+
 BOOST_AUTO_TEST_CASE(MotorPositionSpiTransform,
                      * boost::unit_test::tolerance(5e-3f)) {
   struct TestCase {
@@ -748,6 +952,475 @@ BOOST_AUTO_TEST_CASE(MotorPositionInfrequentUpdates) {
   BOOST_TEST(ctx.dut.status().sources[0].time_since_update == 0.0f);
 }
 
+BOOST_AUTO_TEST_CASE(MotorPositionSampleAge) {
+  using Source = MotorPosition::SourceConfig;
+
+  // A UART encoder which is queried every 1ms, and whose reply
+  // arrives 400us later, with an additional 50us of internal delay.
+  constexpr double kVelocity = 10.0;
+  constexpr float kCpr = 16384.0f;
+  constexpr int kQueryAgeUs = 400;
+  constexpr int kLatencyUs = 50;
+
+  for (const bool compensate : { false, true }) {
+    BOOST_TEST_CONTEXT("compensate " << compensate) {
+      Context ctx;
+      ctx.dut.config()->sources[0].type = Source::kUart;
+      ctx.dut.config()->sources[0].pll_filter_hz = 100.0f;
+      ctx.dut.config()->sources[0].latency_us = compensate ? kLatencyUs : 0;
+      ctx.pcf.persistent_config.Load();
+
+      ctx.aux1_status.uart.active = true;
+
+      const auto position_at = [&](int us) {
+        const double revs = kVelocity * us * 1e-6;
+        return revs - std::floor(revs);
+      };
+
+      int now_us = 0;
+      for (int i = 0; i < 5000; i++) {
+        now_us = i * 100;
+        ctx.aux1_status.sample_us = now_us;
+        if (i % 10 == 4) {
+          const int query_us = now_us - kQueryAgeUs;
+          ctx.aux1_status.uart.value = static_cast<uint32_t>(
+              std::round(position_at(query_us - kLatencyUs) * kCpr)) % 16384;
+          ctx.aux1_status.uart.sample_us = compensate ? query_us : now_us;
+          ctx.aux1_status.uart.nonce++;
+        }
+        ctx.dut.ISR_Update(kDt);
+      }
+
+      const auto& source = ctx.dut.status().sources[0];
+      const float error = MotorPosition::WrapBalancedCpr(
+          source.filtered_value -
+          static_cast<float>(position_at(now_us)) * kCpr, kCpr);
+      const float lag_counts =
+          static_cast<float>(kVelocity) * kCpr *
+          (kQueryAgeUs + kLatencyUs) * 1e-6f;
+
+      if (compensate) {
+        BOOST_TEST(source.age_us == kQueryAgeUs + kLatencyUs);
+        BOOST_TEST(std::abs(error) < 2.0f);
+      } else {
+        BOOST_TEST(source.age_us == 0);
+        BOOST_TEST(std::abs(error + lag_counts) < 2.0f);
+      }
+    }
+  }
+}
+
+BOOST_AUTO_TEST_CASE(MotorPositionEstimators) {
+  using Source = MotorPosition::SourceConfig;
+
+  // A constant acceleration, with a low filter bandwidth so that the
+  // tracking error of the second order PLL is large.
+  constexpr double kAccel = 5.0;
+  constexpr float kCpr = 16384.0f;
+  const float accel_counts = static_cast<float>(kAccel) * kCpr;
+
+  for (const auto estimator : { Source::kPll, Source::kPll3, Source::kKalman }) {
+    BOOST_TEST_CONTEXT("estimator " << static_cast<int>(estimator)) {
+      Context ctx;
+      ctx.dut.config()->sources[0].pll_filter_hz = 20.0f;
+      ctx.dut.config()->sources[0].estimator = estimator;
+      ctx.pcf.persistent_config.Load();
+
+      ctx.aux1_status.spi.active = true;
+
+      double position = 0.0;
+      auto update = [&](int i) {
+        const double t = i * static_cast<double>(kDt);
+        position = 0.5 * kAccel * t * t;
+        const double frac = position - std::floor(position);
+        ctx.aux1_status.spi.value =
+            static_cast<uint32_t>(std::round(frac * kCpr)) % 16384;
+        ctx.aux1_status.spi.nonce++;
+        ctx.dut.ISR_Update(kDt);
+      };
+
+      for (int i = 0; i < 10000; i++) { update(i); }
+
+      const auto& source = ctx.dut.status().sources[0];
+      const double frac = position - std::floor(position);
+      const float error = MotorPosition::WrapBalancedCpr(
+          source.filtered_value - static_cast<float>(frac) * kCpr, kCpr);
+      const float velocity_error =
+          source.velocity - static_cast<float>(position / 0.5) * kCpr;
+
+      if (estimator == Source::kPll) {
+        // A second order loop lags by a / ki in position and
+        // a * kp / ki in velocity.
+        const float w = 20.0f * k2Pi;
+        BOOST_TEST(std::abs(error + accel_counts / (w * w)) < 1.0f);
+        BOOST_TEST(std::abs(velocity_error + 2.0f * accel_counts / w) <
+                   0.01f * kCpr);
+        BOOST_TEST(source.acceleration == 0.0f);
+      } else {
+        BOOST_TEST(std::abs(error) < 1.0f);
+        BOOST_TEST(std::abs(velocity_error) < 0.01f * kCpr);
+        BOOST_TEST(std::abs(source.acceleration - accel_counts) <
+                   0.01f * accel_counts);
+        BOOST_TEST(std::abs(ctx.dut.status().acceleration -
+                            static_cast<float>(kAccel)) < 0.05f);
+      }
+    }
+  }
+}
+
+BOOST_AUTO_TEST_CASE(MotorPositionEstimatorVelocityClamp) {
+  using Source = MotorPosition::SourceConfig;
+
+  for (const auto estimator : { Source::kPll3, Source::kKalman }) {
+    BOOST_TEST_CONTEXT("estimator " << static_cast<int>(estimator)) {
+      Context ctx;
+      ctx.dut.config()->sources[0].pll_filter_hz = 200.0f;
+      ctx.dut.config()->sources[0].estimator = estimator;
+      ctx.pcf.persistent_config.Load();
+
+      ctx.aux1_status.spi.active = true;
+
+      // Noise across the whole revolution drives the velocity into
+      // its limit.
+      const float max_velocity = 0.125f * 16384.0f / kDt;
+      boost::mt19937 rng;
+      boost::random::uniform_int_distribution<uint32_t> dist(0, 16383);
+      int clamped = 0;
+      for (int i = 0; i < 1000; i++) {
+        ctx.aux1_status.spi.value = dist(rng);
+        ctx.aux1_status.spi.nonce++;
+        ctx.Update();
+
+        const auto& source = ctx.dut.status().sources[0];
+        if (std::abs(source.velocity) >= max_velocity) {
+          clamped++;
+          BOOST_TEST(source.acceleration == 0.0f);
+        }
+      }
+      BOOST_TEST(clamped > 0);
+
+      // Once the input is steady, the estimate recovers promptly.
+      for (int i = 0; i < 200; i++) {
+        ctx.aux1_status.spi.value = 1000;
+        ctx.aux1_status.spi.nonce++;
+        ctx.Update();
+      }
+      const auto& source = ctx.dut.status().sources[0];
+      BOOST_TEST(std::abs(source.velocity) < 0.01f * max_velocity);
+      BOOST_TEST(std::abs(source.filtered_value - 1000.0f) < 10.0f);
+    }
+  }
+}
+
+BOOST_AUTO_TEST_CASE(MotorPositionFusion) {
+  using Source = MotorPosition::SourceConfig;
+
+  // A rotor encoder after which there is a 4:1 reducer with a
+  // transmission error, and an accurate output encoder which is only
+  // updated every 1ms.
+  constexpr double kCpr = 16384.0;
+  constexpr double kVelocity = 0.3;
+  const auto transmission_error = [](double output) {
+    return 0.005 * std::sin(2.0 * M_PI * output);
+  };
+
+  for (const bool fusion : { false, true }) {
+    BOOST_TEST_CONTEXT("fusion " << fusion) {
+      Context ctx;
+      auto& config = *ctx.dut.config();
+      config.sources[1].aux_number = 2;
+      config.sources[1].type = Source::kUart;
+      config.sources[1].reference = Source::kOutput;
+      config.sources[1].pll_filter_hz = 50.0f;
+      config.output.reference_source = 1;
+      config.rotor_to_output_ratio = 0.25f;
+      config.output.fusion_source = fusion ? 1 : -1;
+      config.output.fusion_crossover_hz = 5.0f;
+      ctx.pcf.persistent_config.Load();
+      BOOST_TEST(ctx.dut.status().error == MotorPosition::Status::kNone);
+
+      ctx.aux1_status.spi.active = true;
+      ctx.aux2_status.uart.active = true;
+
+      double max_error = 0.0;
+      // The velocity error is averaged over 20ms, to remove the
+      // noise from the rotor encoder quantization.
+      double velocity_error_sum = 0.0;
+      double max_velocity_error = 0.0;
+      for (int i = 0; i < 50000; i++) {
+        const double output = 0.1 + kVelocity * i * static_cast<double>(kDt);
+        const double rotor = (output + transmission_error(output)) * 4.0;
+        ctx.aux1_status.spi.value = static_cast<uint32_t>(
+            std::round((rotor - std::floor(rotor)) * kCpr)) % 16384;
+        ctx.aux1_status.spi.nonce++;
+        if ((i % 10) == 0) {
+          ctx.aux2_status.uart.value = static_cast<uint32_t>(
+              std::round((output - std::floor(output)) * kCpr)) % 16384;
+          ctx.aux2_status.uart.nonce++;
+        }
+
+        ctx.dut.ISR_Update(kDt);
+
+        if (i > 20000) {
+          const auto& status = ctx.dut.status();
+          max_error = std::max(
+              max_error, std::abs(status.position - output));
+          velocity_error_sum += static_cast<double>(status.velocity) - kVelocity;
+          if ((i % 200) == 0) {
+            max_velocity_error = std::max(
+                max_velocity_error, std::abs(velocity_error_sum / 200.0));
+            velocity_error_sum = 0.0;
+          }
+        }
+      }
+
+      if (fusion) {
+        BOOST_TEST(max_error < 0.0005);
+        BOOST_TEST(max_velocity_error < 0.002);
+      } else {
+        BOOST_TEST(max_error > 0.004);
+        BOOST_TEST(max_velocity_error > 0.008);
+      }
+    }
+  }
+
+  {
+    Context ctx;
+    ctx.dut.config()->output.fusion_source = 0;
+    ctx.pcf.persistent_config.Load();
+    BOOST_TEST(ctx.dut.status().error ==
+               MotorPosition::Status::kInvalidConfig);
+  }
+}
+
+BOOST_AUTO_TEST_CASE(MotorPositionFusionSetOutput) {
+  using Source = MotorPosition::SourceConfig;
+
+  // The same rotor and output encoders as MotorPositionFusion, with
+  // no transmission error.
+  constexpr double kCpr = 16384.0;
+  constexpr double kVelocity = 0.3;
+
+  Context ctx;
+  auto& config = *ctx.dut.config();
+  config.sources[1].aux_number = 2;
+  config.sources[1].type = Source::kUart;
+  config.sources[1].reference = Source::kOutput;
+  config.sources[1].pll_filter_hz = 50.0f;
+  config.output.reference_source = 1;
+  config.rotor_to_output_ratio = 0.25f;
+  config.output.fusion_source = 1;
+  config.output.fusion_crossover_hz = 5.0f;
+  ctx.pcf.persistent_config.Load();
+  BOOST_TEST(ctx.dut.status().error == MotorPosition::Status::kNone);
+
+  ctx.aux1_status.spi.active = true;
+  ctx.aux2_status.uart.active = true;
+
+  int i = 0;
+  auto run = [&](int count) {
+    for (int end = i + count; i < end; i++) {
+      const double output = 0.1 + kVelocity * i * static_cast<double>(kDt);
+      const double rotor = output * 4.0;
+      ctx.aux1_status.spi.value = static_cast<uint32_t>(
+          std::round((rotor - std::floor(rotor)) * kCpr)) % 16384;
+      ctx.aux1_status.spi.nonce++;
+      if ((i % 10) == 0) {
+        ctx.aux2_status.uart.value = static_cast<uint32_t>(
+            std::round((output - std::floor(output)) * kCpr)) % 16384;
+        ctx.aux2_status.uart.nonce++;
+      }
+      ctx.dut.ISR_Update(kDt);
+    }
+  };
+
+  run(20000);
+  BOOST_TEST(std::abs(ctx.dut.status().position -
+                      (0.1 + kVelocity * (i - 1) * kDt)) < 0.001);
+
+  // An explicitly set position is kept, rather than being pulled
+  // back to that of the fusion source.
+  ctx.dut.ISR_SetOutputPosition(7.3f);
+  const double set_output = 0.1 + kVelocity * (i - 1) * kDt;
+  run(20000);
+  BOOST_TEST(std::abs(ctx.dut.status().position -
+                      (7.3 + (0.1 + kVelocity * (i - 1) * kDt - set_output))) <
+             0.001);
+  BOOST_TEST(std::abs(ctx.dut.status().velocity - kVelocity) < 0.01);
+}
+
+BOOST_AUTO_TEST_CASE(MotorPositionFusionLargeCorrection) {
+  using Source = MotorPosition::SourceConfig;
+
+  // The rotor encoder sees nothing, as if the reducer were slipping
+  // completely, so the fusion correction carries the whole motion.
+  constexpr double kCpr = 16384.0;
+  constexpr double kVelocity = 25.0;
+
+  Context ctx;
+  auto& config = *ctx.dut.config();
+  config.sources[1].aux_number = 2;
+  config.sources[1].type = Source::kUart;
+  config.sources[1].reference = Source::kOutput;
+  config.sources[1].pll_filter_hz = 200.0f;
+  config.output.reference_source = 1;
+  config.rotor_to_output_ratio = 0.25f;
+  config.output.fusion_source = 1;
+  config.output.fusion_crossover_hz = 5.0f;
+  ctx.pcf.persistent_config.Load();
+
+  ctx.aux1_status.spi.active = true;
+  ctx.aux1_status.spi.value = 0;
+  ctx.aux2_status.uart.active = true;
+
+  double max_error = 0.0;
+  for (int i = 0; i < 80000; i++) {
+    // Start from rest, so that the filter can follow.
+    const double t = i * static_cast<double>(kDt);
+    const double output =
+        (t < 1.0) ? (0.5 * kVelocity * t * t) :
+        (kVelocity * (t - 0.5));
+    ctx.aux1_status.spi.nonce++;
+    ctx.aux2_status.uart.value = static_cast<uint32_t>(
+        std::round((output - std::floor(output)) * kCpr)) % 16384;
+    ctx.aux2_status.uart.nonce++;
+    ctx.dut.ISR_Update(kDt);
+
+    if (i > 20000) {
+      max_error = std::max(
+          max_error,
+          std::abs(static_cast<double>(
+                       ctx.dut.status().position_relative) - output));
+    }
+  }
+
+  // The correction is now well beyond the range of an int32 in
+  // 2^-24 revolution units.
+  BOOST_TEST(ctx.dut.status().fusion_correction > 150.0f);
+  BOOST_TEST(max_error < 0.05);
+}
+
+BOOST_AUTO_TEST_CASE(MotorPositionSourceKernels) {
+  // The per-source update kernels must produce exactly the same
+  // results as the generic update they replaced.  These hashes cover
+  // every source and output value after each cycle, and were
+  // recorded with the generic update.
+  using Source = MotorPosition::SourceConfig;
+
+  const auto hash_status = [](uint64_t hash, const MotorPosition::Status& s) {
+    const auto add = [&](const auto& value) {
+      unsigned char bytes[sizeof(value)] = {};
+      std::memcpy(bytes, &value, sizeof(value));
+      for (const auto byte : bytes) {
+        hash = (hash ^ byte) * 1099511628211ull;
+      }
+    };
+    for (const auto& source : s.sources) {
+      add(source.raw);
+      add(source.nonce);
+      add(source.offset_value);
+      add(source.compensated_value);
+      add(source.filtered_value);
+      add(source.velocity);
+      add(source.active_velocity);
+      add(source.active_theta);
+      add(source.active_absolute);
+    }
+    add(s.position_relative_raw);
+    add(s.position_raw);
+    add(s.velocity);
+    add(s.electrical_phase);
+    return hash;
+  };
+
+  struct Case {
+    const char* name;
+    std::function<void (MotorPosition::Config*)> configure;
+    uint64_t expected;
+  };
+
+  const Case cases[] = {
+    { "spi_uart_quadrature",
+      [](MotorPosition::Config* config) {
+        // A power of two rotor encoder with compensation, a non power
+        // of two output encoder, and an incremental one.
+        config->sources[0].offset = 1234;
+        config->sources[0].sign = -1;
+        config->sources[0].compensation_table[3] = 0.002f;
+        config->sources[0].compensation_table[17] = -0.001f;
+        config->sources[1].aux_number = 2;
+        config->sources[1].type = Source::kUart;
+        config->sources[1].reference = Source::kOutput;
+        config->sources[1].cpr = 10000;
+        config->sources[1].offset = -777;
+        config->sources[1].pll_filter_hz = 50.0f;
+        config->sources[2].aux_number = 2;
+        config->sources[2].type = Source::kQuadrature;
+        config->sources[2].reference = Source::kOutput;
+        config->sources[2].cpr = 4000;
+        config->sources[2].pll_filter_hz = 100.0f;
+        config->rotor_to_output_ratio = 0.25f;
+        config->output.reference_source = 1;
+      },
+      15664250975284436433ull,
+    },
+    { "hall_spi",
+      [](MotorPosition::Config* config) {
+        config->sources[0].type = Source::kHall;
+        config->sources[0].pll_filter_hz = 20.0f;
+        config->sources[1].type = Source::kSpi;
+        config->sources[1].cpr = 65536;
+        config->sources[1].compensation_harmonics[0] = { 2, 0.001f, -0.0005f };
+        config->sources[1].compensation_bits = 10;
+        config->output.source = 1;
+      },
+      16712001620638190574ull,
+    },
+  };
+
+  for (const auto& test_case : cases) {
+    BOOST_TEST_CONTEXT(test_case.name) {
+      Context ctx;
+      test_case.configure(ctx.dut.config());
+      ctx.pcf.persistent_config.Load();
+      BOOST_TEST(ctx.dut.status().error == MotorPosition::Status::kNone);
+
+      ctx.aux1_status.spi.active = true;
+      ctx.aux1_status.hall.active = true;
+      ctx.aux2_status.uart.active = true;
+      ctx.aux2_status.quadrature.active = true;
+
+      uint64_t hash = 14695981039346656037ull;
+      double rotor = 0.3;
+      for (int i = 0; i < 20000; i++) {
+        // Speed up, then reverse.
+        const double time = i * static_cast<double>(kDt);
+        rotor += static_cast<double>(kDt) * 40.0 * std::sin(2.0 * time);
+        const double output = rotor * 0.25;
+        const auto fraction = [](double value, double cpr) {
+          return static_cast<uint32_t>(
+              (value - std::floor(value)) * cpr) % static_cast<uint32_t>(cpr);
+        };
+
+        ctx.aux1_status.spi.value = fraction(rotor, 16384.0);
+        ctx.aux1_status.spi.nonce++;
+        ctx.aux1_status.hall.count = fraction(rotor * 2.0, 6.0);
+        if ((i % 7) == 0) {
+          ctx.aux2_status.uart.value = fraction(output, 10000.0);
+          ctx.aux2_status.uart.nonce++;
+        }
+        ctx.aux2_status.quadrature.value = fraction(output, 4000.0);
+
+        ctx.dut.ISR_Update(kDt);
+        BOOST_REQUIRE(ctx.dut.status().error == MotorPosition::Status::kNone);
+        hash = hash_status(hash, ctx.dut.status());
+      }
+
+      BOOST_TEST(hash == test_case.expected);
+    }
+  }
+}
+
 BOOST_AUTO_TEST_CASE(WrapBalancedCpr) {
   BOOST_TEST(MotorPosition::WrapBalancedCpr(40.0f, 100.0f) == 40.0f);
   BOOST_TEST(MotorPosition::WrapBalancedCpr(-40.0f, 100.0f) == -40.0f);
@@ -755,6 +1428,38 @@ BOOST_AUTO_TEST_CASE(WrapBalancedCpr) {
   BOOST_TEST(MotorPosition::WrapBalancedCpr(55.0f, 100.0f) == -45.0f);
 }
 
+BOOST_AUTO_TEST_CASE(WrapCprFast) {
+  boost::random::mt19937 rng;
+  for (const float cpr : { 16384.0f, 10000.0f, 12.0f, 4000.0f }) {
+    const auto check = [&](float value) {
+      const float expected = MotorPosition::WrapCpr(value, cpr);
+      const float actual = MotorPosition::WrapCprFast(value, cpr);
+      BOOST_TEST(std::memcmp(&expected, &actual, sizeof(float)) == 0,
+                 "cpr " << cpr << " value " << value);
+    };
+
+    // Either side of each boundary.
+    for (const float boundary : { -2.0f * cpr, -cpr, 0.0f, cpr,
+            2.0f * cpr, 3.0f * cpr }) {
+      float value = boundary;
+      for (int i = 0; i < 4; i++) {
+        value = std::nextafter(value, -1e9f);
+      }
+      for (int i = 0; i < 8; i++) {
+        check(value);
+        value = std::nextafter(value, 1e9f);
+      }
+    }
+    check(-0.0f);
+
+    boost::random::uniform_real_distribution<float> dist(-3.0f * cpr,
+                                                         4.0f * cpr);
+    for (int i = 0; i < 100000; i++) {
+      check(dist(rng));
+    }
+  }
+}
+
 BOOST_AUTO_TEST_CASE(MotorPositionBasicI2C) {
   Context ctx;
   auto& config = *ctx.dut.config();
@@ -935,6 +1640,70 @@ BOOST_AUTO_TEST_CASE(MotorPositionHallSource) {
   }
 }
 
+BOOST_AUTO_TEST_CASE(MotorPositionHallInterpolation) {
+  // With 4 poles, there are 12 hall sectors per revolution.
+  constexpr double kSectors = 12.0;
+
+  struct Result {
+    double max_error = 0.0;
+    bool all_steps = true;
+  };
+
+  const auto run = [&](float min_hz, double velocity) {
+    Context ctx;
+    auto& source = ctx.dut.config()->sources[0];
+    source.type = MotorPosition::SourceConfig::kHall;
+    source.pll_filter_hz = 0.0f;
+    source.hall_interpolation_min_hz = min_hz;
+    ctx.pcf.persistent_config.Load();
+    BOOST_TEST(ctx.dut.status().error == MotorPosition::Status::kNone);
+    ctx.aux1_status.hall.active = true;
+
+    const double counts_per_sector =
+        ctx.dut.config()->sources[0].cpr / kSectors;
+
+    Result result;
+    for (int i = 0; i < 20000; i++) {
+      const double rotor = 0.01 + velocity * i * static_cast<double>(kDt);
+      const double sector = rotor * kSectors;
+      ctx.aux1_status.hall.count =
+          (static_cast<int>(std::floor(sector)) % 6 + 6) % 6;
+      ctx.dut.ISR_Update(kDt);
+
+      const auto& status = ctx.dut.status().sources[0];
+      const double value = status.filtered_value / counts_per_sector;
+      if (std::abs(value - std::round(value)) > 1e-6) {
+        result.all_steps = false;
+      }
+      if (i < 5000) { continue; }
+
+      // Each step value is at the center of its sector.
+      double error = value - (sector - 0.5);
+      error -= kSectors * std::round(error / kSectors);
+      result.max_error = std::max(result.max_error, std::abs(error));
+    }
+    return result;
+  };
+
+  for (const double velocity : { 3.0, -3.0 }) {
+    BOOST_TEST_CONTEXT("velocity " << velocity) {
+      const auto steps = run(0.0f, velocity);
+      BOOST_TEST(steps.all_steps);
+      BOOST_TEST(steps.max_error > 0.45);
+
+      const auto interpolated = run(1.0f, velocity);
+      BOOST_TEST(!interpolated.all_steps);
+      BOOST_TEST(interpolated.max_error < 0.02);
+    }
+  }
+
+  {
+    // At 0.1 Hz electrical, this should revert to stepping.
+    const auto slow = run(1.0f, 0.05);
+    BOOST_TEST(slow.all_steps);
+  }
+}
+
 BOOST_AUTO_TEST_CASE(MotorPositionQuadratureTest) {
   for (int index = 0; index < 2; index++) {
     Context ctx;
@@ -1053,6 +1822,89 @@ BOOST_AUTO_TEST_CASE(MotorPositionQuadratureTest) {
   }
 }
 
+BOOST_AUTO_TEST_CASE(MotorPositionQuadratureEdgeVelocity) {
+  constexpr double kCpr = 4000.0;
+
+  struct Result {
+    double max_error = 0.0;
+  };
+
+  const auto run = [&](float edge_velocity_max, double counts_per_s,
+                       int glitch_at = -1) {
+    Context ctx;
+    auto& source = ctx.dut.config()->sources[0];
+    source.type = MotorPosition::SourceConfig::kQuadrature;
+    source.cpr = kCpr;
+    source.pll_filter_hz = 100.0f;
+    source.edge_velocity_max = edge_velocity_max;
+    ctx.pcf.persistent_config.Load();
+    BOOST_TEST(ctx.dut.status().error == MotorPosition::Status::kNone);
+
+    auto& quad = ctx.aux1_status.quadrature;
+    quad.active = true;
+
+    Result result;
+    const double start = 100.3;
+    int64_t old_count = static_cast<int64_t>(std::floor(start));
+    for (int i = 0; i < 30000; i++) {
+      const uint32_t now_us = 1000 + i * 100;
+      const double counts = start + counts_per_s * (now_us - 1000) * 1e-6;
+      const int64_t count = static_cast<int64_t>(std::floor(counts));
+
+      ctx.aux1_status.sample_us = now_us;
+      quad.edge_count = static_cast<uint8_t>(std::abs(count - old_count));
+      // A glitch on one of the pins is counted as an edge, but does
+      // not change the value.
+      if (i == glitch_at) { quad.edge_count++; }
+      if (count != old_count) {
+        // When the most recent edge happened.
+        const double edge = (counts_per_s > 0.0) ? count : (count + 1);
+        quad.edge_us = static_cast<uint32_t>(std::round(
+            1000.0 + (edge - start) / counts_per_s * 1e6));
+      }
+      old_count = count;
+      quad.value = static_cast<uint32_t>(
+          (count % static_cast<int64_t>(kCpr)) + kCpr) %
+          static_cast<uint32_t>(kCpr);
+
+      ctx.dut.ISR_Update(kDt);
+
+      const auto& status = ctx.dut.status().sources[0];
+      if (i < 10000) { continue; }
+      result.max_error = std::max(
+          result.max_error,
+          std::abs(static_cast<double>(status.velocity) - counts_per_s));
+    }
+    return result;
+  };
+
+  for (const double counts_per_s : { 8.0, -8.0, 50.0 }) {
+    BOOST_TEST_CONTEXT("velocity " << counts_per_s) {
+      // A few counts per second is well below the resolution of the
+      // filter alone.
+      const auto filter = run(0.0f, counts_per_s);
+      BOOST_TEST(filter.max_error > 0.5 * std::abs(counts_per_s));
+
+      const auto timed = run(100.0f, counts_per_s);
+      BOOST_TEST(timed.max_error < 0.01);
+    }
+  }
+
+  {
+    // Above twice the maximum, the filter is used unchanged.
+    const auto filter = run(0.0f, 3000.0);
+    const auto timed = run(100.0f, 3000.0);
+    BOOST_TEST(std::abs(timed.max_error - filter.max_error) <
+               0.01 * filter.max_error);
+
+    // Even across a glitch, which could otherwise look like a
+    // reversal.
+    const auto glitch = run(100.0f, 3000.0, 20000);
+    BOOST_TEST(std::abs(glitch.max_error - filter.max_error) <
+               0.01 * filter.max_error);
+  }
+}
+
 BOOST_AUTO_TEST_CASE(MotorPositionExternalIndex) {
   Context ctx;
   auto& config = *ctx.dut.config();
@@ -0,0 +1,160 @@
+// Copyright 2023 mjbots Robotic Systems, LLC.  info@mjbots.com
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "fw/replay_log.h"
+
+#include <unistd.h>
+
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+
+#include <boost/test/auto_unit_test.hpp>
+
+using namespace moteus;
+
+namespace {
+class TempFile {
+ public:
+  TempFile() {
+    char name[] = "/tmp/replay_log_test_XXXXXX";
+    const int fd = ::mkstemp(name);
+    BOOST_REQUIRE(fd >= 0);
+    ::close(fd);
+    name_ = name;
+  }
+
+  ~TempFile() { ::unlink(name_.c_str()); }
+
+  const char* name() const { return name_.c_str(); }
+
+ private:
+  std::string name_;
+};
+}
+
+BOOST_AUTO_TEST_CASE(ReplayLogRoundTrip) {
+  TempFile temp;
+  constexpr int kCycles = 2000;
+
+  {
+    std::FILE* file = std::fopen(temp.name(), "wb");
+    BOOST_REQUIRE(file);
+    replay::Writer writer(file, 30000.0f);
+
+    replay::Command command;
+    command.position = 1.5f;
+    command.velocity = 0.25f;
+    writer.Write(command);
+
+    for (int i = 0; i < kCycles; i++) {
+      replay::Spi spi;
+      spi.aux = 1 + (i % 2);
+      spi.nonce = i;
+      spi.value = i * 7;
+      spi.sample_us = i * 33;
+      writer.Write(spi);
+      if ((i % 3) == 0) {
+        replay::Hall hall;
+        hall.bits = i % 8;
+        hall.count = i % 6;
+        writer.Write(hall);
+      }
+      writer.Cycle();
+    }
+    std::fclose(file);
+  }
+
+  // A window this small requires many remappings, some of which
+  // fall in the middle of a record.
+  replay::Reader dut(temp.name(), 4096);
+  BOOST_TEST(dut.error() == "");
+  BOOST_TEST(dut.header().rate_hz == 30000.0f);
+
+  replay::Reader::Record record;
+  BOOST_REQUIRE(dut.Next(&record));
+  BOOST_TEST((record.type == replay::Type::kCommand));
+  BOOST_TEST(record.as<replay::Command>().position == 1.5f);
+  BOOST_TEST(record.as<replay::Command>().velocity == 0.25f);
+
+  for (int i = 0; i < kCycles; i++) {
+    BOOST_REQUIRE(dut.Next(&record));
+    BOOST_REQUIRE((record.type == replay::Type::kSpi));
+    const auto spi = record.as<replay::Spi>();
+    BOOST_TEST(spi.aux == 1 + (i % 2));
+    BOOST_TEST(spi.nonce == static_cast<uint8_t>(i));
+    BOOST_TEST(spi.value == static_cast<uint32_t>(i * 7));
+    BOOST_TEST(spi.sample_us == static_cast<uint32_t>(i * 33));
+
+    if ((i % 3) == 0) {
+      BOOST_REQUIRE(dut.Next(&record));
+      BOOST_REQUIRE((record.type == replay::Type::kHall));
+      BOOST_TEST(record.as<replay::Hall>().bits == i % 8);
+      BOOST_TEST(record.as<replay::Hall>().count == i % 6);
+    }
+
+    BOOST_REQUIRE(dut.Next(&record));
+    BOOST_TEST((record.type == replay::Type::kCycle));
+  }
+
+  BOOST_TEST(!dut.Next(&record));
+  BOOST_TEST(dut.error() == "");
+  BOOST_TEST(dut.offset() == dut.size());
+}
+
+BOOST_AUTO_TEST_CASE(ReplayLogErrors) {
+  {
+    replay::Reader dut("/nonexistent/replay");
+    BOOST_TEST(dut.error() != "");
+  }
+
+  TempFile temp;
+  {
+    std::FILE* file = std::fopen(temp.name(), "wb");
+    std::fputs("not a replay file", file);
+    std::fclose(file);
+    replay::Reader dut(temp.name());
+    BOOST_TEST(dut.error() == "not a replay file");
+  }
+
+  {
+    std::FILE* file = std::fopen(temp.name(), "wb");
+    replay::Writer writer(file, 1000.0f);
+    writer.Cycle();
+    writer.Write(replay::Spi());
+    std::fclose(file);
+    // Drop the last byte of the final record.
+    BOOST_REQUIRE(::truncate(temp.name(), sizeof(replay::FileHeader) + 1 +
+                             1 + sizeof(replay::Spi) - 1) == 0);
+
+    replay::Reader dut(temp.name());
+    BOOST_TEST(dut.error() == "");
+    replay::Reader::Record record;
+    BOOST_TEST(dut.Next(&record));
+    BOOST_TEST(!dut.Next(&record));
+    BOOST_TEST(dut.error() == "truncated record at offset 17");
+  }
+
+  {
+    std::FILE* file = std::fopen(temp.name(), "wb");
+    replay::Writer writer(file, 1000.0f);
+    std::fputc(200, file);
+    std::fclose(file);
+
+    replay::Reader dut(temp.name());
+    replay::Reader::Record record;
+    BOOST_TEST(!dut.Next(&record));
+    BOOST_TEST(dut.error() == "unknown record type 200 at offset 16");
+  }
+}
@@ -0,0 +1,125 @@
+// Copyright 2023 mjbots Robotic Systems, LLC.  info@mjbots.com
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "fw/svpwm.h"
+
+#include <random>
+
+#include <fmt/format.h>
+
+#include <boost/test/auto_unit_test.hpp>
+
+using namespace moteus;
+
+namespace {
+// One count of the PWM timer at 40kHz with a 170MHz timer clock.
+constexpr float kLsb = 1.0f / 4250.0f;
+}
+
+BOOST_AUTO_TEST_CASE(BalancedPwmBasic) {
+  PwmCompensation comp;
+
+  {
+    const BalancedPwm dut(0.0f, 0.0f, 0.0f, 24.0f, comp);
+    BOOST_TEST(dut.a == 0.5f);
+    BOOST_TEST(dut.b == 0.5f);
+    BOOST_TEST(dut.c == 0.5f);
+  }
+
+  {
+    // With no compensation, the result is just the phase voltages
+    // centered about 50%.
+    const BalancedPwm dut(-6.0f, 3.0f, 3.0f, 24.0f, comp);
+    BOOST_TEST(dut.a == 0.25f);
+    BOOST_TEST(dut.b == 0.625f);
+    BOOST_TEST(dut.c == 0.625f);
+  }
+}
+
+BOOST_AUTO_TEST_CASE(SpaceVectorPwmMatchesBalanced) {
+  std::mt19937 rng(1);
+  std::uniform_real_distribution<float> theta_dist(0.0f, k2Pi);
+  std::uniform_real_distribution<float> voltage_dist(-11.0f, 11.0f);
+  std::uniform_real_distribution<float> bus_dist(10.0f, 50.0f);
+
+  struct Compensation {
+    float offset;
+    float mag;
+    float scale;
+  };
+  const Compensation compensations[] = {
+    { 0.0f, 0.0f, 1.0f },
+    { 0.055f, 0.005f, 1.0f },
+    { 0.015f, 0.0f, 1.0f },
+    { 0.055f, 0.005f, 0.95f },
+  };
+
+  for (const auto& compensation : compensations) {
+    PwmCompensation comp;
+    comp.offset = compensation.offset;
+    comp.mag = compensation.mag;
+    comp.scale = compensation.scale;
+
+    float max_error = 0.0f;
+    for (int i = 0; i < 20000; i++) {
+      const float theta = theta_dist(rng);
+      const SinCos sc{std::sin(theta), std::cos(theta)};
+      const float d_V = voltage_dist(rng);
+      const float q_V = voltage_dist(rng);
+      const float bus_V = bus_dist(rng);
+
+      const InverseDqTransform idt(sc, d_V, q_V);
+      const BalancedPwm expected(idt.a, idt.b, idt.c, bus_V, comp);
+      const SpaceVectorPwm actual(sc, d_V, q_V, 1.0f / bus_V, comp);
+
+      max_error = std::max(max_error, std::abs(actual.a - expected.a));
+      max_error = std::max(max_error, std::abs(actual.b - expected.b));
+      max_error = std::max(max_error, std::abs(actual.c - expected.c));
+
+      BOOST_TEST_CONTEXT(fmt::format("theta={} d={} q={}", theta, d_V, q_V)) {
+        BOOST_TEST(std::abs(actual.va - idt.a) < 1e-4f);
+        BOOST_TEST(std::abs(actual.vb - idt.b) < 1e-4f);
+        BOOST_TEST(std::abs(actual.vc - idt.c) < 1e-4f);
+      }
+    }
+
+    BOOST_TEST_CONTEXT(fmt::format("offset={} mag={} scale={}",
+                                   comp.offset, comp.mag, comp.scale)) {
+      BOOST_TEST(max_error < kLsb);
+    }
+  }
+}
+
+BOOST_AUTO_TEST_CASE(SpaceVectorPwmSectorBoundaries) {
+  PwmCompensation comp;
+  comp.offset = 0.055f;
+  comp.mag = 0.005f;
+
+  // Every 30 degrees lands either on a boundary between sectors, or
+  // where two phases are equal.
+  for (int i = 0; i < 12; i++) {
+    const float theta = i * k2Pi / 12.0f;
+    const SinCos sc{std::sin(theta), std::cos(theta)};
+
+    const InverseDqTransform idt(sc, 0.0f, 5.0f);
+    const BalancedPwm expected(idt.a, idt.b, idt.c, 24.0f, comp);
+    const SpaceVectorPwm actual(sc, 0.0f, 5.0f, 1.0f / 24.0f, comp);
+
+    BOOST_TEST_CONTEXT(fmt::format("i={}", i)) {
+      BOOST_TEST(std::abs(actual.a - expected.a) < kLsb);
+      BOOST_TEST(std::abs(actual.b - expected.b) < kLsb);
+      BOOST_TEST(std::abs(actual.c - expected.c) < kLsb);
+    }
+  }
+}
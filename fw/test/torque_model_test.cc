@@ -54,3 +54,76 @@ BOOST_AUTO_TEST_CASE(BasicTorqueModel, * boost::unit_test::tolerance(1e-3f)) {
     }
   }
 }
+
+BOOST_AUTO_TEST_CASE(TorqueTableMatchesModel) {
+  // A table sampled from the same curve as BasicTorqueModel should
+  // reproduce it closely, and be consistent in both directions.  The
+  // range is chosen so that the cutoff current lands on a table
+  // entry.
+  auto expected_torque = [](float current) {
+    const float abs_current = std::abs(current);
+    if (abs_current < 17.0f) { return current * 0.41f; }
+    return std::copysign(
+        17.0f * 0.41f + 97.0f * std::log2(1.0f + (abs_current - 17.0f) * 0.002f),
+        current);
+  };
+  constexpr float kMaxCurrent = 68.0f;
+
+  TorqueTable::Table table;
+  for (int i = 0; i < TorqueTable::kSize; i++) {
+    table[i] = expected_torque(i * kMaxCurrent / (TorqueTable::kSize - 1));
+  }
+
+  TorqueTable dut;
+  BOOST_TEST(!dut.active());
+  BOOST_TEST_REQUIRE(dut.Configure(table, kMaxCurrent));
+  BOOST_TEST(dut.active());
+
+  BOOST_TEST(dut.current_to_torque(0.0f) == 0.0f);
+  BOOST_TEST(dut.torque_to_current(0.0f) == 0.0f);
+
+  for (float current = -kMaxCurrent; current <= kMaxCurrent;
+       current += 0.25f) {
+    BOOST_TEST_CONTEXT(fmt::format("current={}", current)) {
+      const float torque = dut.current_to_torque(current);
+      BOOST_TEST(std::abs(torque - expected_torque(current)) < 0.005f);
+      // The inverse is tabulated evenly in torque, so is less exact
+      // near the knee at the cutoff current.
+      BOOST_TEST(std::abs(dut.torque_to_current(torque) - current) < 0.1f);
+    }
+  }
+
+  // Beyond the end of the table, the last segment is extrapolated.
+  const float last_slope =
+      (table[TorqueTable::kSize - 1] - table[TorqueTable::kSize - 2]) /
+      (kMaxCurrent / (TorqueTable::kSize - 1));
+  BOOST_TEST(dut.current_to_torque(kMaxCurrent + 10.0f) ==
+             table[TorqueTable::kSize - 1] + 10.0f * last_slope,
+             boost::test_tools::tolerance(1e-4f));
+  BOOST_TEST(dut.torque_to_current(
+                 dut.current_to_torque(kMaxCurrent + 10.0f)) ==
+             kMaxCurrent + 10.0f,
+             boost::test_tools::tolerance(1e-3f));
+}
+
+BOOST_AUTO_TEST_CASE(TorqueTableInvalid) {
+  TorqueTable::Table table;
+  for (int i = 0; i < TorqueTable::kSize; i++) { table[i] = 0.5f * i; }
+
+  TorqueTable dut;
+  BOOST_TEST(dut.Configure(table, 16.0f));
+  BOOST_TEST(dut.current_to_torque(3.0f) == 1.5f);
+  BOOST_TEST(dut.torque_to_current(-1.5f) == -3.0f);
+
+  BOOST_TEST(!dut.Configure(table, 0.0f));
+  BOOST_TEST(!dut.active());
+
+  auto offset = table;
+  offset[0] = 0.1f;
+  BOOST_TEST(!dut.Configure(offset, 16.0f));
+
+  auto flat = table;
+  flat[5] = flat[4];
+  BOOST_TEST(!dut.Configure(flat, 16.0f));
+  BOOST_TEST(!dut.active());
+}
@@ -0,0 +1,98 @@
+// Copyright 2023 mjbots Robotic Systems, LLC.  info@mjbots.com
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "fw/waypoint_queue.h"
+
+#include <boost/test/auto_unit_test.hpp>
+
+using namespace moteus;
+
+namespace {
+Waypoint Make(int index) {
+  Waypoint result;
+  result.position_relative_raw = index;
+  result.duration_s = 0.01f * index;
+  return result;
+}
+}
+
+BOOST_AUTO_TEST_CASE(WaypointQueueBasic) {
+  WaypointQueue dut;
+  BOOST_TEST(dut.size() == 0);
+  BOOST_TEST(dut.ISR_Front() == nullptr);
+
+  BOOST_TEST(dut.Push(Make(1)));
+  BOOST_TEST(dut.Push(Make(2)));
+  BOOST_TEST(dut.size() == 2);
+
+  BOOST_REQUIRE(dut.ISR_Front() != nullptr);
+  BOOST_TEST(dut.ISR_Front()->position_relative_raw == 1);
+  dut.ISR_Pop();
+  BOOST_REQUIRE(dut.ISR_Front() != nullptr);
+  BOOST_TEST(dut.ISR_Front()->position_relative_raw == 2);
+  dut.ISR_Pop();
+  BOOST_TEST(dut.ISR_Front() == nullptr);
+  BOOST_TEST(dut.size() == 0);
+}
+
+BOOST_AUTO_TEST_CASE(WaypointQueueWrap) {
+  WaypointQueue dut;
+
+  // Go around the index space several times, at varying depths.
+  int pushed = 0;
+  int popped = 0;
+  for (int round = 0; round < 40; round++) {
+    const int depth = 1 + (round * 7) % WaypointQueue::kSize;
+    while (dut.size() < depth) {
+      BOOST_REQUIRE(dut.Push(Make(pushed++)));
+    }
+    while (dut.size() > depth / 2) {
+      BOOST_REQUIRE(dut.ISR_Front() != nullptr);
+      BOOST_TEST(dut.ISR_Front()->position_relative_raw == popped);
+      dut.ISR_Pop();
+      popped++;
+    }
+  }
+  BOOST_TEST(pushed > 512);
+}
+
+BOOST_AUTO_TEST_CASE(WaypointQueueFull) {
+  WaypointQueue dut;
+  for (int i = 0; i < WaypointQueue::kSize; i++) {
+    BOOST_TEST(dut.Push(Make(i)));
+  }
+  BOOST_TEST(dut.size() == WaypointQueue::kSize);
+  BOOST_TEST(!dut.Push(Make(100)));
+
+  dut.ISR_Pop();
+  BOOST_TEST(dut.Push(Make(100)));
+  BOOST_TEST(dut.size() == WaypointQueue::kSize);
+}
+
+BOOST_AUTO_TEST_CASE(WaypointQueueClear) {
+  WaypointQueue dut;
+  dut.Push(Make(1));
+  dut.Push(Make(2));
+  dut.Clear();
+
+  // Anything pushed after the clear is kept, even though the ISR has
+  // not yet observed the clear.
+  dut.Push(Make(3));
+
+  BOOST_REQUIRE(dut.ISR_Front() != nullptr);
+  BOOST_TEST(dut.ISR_Front()->position_relative_raw == 3);
+  dut.ISR_Pop();
+  BOOST_TEST(dut.ISR_Front() == nullptr);
+  BOOST_TEST(dut.size() == 0);
+}
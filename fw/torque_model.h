@@ -47,6 +47,8 @@ This C++ header file defines the `TorqueModel` class within the `moteus` namespa
 #pragma once
 
 #include <algorithm>
+#include <array>
+#include <cmath>
 
 #include "fw/math.h"
 
@@ -98,10 +100,93 @@ class TorqueModel {
                       torque);
   }
 
-  const float torque_constant_;
-  const float current_cutoff_A_;
-  const float current_scale_;
-  const float torque_scale_;
+  float torque_constant_;
+  float current_cutoff_A_;
+  float current_scale_;
+  float torque_scale_;
+};
+
+/// A piecewise linear torque versus current curve, typically measured
+/// on a dynamometer.  The inverse is tabulated when configured, so
+/// that both directions are a single indexed interpolation.
+class TorqueTable {
+ public:
+  // The number of points in the forward table, which are evenly
+  // spaced in current.
+  static constexpr int kSize = 17;
+  // The number of points in the inverse table, which are evenly
+  // spaced in torque.  This is finer than the forward table so that
+  // the knees of the forward curve are not smoothed over too much.
+  static constexpr int kInverseSize = 65;
+
+  using Table = std::array<float, kSize>;
+
+  /// @p torque_Nm[i] is the torque produced at a phase current of
+  /// i * max_current_A / (kSize - 1).  Returns false, leaving the
+  /// table inactive, if @p max_current_A is not positive, or the
+  /// torque does not start at 0 and strictly increase.
+  ///
+  /// This is intended to be used at configuration time, not in an
+  /// ISR.
+  bool Configure(const Table& torque_Nm, float max_current_A) {
+    active_ = false;
+
+    if (!(max_current_A > 0.0f)) { return false; }
+    if (torque_Nm[0] != 0.0f) { return false; }
+    for (int i = 1; i < kSize; i++) {
+      if (!(torque_Nm[i] > torque_Nm[i - 1])) { return false; }
+    }
+
+    torque_ = torque_Nm;
+    current_scale_ = (kSize - 1) / max_current_A;
+
+    const float max_torque = torque_Nm[kSize - 1];
+    torque_scale_ = (kInverseSize - 1) / max_torque;
+
+    int segment = 0;
+    for (int i = 0; i < kInverseSize; i++) {
+      const float torque = i * max_torque / (kInverseSize - 1);
+      while (segment < kSize - 2 && torque > torque_[segment + 1]) {
+        segment++;
+      }
+      const float frac = (torque - torque_[segment]) /
+          (torque_[segment + 1] - torque_[segment]);
+      current_[i] = (segment + frac) / current_scale_;
+    }
+
+    active_ = true;
+    return true;
+  }
+
+  bool active() const { return active_; }
+
+  float current_to_torque(float current) const __attribute__((always_inline)) {
+    return std::copysign(
+        Interpolate(torque_, std::abs(current) * current_scale_), current);
+  }
+
+  float torque_to_current(float torque) const __attribute__((always_inline)) {
+    return std::copysign(
+        Interpolate(current_, std::abs(torque) * torque_scale_), torque);
+  }
+
+ private:
+  /// Linearly interpolate @p table at fractional index @p x, where x
+  /// is non-negative.  Beyond the end, the final segment is
+  /// extrapolated.
+  template <size_t N>
+  __attribute__((always_inline))
+  static float Interpolate(const std::array<float, N>& table, float x) {
+    const int index = std::min<int>(static_cast<int>(x), N - 2);
+    const float frac = x - index;
+    return table[index] + frac * (table[index + 1] - table[index]);
+  }
+
+  bool active_ = false;
+  float current_scale_ = 0.0f;
+  float torque_scale_ = 0.0f;
+  Table torque_ = {};
+  std::array<float, kInverseSize> current_ = {};
 };
 
 }
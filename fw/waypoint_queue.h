@@ -0,0 +1,138 @@
+// Copyright 2023 mjbots Robotic Systems, LLC.  info@mjbots.com
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <limits>
+
+#include "fw/ccm.h"
+
+namespace moteus {
+
+/// One timed knot of a streamed position mode trajectory.
+struct Waypoint {
+  // In the same relative raw space as
+  // BldcServoCommandData::position_relative_raw.
+  int64_t position_relative_raw = 0;
+  float velocity = 0.0f;
+
+  // NaN means to use the feedforward of the position mode command.
+  float feedforward_Nm = std::numeric_limits<float>::quiet_NaN();
+
+  // The time to travel from the previous waypoint to this one.
+  float duration_s = 0.0f;
+};
+
+/// A fixed size ring buffer of waypoints, filled from the main loop
+/// and consumed from the ISR.  There must be exactly one of each.
+class WaypointQueue {
+ public:
+  static constexpr int kSize = 64;
+
+  /// Return false if the queue is full.
+  bool Push(const Waypoint& waypoint) {
+    const uint8_t head = head_.load(std::memory_order_relaxed);
+    if (static_cast<uint8_t>(head - tail_.load(std::memory_order_acquire)) >=
+        kSize) {
+      return false;
+    }
+    waypoints_[head % kSize] = waypoint;
+    head_.store(head + 1, std::memory_order_release);
+    return true;
+  }
+
+  /// Discard everything pushed so far.  This is performed by the ISR
+  /// in ISR_HandleClear, so it is safe to call from the main loop.
+  void Clear() {
+    discard_to_.store(head_.load(std::memory_order_relaxed),
+                      std::memory_order_relaxed);
+    discard_count_.store(discard_count_.load(std::memory_order_relaxed) + 1,
+                         std::memory_order_release);
+  }
+
+  int size() const {
+    return static_cast<uint8_t>(head_.load(std::memory_order_acquire) -
+                                tail_.load(std::memory_order_acquire));
+  }
+
+  /// Return the oldest waypoint, or nullptr if there is none.  It
+  /// remains valid until ISR_Pop.
+  const Waypoint* ISR_Front() MOTEUS_CCM_ATTRIBUTE {
+    ISR_HandleClear();
+
+    const uint8_t tail = tail_.load(std::memory_order_relaxed);
+    if (tail == head_.load(std::memory_order_acquire)) { return nullptr; }
+    return &waypoints_[tail % kSize];
+  }
+
+  /// Perform any Clear which is pending.
+  void ISR_HandleClear() MOTEUS_CCM_ATTRIBUTE {
+    const uint8_t discard_count =
+        discard_count_.load(std::memory_order_acquire);
+    if (discard_count != handled_discard_count_) {
+      handled_discard_count_ = discard_count;
+      tail_.store(discard_to_.load(std::memory_order_relaxed),
+                  std::memory_order_release);
+    }
+  }
+
+  void ISR_Pop() MOTEUS_CCM_ATTRIBUTE {
+    tail_.store(tail_.load(std::memory_order_relaxed) + 1,
+                std::memory_order_release);
+  }
+
+ private:
+  static_assert((256 % kSize) == 0);
+
+  std::array<Waypoint, kSize> waypoints_ = {};
+
+  // These are free running, and are only written by the producer and
+  // consumer respectively.
+  std::atomic<uint8_t> head_{0};
+  std::atomic<uint8_t> tail_{0};
+
+  std::atomic<uint8_t> discard_to_{0};
+  std::atomic<uint8_t> discard_count_{0};
+  uint8_t handled_discard_count_ = 0;
+};
+
+/// The progress of the ISR through the waypoint it is currently
+/// moving toward.
+struct WaypointSegment {
+  bool active = false;
+
+  int64_t start_raw = 0;
+  float start_velocity = 0.0f;
+  float start_feedforward_Nm = 0.0f;
+  Waypoint end;
+  float end_feedforward_Nm = 0.0f;
+
+  // The quadratic and cubic coefficients of the offset from
+  // start_raw as a function of time.
+  float c2 = 0.0f;
+  float c3 = 0.0f;
+
+  // The time at the start of this cycle is start_s plus this many
+  // cycles, which avoids accumulating rounding error in a float.
+  float start_s = 0.0f;
+  uint32_t cycles = 0;
+
+  // The part of the previous step which was not applied.
+  float residual = 0.0f;
+};
+
+}